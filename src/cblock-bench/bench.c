@@ -0,0 +1,1047 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/param.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <net/if.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include <termios.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+
+#include <cblock/libcblock.h>
+
+#include <openssl/evp.h>
+
+/*
+ * cblock-bench: drive a running cblockd with a configurable mix of
+ * requests from N concurrent connections and report throughput and
+ * latency percentiles. The daemon is expected to be running against a
+ * data directory populated with the stub scripts in lib/ so that launches
+ * and builds complete without jails or file systems being created.
+ */
+
+enum {
+	OP_INSTANCES,
+	OP_LAUNCH,
+	OP_SIGNAL,
+	OP_CONSOLE,
+	OP_ATTACH,
+	OP_BUILD,
+	OP_MAX
+};
+
+static const char *op_names[OP_MAX] = {
+	"instances",
+	"launch",
+	"signal",
+	"console",
+	"attach",
+	"build"
+};
+
+#define	BENCH_MAX_LIVE		64
+#define	BENCH_CONSOLE_MARK	"<cbb:"
+#define	BENCH_CONTEXT_FILE	"context"
+
+struct bench_params {
+	char		*b_sock;
+	int		 b_conns;
+	int		 b_duration;
+	long		 b_ops;
+	char		*b_mix;
+	int		 b_weights[OP_MAX];
+	int		 b_weight_total;
+	size_t		 b_console_bytes;
+	off_t		 b_context_size;
+	int		 b_max_live;
+	char		*b_image;
+	char		*b_synth_args;
+	int		 b_populate;
+	char		*b_json_path;
+	int		 b_json_only;
+};
+
+struct lat_vec {
+	uint64_t	*lv_samples;
+	size_t		 lv_used;
+	size_t		 lv_alloc;
+	uint64_t	 lv_errors;
+};
+
+struct bench_thread {
+	pthread_t	 bt_thread;
+	int		 bt_id;
+	int		 bt_ctlsock;
+	int		 bt_consock;
+	char		*bt_contag;
+	u_int		 bt_seed;
+	u_int		 bt_seq;
+	char		*bt_live[BENCH_MAX_LIVE];
+	int		 bt_nlive;
+	char		*bt_context;
+	char		**bt_bg;
+	int		 bt_nbg;
+	struct lat_vec	 bt_lat[OP_MAX];
+};
+
+static struct option bench_options[] = {
+	{ "unix-sock",		required_argument, 0, 'U' },
+	{ "connections",	required_argument, 0, 'c' },
+	{ "duration",		required_argument, 0, 't' },
+	{ "operations",		required_argument, 0, 'n' },
+	{ "mix",		required_argument, 0, 'm' },
+	{ "console-bytes",	required_argument, 0, 'C' },
+	{ "context-size",	required_argument, 0, 'B' },
+	{ "max-live",		required_argument, 0, 'i' },
+	{ "image",		required_argument, 0, 'I' },
+	{ "synth-args",		required_argument, 0, 'a' },
+	{ "populate",		required_argument, 0, 'P' },
+	{ "output",		required_argument, 0, 'o' },
+	{ "json",		no_argument, 0, 'j' },
+	{ "help",		no_argument, 0, 'h' },
+	{ 0, 0, 0, 0 }
+};
+
+/*
+ * Daemon gauges sampled at the end of the run, while every instance is
+ * still up.
+ */
+static const char *daemon_gauges[] = {
+	"cblockd_instances",
+	"cblockd_cpu_utilization",
+	"cblockd_cpu_utilization_per_100_instances",
+	"cblockd_resident_bytes",
+	"cblockd_resident_bytes_per_100_instances",
+	"cblockd_tty_bytes_total",
+	"cblockd_termbuf_trims_total",
+	NULL
+};
+
+static struct bench_params bcfg;
+static pthread_barrier_t start_barrier, stop_barrier, teardown_barrier;
+
+static void
+usage(void)
+{
+	(void) fprintf(stderr,
+	    "Usage: cblock-bench [OPTIONS]\n\n"
+	    "Options\n"
+	    " -U, --unix-sock=PATH       Path to the cblockd UNIX socket\n"
+	    " -c, --connections=N        Number of concurrent connections (4)\n"
+	    " -t, --duration=SECS        Run for SECS seconds (10)\n"
+	    " -n, --operations=N         Run N operations per connection instead\n"
+	    " -m, --mix=SPEC             Request mix, e.g.\n"
+	    "                            instances=70,launch=10,signal=10,console=5,build=5\n"
+	    " -C, --console-bytes=N      Bytes of synthetic console input per request (64)\n"
+	    " -B, --context-size=N       Bytes of build context per upload (65536)\n"
+	    " -i, --max-live=N           Live instances per connection (8)\n"
+	    " -I, --image=NAME           Image name passed to launches and builds\n"
+	    " -a, --synth-args=ARGS      Entry point arguments for launches, e.g.\n"
+	    "                            cblock-synth options when cblockd runs\n"
+	    "                            with --synthetic\n"
+	    " -P, --populate=N           Launch N instances before the run and keep\n"
+	    "                            them up until it ends\n"
+	    " -o, --output=FILE          Write results as JSON to FILE\n"
+	    " -j, --json                 Print results as JSON instead of a table\n"
+	    " -h, --help                 Print help\n\n"
+	    "A launch is turned into a signal once a connection has --max-live\n"
+	    "instances running, and a signal into a launch when it has none.\n"
+	    "Console requests attach to an instance owned by the connection and\n"
+	    "time the round trip of the input through the instance tty.\n");
+	exit(1);
+}
+
+static uint64_t
+bench_now_usec(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static int
+bench_connect(void)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	sock = socket(PF_UNIX, SOCK_STREAM, PF_UNSPEC);
+	if (sock == -1) {
+		err(1, "socket(PF_UNIX) failed");
+	}
+	bzero(&addr, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, bcfg.b_sock, sizeof(addr.sun_path) - 1);
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		err(1, "connect(%s) failed", bcfg.b_sock);
+	}
+	return (sock);
+}
+
+static void
+lat_record(struct lat_vec *lv, uint64_t usec)
+{
+
+	if (lv->lv_used == lv->lv_alloc) {
+		lv->lv_alloc = lv->lv_alloc == 0 ? 1024 : lv->lv_alloc * 2;
+		lv->lv_samples = realloc(lv->lv_samples,
+		    lv->lv_alloc * sizeof(*lv->lv_samples));
+		if (lv->lv_samples == NULL) {
+			err(1, "realloc latency samples failed");
+		}
+	}
+	lv->lv_samples[lv->lv_used++] = usec;
+}
+
+static int
+lat_cmp(const void *a, const void *b)
+{
+	uint64_t x, y;
+
+	x = *(const uint64_t *)a;
+	y = *(const uint64_t *)b;
+	return (x < y ? -1 : x > y);
+}
+
+static uint64_t
+lat_percentile(struct lat_vec *lv, double p)
+{
+	size_t idx;
+
+	if (lv->lv_used == 0) {
+		return (0);
+	}
+	idx = (size_t)(p * lv->lv_used);
+	if (idx >= lv->lv_used) {
+		idx = lv->lv_used - 1;
+	}
+	return (lv->lv_samples[idx]);
+}
+
+static int
+bench_parse_mix(char *spec)
+{
+	char *copy, *tok, *val, *p;
+	int k, weight;
+
+	bzero(bcfg.b_weights, sizeof(bcfg.b_weights));
+	copy = strdup(spec);
+	if (copy == NULL) {
+		err(1, "strdup failed");
+	}
+	p = copy;
+	while ((tok = strsep(&p, ",")) != NULL) {
+		val = strchr(tok, '=');
+		if (val == NULL) {
+			warnx("%s: mix entries are NAME=WEIGHT", tok);
+			free(copy);
+			return (-1);
+		}
+		*val++ = '\0';
+		for (k = 0; k < OP_MAX; k++) {
+			if (k != OP_ATTACH && strcmp(op_names[k], tok) == 0) {
+				break;
+			}
+		}
+		if (k == OP_MAX) {
+			warnx("%s: unknown operation", tok);
+			free(copy);
+			return (-1);
+		}
+		weight = atoi(val);
+		if (weight < 0) {
+			warnx("%s: invalid weight", val);
+			free(copy);
+			return (-1);
+		}
+		bcfg.b_weights[k] = weight;
+	}
+	free(copy);
+	bcfg.b_weight_total = 0;
+	for (k = 0; k < OP_MAX; k++) {
+		bcfg.b_weight_total += bcfg.b_weights[k];
+	}
+	if (bcfg.b_weight_total == 0) {
+		warnx("mix has no operations");
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+bench_pick_op(struct bench_thread *bt)
+{
+	int k, r;
+
+	r = rand_r(&bt->bt_seed) % bcfg.b_weight_total;
+	for (k = 0; k < OP_MAX; k++) {
+		if (r < bcfg.b_weights[k]) {
+			break;
+		}
+		r -= bcfg.b_weights[k];
+	}
+	if (k == OP_LAUNCH && bt->bt_nlive == bcfg.b_max_live) {
+		k = OP_SIGNAL;
+	} else if (k == OP_SIGNAL && bt->bt_nlive == 0) {
+		k = OP_LAUNCH;
+	}
+	return (k);
+}
+
+static int
+op_instances(struct bench_thread *bt)
+{
+	struct instance_ent *ents;
+	uint32_t cmd;
+	size_t count;
+
+	cmd = PRISON_IPC_GET_INSTANCES;
+	sock_ipc_must_write(bt->bt_ctlsock, &cmd, sizeof(cmd));
+	if (sock_ipc_must_read(bt->bt_ctlsock, &count, sizeof(count)) == 0) {
+		return (-1);
+	}
+	if (count == 0) {
+		return (0);
+	}
+	ents = calloc(count, sizeof(*ents));
+	if (ents == NULL) {
+		err(1, "calloc instances failed");
+	}
+	if (sock_ipc_must_read(bt->bt_ctlsock, ents,
+	    count * sizeof(*ents)) == 0) {
+		free(ents);
+		return (-1);
+	}
+	free(ents);
+	return (0);
+}
+
+static char *
+bench_launch(struct bench_thread *bt)
+{
+	struct cblock_response resp;
+	struct cblock_launch pl;
+	uint32_t cmd;
+
+	bzero(&pl, sizeof(pl));
+	strlcpy(pl.p_name, bcfg.b_image, sizeof(pl.p_name));
+	strlcpy(pl.p_term, "xterm", sizeof(pl.p_term));
+	strlcpy(pl.p_tag, "latest", sizeof(pl.p_tag));
+	if (bcfg.b_synth_args != NULL) {
+		strlcpy(pl.p_entry_point_args, bcfg.b_synth_args,
+		    sizeof(pl.p_entry_point_args));
+	}
+	cmd = PRISON_IPC_LAUNCH_PRISON;
+	sock_ipc_must_write(bt->bt_ctlsock, &cmd, sizeof(cmd));
+	sock_ipc_must_write(bt->bt_ctlsock, &pl, sizeof(pl));
+	do {
+		if (sock_ipc_must_read(bt->bt_ctlsock, &resp,
+		    sizeof(resp)) == 0) {
+			return (NULL);
+		}
+	} while (resp.p_ecode == CBLOCK_RESP_QUEUED);
+	if (resp.p_ecode != 0) {
+		warnx("launch failed: %s", resp.p_errbuf);
+		return (NULL);
+	}
+	return (strdup(resp.p_errbuf));
+}
+
+static int
+op_launch(struct bench_thread *bt)
+{
+	char *tag;
+
+	tag = bench_launch(bt);
+	if (tag == NULL) {
+		return (-1);
+	}
+	bt->bt_live[bt->bt_nlive++] = tag;
+	return (0);
+}
+
+static int
+bench_signal(char *tag, int sig)
+{
+	struct cblock_signal_instance csi;
+	struct cblock_response resp;
+	uint32_t cmd;
+	int sock;
+
+	sock = bench_connect();
+	bzero(&csi, sizeof(csi));
+	strlcpy(csi.p_instance, tag, sizeof(csi.p_instance));
+	csi.p_sig = sig;
+	cmd = PRISON_IPC_SIGNAL_INSTANCE;
+	sock_ipc_must_write(sock, &cmd, sizeof(cmd));
+	sock_ipc_must_write(sock, &csi, sizeof(csi));
+	if (sock_ipc_must_read(sock, &resp, sizeof(resp)) == 0) {
+		(void) close(sock);
+		return (-1);
+	}
+	(void) close(sock);
+	return (resp.p_ecode == 0 ? 0 : -1);
+}
+
+static int
+op_signal(struct bench_thread *bt)
+{
+	char *tag;
+	int ret;
+
+	tag = bt->bt_live[--bt->bt_nlive];
+	ret = bench_signal(tag, SIGKILL);
+	free(tag);
+	return (ret);
+}
+
+/*
+ * Read console frames until the marker for this round comes back out of
+ * the instance tty.
+ */
+static int
+bench_console_wait(struct bench_thread *bt, const char *mark)
+{
+	char buf[8192], window[8192 + 64];
+	size_t len, wlen, chunk;
+	uint32_t cmd;
+
+	wlen = 0;
+	while (1) {
+		if (sock_ipc_must_read(bt->bt_consock, &cmd,
+		    sizeof(cmd)) == 0) {
+			return (-1);
+		}
+		if (cmd != PRISON_IPC_CONSOLE_TO_CLIENT) {
+			warnx("unexpected console command %u", cmd);
+			return (-1);
+		}
+		if (sock_ipc_must_read(bt->bt_consock, &len,
+		    sizeof(len)) == 0) {
+			return (-1);
+		}
+		while (len > 0) {
+			chunk = MIN(len, sizeof(buf));
+			if (sock_ipc_must_read(bt->bt_consock, buf,
+			    chunk) == 0) {
+				return (-1);
+			}
+			len -= chunk;
+			/*
+			 * Keep a short tail of the previous data around in
+			 * case the marker straddles two frames.
+			 */
+			if (wlen > 64) {
+				memmove(window, window + wlen - 64, 64);
+				wlen = 64;
+			}
+			memcpy(window + wlen, buf, chunk);
+			wlen += chunk;
+			if (memmem(window, wlen, mark, strlen(mark)) != NULL) {
+				return (0);
+			}
+		}
+	}
+}
+
+static int
+bench_console_attach(struct bench_thread *bt)
+{
+	struct cblock_console_connect pcc;
+	struct cblock_response resp;
+	uint64_t start;
+	uint32_t cmd;
+
+	bt->bt_contag = bench_launch(bt);
+	if (bt->bt_contag == NULL) {
+		return (-1);
+	}
+	start = bench_now_usec();
+	bt->bt_consock = bench_connect();
+	bzero(&pcc, sizeof(pcc));
+	strlcpy(pcc.p_instance, bt->bt_contag, sizeof(pcc.p_instance));
+	strlcpy(pcc.p_term, "xterm", sizeof(pcc.p_term));
+	cfmakeraw(&pcc.p_termios);
+	pcc.p_termios.c_cflag |= CREAD | CLOCAL;
+	(void) cfsetspeed(&pcc.p_termios, B38400);
+	pcc.p_winsize.ws_row = 24;
+	pcc.p_winsize.ws_col = 80;
+	cmd = PRISON_IPC_CONSOLE_CONNECT;
+	sock_ipc_must_write(bt->bt_consock, &cmd, sizeof(cmd));
+	sock_ipc_must_write(bt->bt_consock, &pcc, sizeof(pcc));
+	bzero(&resp, sizeof(resp));
+	if (sock_ipc_must_read(bt->bt_consock, &resp, sizeof(resp)) == 0) {
+		strlcpy(resp.p_errbuf, "connection closed by daemon",
+		    sizeof(resp.p_errbuf));
+		resp.p_ecode = -1;
+	}
+	if (resp.p_ecode != 0) {
+		warnx("console attach failed: %s", resp.p_errbuf);
+		(void) close(bt->bt_consock);
+		bt->bt_consock = -1;
+		(void) bench_signal(bt->bt_contag, SIGKILL);
+		free(bt->bt_contag);
+		bt->bt_contag = NULL;
+		return (-1);
+	}
+	lat_record(&bt->bt_lat[OP_ATTACH], bench_now_usec() - start);
+	return (0);
+}
+
+static int
+op_console(struct bench_thread *bt)
+{
+	char mark[64], *buf;
+	size_t len, off;
+	uint32_t cmd;
+	int ret;
+
+	/*
+	 * The first console request on a connection only attaches, so that
+	 * the launch and the scrollback replay are not counted as input
+	 * latency.
+	 */
+	if (bt->bt_consock == -1) {
+		if (bench_console_attach(bt) == -1) {
+			bt->bt_lat[OP_ATTACH].lv_errors++;
+		}
+		return (1);
+	}
+	(void) snprintf(mark, sizeof(mark), BENCH_CONSOLE_MARK "%d:%u>",
+	    bt->bt_id, bt->bt_seq++);
+	len = MAX(bcfg.b_console_bytes, strlen(mark) + 1);
+	buf = malloc(sizeof(cmd) + len);
+	if (buf == NULL) {
+		err(1, "malloc console input failed");
+	}
+	/*
+	 * Pad the synthetic input in front of the marker and terminate it with
+	 * a newline. The header and payload go out in a single write so the
+	 * daemon sees them together.
+	 */
+	cmd = PRISON_IPC_CONSOLE_DATA;
+	memcpy(buf, &cmd, sizeof(cmd));
+	off = len - strlen(mark) - 1;
+	memset(buf + sizeof(cmd), 'x', off);
+	memcpy(buf + sizeof(cmd) + off, mark, strlen(mark));
+	buf[sizeof(cmd) + len - 1] = '\n';
+	sock_ipc_must_write(bt->bt_consock, buf, sizeof(cmd) + len);
+	free(buf);
+	ret = bench_console_wait(bt, mark);
+	return (ret);
+}
+
+/*
+ * Upload a build context of one file. The file is stamped with the thread
+ * and a sequence number so that every upload is new to the daemon's blob
+ * store and the full context is transferred each time.
+ */
+static int
+op_build(struct bench_thread *bt)
+{
+	struct cblock_build_context pbc;
+	struct cblock_context_entry ce;
+	u_char hash[EVP_MAX_MD_SIZE];
+	struct cblock_response resp;
+	char want[CBLOCK_DIGEST_LEN];
+	struct build_stage stage;
+	struct build_step step;
+	uint32_t cmd, compress, count;
+	u_int dlen, k;
+	void *manifest;
+	size_t len;
+
+	if (bcfg.b_context_size > 0) {
+		(void) snprintf(bt->bt_context, bcfg.b_context_size, "%d:%u",
+		    bt->bt_id, bt->bt_seq++);
+	}
+	bzero(&ce, sizeof(ce));
+	ce.ce_mode = S_IFREG | 0644;
+	ce.ce_path_len = sizeof(BENCH_CONTEXT_FILE);
+	ce.ce_size = bcfg.b_context_size;
+	if (!EVP_Digest(bt->bt_context, bcfg.b_context_size, hash, &dlen,
+	    EVP_sha256(), NULL)) {
+		errx(1, "EVP_Digest failed");
+	}
+	for (k = 0; k < dlen; k++) {
+		(void) sprintf(ce.ce_digest + (k * 2), "%02x", hash[k]);
+	}
+	bzero(&pbc, sizeof(pbc));
+	strlcpy(pbc.p_image_name, bcfg.b_image, sizeof(pbc.p_image_name));
+	strlcpy(pbc.p_cblock_file, "Cblockfile", sizeof(pbc.p_cblock_file));
+	strlcpy(pbc.p_tag, "latest", sizeof(pbc.p_tag));
+	strlcpy(pbc.p_term, "xterm", sizeof(pbc.p_term));
+	pbc.p_context_size = sizeof(ce) + sizeof(BENCH_CONTEXT_FILE);
+	pbc.p_context_entries = 1;
+	pbc.p_nstages = 1;
+	pbc.p_nsteps = 1;
+	bzero(&stage, sizeof(stage));
+	stage.bs_index = 0;
+	stage.bs_is_last = 1;
+	stage.bs_name = "";
+	stage.bs_base_container = "FreeBSD-bench";
+	bzero(&step, sizeof(step));
+	step.step_op = STEP_RUN;
+	step.stage_index = 0;
+	step.step_data.step_cmd = "true";
+	step.step_string = "RUN true";
+	manifest = build_manifest_pack(&stage, 1, &step, 1, &len);
+	if (manifest == NULL) {
+		errx(1, "build_manifest_pack failed");
+	}
+	pbc.p_manifest_len = len;
+	cmd = PRISON_IPC_SEND_BUILD_CTX;
+	sock_ipc_must_write(bt->bt_ctlsock, &cmd, sizeof(cmd));
+	sock_ipc_must_write(bt->bt_ctlsock, &pbc, sizeof(pbc));
+	sock_ipc_must_write(bt->bt_ctlsock, manifest, len);
+	free(manifest);
+	sock_ipc_must_write(bt->bt_ctlsock, &ce, sizeof(ce));
+	sock_ipc_must_write(bt->bt_ctlsock, BENCH_CONTEXT_FILE,
+	    sizeof(BENCH_CONTEXT_FILE));
+	if (sock_ipc_must_read(bt->bt_ctlsock, &resp, sizeof(resp)) == 0) {
+		return (-1);
+	}
+	if (resp.p_ecode != 0) {
+		warnx("build upload failed: %s", resp.p_errbuf);
+		return (-1);
+	}
+	sock_ipc_must_read(bt->bt_ctlsock, &compress, sizeof(compress));
+	sock_ipc_must_read(bt->bt_ctlsock, &count, sizeof(count));
+	for (k = 0; k < count; k++) {
+		sock_ipc_must_read(bt->bt_ctlsock, want, sizeof(want));
+		sock_ipc_must_write(bt->bt_ctlsock, bt->bt_context,
+		    bcfg.b_context_size);
+	}
+	do {
+		if (sock_ipc_must_read(bt->bt_ctlsock, &resp,
+		    sizeof(resp)) == 0) {
+			return (-1);
+		}
+	} while (resp.p_ecode == CBLOCK_RESP_QUEUED);
+	/*
+	 * An identical build was in flight. Its console is streamed on this
+	 * connection until it completes, so carry on with a new one.
+	 */
+	if (resp.p_ecode == CBLOCK_RESP_SHARED) {
+		(void) close(bt->bt_ctlsock);
+		bt->bt_ctlsock = bench_connect();
+		return (0);
+	}
+	if (resp.p_ecode != 0) {
+		warnx("build upload failed: %s", resp.p_errbuf);
+		return (-1);
+	}
+	return (0);
+}
+
+static int (*op_funcs[OP_MAX])(struct bench_thread *) = {
+	op_instances,
+	op_launch,
+	op_signal,
+	op_console,
+	NULL,
+	op_build
+};
+
+static void *
+bench_thread_loop(void *arg)
+{
+	struct bench_thread *bt;
+	uint64_t deadline, start, now;
+	long nops;
+	int op, ret, k;
+
+	bt = arg;
+	bt->bt_ctlsock = bench_connect();
+	bt->bt_consock = -1;
+	bt->bt_context = malloc(bcfg.b_context_size);
+	if (bt->bt_context == NULL) {
+		err(1, "malloc build context failed");
+	}
+	memset(bt->bt_context, 'c', bcfg.b_context_size);
+	/*
+	 * Background instances are spread evenly over the connections.
+	 */
+	bt->bt_nbg = bcfg.b_populate / bcfg.b_conns +
+	    (bt->bt_id < bcfg.b_populate % bcfg.b_conns);
+	bt->bt_bg = calloc(bt->bt_nbg + 1, sizeof(*bt->bt_bg));
+	if (bt->bt_bg == NULL) {
+		err(1, "calloc background instances failed");
+	}
+	for (k = 0; k < bt->bt_nbg; k++) {
+		bt->bt_bg[k] = bench_launch(bt);
+	}
+	(void) pthread_barrier_wait(&start_barrier);
+	deadline = bench_now_usec() + (uint64_t)bcfg.b_duration * 1000000;
+	for (nops = 0; ; nops++) {
+		now = bench_now_usec();
+		if (bcfg.b_ops > 0 ? nops == bcfg.b_ops : now >= deadline) {
+			break;
+		}
+		op = bench_pick_op(bt);
+		start = bench_now_usec();
+		ret = op_funcs[op](bt);
+		if (ret == -1) {
+			bt->bt_lat[op].lv_errors++;
+		} else if (ret == 0) {
+			lat_record(&bt->bt_lat[op], bench_now_usec() - start);
+		}
+	}
+	(void) pthread_barrier_wait(&stop_barrier);
+	(void) pthread_barrier_wait(&teardown_barrier);
+	/*
+	 * Tear down whatever this connection left running.
+	 */
+	for (k = 0; k < bt->bt_nbg; k++) {
+		if (bt->bt_bg[k] != NULL) {
+			(void) bench_signal(bt->bt_bg[k], SIGKILL);
+			free(bt->bt_bg[k]);
+		}
+	}
+	free(bt->bt_bg);
+	if (bt->bt_consock != -1) {
+		(void) close(bt->bt_consock);
+	}
+	if (bt->bt_contag != NULL) {
+		(void) bench_signal(bt->bt_contag, SIGKILL);
+		free(bt->bt_contag);
+	}
+	while (bt->bt_nlive > 0) {
+		(void) op_signal(bt);
+	}
+	(void) close(bt->bt_ctlsock);
+	free(bt->bt_context);
+	return (NULL);
+}
+
+static char *
+bench_get_stats(void)
+{
+	uint32_t cmd;
+	size_t len;
+	char *buf;
+	int sock;
+
+	sock = bench_connect();
+	cmd = PRISON_IPC_GET_STATS;
+	sock_ipc_must_write(sock, &cmd, sizeof(cmd));
+	if (sock_ipc_must_read(sock, &len, sizeof(len)) == 0) {
+		(void) close(sock);
+		return (NULL);
+	}
+	buf = malloc(len + 1);
+	if (buf == NULL) {
+		err(1, "malloc stats failed");
+	}
+	if (len > 0 && sock_ipc_must_read(sock, buf, len) == 0) {
+		(void) close(sock);
+		free(buf);
+		return (NULL);
+	}
+	buf[len] = '\0';
+	(void) close(sock);
+	return (buf);
+}
+
+/*
+ * Pick the un-labelled samples named in daemon_gauges out of the Prometheus
+ * text. Missing samples are reported as -1.
+ */
+static void
+bench_parse_stats(char *text, double *values)
+{
+	char *line, *sp;
+	int k;
+
+	for (k = 0; daemon_gauges[k] != NULL; k++) {
+		values[k] = -1;
+	}
+	while (text != NULL && (line = strsep(&text, "\n")) != NULL) {
+		if (*line == '#' || (sp = strchr(line, ' ')) == NULL) {
+			continue;
+		}
+		*sp++ = '\0';
+		for (k = 0; daemon_gauges[k] != NULL; k++) {
+			if (strcmp(line, daemon_gauges[k]) == 0) {
+				values[k] = strtod(sp, NULL);
+				break;
+			}
+		}
+	}
+}
+
+static void
+bench_report(struct lat_vec *totals, double elapsed, double *daemon)
+{
+	struct lat_vec *lv;
+	uint64_t nops;
+	FILE *fp;
+	int k, first;
+
+	nops = 0;
+	for (k = 0; k < OP_MAX; k++) {
+		if (k != OP_ATTACH) {
+			nops += totals[k].lv_used;
+		}
+	}
+	if (!bcfg.b_json_only) {
+		printf("%d connections, %.2f seconds, %ju operations, "
+		    "%.1f ops/sec\n\n", bcfg.b_conns, elapsed, (uintmax_t)nops,
+		    nops / elapsed);
+		printf("%-10s %10s %8s %10s %10s %10s %10s %10s\n",
+		    "operation", "count", "errors", "ops/sec", "p50(us)",
+		    "p99(us)", "p999(us)", "max(us)");
+		for (k = 0; k < OP_MAX; k++) {
+			lv = &totals[k];
+			if (lv->lv_used == 0 && lv->lv_errors == 0) {
+				continue;
+			}
+			printf("%-10s %10zu %8ju %10.1f %10ju %10ju %10ju %10ju\n",
+			    op_names[k], lv->lv_used, (uintmax_t)lv->lv_errors,
+			    lv->lv_used / elapsed,
+			    (uintmax_t)lat_percentile(lv, 0.50),
+			    (uintmax_t)lat_percentile(lv, 0.99),
+			    (uintmax_t)lat_percentile(lv, 0.999),
+			    (uintmax_t)lat_percentile(lv, 1.0));
+		}
+		printf("\n");
+		for (k = 0; daemon_gauges[k] != NULL; k++) {
+			if (daemon[k] >= 0) {
+				printf("%-42s %.4f\n", daemon_gauges[k],
+				    daemon[k]);
+			}
+		}
+	}
+	if (bcfg.b_json_path == NULL && !bcfg.b_json_only) {
+		return;
+	}
+	if (bcfg.b_json_path != NULL) {
+		fp = fopen(bcfg.b_json_path, "w");
+		if (fp == NULL) {
+			err(1, "fopen(%s) failed", bcfg.b_json_path);
+		}
+	} else {
+		fp = stdout;
+	}
+	fprintf(fp, "{\"connections\":%d,\"duration_sec\":%.3f,"
+	    "\"mix\":\"%s\",\"console_bytes\":%zu,\"context_size\":%jd,"
+	    "\"populate\":%d,\"total_ops\":%ju,\"throughput\":%.1f,"
+	    "\"ops\":{",
+	    bcfg.b_conns, elapsed, bcfg.b_mix, bcfg.b_console_bytes,
+	    (intmax_t)bcfg.b_context_size, bcfg.b_populate, (uintmax_t)nops,
+	    nops / elapsed);
+	first = 1;
+	for (k = 0; k < OP_MAX; k++) {
+		lv = &totals[k];
+		if (lv->lv_used == 0 && lv->lv_errors == 0) {
+			continue;
+		}
+		fprintf(fp, "%s\"%s\":{\"count\":%zu,\"errors\":%ju,"
+		    "\"throughput\":%.1f,\"p50_usec\":%ju,\"p99_usec\":%ju,"
+		    "\"p999_usec\":%ju,\"max_usec\":%ju}",
+		    first ? "" : ",", op_names[k], lv->lv_used,
+		    (uintmax_t)lv->lv_errors, lv->lv_used / elapsed,
+		    (uintmax_t)lat_percentile(lv, 0.50),
+		    (uintmax_t)lat_percentile(lv, 0.99),
+		    (uintmax_t)lat_percentile(lv, 0.999),
+		    (uintmax_t)lat_percentile(lv, 1.0));
+		first = 0;
+	}
+	fprintf(fp, "},\"daemon\":{");
+	first = 1;
+	for (k = 0; daemon_gauges[k] != NULL; k++) {
+		if (daemon[k] < 0) {
+			continue;
+		}
+		fprintf(fp, "%s\"%s\":%.4f", first ? "" : ",",
+		    daemon_gauges[k], daemon[k]);
+		first = 0;
+	}
+	fprintf(fp, "}}\n");
+	if (fp != stdout) {
+		(void) fclose(fp);
+	}
+}
+
+int
+main(int argc, char *argv [])
+{
+	struct lat_vec totals[OP_MAX], *lv, *src;
+	struct bench_thread *threads, *bt;
+	int option_index, c, k, j;
+	double elapsed, daemon[16];
+	char *stats_text;
+	uint64_t start;
+	size_t n;
+
+	bcfg.b_sock = "/var/run/cblock.sock";
+	bcfg.b_conns = 4;
+	bcfg.b_duration = 10;
+	bcfg.b_mix = "instances=70,launch=10,signal=10,console=5,build=5";
+	bcfg.b_console_bytes = 64;
+	bcfg.b_context_size = 65536;
+	bcfg.b_max_live = 8;
+	bcfg.b_image = "bench";
+	while (1) {
+		option_index = 0;
+		c = getopt_long(argc, argv, "U:c:t:n:m:C:B:i:I:a:P:o:jh",
+		    bench_options, &option_index);
+		if (c == -1) {
+			break;
+		}
+		switch (c) {
+		case 'U':
+			bcfg.b_sock = optarg;
+			break;
+		case 'c':
+			bcfg.b_conns = atoi(optarg);
+			break;
+		case 't':
+			bcfg.b_duration = atoi(optarg);
+			break;
+		case 'n':
+			bcfg.b_ops = atol(optarg);
+			break;
+		case 'm':
+			bcfg.b_mix = optarg;
+			break;
+		case 'C':
+			bcfg.b_console_bytes = strtoul(optarg, NULL, 10);
+			break;
+		case 'B':
+			bcfg.b_context_size = strtoll(optarg, NULL, 10);
+			break;
+		case 'i':
+			bcfg.b_max_live = atoi(optarg);
+			break;
+		case 'I':
+			bcfg.b_image = optarg;
+			break;
+		case 'a':
+			bcfg.b_synth_args = optarg;
+			break;
+		case 'P':
+			bcfg.b_populate = atoi(optarg);
+			break;
+		case 'o':
+			bcfg.b_json_path = optarg;
+			break;
+		case 'j':
+			bcfg.b_json_only = 1;
+			break;
+		case 'h':
+		default:
+			usage();
+			/* NOT REACHED */
+		}
+	}
+	if (bcfg.b_conns <= 0 || bcfg.b_duration <= 0 ||
+	    bcfg.b_context_size < 0 || bcfg.b_max_live <= 0 ||
+	    bcfg.b_populate < 0 ||
+	    bcfg.b_max_live > BENCH_MAX_LIVE) {
+		usage();
+	}
+	if (bench_parse_mix(bcfg.b_mix) == -1) {
+		usage();
+	}
+	/*
+	 * A daemon that goes away mid-run should be reported as an error, not
+	 * silently kill the benchmark.
+	 */
+	(void) signal(SIGPIPE, SIG_IGN);
+	threads = calloc(bcfg.b_conns, sizeof(*threads));
+	if (threads == NULL) {
+		err(1, "calloc threads failed");
+	}
+	(void) pthread_barrier_init(&start_barrier, NULL, bcfg.b_conns + 1);
+	(void) pthread_barrier_init(&stop_barrier, NULL, bcfg.b_conns + 1);
+	(void) pthread_barrier_init(&teardown_barrier, NULL, bcfg.b_conns + 1);
+	start = bench_now_usec();
+	for (k = 0; k < bcfg.b_conns; k++) {
+		bt = &threads[k];
+		bt->bt_id = k;
+		bt->bt_seed = (u_int)(start ^ (k * 2654435761U));
+		if (pthread_create(&bt->bt_thread, NULL, bench_thread_loop,
+		    bt) != 0) {
+			errx(1, "pthread_create failed");
+		}
+	}
+	/*
+	 * Scrape once when the run starts so that the daemon's CPU
+	 * utilization covers just the measured interval.
+	 */
+	(void) pthread_barrier_wait(&start_barrier);
+	free(bench_get_stats());
+	start = bench_now_usec();
+	(void) pthread_barrier_wait(&stop_barrier);
+	elapsed = (bench_now_usec() - start) / 1000000.0;
+	stats_text = bench_get_stats();
+	bench_parse_stats(stats_text, daemon);
+	free(stats_text);
+	(void) pthread_barrier_wait(&teardown_barrier);
+	bzero(totals, sizeof(totals));
+	for (k = 0; k < bcfg.b_conns; k++) {
+		bt = &threads[k];
+		(void) pthread_join(bt->bt_thread, NULL);
+		for (j = 0; j < OP_MAX; j++) {
+			src = &bt->bt_lat[j];
+			lv = &totals[j];
+			for (n = 0; n < src->lv_used; n++) {
+				lat_record(lv, src->lv_samples[n]);
+			}
+			lv->lv_errors += src->lv_errors;
+			free(src->lv_samples);
+		}
+	}
+	for (j = 0; j < OP_MAX; j++) {
+		qsort(totals[j].lv_samples, totals[j].lv_used,
+		    sizeof(uint64_t), lat_cmp);
+	}
+	bench_report(totals, elapsed, daemon);
+	for (j = 0; j < OP_MAX; j++) {
+		free(totals[j].lv_samples);
+	}
+	free(threads);
+	return (0);
+}
@@ -0,0 +1,378 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+
+/*
+ * cblock-synth: a stand-in for a container that cblockd runs under a pty
+ * when launched with --synthetic. It produces console output at a
+ * configurable rate and shape, echoes console input back, and exits when
+ * signalled, when its lifetime runs out, or when "q" is typed on the
+ * console.
+ */
+
+enum {
+	PATTERN_LINES,
+	PATTERN_ANSI,
+	PATTERN_RANDOM,
+	PATTERN_PROGRESS
+};
+
+static const char *pattern_names[] = {
+	"lines",
+	"ansi",
+	"random",
+	"progress",
+	NULL
+};
+
+struct synth_params {
+	char		*s_name;
+	int		 s_pattern;
+	double		 s_rate;
+	size_t		 s_size;
+	u_int		 s_burst;
+	u_int		 s_lifetime;
+	int		 s_exit_code;
+};
+
+static struct option synth_options[] = {
+	{ "name",		required_argument, 0, 'n' },
+	{ "pattern",		required_argument, 0, 'p' },
+	{ "rate",		required_argument, 0, 'r' },
+	{ "size",		required_argument, 0, 's' },
+	{ "burst",		required_argument, 0, 'b' },
+	{ "lifetime",		required_argument, 0, 'l' },
+	{ "exit-code",		required_argument, 0, 'x' },
+	{ "help",		no_argument, 0, 'h' },
+	{ 0, 0, 0, 0 }
+};
+
+static struct synth_params scfg;
+static volatile sig_atomic_t synth_done;
+static uint64_t synth_seq;
+
+static void
+usage(void)
+{
+	(void) fprintf(stderr,
+	    "Usage: cblock-synth [OPTIONS]\n\n"
+	    "Options\n"
+	    " -n, --name=NAME            Name printed in the output (synth)\n"
+	    " -p, --pattern=PATTERN      lines, ansi, random or progress (lines)\n"
+	    " -r, --rate=N               Lines per second, 0 for none (10)\n"
+	    " -s, --size=N               Bytes per line (80)\n"
+	    " -b, --burst=N              Write lines in bursts of N (1)\n"
+	    " -l, --lifetime=SECS        Exit after SECS seconds, 0 for never (0)\n"
+	    " -x, --exit-code=N          Exit status to use (0)\n"
+	    " -h, --help                 Print help\n");
+	exit(1);
+}
+
+static void
+handle_exit_signal(int sig __attribute__((unused)))
+{
+
+	synth_done = 1;
+}
+
+static uint64_t
+synth_now_usec(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static int
+synth_write(const char *buf, size_t len)
+{
+	ssize_t cc;
+
+	while (len > 0) {
+		cc = write(STDOUT_FILENO, buf, len);
+		if (cc == -1) {
+			if (errno == EINTR && !synth_done) {
+				continue;
+			}
+			return (-1);
+		}
+		buf += cc;
+		len -= cc;
+	}
+	return (0);
+}
+
+/*
+ * Format one unit of output for the selected pattern into buf, which must
+ * hold at least scfg.s_size + 64 bytes.
+ */
+static size_t
+synth_format(char *buf)
+{
+	static const char *colors[] = { "31", "32", "33", "34", "35", "36" };
+	size_t len, k, width;
+	uint64_t seq;
+
+	seq = synth_seq++;
+	switch (scfg.s_pattern) {
+	case PATTERN_ANSI:
+		len = sprintf(buf, "\033[%sm%.16s %ju\033[0m ",
+		    colors[seq % 6], scfg.s_name, (uintmax_t)seq);
+		while (len < scfg.s_size + 16) {
+			buf[len] = 'a' + (seq + len) % 26;
+			len++;
+		}
+		len += sprintf(buf + len, "\033[K\r\n");
+		break;
+	case PATTERN_RANDOM:
+		for (len = 0; len < scfg.s_size; len++) {
+			buf[len] = ' ' + arc4random_uniform(95);
+		}
+		buf[len++] = '\r';
+		buf[len++] = '\n';
+		break;
+	case PATTERN_PROGRESS:
+		width = scfg.s_size > 16 ? scfg.s_size - 16 : 0;
+		len = sprintf(buf, "\r%.16s [", scfg.s_name);
+		for (k = 0; k < width; k++) {
+			buf[len++] = k < (seq % (width + 1)) ? '#' : ' ';
+		}
+		len += sprintf(buf + len, "] %3ju%%",
+		    (uintmax_t)(width ? seq % (width + 1) * 100 / width : 100));
+		break;
+	case PATTERN_LINES:
+	default:
+		len = sprintf(buf, "%.16s %ju ", scfg.s_name, (uintmax_t)seq);
+		while (len < scfg.s_size) {
+			buf[len] = 'a' + (seq + len) % 26;
+			len++;
+		}
+		buf[len++] = '\r';
+		buf[len++] = '\n';
+		break;
+	}
+	return (len);
+}
+
+/*
+ * Echo console input back to the daemon. A "q" on its own exits.
+ */
+static int
+synth_input(void)
+{
+	char buf[4096];
+	ssize_t cc;
+
+	cc = read(STDIN_FILENO, buf, sizeof(buf));
+	if (cc == -1) {
+		return (errno == EINTR ? 0 : -1);
+	}
+	if (cc == 0) {
+		return (-1);
+	}
+	if (buf[0] == 'q' && (cc == 1 || buf[1] == '\r' || buf[1] == '\n')) {
+		synth_done = 1;
+		return (0);
+	}
+	return (synth_write(buf, cc));
+}
+
+static void
+synth_ready(void)
+{
+	char *fd_str, *ep;
+	long fd;
+
+	fd_str = getenv("CBLOCK_READY_FD");
+	if (fd_str == NULL) {
+		return;
+	}
+	fd = strtol(fd_str, &ep, 10);
+	if (*ep != '\0' || fd < 0) {
+		return;
+	}
+	(void) write(fd, "ready\n", 6);
+	(void) close(fd);
+}
+
+static void
+synth_loop(void)
+{
+	uint64_t now, next, interval, deadline;
+	struct pollfd pfd;
+	char *buf, *ep;
+	size_t unit;
+	int timeout;
+	u_int k;
+
+	unit = scfg.s_size + 64;
+	buf = malloc(unit * scfg.s_burst);
+	if (buf == NULL) {
+		err(1, "malloc output buffer failed");
+	}
+	interval = 0;
+	if (scfg.s_rate > 0) {
+		interval = (uint64_t)(1000000.0 * scfg.s_burst / scfg.s_rate);
+	}
+	now = synth_now_usec();
+	next = now;
+	deadline = scfg.s_lifetime ? now + scfg.s_lifetime * 1000000ULL : 0;
+	pfd.fd = STDIN_FILENO;
+	pfd.events = POLLIN;
+	while (!synth_done) {
+		now = synth_now_usec();
+		if (deadline != 0 && now >= deadline) {
+			break;
+		}
+		if (interval != 0 && now >= next) {
+			ep = buf;
+			for (k = 0; k < scfg.s_burst; k++) {
+				ep += synth_format(ep);
+			}
+			if (synth_write(buf, ep - buf) == -1) {
+				break;
+			}
+			/*
+			 * Do not try to catch up on ticks that were missed
+			 * because the daemon was not draining the pty.
+			 */
+			next += interval;
+			if (next < now) {
+				next = now + interval;
+			}
+			continue;
+		}
+		timeout = -1;
+		if (interval != 0) {
+			timeout = (next - now + 999) / 1000;
+		}
+		if (deadline != 0 && (timeout == -1 ||
+		    (uint64_t)timeout > (deadline - now + 999) / 1000)) {
+			timeout = (deadline - now + 999) / 1000;
+		}
+		if (poll(&pfd, 1, timeout) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err(1, "poll failed");
+		}
+		if ((pfd.revents & (POLLIN | POLLHUP)) != 0 &&
+		    synth_input() == -1) {
+			break;
+		}
+	}
+	free(buf);
+}
+
+int
+main(int argc, char *argv [])
+{
+	int option_index, c, k;
+	char *r;
+
+	scfg.s_name = "synth";
+	scfg.s_pattern = PATTERN_LINES;
+	scfg.s_rate = 10;
+	scfg.s_size = 80;
+	scfg.s_burst = 1;
+	while (1) {
+		option_index = 0;
+		c = getopt_long(argc, argv, "n:p:r:s:b:l:x:h", synth_options,
+		    &option_index);
+		if (c == -1) {
+			break;
+		}
+		switch (c) {
+		case 'n':
+			scfg.s_name = optarg;
+			break;
+		case 'p':
+			for (k = 0; pattern_names[k] != NULL; k++) {
+				if (strcmp(pattern_names[k], optarg) == 0) {
+					break;
+				}
+			}
+			if (pattern_names[k] == NULL) {
+				errx(1, "unknown pattern: %s", optarg);
+			}
+			scfg.s_pattern = k;
+			break;
+		case 'r':
+			scfg.s_rate = strtod(optarg, &r);
+			if (*r != '\0' || scfg.s_rate < 0) {
+				errx(1, "invalid rate: %s", optarg);
+			}
+			break;
+		case 's':
+			scfg.s_size = strtoul(optarg, &r, 10);
+			if (*r != '\0' || scfg.s_size > 65536) {
+				errx(1, "invalid size: %s", optarg);
+			}
+			break;
+		case 'b':
+			scfg.s_burst = strtoul(optarg, &r, 10);
+			if (*r != '\0' || scfg.s_burst == 0 ||
+			    scfg.s_burst > 4096) {
+				errx(1, "invalid burst: %s", optarg);
+			}
+			break;
+		case 'l':
+			scfg.s_lifetime = strtoul(optarg, &r, 10);
+			if (*r != '\0') {
+				errx(1, "invalid lifetime: %s", optarg);
+			}
+			break;
+		case 'x':
+			scfg.s_exit_code = atoi(optarg);
+			break;
+		case 'h':
+		default:
+			usage();
+			/* NOT REACHED */
+		}
+	}
+	(void) signal(SIGTERM, handle_exit_signal);
+	(void) signal(SIGHUP, handle_exit_signal);
+	(void) signal(SIGINT, handle_exit_signal);
+	synth_ready();
+	synth_loop();
+	return (scfg.s_exit_code);
+}
@@ -29,7 +29,9 @@
 #include <sys/queue.h>
 #include <sys/ioctl.h>
 #include <sys/wait.h>
+#ifdef __FreeBSD__
 #include <sys/ttycom.h>
+#endif
 
 #include <stdio.h>
 #include <errno.h>
@@ -52,11 +54,17 @@ struct build_config {
 	char			*b_name;
 	char			*b_cblock_file;
 	char			*b_path;
-	char			*b_context_path;
+	struct context_manifest	*b_context;
 	char			*b_tag;
 	struct build_manifest	*b_bmp;
 	int			 b_verbose;
 	int			 b_fim_spec;
+	char			*b_trace;
+	int			 b_jobs;
+	int			 b_no_cache;
+	int			 b_transfer;
+	int			 b_detach;
+	int			 b_priority;
 };
 
 static struct option build_options[] = {
@@ -67,6 +75,12 @@ static struct option build_options[] = {
 	{ "help",		no_argument, 0, 'h' },
 	{ "verbose",		no_argument, 0, 'v' },
 	{ "file-integrity",	no_argument, 0, 'F' },
+	{ "trace",		required_argument, 0, 'X' },
+	{ "jobs",		required_argument, 0, 'j' },
+	{ "no-cache",		no_argument, 0, 'c' },
+	{ "compress",		required_argument, 0, 'z' },
+	{ "detach",		no_argument, 0, 'd' },
+	{ "priority",		required_argument, 0, 'p' },
 	{ 0, 0, 0, 0 }
 };
 
@@ -110,6 +124,16 @@ build_usage(void)
 	    " -N, --no-exec                 Do everything but submit the build context\n"
 	    " -v, --verbose                 Increase verbosity of build\n"
 	    " -F, --file-integrity          Create file integrity spec\n"
+	    " -X, --trace=FILE              Write a Chrome trace of the build to FILE\n"
+	    " -j, --jobs=N                  Build up to N independent stages at once\n"
+	    " -c, --no-cache                Do not use or populate the step cache\n"
+	    " -z, --compress=METHOD         Send the build context compressed (zlib)\n"
+	    "                               or not (none). By default it is compressed\n"
+	    "                               over TCP and passed as file descriptors\n"
+	    "                               over the UNIX socket\n"
+	    " -d, --detach                  Queue the build and return, see cblock builds\n"
+	    " -p, --priority=N              Queue ahead of builds with a lower priority.\n"
+	    "                               Only root may use priorities above 0\n"
 	);
 	exit(1);
 }
@@ -131,23 +155,41 @@ build_init_stage_count(struct build_config *bcp,
 	}
 }
 
-static void
-build_send_stages(int sock, struct build_config *bcp)
+/*
+ * Pack the stages and steps, in the order they appear in the Cblockfile,
+ * into one buffer for the daemon.
+ */
+static void *
+build_pack_manifest(struct build_config *bcp,
+    struct cblock_build_context *pbc, size_t *lenp)
 {
-	struct build_stage *stage;
-	struct build_step *step;
+	struct build_stage *stage, *stages;
+	struct build_step *step, *steps;
+	int k, j;
+	void *buf;
 
-	TAILQ_FOREACH_REVERSE(stage, &bcp->b_bmp->stage_head,
-	    tailhead_stage, stage_glue) {
-		sock_ipc_must_write(sock, stage, sizeof(*stage));
+	stages = calloc(pbc->p_nstages, sizeof(*stages));
+	steps = calloc(pbc->p_nsteps, sizeof(*steps));
+	if ((stages == NULL && pbc->p_nstages != 0) ||
+	    (steps == NULL && pbc->p_nsteps != 0)) {
+		err(1, "calloc(build manifest) failed");
 	}
+	k = j = 0;
 	TAILQ_FOREACH_REVERSE(stage, &bcp->b_bmp->stage_head,
 	    tailhead_stage, stage_glue) {
+		stages[k++] = *stage;
 		TAILQ_FOREACH_REVERSE(step, &stage->step_head,
 		    tailhead_step, step_glue) {
-			sock_ipc_must_write(sock, step, sizeof(*step));
+			steps[j++] = *step;
 		}
 	}
+	buf = build_manifest_pack(stages, k, steps, j, lenp);
+	if (buf == NULL) {
+		err(1, "failed to pack build manifest");
+	}
+	free(stages);
+	free(steps);
+	return (buf);
 }
 
 static int
@@ -155,29 +197,24 @@ build_send_context(int sock, struct build_config *bcp)
 {
 	struct cblock_build_context pbc;
 	struct cblock_response resp;
-	int fd, status;
-	struct stat sb;
-	vec_t *vec;
+	uint64_t start;
+	void *manifest;
 	char *term;
+	size_t len;
 	u_int cmd;
 
-	if (stat(bcp->b_context_path, &sb) == -1) {
-		err(1, "stat failed");
-	}
-	fd = open(bcp->b_context_path, O_RDONLY);
-	if (fd == -1) {
-		err(1, "error opening build context");
-	}
 	term = getenv("TERM");
 	if (term == NULL) {
 		errx(1, "Can not determine TERM type\n");
 	}
 	bzero(&pbc, sizeof(pbc));
 	bzero(&resp, sizeof(resp));
+	start = trace_now_usec();
 	cmd = PRISON_IPC_SEND_BUILD_CTX;
 	sock_ipc_must_write(sock, &cmd, sizeof(cmd));
 	pbc.p_build_fim_spec = bcp->b_fim_spec;
-	pbc.p_context_size = sb.st_size;
+	pbc.p_context_size = context_manifest_len(bcp->b_context);
+	pbc.p_context_entries = context_manifest_entries(bcp->b_context);
 	pbc.p_verbose = bcp->b_verbose;
 	strlcpy(pbc.p_term, term, sizeof(pbc.p_term));
 	strlcpy(pbc.p_image_name, bcp->b_name, sizeof(pbc.p_image_name));
@@ -200,78 +237,100 @@ build_send_context(int sock, struct build_config *bcp)
 		    sizeof(pbc.p_entry_point_args));
 	}
 	strlcpy(pbc.p_tag, bcp->b_tag, sizeof(pbc.p_tag));
+	strlcpy(pbc.p_trace_id, trace_client_id(), sizeof(pbc.p_trace_id));
+	pbc.p_jobs = bcp->b_jobs;
+	pbc.p_no_cache = bcp->b_no_cache;
+	pbc.p_context_transfer = bcp->b_transfer;
+	pbc.p_detach = bcp->b_detach;
+	pbc.p_priority = bcp->b_priority;
 	build_init_stage_count(bcp, &pbc);
+	manifest = build_pack_manifest(bcp, &pbc, &len);
+	pbc.p_manifest_len = len;
 	sock_ipc_must_write(sock, &pbc, sizeof(pbc));
-	build_send_stages(sock, bcp);
-	print_bold_prefix(stdout);
-	fprintf(stdout,
-	    "Transmitting build context to cblock daemon (%zu) bytes...\n",
-	    sb.st_size);
-	fflush(stdout);
-	if (sock_ipc_from_to(fd, sock, sb.st_size) == -1) {
-		close(fd);
-		err(1, "sock_ipc_from_to: failed");
+	sock_ipc_must_write(sock, manifest, len);
+	free(manifest);
+	if (context_send(sock, bcp->b_context) == -1) {
+		return (1);
 	}
-	close(fd);
-	if (unlink(bcp->b_context_path) == -1) {
-		err(1, "failed to cleanup build context");
+	trace_client_span("send context", start);
+	if (bcp->b_detach) {
+		sock_ipc_must_read(sock, &resp, sizeof(resp));
+		resp.p_errbuf[sizeof(resp.p_errbuf) - 1] = '\0';
+		if (resp.p_ecode != 0) {
+			errx(1, "failed to queue build: %s", resp.p_errbuf);
+		}
+		printf("%s\n", resp.p_errbuf);
+		return (0);
+	}
+	return (build_attach(sock));
+}
+
+/*
+ * Wait for a build that was submitted (or is being followed) on this socket
+ * to make its way through the daemon's build queue, then attach to its
+ * console until it completes. If the daemon found an identical build in
+ * flight, its console is streamed here without attaching. Returns the
+ * status of the build.
+ */
+int
+build_attach(int sock)
+{
+	struct cblock_response resp;
+	uint64_t start, qstart;
+	vec_t *vec;
+	int status;
+
+	start = trace_now_usec();
+	qstart = 0;
+	while (1) {
+		sock_ipc_must_read(sock, &resp, sizeof(resp));
+		resp.p_errbuf[sizeof(resp.p_errbuf) - 1] = '\0';
+		if (resp.p_ecode != CBLOCK_RESP_QUEUED) {
+			break;
+		}
+		if (qstart == 0) {
+			qstart = trace_now_usec();
+		}
+		printf("cellblock: build queued: position %s\n",
+		    resp.p_errbuf);
+	}
+	if (qstart != 0) {
+		trace_client_span("queued", qstart);
+	}
+	if (resp.p_ecode == CBLOCK_RESP_SHARED) {
+		print_bold_prefix(stdout);
+		printf("sharing identical build %s\n", resp.p_errbuf);
+		fflush(stdout);
+		start = trace_now_usec();
+		console_tty_console_session(sock);
+		sock_ipc_must_read(sock, &status, sizeof(status));
+		trace_client_span("build", start);
+		return (status);
+	}
+	if (resp.p_ecode != 0) {
+		errx(1, "failed to spawn container: %s", resp.p_errbuf);
 	}
-        sock_ipc_must_read(sock, &resp, sizeof(resp));
-        if (resp.p_ecode != 0) {
-                err(1, "failed to spawn container");
-        }
 	vec = vec_init(8);
 	vec_append(vec, "console");
 	vec_append(vec, "--name");
 	vec_append(vec, resp.p_errbuf);
 	vec_finalize(vec);
+	start = trace_now_usec();
 	console_main(vec->vec_used, vec_return(vec), sock);
 	vec_free(vec);
 	sock_ipc_must_read(sock, &status, sizeof(status));
+	trace_client_span("build", start);
 	return (status);
 }
 
-static int
+static void
 build_generate_context(struct build_config *bcp)
 {
-	char *argv[10], *build_context_path, *template, dst[256];
-	int status;
-	pid_t pid;
 
-	template = strdup("/tmp/cblock-bcontext.XXXXXXXXX");
-	build_context_path = mktemp(template);
-	if (build_context_path == NULL) {
-		err(1, "failed to generate random file");
-	}
-	snprintf(dst, sizeof(dst), "%s.tar.gz", build_context_path);
 	print_bold_prefix(stdout),
 	fprintf(stdout, "Preparing local build context...\n");
 	fflush(stdout);
-	pid = fork();
-	if (pid == -1) {
-		err(1, "fork faild");
-	}
-	if (pid == 0) {
-		argv[0] = "/usr/bin/tar";
-		argv[1] = "-C";
-		argv[2] = bcp->b_path;
-		argv[3] = "-cpf";
-		argv[4] = build_context_path;
-		argv[5] = ".";
-		argv[6] = NULL;
-		execve(*argv, argv, NULL);
-		err(1, "failed to exec tar for build context");
-	}
-	waitpid_ignore_intr(pid, &status);
-	if (rename(build_context_path, dst) == -1) {
-		err(1, "could not rename build context");
-	}
-	free(template);
-	bcp->b_context_path = strdup(dst);
-	if (bcp->b_context_path == NULL) {
-		err(1, "strdup failed");
-	}
-	return (status);
+	bcp->b_context = context_manifest_build(bcp->b_path);
 }
 
 static void
@@ -293,18 +352,23 @@ build_set_default_tag(struct build_config *bcp)
 int
 build_main(int argc, char *argv [], int cltlsock)
 {
+	extern struct global_params gcfg;
 	int c, noexec, status, option_index;
 	struct build_config bc;
 	time_t before, after;
+	uint64_t start;
 	char *tag, *ptr;
 
 	noexec = 0;
 	bzero(&bc, sizeof(bc));
 	bc.b_cblock_file = "Cblockfile";
+	bc.b_jobs = 1;
+	bc.b_transfer = gcfg.c_host != NULL ? CBLOCK_TRANSFER_ZLIB :
+	    CBLOCK_TRANSFER_FDS;
 	reset_getopt_state();
 	while (1) {
 		option_index = 0;
-		c = getopt_long(argc, argv, "FNhf:n:t:v", build_options,
+		c = getopt_long(argc, argv, "FNcdhf:j:n:p:t:vX:z:", build_options,
 		    &option_index);
 		if (c == -1) {
 			break;
@@ -316,9 +380,31 @@ build_main(int argc, char *argv [], int cltlsock)
 		case 'v':
 			bc.b_verbose++;
 			break;
+		case 'c':
+			bc.b_no_cache = 1;
+			break;
+		case 'z':
+			if (strcmp(optarg, "none") == 0) {
+				bc.b_transfer = CBLOCK_TRANSFER_RAW;
+			} else if (strcmp(optarg, "zlib") == 0) {
+				bc.b_transfer = CBLOCK_TRANSFER_ZLIB;
+			} else {
+				errx(1, "invalid compression method: %s",
+				    optarg);
+			}
+			break;
 		case 'N':
 			noexec = 1;
 			break;
+		case 'd':
+			bc.b_detach = 1;
+			break;
+		case 'p':
+			bc.b_priority = strtol(optarg, &ptr, 10);
+			if (*ptr != '\0') {
+				errx(1, "invalid priority: %s", optarg);
+			}
+			break;
 		case 'h':
 			build_usage();
 			exit(1);
@@ -331,6 +417,15 @@ build_main(int argc, char *argv [], int cltlsock)
 		case 't':
 			bc.b_tag = optarg;
 			break;
+		case 'X':
+			bc.b_trace = optarg;
+			break;
+		case 'j':
+			bc.b_jobs = atoi(optarg);
+			if (bc.b_jobs < 1) {
+				errx(1, "invalid job count: %s", optarg);
+			}
+			break;
 		default:
 			build_usage();
 			/* NOT REACHED */
@@ -362,17 +457,30 @@ build_main(int argc, char *argv [], int cltlsock)
 		build_usage();
 	}
 	before = time(NULL);
+	if (bc.b_trace != NULL && !noexec) {
+		trace_client_start(bc.b_trace, "cblock build");
+	}
 	build_set_default_tag(&bc);
+	start = trace_now_usec();
 	(void) build_manifest_load(&bc);
+	trace_client_span("parse manifest", start);
 	if (noexec) {
 		return (0);
 	}
+	start = trace_now_usec();
 	build_generate_context(&bc);
+	if (!bc.b_no_cache) {
+		hash_build_steps(bc.b_bmp, bc.b_path, bc.b_context);
+	}
+	trace_client_span("prepare context", start);
 	status = build_send_context(cltlsock, &bc);
-	if (status == 0) {
+	trace_client_finish();
+	if (status == 0 && !bc.b_detach) {
 		after = time(NULL);
 		print_bold_prefix(stdout);
 		printf("build occured in %ld seconds: status code %d\n", after - before, status);
+		context_manifest_report(bc.b_context);
 	}
+	context_manifest_free(bc.b_context);
 	return (status);
 }
@@ -0,0 +1,253 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <err.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cblock/libcblock.h>
+
+#include "main.h"
+
+struct builds_config {
+	int		 b_quiet;
+	int		 b_op;
+	char		*b_instance;
+};
+
+static struct option builds_options[] = {
+	{ "help",		no_argument, 0, 'h' },
+	{ "quiet",		no_argument, 0, 'q' },
+	{ "inspect",		required_argument, 0, 'i' },
+	{ "follow",		required_argument, 0, 'f' },
+	{ "cancel",		required_argument, 0, 'c' },
+	{ 0, 0, 0, 0 }
+};
+
+static void
+builds_usage(void)
+{
+	(void) fprintf(stderr,
+	    "Usage: cblock builds [OPTIONS]\n\n"
+	    "List running builds, then queued builds in the order they will\n"
+	    "be started.\n\n"
+	    "Options\n"
+	    " -h, --help                  Print help\n"
+	    " -q, --quiet                 Do not print column headers\n"
+	    " -i, --inspect=INSTANCE      Print details of a build\n"
+	    " -f, --follow=INSTANCE       Wait for a build to start and attach to it\n"
+	    " -c, --cancel=INSTANCE       Remove a build from the queue or stop it\n");
+	exit(1);
+}
+
+static const char *
+builds_state(struct cblock_build_info *bip)
+{
+
+	switch (bip->p_state) {
+	case BUILD_STATE_QUEUED:
+		return ("queued");
+	case BUILD_STATE_RUNNING:
+		return ("running");
+	}
+	return ("unknown");
+}
+
+static void
+builds_request(struct builds_config *bcp, int ctlsock)
+{
+	struct cblock_build_ctl bc;
+	uint32_t cmd;
+
+	cmd = PRISON_IPC_BUILD_CTL;
+	bzero(&bc, sizeof(bc));
+	bc.p_op = bcp->b_op;
+	if (bcp->b_instance != NULL) {
+		strlcpy(bc.p_instance, bcp->b_instance, sizeof(bc.p_instance));
+	}
+	sock_ipc_must_write(ctlsock, &cmd, sizeof(cmd));
+	sock_ipc_must_write(ctlsock, &bc, sizeof(bc));
+}
+
+static void
+builds_list(struct builds_config *bcp, int ctlsock)
+{
+	struct cblock_build_info *vec, *cur;
+	uint32_t count, k;
+	char pos[16];
+	time_t now;
+
+	builds_request(bcp, ctlsock);
+	sock_ipc_must_read(ctlsock, &count, sizeof(count));
+	if (!bcp->b_quiet) {
+		printf("%-10.10s  %-20.20s %-8.8s %8.8s %8.8s %7.7s %10.10s\n",
+		    "INSTANCE", "IMAGE", "STATE", "PRIORITY", "POSITION",
+		    "STAGES", "AGE");
+	}
+	if (count == 0) {
+		return;
+	}
+	vec = malloc(count * sizeof(*vec));
+	if (vec == NULL) {
+		err(1, "malloc for build list failed");
+	}
+	sock_ipc_must_read(ctlsock, vec, count * sizeof(*vec));
+	now = time(NULL);
+	for (k = 0; k < count; k++) {
+		cur = &vec[k];
+		cur->p_image_name[sizeof(cur->p_image_name) - 1] = '\0';
+		cur->p_tag[sizeof(cur->p_tag) - 1] = '\0';
+		pos[0] = '-';
+		pos[1] = '\0';
+		if (cur->p_state == BUILD_STATE_QUEUED) {
+			snprintf(pos, sizeof(pos), "%u", cur->p_position);
+		}
+		printf("%-10.10s  %-20.20s %-8.8s %8d %8s %7u %9jds\n",
+		    cur->p_instance, cur->p_image_name, builds_state(cur),
+		    cur->p_priority, pos, cur->p_nstages,
+		    (intmax_t)(now - cur->p_submitted));
+	}
+	free(vec);
+}
+
+static int
+builds_inspect(struct builds_config *bcp, int ctlsock)
+{
+	struct cblock_response resp;
+	struct cblock_build_info bi;
+	char buf[64];
+	time_t when;
+
+	builds_request(bcp, ctlsock);
+	sock_ipc_must_read(ctlsock, &resp, sizeof(resp));
+	if (resp.p_ecode != 0) {
+		resp.p_errbuf[sizeof(resp.p_errbuf) - 1] = '\0';
+		warnx("%s", resp.p_errbuf);
+		return (1);
+	}
+	sock_ipc_must_read(ctlsock, &bi, sizeof(bi));
+	bi.p_instance[sizeof(bi.p_instance) - 1] = '\0';
+	bi.p_image_name[sizeof(bi.p_image_name) - 1] = '\0';
+	bi.p_tag[sizeof(bi.p_tag) - 1] = '\0';
+	printf("%-12s %s\n", "instance:", bi.p_instance);
+	printf("%-12s %s:%s\n", "image:", bi.p_image_name, bi.p_tag);
+	printf("%-12s %s\n", "state:", builds_state(&bi));
+	printf("%-12s %d\n", "priority:", bi.p_priority);
+	if (bi.p_state == BUILD_STATE_QUEUED) {
+		printf("%-12s %u\n", "position:", bi.p_position);
+	}
+	printf("%-12s %u\n", "stages:", bi.p_nstages);
+	if (bi.p_shared > 0) {
+		printf("%-12s %u\n", "shared by:", bi.p_shared);
+	}
+	printf("%-12s %d\n", "uid:", bi.p_uid);
+	when = bi.p_submitted;
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&when));
+	printf("%-12s %s\n", "submitted:", buf);
+	if (bi.p_state == BUILD_STATE_RUNNING) {
+		when = bi.p_started;
+		strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S",
+		    localtime(&when));
+		printf("%-12s %s\n", "started:", buf);
+		printf("%-12s %d\n", "pid:", bi.p_pid);
+	}
+	return (0);
+}
+
+static int
+builds_cancel(struct builds_config *bcp, int ctlsock)
+{
+	struct cblock_response resp;
+
+	builds_request(bcp, ctlsock);
+	sock_ipc_must_read(ctlsock, &resp, sizeof(resp));
+	if (resp.p_ecode != 0) {
+		resp.p_errbuf[sizeof(resp.p_errbuf) - 1] = '\0';
+		warnx("%s", resp.p_errbuf);
+		return (1);
+	}
+	return (0);
+}
+
+int
+builds_main(int argc, char *argv [], int ctlsock)
+{
+	struct builds_config bc;
+	int option_index, c;
+
+	bzero(&bc, sizeof(bc));
+	bc.b_op = BUILD_CTL_LIST;
+	reset_getopt_state();
+	while (1) {
+		option_index = 0;
+		c = getopt_long(argc, argv, "qhi:f:c:", builds_options,
+		    &option_index);
+		if (c == -1) {
+			break;
+		}
+		switch (c) {
+		case 'q':
+			bc.b_quiet = 1;
+			break;
+		case 'i':
+			bc.b_op = BUILD_CTL_INSPECT;
+			bc.b_instance = optarg;
+			break;
+		case 'f':
+			bc.b_op = BUILD_CTL_FOLLOW;
+			bc.b_instance = optarg;
+			break;
+		case 'c':
+			bc.b_op = BUILD_CTL_CANCEL;
+			bc.b_instance = optarg;
+			break;
+		case 'h':
+			builds_usage();
+			exit(1);
+		default:
+			builds_usage();
+			/* NOT REACHED */
+		}
+	}
+	switch (bc.b_op) {
+	case BUILD_CTL_INSPECT:
+		return (builds_inspect(&bc, ctlsock));
+	case BUILD_CTL_FOLLOW:
+		builds_request(&bc, ctlsock);
+		return (build_attach(ctlsock));
+	case BUILD_CTL_CANCEL:
+		return (builds_cancel(&bc, ctlsock));
+	}
+	builds_list(&bc, ctlsock);
+	return (0);
+}
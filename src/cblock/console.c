@@ -31,7 +31,9 @@
 #include <sys/param.h>
 #include <sys/uio.h>
 #include <sys/un.h>
+#ifdef __FreeBSD__
 #include <sys/ttycom.h>
+#endif
 
 #include <netinet/in.h>
 
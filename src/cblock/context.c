@@ -0,0 +1,810 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#ifndef __FreeBSD__
+#include <sys/sendfile.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <zlib.h>
+
+#include <cblock/libcblock.h>
+#include <cblock/sbuf.h>
+
+#include "main.h"
+#include "sock_ipc.h"
+
+/*
+ * Incremental build context upload. Rather than archiving and sending the
+ * whole build directory, describe it with a manifest of paths, modes and
+ * content digests. cblockd keeps file contents in a store keyed by digest,
+ * so only files it has not seen before are sent. A rebuild after changing
+ * one file transfers that file and the manifest.
+ *
+ * The tree is walked once to collect entries, skipping anything excluded
+ * by .cblockignore, then the regular files are read and hashed by a pool
+ * of threads. Reading the files dominates for any real context, so this is
+ * the part worth spreading across CPUs.
+ */
+struct context_ent {
+	struct cblock_context_entry	 ce;
+	char				*rel;
+	char				*link;
+	char				*path;
+	dev_t				 dev;
+	ino_t				 ino;
+};
+
+/*
+ * An excluded directory that is being walked only because a '!' pattern
+ * might re-include something below it. Its entry is added to the manifest
+ * the first time that happens, so the daemon has somewhere to put it.
+ */
+struct context_pending {
+	struct context_pending		*parent;
+	struct cblock_context_entry	 ce;
+	const char			*rel;
+	int				 added;
+};
+
+struct context_manifest {
+	struct sbuf		*cm_sbuf;
+	struct ignore_list	*cm_ignore;
+	struct context_ent	*cm_ents;
+	size_t			 cm_nents;
+	size_t			 cm_alloc;
+	struct context_ent	**cm_files;
+	struct context_ent	**cm_inodes;
+	size_t			 cm_nfiles;
+	pthread_mutex_t		 cm_lock;
+	size_t			 cm_next;
+	size_t			 cm_ignored;
+	uint64_t		 cm_bytes;
+	uint64_t		 cm_prep_usec;
+	uint32_t		 cm_sent;
+	uint64_t		 cm_sent_bytes;
+};
+
+static int
+context_file_cmp(const void *a, const void *b)
+{
+	struct context_ent * const *x = a, * const *y = b;
+
+	return (strcmp((*x)->ce.ce_digest, (*y)->ce.ce_digest));
+}
+
+static int
+context_inode_cmp(const void *a, const void *b)
+{
+	struct context_ent * const *x = a, * const *y = b;
+
+	if ((*x)->dev != (*y)->dev) {
+		return ((*x)->dev < (*y)->dev ? -1 : 1);
+	}
+	if ((*x)->ino != (*y)->ino) {
+		return ((*x)->ino < (*y)->ino ? -1 : 1);
+	}
+	return (0);
+}
+
+static char *
+context_strdup(const char *str)
+{
+	char *p;
+
+	if (str == NULL) {
+		return (NULL);
+	}
+	p = strdup(str);
+	if (p == NULL) {
+		err(1, "strdup failed");
+	}
+	return (p);
+}
+
+static struct context_ent *
+context_add_entry(struct context_manifest *cmp,
+    struct cblock_context_entry *cep, const char *rel, const char *link)
+{
+	struct context_ent *ent;
+
+	if (cmp->cm_nents == cmp->cm_alloc) {
+		cmp->cm_alloc = cmp->cm_alloc == 0 ? 256 : cmp->cm_alloc * 2;
+		cmp->cm_ents = realloc(cmp->cm_ents,
+		    cmp->cm_alloc * sizeof(*cmp->cm_ents));
+		if (cmp->cm_ents == NULL) {
+			err(1, "realloc context entries failed");
+		}
+	}
+	ent = &cmp->cm_ents[cmp->cm_nents++];
+	bzero(ent, sizeof(*ent));
+	ent->ce = *cep;
+	ent->ce.ce_path_len = strlen(rel) + 1;
+	ent->ce.ce_link_len = link != NULL ? strlen(link) + 1 : 0;
+	ent->rel = context_strdup(rel);
+	ent->link = context_strdup(link);
+	return (ent);
+}
+
+static void
+context_add_pending(struct context_manifest *cmp, struct context_pending *pp)
+{
+
+	if (pp == NULL || pp->added) {
+		return;
+	}
+	context_add_pending(cmp, pp->parent);
+	(void) context_add_entry(cmp, &pp->ce, pp->rel, NULL);
+	pp->added = 1;
+}
+
+static void
+context_walk(struct context_manifest *cmp, const char *path, const char *rel,
+    int excluded, struct context_pending *parent)
+{
+	char child[MAXPATHLEN], crel[MAXPATHLEN], target[MAXPATHLEN];
+	struct cblock_context_entry ce;
+	struct context_pending pending;
+	struct context_ent *ent;
+	struct dirent **names;
+	struct stat sb;
+	int n, k, cex;
+	ssize_t cc;
+
+	n = scandir(path, &names, NULL, alphasort);
+	if (n == -1) {
+		err(1, "scandir(%s)", path);
+	}
+	for (k = 0; k < n; k++) {
+		if (strcmp(names[k]->d_name, ".") == 0 ||
+		    strcmp(names[k]->d_name, "..") == 0) {
+			free(names[k]);
+			continue;
+		}
+		(void) snprintf(child, sizeof(child), "%s/%s", path,
+		    names[k]->d_name);
+		if (*rel == '\0') {
+			strlcpy(crel, names[k]->d_name, sizeof(crel));
+		} else {
+			(void) snprintf(crel, sizeof(crel), "%s/%s", rel,
+			    names[k]->d_name);
+		}
+		free(names[k]);
+		if (lstat(child, &sb) == -1) {
+			err(1, "lstat(%s)", child);
+		}
+		bzero(&ce, sizeof(ce));
+		ce.ce_mode = sb.st_mode;
+		ce.ce_mtime = sb.st_mtime;
+		cex = ignore_match(cmp->cm_ignore, crel, excluded);
+		if (cex) {
+			cmp->cm_ignored++;
+			if (!S_ISDIR(sb.st_mode) ||
+			    !ignore_has_exceptions(cmp->cm_ignore)) {
+				continue;
+			}
+			bzero(&pending, sizeof(pending));
+			pending.parent = parent;
+			pending.ce = ce;
+			pending.rel = crel;
+			context_walk(cmp, child, crel, 1, &pending);
+			continue;
+		}
+		context_add_pending(cmp, parent);
+		if (S_ISDIR(sb.st_mode)) {
+			(void) context_add_entry(cmp, &ce, crel, NULL);
+			context_walk(cmp, child, crel, 0, NULL);
+		} else if (S_ISLNK(sb.st_mode)) {
+			cc = readlink(child, target, sizeof(target) - 1);
+			if (cc == -1) {
+				err(1, "readlink(%s)", child);
+			}
+			target[cc] = '\0';
+			(void) context_add_entry(cmp, &ce, crel, target);
+		} else if (S_ISREG(sb.st_mode)) {
+			ce.ce_size = sb.st_size;
+			ent = context_add_entry(cmp, &ce, crel, NULL);
+			ent->path = context_strdup(child);
+			ent->dev = sb.st_dev;
+			ent->ino = sb.st_ino;
+		}
+		/*
+		 * Sockets, FIFOs and devices have no place in an image
+		 * build, skip them.
+		 */
+	}
+	free(names);
+}
+
+static void *
+context_hash_worker(void *arg)
+{
+	struct context_manifest *cmp;
+	struct context_ent *ent;
+	off_t size;
+	size_t k;
+	int fd;
+
+	cmp = arg;
+	for (;;) {
+		pthread_mutex_lock(&cmp->cm_lock);
+		k = cmp->cm_next++;
+		pthread_mutex_unlock(&cmp->cm_lock);
+		if (k >= cmp->cm_nfiles) {
+			break;
+		}
+		ent = cmp->cm_files[k];
+		fd = open(ent->path, O_RDONLY);
+		if (fd == -1) {
+			err(1, "open(%s)", ent->path);
+		}
+		if (hash_fd(fd, ent->ce.ce_digest, sizeof(ent->ce.ce_digest),
+		    &size) == -1) {
+			errx(1, "failed to hash %s", ent->path);
+		}
+		(void) close(fd);
+		/*
+		 * The digest describes what was read, so if the file changed
+		 * size since the walk, trust the read.
+		 */
+		ent->ce.ce_size = size;
+	}
+	return (NULL);
+}
+
+static void
+context_hash_files(struct context_manifest *cmp)
+{
+	pthread_t thr[CONTEXT_MAX_THREADS];
+	long ncpu;
+	int k, n;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	n = ncpu < 1 ? 1 : MIN(ncpu, CONTEXT_MAX_THREADS);
+	if ((size_t)n > cmp->cm_nfiles) {
+		n = cmp->cm_nfiles;
+	}
+	if (n <= 1) {
+		(void) context_hash_worker(cmp);
+		return;
+	}
+	for (k = 0; k < n; k++) {
+		if (pthread_create(&thr[k], NULL, context_hash_worker,
+		    cmp) != 0) {
+			errx(1, "pthread_create failed");
+		}
+	}
+	for (k = 0; k < n; k++) {
+		(void) pthread_join(thr[k], NULL);
+	}
+}
+
+struct context_manifest *
+context_manifest_build(const char *root)
+{
+	struct context_manifest *cmp;
+	struct context_ent *ent;
+	uint64_t start;
+	size_t k, j;
+
+	start = trace_now_usec();
+	cmp = calloc(1, sizeof(*cmp));
+	if (cmp == NULL) {
+		err(1, "calloc failed");
+	}
+	pthread_mutex_init(&cmp->cm_lock, NULL);
+	cmp->cm_ignore = ignore_load(root);
+	context_walk(cmp, root, "", 0, NULL);
+	for (k = 0; k < cmp->cm_nents; k++) {
+		if (S_ISREG(cmp->cm_ents[k].ce.ce_mode)) {
+			cmp->cm_nfiles++;
+		}
+	}
+	cmp->cm_files = calloc(cmp->cm_nfiles + 1, sizeof(*cmp->cm_files));
+	cmp->cm_inodes = calloc(cmp->cm_nfiles + 1, sizeof(*cmp->cm_inodes));
+	if (cmp->cm_files == NULL || cmp->cm_inodes == NULL) {
+		err(1, "calloc failed");
+	}
+	for (j = 0, k = 0; k < cmp->cm_nents; k++) {
+		if (S_ISREG(cmp->cm_ents[k].ce.ce_mode)) {
+			cmp->cm_files[j] = &cmp->cm_ents[k];
+			cmp->cm_inodes[j++] = &cmp->cm_ents[k];
+		}
+	}
+	context_hash_files(cmp);
+	cmp->cm_sbuf = sbuf_new_auto();
+	if (cmp->cm_sbuf == NULL) {
+		err(1, "sbuf_new_auto failed");
+	}
+	for (k = 0; k < cmp->cm_nents; k++) {
+		ent = &cmp->cm_ents[k];
+		sbuf_bcat(cmp->cm_sbuf, &ent->ce, sizeof(ent->ce));
+		sbuf_bcat(cmp->cm_sbuf, ent->rel, ent->ce.ce_path_len);
+		if (ent->link != NULL) {
+			sbuf_bcat(cmp->cm_sbuf, ent->link,
+			    ent->ce.ce_link_len);
+		}
+		cmp->cm_bytes += ent->ce.ce_size;
+	}
+	if (sbuf_finish(cmp->cm_sbuf) != 0) {
+		err(1, "failed to build context manifest");
+	}
+	qsort(cmp->cm_files, cmp->cm_nfiles, sizeof(*cmp->cm_files),
+	    context_file_cmp);
+	qsort(cmp->cm_inodes, cmp->cm_nfiles, sizeof(*cmp->cm_inodes),
+	    context_inode_cmp);
+	cmp->cm_prep_usec = trace_now_usec() - start;
+	return (cmp);
+}
+
+/*
+ * Look up the content digest of a file already read for the manifest, so
+ * that the step hashes do not read the same files a second time.
+ */
+int
+context_manifest_digest(struct context_manifest *cmp, const struct stat *sb,
+    char *digest, size_t len)
+{
+	struct context_ent key, *kp, **found;
+
+	if (cmp == NULL) {
+		return (-1);
+	}
+	key.dev = sb->st_dev;
+	key.ino = sb->st_ino;
+	kp = &key;
+	found = bsearch(&kp, cmp->cm_inodes, cmp->cm_nfiles,
+	    sizeof(*cmp->cm_inodes), context_inode_cmp);
+	if (found == NULL || (*found)->ce.ce_size != (uint64_t)sb->st_size ||
+	    (*found)->ce.ce_mtime != sb->st_mtime) {
+		return (-1);
+	}
+	strlcpy(digest, (*found)->ce.ce_digest, len);
+	return (0);
+}
+
+void
+context_manifest_free(struct context_manifest *cmp)
+{
+	size_t k;
+
+	for (k = 0; k < cmp->cm_nents; k++) {
+		free(cmp->cm_ents[k].rel);
+		free(cmp->cm_ents[k].link);
+		free(cmp->cm_ents[k].path);
+	}
+	free(cmp->cm_ents);
+	free(cmp->cm_files);
+	free(cmp->cm_inodes);
+	ignore_free(cmp->cm_ignore);
+	if (cmp->cm_sbuf != NULL) {
+		sbuf_delete(cmp->cm_sbuf);
+	}
+	pthread_mutex_destroy(&cmp->cm_lock);
+	free(cmp);
+}
+
+size_t
+context_manifest_len(struct context_manifest *cmp)
+{
+
+	return (sbuf_len(cmp->cm_sbuf));
+}
+
+int
+context_manifest_entries(struct context_manifest *cmp)
+{
+
+	return (cmp->cm_nents);
+}
+
+void
+context_manifest_report(struct context_manifest *cmp)
+{
+
+	print_bold_prefix(stdout);
+	printf("build context: %zu files (%ju bytes) prepared in %.3f "
+	    "seconds, %zu paths ignored\n", cmp->cm_nfiles,
+	    (uintmax_t)cmp->cm_bytes, cmp->cm_prep_usec / 1000000.0,
+	    cmp->cm_ignored);
+	print_bold_prefix(stdout);
+	printf("build context: %u files (%ju bytes) transmitted\n",
+	    cmp->cm_sent, (uintmax_t)cmp->cm_sent_bytes);
+}
+
+/*
+ * Send a file to the socket with sendfile(2), so that its pages go from
+ * the page cache to the socket without being copied through the client.
+ * If the file can not be sent that way at all, copy it instead.
+ */
+static int
+context_sendfile(int fd, int sock, uint64_t len)
+{
+	off_t off;
+#ifdef __FreeBSD__
+	off_t sbytes;
+	int ret;
+
+	off = 0;
+	while ((uint64_t)off < len) {
+		sbytes = 0;
+		ret = sendfile(fd, sock, off, len - off, NULL, &sbytes, 0);
+		off += sbytes;
+		if (ret == -1 && off == 0 && (errno == EINVAL ||
+		    errno == EOPNOTSUPP)) {
+			break;
+		}
+		if (ret == -1 && errno != EINTR && errno != EAGAIN) {
+			return (-1);
+		}
+		if (ret == 0 && sbytes == 0) {
+			return (-1);
+		}
+	}
+#else
+	ssize_t cc;
+
+	off = 0;
+	while ((uint64_t)off < len) {
+		cc = sendfile(sock, fd, &off, len - off);
+		if (cc == -1 && (errno == EINTR || errno == EAGAIN)) {
+			continue;
+		}
+		if (cc == -1 && off == 0 && (errno == EINVAL ||
+		    errno == ENOSYS)) {
+			break;
+		}
+		if (cc <= 0) {
+			return (-1);
+		}
+	}
+#endif
+	if ((uint64_t)off < len &&
+	    sock_ipc_from_to(fd, sock, len) != (ssize_t)len) {
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Compressed contents are produced by two threads: one reads the files
+ * into a small ring of large buffers while the other compresses what has
+ * been read and writes it to the socket, so the disk, the compressor and
+ * the network are all kept busy.
+ */
+struct context_pipe {
+	pthread_mutex_t		  cp_lock;
+	pthread_cond_t		  cp_cv;
+	char			 *cp_buf[CONTEXT_PIPE_DEPTH];
+	size_t			  cp_len[CONTEXT_PIPE_DEPTH];
+	int			  cp_head;
+	int			  cp_count;
+	int			  cp_eof;
+	struct context_ent	**cp_want;
+	uint32_t		  cp_nwant;
+};
+
+static void *
+context_pipe_reader(void *arg)
+{
+	struct context_pipe *cpp;
+	uint64_t resid;
+	size_t len, fill;
+	uint32_t k;
+	ssize_t cc;
+	int fd, slot;
+
+	cpp = arg;
+	slot = 0;
+	fill = 0;
+	for (k = 0; k < cpp->cp_nwant; k++) {
+		fd = open(cpp->cp_want[k]->path, O_RDONLY);
+		if (fd == -1) {
+			err(1, "open(%s)", cpp->cp_want[k]->path);
+		}
+		resid = cpp->cp_want[k]->ce.ce_size;
+		while (resid > 0) {
+			if (fill == 0) {
+				pthread_mutex_lock(&cpp->cp_lock);
+				while (cpp->cp_count == CONTEXT_PIPE_DEPTH) {
+					pthread_cond_wait(&cpp->cp_cv,
+					    &cpp->cp_lock);
+				}
+				slot = (cpp->cp_head + cpp->cp_count) %
+				    CONTEXT_PIPE_DEPTH;
+				pthread_mutex_unlock(&cpp->cp_lock);
+			}
+			len = MIN(resid, CBLOCK_COMPRESS_FRAME_MAX - fill);
+			cc = read(fd, cpp->cp_buf[slot] + fill, len);
+			if (cc == -1 && errno == EINTR) {
+				continue;
+			}
+			if (cc <= 0) {
+				errx(1, "%s: changed while being sent",
+				    cpp->cp_want[k]->path);
+			}
+			fill += cc;
+			resid -= cc;
+			if (fill == CBLOCK_COMPRESS_FRAME_MAX) {
+				pthread_mutex_lock(&cpp->cp_lock);
+				cpp->cp_len[slot] = fill;
+				cpp->cp_count++;
+				pthread_cond_broadcast(&cpp->cp_cv);
+				pthread_mutex_unlock(&cpp->cp_lock);
+				fill = 0;
+			}
+		}
+		(void) close(fd);
+	}
+	pthread_mutex_lock(&cpp->cp_lock);
+	if (fill != 0) {
+		cpp->cp_len[slot] = fill;
+		cpp->cp_count++;
+	}
+	cpp->cp_eof = 1;
+	pthread_cond_broadcast(&cpp->cp_cv);
+	pthread_mutex_unlock(&cpp->cp_lock);
+	return (NULL);
+}
+
+/*
+ * Compress len bytes of buf into the stream, writing out each block of
+ * output as a frame.
+ */
+static void
+context_deflate(int sock, z_stream *zs, char *buf, size_t len, int flush,
+    u_char *out)
+{
+	uint32_t olen;
+	int ret;
+
+	zs->next_in = (u_char *)buf;
+	zs->avail_in = len;
+	do {
+		zs->next_out = out;
+		zs->avail_out = CBLOCK_COMPRESS_FRAME_MAX;
+		ret = deflate(zs, flush);
+		if (ret == Z_STREAM_ERROR) {
+			errx(1, "deflate failed");
+		}
+		olen = CBLOCK_COMPRESS_FRAME_MAX - zs->avail_out;
+		if (olen != 0) {
+			sock_ipc_must_write(sock, &olen, sizeof(olen));
+			sock_ipc_must_write(sock, out, olen);
+		}
+	} while (zs->avail_out == 0 || (flush == Z_FINISH &&
+	    ret != Z_STREAM_END));
+}
+
+static void
+context_send_compressed(int sock, struct context_ent **want, uint32_t count)
+{
+	struct context_pipe cp;
+	uint32_t olen;
+	pthread_t thr;
+	z_stream zs;
+	u_char *out;
+	int k, slot;
+
+	bzero(&cp, sizeof(cp));
+	pthread_mutex_init(&cp.cp_lock, NULL);
+	pthread_cond_init(&cp.cp_cv, NULL);
+	for (k = 0; k < CONTEXT_PIPE_DEPTH; k++) {
+		cp.cp_buf[k] = malloc(CBLOCK_COMPRESS_FRAME_MAX);
+		if (cp.cp_buf[k] == NULL) {
+			err(1, "malloc failed");
+		}
+	}
+	out = malloc(CBLOCK_COMPRESS_FRAME_MAX);
+	if (out == NULL) {
+		err(1, "malloc failed");
+	}
+	cp.cp_want = want;
+	cp.cp_nwant = count;
+	bzero(&zs, sizeof(zs));
+	if (deflateInit(&zs, Z_BEST_SPEED) != Z_OK) {
+		errx(1, "deflateInit failed");
+	}
+	if (pthread_create(&thr, NULL, context_pipe_reader, &cp) != 0) {
+		errx(1, "pthread_create failed");
+	}
+	for (;;) {
+		pthread_mutex_lock(&cp.cp_lock);
+		while (cp.cp_count == 0 && !cp.cp_eof) {
+			pthread_cond_wait(&cp.cp_cv, &cp.cp_lock);
+		}
+		if (cp.cp_count == 0) {
+			pthread_mutex_unlock(&cp.cp_lock);
+			break;
+		}
+		slot = cp.cp_head;
+		pthread_mutex_unlock(&cp.cp_lock);
+		context_deflate(sock, &zs, cp.cp_buf[slot], cp.cp_len[slot],
+		    Z_NO_FLUSH, out);
+		pthread_mutex_lock(&cp.cp_lock);
+		cp.cp_head = (cp.cp_head + 1) % CONTEXT_PIPE_DEPTH;
+		cp.cp_count--;
+		pthread_cond_broadcast(&cp.cp_cv);
+		pthread_mutex_unlock(&cp.cp_lock);
+	}
+	(void) pthread_join(thr, NULL);
+	context_deflate(sock, &zs, NULL, 0, Z_FINISH, out);
+	olen = 0;
+	sock_ipc_must_write(sock, &olen, sizeof(olen));
+	(void) deflateEnd(&zs);
+	for (k = 0; k < CONTEXT_PIPE_DEPTH; k++) {
+		free(cp.cp_buf[k]);
+	}
+	free(out);
+	pthread_cond_destroy(&cp.cp_cv);
+	pthread_mutex_destroy(&cp.cp_lock);
+}
+
+/*
+ * For builds on the same host, pass cblockd open descriptors for the files
+ * rather than their contents, so it can copy them directly into its store.
+ */
+static void
+context_send_fds(int sock, struct context_ent **want, uint32_t count)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * CBLOCK_TRANSFER_FDS_MAX)];
+	int fds[CBLOCK_TRANSFER_FDS_MAX];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	uint32_t k, j, n;
+	ssize_t cc;
+	char byte;
+
+	for (k = 0; k < count; k += n) {
+		n = MIN(count - k, CBLOCK_TRANSFER_FDS_MAX);
+		for (j = 0; j < n; j++) {
+			fds[j] = open(want[k + j]->path, O_RDONLY);
+			if (fds[j] == -1) {
+				err(1, "open(%s)", want[k + j]->path);
+			}
+		}
+		bzero(&msg, sizeof(msg));
+		bzero(cbuf, sizeof(cbuf));
+		byte = 0;
+		iov.iov_base = &byte;
+		iov.iov_len = sizeof(byte);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+		bcopy(fds, CMSG_DATA(cmsg), sizeof(int) * n);
+		do {
+			cc = sendmsg(sock, &msg, 0);
+		} while (cc == -1 && errno == EINTR);
+		if (cc != 1) {
+			err(1, "sendmsg(SCM_RIGHTS) failed");
+		}
+		for (j = 0; j < n; j++) {
+			(void) close(fds[j]);
+		}
+	}
+}
+
+/*
+ * Send the manifest, then the contents of the files cblockd asks for.
+ */
+int
+context_send(int sock, struct context_manifest *cmp)
+{
+	struct context_ent key, *kp, **found, **want;
+	struct cblock_response resp;
+	uint32_t transfer, count, k;
+	uint64_t bytes;
+	int fd;
+
+	sock_ipc_must_write(sock, sbuf_data(cmp->cm_sbuf),
+	    sbuf_len(cmp->cm_sbuf));
+	bzero(&resp, sizeof(resp));
+	if (sock_ipc_must_read(sock, &resp, sizeof(resp)) == 0) {
+		warnx("connection closed by cblockd");
+		return (-1);
+	}
+	if (resp.p_ecode != 0) {
+		resp.p_errbuf[sizeof(resp.p_errbuf) - 1] = '\0';
+		warnx("build context rejected: %s", resp.p_errbuf);
+		return (-1);
+	}
+	sock_ipc_must_read(sock, &transfer, sizeof(transfer));
+	if (transfer != CBLOCK_TRANSFER_RAW &&
+	    transfer != CBLOCK_TRANSFER_ZLIB &&
+	    transfer != CBLOCK_TRANSFER_FDS) {
+		errx(1, "cblockd chose unknown transfer method %u", transfer);
+	}
+	sock_ipc_must_read(sock, &count, sizeof(count));
+	want = calloc(count + 1, sizeof(*want));
+	if (want == NULL) {
+		err(1, "calloc failed");
+	}
+	bytes = 0;
+	for (k = 0; k < count; k++) {
+		bzero(&key, sizeof(key));
+		sock_ipc_must_read(sock, key.ce.ce_digest,
+		    sizeof(key.ce.ce_digest));
+		key.ce.ce_digest[sizeof(key.ce.ce_digest) - 1] = '\0';
+		kp = &key;
+		found = bsearch(&kp, cmp->cm_files, cmp->cm_nfiles,
+		    sizeof(*cmp->cm_files), context_file_cmp);
+		if (found == NULL) {
+			errx(1, "cblockd asked for unknown blob %s",
+			    key.ce.ce_digest);
+		}
+		want[k] = *found;
+		bytes += (*found)->ce.ce_size;
+	}
+	print_bold_prefix(stdout);
+	fprintf(stdout, "Transmitting %u of %zu files (%ju bytes%s) to "
+	    "cblock daemon...\n", count, cmp->cm_nfiles, (uintmax_t)bytes,
+	    transfer == CBLOCK_TRANSFER_ZLIB ? ", compressed" :
+	    transfer == CBLOCK_TRANSFER_FDS ? ", by descriptor" : "");
+	fflush(stdout);
+	if (transfer == CBLOCK_TRANSFER_ZLIB) {
+		context_send_compressed(sock, want, count);
+	} else if (transfer == CBLOCK_TRANSFER_FDS) {
+		context_send_fds(sock, want, count);
+	} else {
+		for (k = 0; k < count; k++) {
+			fd = open(want[k]->path, O_RDONLY);
+			if (fd == -1) {
+				err(1, "open(%s)", want[k]->path);
+			}
+			if (context_sendfile(fd, sock,
+			    want[k]->ce.ce_size) == -1) {
+				errx(1, "%s: changed while being sent",
+				    want[k]->path);
+			}
+			(void) close(fd);
+		}
+	}
+	free(want);
+	cmp->cm_sent = count;
+	cmp->cm_sent_bytes = bytes;
+	return (0);
+}
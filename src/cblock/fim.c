@@ -0,0 +1,238 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <err.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cblock/libcblock.h>
+
+#include "main.h"
+
+struct fim_config {
+	char		*f_instance;
+	int		 f_quiet;
+	int		 f_content;
+};
+
+static struct option fim_options[] = {
+	{ "content",		no_argument, 0, 'c' },
+	{ "help",		no_argument, 0, 'h' },
+	{ "instance",		required_argument, 0, 'i' },
+	{ "quiet",		no_argument, 0, 'q' },
+	{ 0, 0, 0, 0 }
+};
+
+static void
+fim_usage(void)
+{
+	(void) fprintf(stderr,
+	    "Usage: cblock fim [OPTIONS] COMMAND [IMAGE ...]\n\n"
+	    "Commands\n"
+	    " diff IMAGE OTHER            List files which differ between images\n"
+	    " drift                       List files in running instances that\n"
+	    "                             differ from their image FIM spec\n"
+	    " verify IMAGE                Check an image against its FIM spec\n\n"
+	    "Options\n"
+	    " -c, --content               Hash every file when verifying, not\n"
+	    "                             only those with a new modification time\n"
+	    " -h, --help                  Print help\n"
+	    " -i, --instance=ID           Only report on instance ID\n"
+	    " -q, --quiet                 Do not print column headers\n");
+	exit(1);
+}
+
+static const char *
+fim_drift_kind(uint32_t kind)
+{
+
+	switch (kind) {
+	case FIM_DRIFT_CONTENT:
+		return ("CONTENT");
+	case FIM_DRIFT_ATTR:
+		return ("ATTR");
+	case FIM_DRIFT_EXTRA:
+		return ("EXTRA");
+	case FIM_DRIFT_MISSING:
+		return ("MISSING");
+	}
+	return ("UNKNOWN");
+}
+
+static void
+fim_drift(struct fim_config *fcp, int ctlsock)
+{
+	struct cblock_get_fim_drift req;
+	struct cblock_fim_drift *recs, *rp;
+	char tbuf[64];
+	uint32_t cmd, count, k;
+	time_t when;
+
+	bzero(&req, sizeof(req));
+	if (fcp->f_instance != NULL) {
+		strlcpy(req.p_instance, fcp->f_instance,
+		    sizeof(req.p_instance));
+	}
+	cmd = PRISON_IPC_GET_FIM_DRIFT;
+	sock_ipc_must_write(ctlsock, &cmd, sizeof(cmd));
+	sock_ipc_must_write(ctlsock, &req, sizeof(req));
+	sock_ipc_must_read(ctlsock, &count, sizeof(count));
+	if (!fcp->f_quiet) {
+		printf("%-10s %-8s %-20s %s\n", "INSTANCE", "KIND",
+		    "DETECTED", "PATH");
+	}
+	if (count == 0) {
+		return;
+	}
+	recs = calloc(count, sizeof(*recs));
+	if (recs == NULL) {
+		err(1, "calloc for FIM drift records failed");
+	}
+	sock_ipc_must_read(ctlsock, recs, count * sizeof(*recs));
+	for (k = 0; k < count; k++) {
+		rp = &recs[k];
+		when = rp->p_detected;
+		strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S",
+		    localtime(&when));
+		printf("%-10.10s %-8s %-20s %s\n", rp->p_instance,
+		    fim_drift_kind(rp->p_kind), tbuf, rp->p_path);
+	}
+	free(recs);
+}
+
+/*
+ * Print the report which follows a diff or verify request. Returns 1 if
+ * anything was reported, like diff(1).
+ */
+static int
+fim_report(int ctlsock)
+{
+	struct cblock_response resp;
+	size_t len;
+	char *buf;
+
+	sock_ipc_must_read(ctlsock, &resp, sizeof(resp));
+	if (resp.p_ecode != 0) {
+		errx(2, "%s", resp.p_errbuf);
+	}
+	sock_ipc_must_read(ctlsock, &len, sizeof(len));
+	if (len == 0) {
+		return (0);
+	}
+	buf = malloc(len);
+	if (buf == NULL) {
+		err(2, "malloc for FIM report failed");
+	}
+	sock_ipc_must_read(ctlsock, buf, len);
+	(void) fwrite(buf, 1, len, stdout);
+	free(buf);
+	return (1);
+}
+
+static int
+fim_diff(char *image, char *other, int ctlsock)
+{
+	struct cblock_fim_diff req;
+	uint32_t cmd;
+
+	bzero(&req, sizeof(req));
+	strlcpy(req.p_image, image, sizeof(req.p_image));
+	strlcpy(req.p_other, other, sizeof(req.p_other));
+	cmd = PRISON_IPC_FIM_DIFF;
+	sock_ipc_must_write(ctlsock, &cmd, sizeof(cmd));
+	sock_ipc_must_write(ctlsock, &req, sizeof(req));
+	return (fim_report(ctlsock));
+}
+
+static int
+fim_verify(struct fim_config *fcp, char *image, int ctlsock)
+{
+	struct cblock_fim_verify req;
+	uint32_t cmd;
+
+	bzero(&req, sizeof(req));
+	strlcpy(req.p_image, image, sizeof(req.p_image));
+	req.p_content = fcp->f_content;
+	cmd = PRISON_IPC_FIM_VERIFY;
+	sock_ipc_must_write(ctlsock, &cmd, sizeof(cmd));
+	sock_ipc_must_write(ctlsock, &req, sizeof(req));
+	return (fim_report(ctlsock));
+}
+
+int
+fim_main(int argc, char *argv [], int ctlsock)
+{
+	struct fim_config fc;
+	int option_index, c;
+
+	bzero(&fc, sizeof(fc));
+	reset_getopt_state();
+	while (1) {
+		option_index = 0;
+		c = getopt_long(argc, argv, "chi:q", fim_options,
+		    &option_index);
+		if (c == -1) {
+			break;
+		}
+		switch (c) {
+		case 'c':
+			fc.f_content = 1;
+			break;
+		case 'i':
+			fc.f_instance = optarg;
+			break;
+		case 'q':
+			fc.f_quiet = 1;
+			break;
+		case 'h':
+		default:
+			fim_usage();
+			/* NOT REACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 1 && strcmp(argv[0], "drift") == 0) {
+		fim_drift(&fc, ctlsock);
+		return (0);
+	}
+	if (argc == 3 && strcmp(argv[0], "diff") == 0) {
+		return (fim_diff(argv[1], argv[2], ctlsock));
+	}
+	if (argc == 2 && strcmp(argv[0], "verify") == 0) {
+		return (fim_verify(&fc, argv[1], ctlsock));
+	}
+	fim_usage();
+	/* NOT REACHED */
+	return (1);
+}
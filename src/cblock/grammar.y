@@ -30,6 +30,9 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <string.h>
 #include <fnmatch.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -58,6 +61,47 @@ static char *archive_extensions[] = {
 	NULL
 };
 
+/*
+ * Stages, steps and their strings are allocated from the manifest's arena
+ * and freed with it.
+ */
+static void *
+build_alloc(size_t len)
+{
+	void *ptr;
+
+	ptr = arena_alloc(cur_build_manifest->arena, len);
+	if (ptr == NULL) {
+		err(1, "failed to allocate build manifest");
+	}
+	return (ptr);
+}
+
+static char *
+build_strdup(const char *str)
+{
+	char *ptr;
+
+	ptr = arena_strdup(cur_build_manifest->arena, str);
+	if (ptr == NULL) {
+		err(1, "failed to allocate build manifest");
+	}
+	return (ptr);
+}
+
+static void
+build_step_string(struct build_step *bs, const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	bs->step_string = arena_vprintf(cur_build_manifest->arena, fmt, va);
+	va_end(va);
+	if (bs->step_string == NULL) {
+		err(1, "failed to allocate build manifest");
+	}
+}
+
 %}
 
 %union {
@@ -67,10 +111,10 @@ static char *archive_extensions[] = {
 
 %token FROM AS COPY ADD RUN ENTRYPOINT STRING WORKDIR
 %token OPEN_SQUARE_BRACKET CLOSE_SQUARE_BRACKET COPY_FROM ENV EQ
-%token INTEGER COMMA CMD ROOTPIVOT OSRELEASE AUDITCFG
+%token INTEGER COMMA CMD ROOTPIVOT OSRELEASE AUDITCFG ADD_CHECKSUM
 
 %type <num> INTEGER
-%type <c_string> STRING
+%type <c_string> STRING add_checksum
 
 %%
 
@@ -227,13 +271,10 @@ copy_spec:
 		if (!match) {
 			errx(1, "stage specification %sdoes not exist", $2);
 		}
-		strlcpy(b_step->step_data.step_copy_from.sc_source, $3,
-		    sizeof(b_step->step_data.step_copy_from.sc_source));
-		strlcpy(b_step->step_data.step_copy_from.sc_dest, $4,
-		    sizeof(b_step->step_data.step_copy_from.sc_dest));
+		b_step->step_data.step_copy_from.sc_source = build_strdup($3);
+		b_step->step_data.step_copy_from.sc_dest = build_strdup($4);
 		cur_build_step->stage_index = stage_counter;
-		snprintf(b_step->step_string, sizeof(b_step->step_string),
-		    "COPY --FROM %s %s %s", $2, $3, $4);
+		build_step_string(b_step, "COPY --FROM %s %s %s", $2, $3, $4);
 		bsp = cur_build_stage;
 		TAILQ_INSERT_HEAD(&bsp->step_head, b_step, step_glue);
 	}
@@ -262,13 +303,10 @@ copy_spec:
 		if (!match) {
 			errx(1, "stage specification %d does not exist", $2);
 		}
-		strlcpy(b_step->step_data.step_copy_from.sc_source, $3,
-		    sizeof(b_step->step_data.step_copy_from.sc_source));
-		strlcpy(b_step->step_data.step_copy_from.sc_dest, $4,
-		    sizeof(b_step->step_data.step_copy_from.sc_dest));
+		b_step->step_data.step_copy_from.sc_source = build_strdup($3);
+		b_step->step_data.step_copy_from.sc_dest = build_strdup($4);
 		cur_build_step->stage_index = stage_counter;
-		snprintf(b_step->step_string, sizeof(b_step->step_string),
-		    "COPY --FROM %d %s %s", $2, $3, $4);
+		build_step_string(b_step, "COPY --FROM %d %s %s", $2, $3, $4);
 		bsp = cur_build_stage;
 		TAILQ_INSERT_HEAD(&bsp->step_head, b_step, step_glue);
 	}
@@ -281,27 +319,31 @@ copy_spec:
 		assert(cur_build_stage != NULL);
 		bsp = cur_build_stage;
 		b_step = cur_build_step;
-		strlcpy(b_step->step_data.step_copy.sc_source, $1,
-		    sizeof(b_step->step_data.step_copy.sc_source));
-		strlcpy(b_step->step_data.step_copy.sc_dest, $2,
-		    sizeof(b_step->step_data.step_copy.sc_dest));
+		b_step->step_data.step_copy.sc_source = build_strdup($1);
+		b_step->step_data.step_copy.sc_dest = build_strdup($2);
 		cur_build_step->stage_index = stage_counter;
-		snprintf(b_step->step_string, sizeof(b_step->step_string),
-		    "COPY %s %s", $1, $2);
+		build_step_string(b_step, "COPY %s %s", $1, $2);
 		TAILQ_INSERT_HEAD(&bsp->step_head, b_step, step_glue);
 		cur_build_step = NULL;
 	}
 	;
 
+add_checksum:	/* empty */
+	{
+		$$ = NULL;
+	}
+	| ADD_CHECKSUM STRING
+	{
+		$$ = $2;
+	}
+	;
+
 op_spec:
 	RUN
 	{
 		struct build_step *b_step;
 
-		b_step = calloc(1, sizeof(*b_step));
-		if (b_step == NULL) {
-			err(1, "calloc(build step) faild");
-		}
+		b_step = build_alloc(sizeof(*b_step));
 		b_step->step_op = STEP_RUN;
 		cur_build_step = b_step;
 	}
@@ -314,11 +356,9 @@ op_spec:
 		assert(cur_build_stage != NULL);
 		bsp = cur_build_stage;
 		b_step = cur_build_step;
-		strlcpy(b_step->step_data.step_cmd, $3,
-		    sizeof(b_step->step_data.step_cmd));
+		b_step->step_data.step_cmd = build_strdup($3);
 		cur_build_step->stage_index = stage_counter;
-		snprintf(b_step->step_string,
-		    sizeof(b_step->step_string), "RUN %s", $3);
+		build_step_string(b_step, "RUN %s", $3);
 		TAILQ_INSERT_HEAD(&bsp->step_head, b_step, step_glue);
 		cur_build_step = NULL;
 	}
@@ -326,14 +366,11 @@ op_spec:
 	{
 		struct build_step *b_step;
 
-		b_step = calloc(1, sizeof(*b_step));
-		if (b_step == NULL) {
-			err(1, "calloc(build step) faild");
-		}
+		b_step = build_alloc(sizeof(*b_step));
 		b_step->step_op = STEP_ADD;
 		cur_build_step = b_step;
 	}
-	STRING STRING
+	add_checksum STRING STRING
 	{
 		char **pattern_list, *pat;
 		struct build_step *b_step;
@@ -342,24 +379,21 @@ op_spec:
 
 		bsp = cur_build_stage;
 		b_step = cur_build_step;
-		snprintf(b_step->step_string, sizeof(b_step->step_string),
-		    "ADD %s %s", $3, $4);
+		build_step_string(b_step, "ADD %s %s", $4, $5);
 		/*
 		 * Set the ADD operation to ADD_TYPE_FILE (basic copy) by
 		 * default. We will look at the source operands and change
 		 * it accordinly as need be.
 		 */
 		b_step->step_data.step_add.sa_op = ADD_TYPE_FILE;
-		strlcpy(b_step->step_data.step_add.sa_source, $3,
-		    sizeof(b_step->step_data.step_add.sa_source));
-		strlcpy(b_step->step_data.step_add.sa_dest, $4,
-		    sizeof(b_step->step_data.step_add.sa_dest));
+		b_step->step_data.step_add.sa_source = build_strdup($4);
+		b_step->step_data.step_add.sa_dest = build_strdup($5);
 		/*
 		 * Is this a URL that will need to be fectched?
 		 */
-		if (strncasecmp("http://", $3, 7) == 0) {
+		if (strncasecmp("http://", $4, 7) == 0) {
 			b_step->step_data.step_add.sa_op = ADD_TYPE_URL;
-		} else if (strncasecmp("https://", $3, 8) == 0) {
+		} else if (strncasecmp("https://", $4, 8) == 0) {
 			b_step->step_data.step_add.sa_op = ADD_TYPE_URL;
 		}
 		/*
@@ -370,7 +404,7 @@ op_spec:
 		pattern_list = archive_extensions;
 		match = 0;
 		while ((pat = *pattern_list++)) {
-			if (!fnmatch(pat, $3, FNM_CASEFOLD)) {
+			if (!fnmatch(pat, $4, FNM_CASEFOLD)) {
 				match = 1;
 				break;
 			}
@@ -382,6 +416,33 @@ op_spec:
 				b_step->step_data.step_add.sa_op = ADD_TYPE_ARCHIVE;
 			}
 		}
+		/*
+		 * A checksum pins the content of a remote source, so that
+		 * cblockd can use the copy it has without asking the server.
+		 * It travels to cblockd as the step digest.
+		 */
+		if ($3 != NULL) {
+			if (b_step->step_data.step_add.sa_op != ADD_TYPE_URL &&
+			    b_step->step_data.step_add.sa_op !=
+			    ADD_TYPE_ARCHIVE_URL) {
+				errx(1, "ADD --CHECKSUM requires a URL source");
+			}
+			pat = $3;
+			if (strncasecmp(pat, "sha256:", 7) == 0) {
+				pat += 7;
+			}
+			if (strlen(pat) != sizeof(b_step->step_digest) - 1) {
+				errx(1, "%s: expected sha256:<hex digest>", $3);
+			}
+			for (match = 0; pat[match] != '\0'; match++) {
+				if (!isxdigit((u_char)pat[match])) {
+					errx(1, "%s: expected sha256:<hex digest>",
+					    $3);
+				}
+				b_step->step_digest[match] =
+				    tolower((u_char)pat[match]);
+			}
+		}
 		cur_build_step->stage_index = stage_counter;
 		TAILQ_INSERT_HEAD(&bsp->step_head, b_step, step_glue);
 		cur_build_step = NULL;
@@ -390,10 +451,7 @@ op_spec:
 	{
 		struct build_step *b_step;
 
-		b_step = calloc(1, sizeof(*b_step));
-		if (b_step == NULL) {
-			err(1, "calloc(build step) faild");
-		}
+		b_step = build_alloc(sizeof(*b_step));
 		b_step->step_op = STEP_COPY;
 		cur_build_step = b_step;
 	} copy_spec
@@ -401,10 +459,7 @@ op_spec:
 	{
 		struct build_step *b_step;
 
-		b_step = calloc(1, sizeof(*b_step));
-		if (b_step == NULL) {
-			err(1, "calloc(build step) faild");
-		}
+		b_step = build_alloc(sizeof(*b_step));
 		b_step->step_op = STEP_ROOT_PIVOT;
 		cur_build_step = b_step;
 	}
@@ -417,11 +472,9 @@ op_spec:
 		bsp = cur_build_stage;
 		assert(b_step != NULL);
 		assert(bsp != NULL);
-		strlcpy(b_step->step_data.step_root_pivot.sr_dir,
-                    $3, sizeof(b_step->step_data.step_root_pivot.sr_dir));
+		b_step->step_data.step_root_pivot.sr_dir = build_strdup($3);
 		cur_build_step->stage_index = stage_counter;
-		snprintf(b_step->step_string, sizeof(b_step->step_string),
-		    "ROOTPIVOT %s", $3);
+		build_step_string(b_step, "ROOTPIVOT %s", $3);
 		TAILQ_INSERT_HEAD(&bsp->step_head, b_step, step_glue);
 		cur_build_step = NULL;
 	}
@@ -429,10 +482,7 @@ op_spec:
 	{
 		struct build_step *b_step;
 
-		b_step = calloc(1, sizeof(*b_step));
-		if (b_step == NULL) {
-			err(1, "calloc(build step) faild");
-		}
+		b_step = build_alloc(sizeof(*b_step));
 		b_step->step_op = STEP_ENV;
 		cur_build_step = b_step;
 	} STRING EQ STRING
@@ -444,13 +494,10 @@ op_spec:
                 bsp = cur_build_stage;
                 assert(b_step != NULL);
                 assert(bsp != NULL);
-                strlcpy(b_step->step_data.step_env.se_key,
-		    $3, sizeof(b_step->step_data.step_env.se_key));
-		strlcpy(b_step->step_data.step_env.se_value,
-		    $5, sizeof(b_step->step_data.step_env.se_value));
+                b_step->step_data.step_env.se_key = build_strdup($3);
+		b_step->step_data.step_env.se_value = build_strdup($5);
 		cur_build_step->stage_index = stage_counter;
-		snprintf(b_step->step_string, sizeof(b_step->step_string),
-		    "ENV %s=%s", $3, $5);
+		build_step_string(b_step, "ENV %s=%s", $3, $5);
 		TAILQ_INSERT_HEAD(&bsp->step_head, b_step, step_glue);
 		cur_build_step = NULL;
 	}
@@ -458,10 +505,7 @@ op_spec:
 	{
 		struct build_step *b_step;
 
-		b_step = calloc(1, sizeof(*b_step));
-		if (b_step == NULL) {
-			err(1, "calloc(build step) faild");
-		}
+		b_step = build_alloc(sizeof(*b_step));
 		b_step->step_op = STEP_WORKDIR;
 		cur_build_step = b_step;
 	}
@@ -474,11 +518,9 @@ op_spec:
 		bsp = cur_build_stage;
 		assert(b_step != NULL);
 		assert(bsp != NULL);
-		strlcpy(b_step->step_data.step_workdir.sw_dir,
-		    $3, sizeof(b_step->step_data.step_workdir.sw_dir));
+		b_step->step_data.step_workdir.sw_dir = build_strdup($3);
 		cur_build_step->stage_index = stage_counter;
-		snprintf(b_step->step_string, sizeof(b_step->step_string),
-		    "WORKDIR %s", $3);
+		build_step_string(b_step, "WORKDIR %s", $3);
 		TAILQ_INSERT_HEAD(&bsp->step_head, b_step, step_glue);
 		cur_build_step = NULL;
 	}
@@ -495,8 +537,7 @@ from_spec:
 
 		bsp = cur_build_stage;
 		assert(bsp != NULL);
-		strlcpy(bsp->bs_base_container, $1,
-		    sizeof(bsp->bs_base_container));
+		bsp->bs_base_container = build_strdup($1);
 	}
 	| STRING AS STRING
 	{
@@ -504,9 +545,8 @@ from_spec:
 
 		bsp = cur_build_stage;
 		assert(bsp != NULL);
-		strlcpy(bsp->bs_name, $3, sizeof(bsp->bs_name));
-		strlcpy(bsp->bs_base_container, $1,
-		    sizeof(bsp->bs_base_container));
+		bsp->bs_name = build_strdup($3);
+		bsp->bs_base_container = build_strdup($1);
 	}
 	;
 
@@ -515,10 +555,10 @@ stage_def:
 	{
 		struct build_stage *bsp;
 
-		bsp = calloc(1, sizeof(*bsp));
-		if (bsp == NULL) {
-			err(1, "calloc(build stage) failed");
-		}
+		bsp = build_alloc(sizeof(*bsp));
+		bsp->bs_name = "";
+		bsp->bs_base_container = "";
+		TAILQ_INIT(&bsp->step_head);
 		cur_build_stage = bsp;
 	}
 	from_spec operations
@@ -546,6 +586,10 @@ build_manifest_init(void)
 	}
 	bmp->entry_point = NULL;
 	bmp->entry_point_args = NULL;
+	bmp->arena = arena_init();
+	if (bmp->arena == NULL) {
+		err(1, "arena_init(build_manifest_init) failed");
+	}
 	TAILQ_INIT(&bmp->stage_head);
 	return (bmp);
 }
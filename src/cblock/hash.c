@@ -0,0 +1,252 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdint.h>
+
+#include <openssl/evp.h>
+
+#include <cblock/libcblock.h>
+
+#include "main.h"
+
+/*
+ * Content hashes of the build context files read by COPY and ADD steps.
+ * cblockd folds these into the step cache keys so that a step is run again
+ * when the files it copies change, even if the Cblockfile itself did not.
+ * Directories are walked in sorted order so the hash does not depend on the
+ * order the file system returns entries in. File contents enter the hash
+ * by their SHA-256, which for files in the build context was already
+ * computed for the context manifest.
+ */
+static int
+hash_walk(EVP_MD_CTX *ctx, const char *path, const char *rel,
+    struct context_manifest *cmp)
+{
+	char buf[MAXPATHLEN + 64], target[MAXPATHLEN], child[MAXPATHLEN];
+	char crel[MAXPATHLEN], digest[CBLOCK_DIGEST_LEN];
+	struct dirent **names;
+	struct stat sb;
+	ssize_t cc;
+	int fd, n, k, ret;
+
+	if (lstat(path, &sb) == -1) {
+		warn("%s", path);
+		return (-1);
+	}
+	(void) snprintf(buf, sizeof(buf), "%s %o %u %u\n", rel,
+	    sb.st_mode, sb.st_uid, sb.st_gid);
+	EVP_DigestUpdate(ctx, buf, strlen(buf));
+	if (S_ISLNK(sb.st_mode)) {
+		cc = readlink(path, target, sizeof(target) - 1);
+		if (cc == -1) {
+			warn("readlink(%s)", path);
+			return (-1);
+		}
+		EVP_DigestUpdate(ctx, target, cc);
+		return (0);
+	}
+	if (S_ISREG(sb.st_mode)) {
+		if (context_manifest_digest(cmp, &sb, digest,
+		    sizeof(digest)) == 0) {
+			EVP_DigestUpdate(ctx, digest, strlen(digest));
+			return (0);
+		}
+		fd = open(path, O_RDONLY);
+		if (fd == -1) {
+			warn("open(%s)", path);
+			return (-1);
+		}
+		ret = hash_fd(fd, digest, sizeof(digest), NULL);
+		(void) close(fd);
+		if (ret == -1) {
+			warnx("failed to hash %s", path);
+			return (-1);
+		}
+		EVP_DigestUpdate(ctx, digest, strlen(digest));
+		return (0);
+	}
+	if (!S_ISDIR(sb.st_mode)) {
+		return (0);
+	}
+	n = scandir(path, &names, NULL, alphasort);
+	if (n == -1) {
+		warn("scandir(%s)", path);
+		return (-1);
+	}
+	ret = 0;
+	for (k = 0; k < n; k++) {
+		if (strcmp(names[k]->d_name, ".") == 0 ||
+		    strcmp(names[k]->d_name, "..") == 0) {
+			free(names[k]);
+			continue;
+		}
+		(void) snprintf(child, sizeof(child), "%s/%s", path,
+		    names[k]->d_name);
+		(void) snprintf(crel, sizeof(crel), "%s/%s", rel,
+		    names[k]->d_name);
+		if (ret == 0 && hash_walk(ctx, child, crel, cmp) == -1) {
+			ret = -1;
+		}
+		free(names[k]);
+	}
+	free(names);
+	return (ret);
+}
+
+static void
+hash_hex(u_char *hash, u_int dlen, char *digest)
+{
+	u_int k;
+
+	for (k = 0; k < dlen; k++) {
+		(void) sprintf(digest + (k * 2), "%02x", hash[k]);
+	}
+}
+
+/*
+ * SHA-256 of everything that can be read from fd, as cblockd's blob store
+ * names it.
+ */
+int
+hash_fd(int fd, char *digest, size_t len, off_t *sizep)
+{
+	u_char hash[EVP_MAX_MD_SIZE];
+	char buf[65536];
+	EVP_MD_CTX *ctx;
+	off_t size;
+	u_int dlen;
+	ssize_t cc;
+
+	ctx = EVP_MD_CTX_new();
+	if (ctx == NULL) {
+		return (-1);
+	}
+	if (!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
+		EVP_MD_CTX_free(ctx);
+		return (-1);
+	}
+	size = 0;
+	while ((cc = read(fd, buf, sizeof(buf))) > 0) {
+		EVP_DigestUpdate(ctx, buf, cc);
+		size += cc;
+	}
+	if (cc == -1 || !EVP_DigestFinal_ex(ctx, hash, &dlen) ||
+	    len < dlen * 2 + 1) {
+		EVP_MD_CTX_free(ctx);
+		return (-1);
+	}
+	EVP_MD_CTX_free(ctx);
+	hash_hex(hash, dlen, digest);
+	if (sizep != NULL) {
+		*sizep = size;
+	}
+	return (0);
+}
+
+int
+hash_context_path(const char *root, const char *source, char *digest,
+    size_t len, struct context_manifest *cmp)
+{
+	u_char hash[EVP_MAX_MD_SIZE];
+	char path[MAXPATHLEN];
+	EVP_MD_CTX *ctx;
+	u_int dlen;
+	int ret;
+
+	(void) snprintf(path, sizeof(path), "%s/%s", root, source);
+	ctx = EVP_MD_CTX_new();
+	if (ctx == NULL) {
+		return (-1);
+	}
+	if (!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
+		EVP_MD_CTX_free(ctx);
+		return (-1);
+	}
+	ret = hash_walk(ctx, path, ".", cmp);
+	if (ret == 0 && !EVP_DigestFinal_ex(ctx, hash, &dlen)) {
+		ret = -1;
+	}
+	EVP_MD_CTX_free(ctx);
+	if (ret == -1 || len < dlen * 2 + 1) {
+		return (-1);
+	}
+	hash_hex(hash, dlen, digest);
+	return (0);
+}
+
+/*
+ * Fill in step_digest for every step that reads the build context. Steps
+ * whose sources can not be hashed are left without a digest, which makes
+ * them (and the rest of their stage) uncacheable rather than failing the
+ * build here; the copy itself will report the problem. URL sources keep
+ * the digest pinned with ADD --CHECKSUM, if any.
+ */
+void
+hash_build_steps(struct build_manifest *bmp, const char *root,
+    struct context_manifest *cmp)
+{
+	struct build_stage *stage;
+	struct build_step *step;
+	char *source;
+
+	TAILQ_FOREACH(stage, &bmp->stage_head, stage_glue) {
+		TAILQ_FOREACH(step, &stage->step_head, step_glue) {
+			switch (step->step_op) {
+			case STEP_COPY:
+				source = step->step_data.step_copy.sc_source;
+				break;
+			case STEP_ADD:
+				if (step->step_data.step_add.sa_op !=
+				    ADD_TYPE_FILE &&
+				    step->step_data.step_add.sa_op !=
+				    ADD_TYPE_ARCHIVE) {
+					continue;
+				}
+				source = step->step_data.step_add.sa_source;
+				break;
+			default:
+				step->step_digest[0] = '\0';
+				continue;
+			}
+			if (hash_context_path(root, source, step->step_digest,
+			    sizeof(step->step_digest), cmp) == -1) {
+				step->step_digest[0] = '\0';
+			}
+		}
+	}
+}
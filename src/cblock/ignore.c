@@ -0,0 +1,220 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fnmatch.h>
+#include <err.h>
+
+#include "main.h"
+
+/*
+ * .cblockignore support. Each line of the file at the root of the build
+ * context is a pattern relative to that root, matched one path component
+ * at a time with fnmatch(3) so that '*' does not cross a '/'. A "**"
+ * component matches any number of components. Lines starting with '#'
+ * are comments and a leading '!' re-includes paths an earlier pattern
+ * excluded. As with .dockerignore, wildcards match a leading '.' too,
+ * the last pattern that matches a path decides, and excluding a directory
+ * excludes everything below it.
+ */
+struct ignore_rule {
+	char			 *ir_buf;
+	char			**ir_comp;
+	int			  ir_ncomp;
+	int			  ir_negate;
+};
+
+struct ignore_list {
+	struct ignore_rule	 *il_rules;
+	int			  il_nrules;
+	int			  il_exceptions;
+};
+
+static int
+ignore_split(char *path, char ***compp)
+{
+	char **comp, *p;
+	int n;
+
+	n = 0;
+	comp = NULL;
+	while ((p = strsep(&path, "/")) != NULL) {
+		if (*p == '\0' || strcmp(p, ".") == 0) {
+			continue;
+		}
+		comp = realloc(comp, (n + 1) * sizeof(*comp));
+		if (comp == NULL) {
+			err(1, "realloc failed");
+		}
+		comp[n++] = p;
+	}
+	*compp = comp;
+	return (n);
+}
+
+static int
+ignore_match_comp(char **pat, int npat, char **name, int nname)
+{
+	int k;
+
+	if (npat == 0) {
+		return (nname == 0);
+	}
+	if (strcmp(pat[0], "**") == 0) {
+		for (k = 0; k <= nname; k++) {
+			if (ignore_match_comp(pat + 1, npat - 1, name + k,
+			    nname - k)) {
+				return (1);
+			}
+		}
+		return (0);
+	}
+	if (nname == 0 || fnmatch(pat[0], name[0], 0) != 0) {
+		return (0);
+	}
+	return (ignore_match_comp(pat + 1, npat - 1, name + 1, nname - 1));
+}
+
+struct ignore_list *
+ignore_load(const char *root)
+{
+	char path[MAXPATHLEN], *line, *p;
+	struct ignore_list *ilp;
+	struct ignore_rule *irp;
+	size_t cap;
+	ssize_t cc;
+	FILE *fp;
+
+	ilp = calloc(1, sizeof(*ilp));
+	if (ilp == NULL) {
+		err(1, "calloc failed");
+	}
+	(void) snprintf(path, sizeof(path), "%s/%s", root, IGNORE_FILE);
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return (ilp);
+	}
+	line = NULL;
+	cap = 0;
+	while ((cc = getline(&line, &cap, fp)) != -1) {
+		while (cc > 0 && (line[cc - 1] == '\n' ||
+		    line[cc - 1] == '\r' || line[cc - 1] == ' ' ||
+		    line[cc - 1] == '\t')) {
+			line[--cc] = '\0';
+		}
+		p = line;
+		while (*p == ' ' || *p == '\t') {
+			p++;
+		}
+		if (*p == '\0' || *p == '#') {
+			continue;
+		}
+		ilp->il_rules = realloc(ilp->il_rules,
+		    (ilp->il_nrules + 1) * sizeof(*ilp->il_rules));
+		if (ilp->il_rules == NULL) {
+			err(1, "realloc failed");
+		}
+		irp = &ilp->il_rules[ilp->il_nrules];
+		irp->ir_negate = 0;
+		if (*p == '!') {
+			irp->ir_negate = 1;
+			ilp->il_exceptions = 1;
+			p++;
+		}
+		p = strdup(p);
+		if (p == NULL) {
+			err(1, "strdup failed");
+		}
+		irp->ir_buf = p;
+		irp->ir_ncomp = ignore_split(p, &irp->ir_comp);
+		if (irp->ir_ncomp == 0) {
+			free(irp->ir_comp);
+			free(p);
+			continue;
+		}
+		ilp->il_nrules++;
+	}
+	free(line);
+	(void) fclose(fp);
+	return (ilp);
+}
+
+/*
+ * Return whether the context relative path rel is excluded. excluded is
+ * the state of its parent directory, which a path inherits unless a
+ * pattern matches it directly.
+ */
+int
+ignore_match(struct ignore_list *ilp, const char *rel, int excluded)
+{
+	char buf[MAXPATHLEN], **name;
+	struct ignore_rule *irp;
+	int k, nname;
+
+	if (ilp->il_nrules == 0) {
+		return (0);
+	}
+	strlcpy(buf, rel, sizeof(buf));
+	nname = ignore_split(buf, &name);
+	for (k = 0; k < ilp->il_nrules; k++) {
+		irp = &ilp->il_rules[k];
+		if (ignore_match_comp(irp->ir_comp, irp->ir_ncomp, name,
+		    nname)) {
+			excluded = !irp->ir_negate;
+		}
+	}
+	free(name);
+	return (excluded);
+}
+
+/*
+ * Whether anything below an excluded directory could be re-included by a
+ * later '!' pattern, in which case the directory still has to be walked.
+ */
+int
+ignore_has_exceptions(struct ignore_list *ilp)
+{
+
+	return (ilp->il_exceptions);
+}
+
+void
+ignore_free(struct ignore_list *ilp)
+{
+	int k;
+
+	for (k = 0; k < ilp->il_nrules; k++) {
+		free(ilp->il_rules[k].ir_buf);
+		free(ilp->il_rules[k].ir_comp);
+	}
+	free(ilp->il_rules);
+	free(ilp);
+}
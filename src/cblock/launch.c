@@ -26,7 +26,9 @@
  */
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#ifdef __FreeBSD__
 #include <sys/ttycom.h>
+#endif
 
 #include <stdio.h>
 #include <errno.h>
@@ -55,6 +57,7 @@ struct launch_config {
 	char		*l_tag;
 	char		*l_ports;
 	int		 l_host_networking;
+	char		*l_trace;
 };
 
 static struct option launch_options[] = {
@@ -70,6 +73,7 @@ static struct option launch_options[] = {
 	{ "verbose",		no_argument, 0, 'v' },
 	{ "port",		required_argument, 0, 'P' },
 	{ "host-networking",	no_argument, 0, 'H' },
+	{ "trace",		required_argument, 0, 'X' },
 	{ 0, 0, 0, 0 }
 };
 
@@ -89,6 +93,7 @@ launch_usage(void)
 	    " -A, --no-attach            Do not attach to container console\n"
 	    " -v, --verbose              Launch container with verbosity enabled\n"
 	    " -H, --host-networking      Use host networking instead of NAT/bridge\n"
+	    " -X, --trace=FILE           Write a Chrome trace of the launch to FILE\n"
 	);
 	exit(1);
 }
@@ -98,6 +103,7 @@ launch_container(int sock, struct launch_config *lcp)
 {
 	struct cblock_launch pl;
 	struct cblock_response resp;
+	uint64_t start, qstart;
 	char *term, *args;
 	uint32_t cmd;
 	vec_t *vec;
@@ -119,8 +125,10 @@ launch_container(int sock, struct launch_config *lcp)
 		free(args);
 		vec_free(lcp->l_vec);
 	}
+	start = trace_now_usec();
 	sock_ipc_must_write(sock, &cmd, sizeof(cmd));
 	pl.p_verbose = lcp->l_verbose;
+	strlcpy(pl.p_trace_id, trace_client_id(), sizeof(pl.p_trace_id));
 	strlcpy(pl.p_tag, lcp->l_tag, sizeof(pl.p_tag));
 	strlcpy(pl.p_name, lcp->l_name, sizeof(pl.p_name));
 	strlcpy(pl.p_term, term, sizeof(pl.p_term));
@@ -128,7 +136,22 @@ launch_container(int sock, struct launch_config *lcp)
 	strlcpy(pl.p_ports, lcp->l_ports, sizeof(pl.p_ports));
 	strlcpy(pl.p_network, lcp->l_network, sizeof(pl.p_network));
 	sock_ipc_must_write(sock, &pl, sizeof(pl));
-	sock_ipc_must_read(sock, &resp, sizeof(resp));
+	qstart = 0;
+	while (1) {
+		sock_ipc_must_read(sock, &resp, sizeof(resp));
+		if (resp.p_ecode != CBLOCK_RESP_QUEUED) {
+			break;
+		}
+		if (qstart == 0) {
+			qstart = trace_now_usec();
+		}
+		printf("cellblock: launch queued: position %s\n",
+		    resp.p_errbuf);
+	}
+	if (qstart != 0) {
+		trace_client_span("queued", qstart);
+	}
+	trace_client_span("launch request", start);
 	if (resp.p_ecode != 0) {
 		warnx("failed to spawn container");
 		return;
@@ -140,7 +163,9 @@ launch_container(int sock, struct launch_config *lcp)
 		vec_append(vec, "--name");
 		vec_append(vec, resp.p_errbuf);
 		vec_finalize(vec);
+		start = trace_now_usec();
 		console_main(vec->vec_used, vec_return(vec), sock);
+		trace_client_span("console", start);
 		vec_free(vec);
 	}
 }
@@ -169,7 +194,7 @@ launch_main(int argc, char *argv [], int ctlsock)
 	reset_getopt_state();
 	while (1) {
 		option_index = 0;
-		c = getopt_long(argc, argv, "AHP:vN:Fpn:t:V:T", launch_options,
+		c = getopt_long(argc, argv, "AHP:vN:Fpn:t:V:TX:", launch_options,
 		    &option_index);
 		if (c == -1) {
 			break;
@@ -216,6 +241,9 @@ launch_main(int argc, char *argv [], int ctlsock)
 		case 'n':
 			lc.l_name = optarg;
 			break;
+		case 'X':
+			lc.l_trace = optarg;
+			break;
 		default:
 			launch_usage();
 			/* NOT REACHED */
@@ -274,6 +302,10 @@ launch_main(int argc, char *argv [], int ctlsock)
 		}
 		vec_finalize(lc.l_vec);
 	}
+	if (lc.l_trace != NULL) {
+		trace_client_start(lc.l_trace, "cblock launch");
+	}
 	launch_container(ctlsock, &lc);
+	trace_client_finish();
 	return (0);
 }
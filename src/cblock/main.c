@@ -29,7 +29,9 @@
 #include <sys/ioctl.h>
 #include <sys/param.h>
 #include <sys/un.h>
+#ifdef __FreeBSD__
 #include <sys/ttycom.h>
+#endif
 #include <netinet/in.h>
 
 #include <stdio.h>
@@ -62,9 +64,12 @@ static struct sub_command sub_command_list[] = {
 	{ "launch",	launch_main, "Launch a new container instance"  },
 	{ "console",	console_main, "Attach to a container console" },
 	{ "build",	build_main, "Build a new container image" },
+	{ "builds",	builds_main, "List, follow or cancel queued and running builds" },
 	{ "instances",	instance_main, "Get information about running instances" },
 	{ "network",    network_main, "Configure networking parameters" },
 	{ "images",	image_main, "Manage cblock images" },
+	{ "stats",	stats_main, "Print daemon metrics" },
+	{ "fim",	fim_main, "Check container file integrity" },
 	{ NULL,		NULL, NULL }
 };
 
@@ -30,6 +30,14 @@
 #define	MAXSOCKS	64
 #define	INSTANCE_SIGOP_KILL	1
 #define	INSTANCE_SIGOP_STOP	2
+#define	IGNORE_FILE		".cblockignore"
+#define	CONTEXT_MAX_THREADS	8
+#define	CONTEXT_PIPE_DEPTH	4
+
+struct build_manifest;
+struct context_manifest;
+struct ignore_list;
+struct stat;
 
 struct global_params {
 	char		*c_name;
@@ -42,9 +50,38 @@ void		reset_getopt_state(void);
 int		console_main(int, char **, int);
 int		launch_main(int, char **, int);
 int		build_main(int, char **, int);
+int		build_attach(int);
+int		builds_main(int, char **, int);
 int		instance_main(int, char **, int);
 int		network_main(int, char **, int);
 int		image_main(int, char **, int);
+int		stats_main(int, char **, int);
+int		fim_main(int, char **, int);
+
+void		trace_client_start(const char *, const char *);
+const char *	trace_client_id(void);
+void		trace_client_span(const char *, uint64_t);
+void		trace_client_finish(void);
+
+int		hash_fd(int, char *, size_t, off_t *);
+int		hash_context_path(const char *, const char *, char *, size_t,
+		    struct context_manifest *);
+void		hash_build_steps(struct build_manifest *, const char *,
+		    struct context_manifest *);
+
+struct context_manifest	*context_manifest_build(const char *);
+size_t		context_manifest_len(struct context_manifest *);
+int		context_manifest_entries(struct context_manifest *);
+int		context_manifest_digest(struct context_manifest *,
+		    const struct stat *, char *, size_t);
+int		context_send(int, struct context_manifest *);
+void		context_manifest_report(struct context_manifest *);
+void		context_manifest_free(struct context_manifest *);
+
+struct ignore_list	*ignore_load(const char *);
+int		ignore_match(struct ignore_list *, const char *, int);
+int		ignore_has_exceptions(struct ignore_list *);
+void		ignore_free(struct ignore_list *);
 
 int		console_tty_set_raw_mode(int);
 void		console_tty_console_session(int);
@@ -0,0 +1,101 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <err.h>
+#include <unistd.h>
+
+#include <cblock/libcblock.h>
+
+#include "main.h"
+
+static struct option stats_options[] = {
+	{ "help",		no_argument, 0, 'h' },
+	{ 0, 0, 0, 0 }
+};
+
+static void
+stats_usage(void)
+{
+	(void) fprintf(stderr,
+	    "Usage: cblock stats [OPTIONS]\n\n"
+	    "Print cblockd counters and latency histograms in Prometheus\n"
+	    "text format.\n\n"
+	    "Options\n"
+	    " -h, --help                  Print help\n");
+	exit(1);
+}
+
+static void
+stats_get(int ctlsock)
+{
+	uint32_t cmd;
+	size_t len;
+	char *buf;
+
+	cmd = PRISON_IPC_GET_STATS;
+	sock_ipc_must_write(ctlsock, &cmd, sizeof(cmd));
+	sock_ipc_must_read(ctlsock, &len, sizeof(len));
+	if (len == 0) {
+		return;
+	}
+	buf = malloc(len);
+	if (buf == NULL) {
+		err(1, "malloc for stats failed");
+	}
+	sock_ipc_must_read(ctlsock, buf, len);
+	(void) fwrite(buf, 1, len, stdout);
+	free(buf);
+}
+
+int
+stats_main(int argc, char *argv [], int ctlsock)
+{
+	int option_index, c;
+
+	reset_getopt_state();
+	while (1) {
+		option_index = 0;
+		c = getopt_long(argc, argv, "h", stats_options,
+		    &option_index);
+		if (c == -1) {
+			break;
+		}
+		switch (c) {
+		case 'h':
+		default:
+			stats_usage();
+			/* NOT REACHED */
+		}
+	}
+	stats_get(ctlsock);
+	return (0);
+}
@@ -0,0 +1,188 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <err.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <cblock/libcblock.h>
+#include <cblock/sbuf.h>
+
+#include "main.h"
+#include "sock_ipc.h"
+
+/*
+ * Client side of --trace. Client spans are collected locally, then merged
+ * with whatever cblockd and the helper scripts recorded under the same trace
+ * ID and written out as Chrome trace JSON, which can be loaded into Perfetto
+ * or chrome://tracing.
+ */
+struct trace_client {
+	char		 tc_id[CBLOCK_TRACE_ID_LEN];
+	char		*tc_path;
+	char		*tc_name;
+	uint64_t	 tc_start;
+	struct sbuf	*tc_events;
+};
+
+static struct trace_client tcfg;
+
+static void
+trace_client_event(const char *name, int ph, uint64_t ts, uint64_t dur)
+{
+	char buf[512];
+
+	if (tcfg.tc_path == NULL) {
+		return;
+	}
+	(void) trace_format_event(buf, sizeof(buf), name, "cblock", ph, ts,
+	    dur, getpid());
+	if (sbuf_len(tcfg.tc_events) > 0) {
+		sbuf_cat(tcfg.tc_events, ",\n");
+	}
+	sbuf_cat(tcfg.tc_events, buf);
+}
+
+void
+trace_client_start(const char *path, const char *name)
+{
+
+	tcfg.tc_path = strdup(path);
+	tcfg.tc_name = strdup(name);
+	if (tcfg.tc_path == NULL || tcfg.tc_name == NULL) {
+		err(1, "strdup failed");
+	}
+	tcfg.tc_events = sbuf_new_auto();
+	trace_gen_id(tcfg.tc_id, sizeof(tcfg.tc_id));
+	tcfg.tc_start = trace_now_usec();
+	trace_client_event("cblock", 'M', 0, 0);
+}
+
+/*
+ * Returns the trace ID to send with a request, or an empty string if the
+ * request is not being traced.
+ */
+const char *
+trace_client_id(void)
+{
+
+	return (tcfg.tc_id);
+}
+
+void
+trace_client_span(const char *name, uint64_t start)
+{
+
+	trace_client_event(name, 'X', start, trace_now_usec() - start);
+}
+
+static char *
+trace_client_fetch(size_t *lenp)
+{
+	extern struct global_params gcfg;
+	struct cblock_response resp;
+	struct cblock_get_trace gt;
+	uint32_t cmd;
+	char *data;
+	int sock;
+
+	*lenp = 0;
+	if (gcfg.c_host) {
+		sock = sock_ipc_connect_inet(&gcfg);
+	} else {
+		sock = sock_ipc_connect_unix(&gcfg);
+	}
+	bzero(&gt, sizeof(gt));
+	strlcpy(gt.p_trace_id, tcfg.tc_id, sizeof(gt.p_trace_id));
+	cmd = PRISON_IPC_GET_TRACE;
+	sock_ipc_must_write(sock, &cmd, sizeof(cmd));
+	sock_ipc_must_write(sock, &gt, sizeof(gt));
+	if (sock_ipc_must_read(sock, &resp, sizeof(resp)) == 0) {
+		errx(1, "trace: daemon closed connection");
+	}
+	if (resp.p_ecode != 0) {
+		warnx("trace: %s", resp.p_errbuf);
+		(void) close(sock);
+		return (NULL);
+	}
+	sock_ipc_must_read(sock, lenp, sizeof(*lenp));
+	data = malloc(*lenp + 1);
+	if (data == NULL) {
+		err(1, "malloc failed");
+	}
+	if (*lenp > 0) {
+		sock_ipc_must_read(sock, data, *lenp);
+	}
+	data[*lenp] = '\0';
+	(void) close(sock);
+	return (data);
+}
+
+/*
+ * Close the top level span, collect the daemon side of the trace and write
+ * the result.
+ */
+void
+trace_client_finish(void)
+{
+	char *data, *line, *next;
+	size_t len;
+	FILE *fp;
+
+	if (tcfg.tc_path == NULL) {
+		return;
+	}
+	trace_client_span(tcfg.tc_name, tcfg.tc_start);
+	data = trace_client_fetch(&len);
+	fp = fopen(tcfg.tc_path, "w");
+	if (fp == NULL) {
+		err(1, "fopen(%s) failed", tcfg.tc_path);
+	}
+	sbuf_finish(tcfg.tc_events);
+	fprintf(fp, "{\"traceEvents\":[\n%s", sbuf_data(tcfg.tc_events));
+	for (line = data; line != NULL && *line != '\0'; line = next) {
+		next = strchr(line, '\n');
+		if (next != NULL) {
+			*next++ = '\0';
+		}
+		fprintf(fp, ",\n%s", line);
+	}
+	fprintf(fp, "\n],\"displayTimeUnit\":\"ms\","
+	    "\"otherData\":{\"trace_id\":\"%s\"}}\n", tcfg.tc_id);
+	fclose(fp);
+	printf("cellblock: trace %s written to %s\n", tcfg.tc_id,
+	    tcfg.tc_path);
+	free(data);
+	sbuf_delete(tcfg.tc_events);
+	free(tcfg.tc_path);
+	free(tcfg.tc_name);
+	tcfg.tc_path = NULL;
+}
@@ -0,0 +1,2030 @@
+/* A Bison parser, made by GNU Bison 3.8.2.  */
+
+/* Bison implementation for Yacc-like parsers in C
+
+   Copyright (C) 1984, 1989-1990, 2000-2015, 2018-2021 Free Software Foundation,
+   Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+/* As a special exception, you may create a larger work that contains
+   part or all of the Bison parser skeleton and distribute that work
+   under terms of your choice, so long as that work isn't itself a
+   parser generator using the skeleton or a modified version thereof
+   as a parser skeleton.  Alternatively, if you modify or redistribute
+   the parser skeleton itself, you may (at your option) remove this
+   special exception, which will cause the skeleton and the resulting
+   Bison output files to be licensed under the GNU General Public
+   License without this special exception.
+
+   This special exception was added by the Free Software Foundation in
+   version 2.2 of Bison.  */
+
+/* C LALR(1) parser skeleton written by Richard Stallman, by
+   simplifying the original so-called "semantic" parser.  */
+
+/* DO NOT RELY ON FEATURES THAT ARE NOT DOCUMENTED in the manual,
+   especially those whose name start with YY_ or yy_.  They are
+   private implementation details that can be changed or removed.  */
+
+/* All symbols defined below should begin with yy or YY, to avoid
+   infringing on user name space.  This should be done even for local
+   variables, as they might otherwise be expanded by user macros.
+   There are some unavoidable exceptions within include files to
+   define necessary library symbols; they are noted "INFRINGES ON
+   USER NAME SPACE" below.  */
+
+/* Identify Bison output, and Bison version.  */
+#define YYBISON 30802
+
+/* Bison version string.  */
+#define YYBISON_VERSION "3.8.2"
+
+/* Skeleton name.  */
+#define YYSKELETON_NAME "yacc.c"
+
+/* Pure parsers.  */
+#define YYPURE 0
+
+/* Push parsers.  */
+#define YYPUSH 0
+
+/* Pull parsers.  */
+#define YYPULL 1
+
+
+
+
+/* First part of user prologue.  */
+#line 1 "grammar.y"
+
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+#include <assert.h>
+
+#include <bsm/libbsm.h>
+
+#include <cblock/libcblock.h>
+
+#include "parser.h"
+
+static struct build_manifest	*cur_build_manifest;
+static struct build_stage	*cur_build_stage;
+static struct build_step	*cur_build_step;
+static int stage_counter;
+vec_t *vec;
+
+static char *archive_extensions[] = {
+	"*.tar.gz",
+	"*.tgz",
+	"*.txz",
+	"*.tar.xz",
+	"*.tar.bz2",
+	"*.tbz2",
+	NULL
+};
+
+
+#line 133 "y.tab.c"
+
+# ifndef YY_CAST
+#  ifdef __cplusplus
+#   define YY_CAST(Type, Val) static_cast<Type> (Val)
+#   define YY_REINTERPRET_CAST(Type, Val) reinterpret_cast<Type> (Val)
+#  else
+#   define YY_CAST(Type, Val) ((Type) (Val))
+#   define YY_REINTERPRET_CAST(Type, Val) ((Type) (Val))
+#  endif
+# endif
+# ifndef YY_NULLPTR
+#  if defined __cplusplus
+#   if 201103L <= __cplusplus
+#    define YY_NULLPTR nullptr
+#   else
+#    define YY_NULLPTR 0
+#   endif
+#  else
+#   define YY_NULLPTR ((void*)0)
+#  endif
+# endif
+
+/* Use api.header.include to #include this header
+   instead of duplicating it here.  */
+#ifndef YY_YY_Y_TAB_H_INCLUDED
+# define YY_YY_Y_TAB_H_INCLUDED
+/* Debug traces.  */
+#ifndef YYDEBUG
+# define YYDEBUG 0
+#endif
+#if YYDEBUG
+extern int yydebug;
+#endif
+
+/* Token kinds.  */
+#ifndef YYTOKENTYPE
+# define YYTOKENTYPE
+  enum yytokentype
+  {
+    YYEMPTY = -2,
+    YYEOF = 0,                     /* "end of file"  */
+    YYerror = 256,                 /* error  */
+    YYUNDEF = 257,                 /* "invalid token"  */
+    FROM = 258,                    /* FROM  */
+    AS = 259,                      /* AS  */
+    COPY = 260,                    /* COPY  */
+    ADD = 261,                     /* ADD  */
+    RUN = 262,                     /* RUN  */
+    ENTRYPOINT = 263,              /* ENTRYPOINT  */
+    STRING = 264,                  /* STRING  */
+    WORKDIR = 265,                 /* WORKDIR  */
+    OPEN_SQUARE_BRACKET = 266,     /* OPEN_SQUARE_BRACKET  */
+    CLOSE_SQUARE_BRACKET = 267,    /* CLOSE_SQUARE_BRACKET  */
+    COPY_FROM = 268,               /* COPY_FROM  */
+    ENV = 269,                     /* ENV  */
+    EQ = 270,                      /* EQ  */
+    INTEGER = 271,                 /* INTEGER  */
+    COMMA = 272,                   /* COMMA  */
+    CMD = 273,                     /* CMD  */
+    ROOTPIVOT = 274,               /* ROOTPIVOT  */
+    OSRELEASE = 275,               /* OSRELEASE  */
+    AUDITCFG = 276                 /* AUDITCFG  */
+  };
+  typedef enum yytokentype yytoken_kind_t;
+#endif
+/* Token kinds.  */
+#define YYEMPTY -2
+#define YYEOF 0
+#define YYerror 256
+#define YYUNDEF 257
+#define FROM 258
+#define AS 259
+#define COPY 260
+#define ADD 261
+#define RUN 262
+#define ENTRYPOINT 263
+#define STRING 264
+#define WORKDIR 265
+#define OPEN_SQUARE_BRACKET 266
+#define CLOSE_SQUARE_BRACKET 267
+#define COPY_FROM 268
+#define ENV 269
+#define EQ 270
+#define INTEGER 271
+#define COMMA 272
+#define CMD 273
+#define ROOTPIVOT 274
+#define OSRELEASE 275
+#define AUDITCFG 276
+
+/* Value type.  */
+#if ! defined YYSTYPE && ! defined YYSTYPE_IS_DECLARED
+union YYSTYPE
+{
+#line 63 "grammar.y"
+
+	uint32_t	 num;
+        char		*c_string;
+
+#line 233 "y.tab.c"
+
+};
+typedef union YYSTYPE YYSTYPE;
+# define YYSTYPE_IS_TRIVIAL 1
+# define YYSTYPE_IS_DECLARED 1
+#endif
+
+
+extern YYSTYPE yylval;
+
+
+int yyparse (void);
+
+
+#endif /* !YY_YY_Y_TAB_H_INCLUDED  */
+/* Symbol kind.  */
+enum yysymbol_kind_t
+{
+  YYSYMBOL_YYEMPTY = -2,
+  YYSYMBOL_YYEOF = 0,                      /* "end of file"  */
+  YYSYMBOL_YYerror = 1,                    /* error  */
+  YYSYMBOL_YYUNDEF = 2,                    /* "invalid token"  */
+  YYSYMBOL_FROM = 3,                       /* FROM  */
+  YYSYMBOL_AS = 4,                         /* AS  */
+  YYSYMBOL_COPY = 5,                       /* COPY  */
+  YYSYMBOL_ADD = 6,                        /* ADD  */
+  YYSYMBOL_RUN = 7,                        /* RUN  */
+  YYSYMBOL_ENTRYPOINT = 8,                 /* ENTRYPOINT  */
+  YYSYMBOL_STRING = 9,                     /* STRING  */
+  YYSYMBOL_WORKDIR = 10,                   /* WORKDIR  */
+  YYSYMBOL_OPEN_SQUARE_BRACKET = 11,       /* OPEN_SQUARE_BRACKET  */
+  YYSYMBOL_CLOSE_SQUARE_BRACKET = 12,      /* CLOSE_SQUARE_BRACKET  */
+  YYSYMBOL_COPY_FROM = 13,                 /* COPY_FROM  */
+  YYSYMBOL_ENV = 14,                       /* ENV  */
+  YYSYMBOL_EQ = 15,                        /* EQ  */
+  YYSYMBOL_INTEGER = 16,                   /* INTEGER  */
+  YYSYMBOL_COMMA = 17,                     /* COMMA  */
+  YYSYMBOL_CMD = 18,                       /* CMD  */
+  YYSYMBOL_ROOTPIVOT = 19,                 /* ROOTPIVOT  */
+  YYSYMBOL_OSRELEASE = 20,                 /* OSRELEASE  */
+  YYSYMBOL_AUDITCFG = 21,                  /* AUDITCFG  */
+  YYSYMBOL_YYACCEPT = 22,                  /* $accept  */
+  YYSYMBOL_root = 23,                      /* root  */
+  YYSYMBOL_stage = 24,                     /* stage  */
+  YYSYMBOL_list_item = 25,                 /* list_item  */
+  YYSYMBOL_list = 26,                      /* list  */
+  YYSYMBOL_cmd_def = 27,                   /* cmd_def  */
+  YYSYMBOL_28_1 = 28,                      /* $@1  */
+  YYSYMBOL_entry_def = 29,                 /* entry_def  */
+  YYSYMBOL_30_2 = 30,                      /* $@2  */
+  YYSYMBOL_copy_spec = 31,                 /* copy_spec  */
+  YYSYMBOL_op_spec = 32,                   /* op_spec  */
+  YYSYMBOL_33_3 = 33,                      /* $@3  */
+  YYSYMBOL_34_4 = 34,                      /* $@4  */
+  YYSYMBOL_35_5 = 35,                      /* $@5  */
+  YYSYMBOL_36_6 = 36,                      /* $@6  */
+  YYSYMBOL_37_7 = 37,                      /* $@7  */
+  YYSYMBOL_38_8 = 38,                      /* $@8  */
+  YYSYMBOL_operations = 39,                /* operations  */
+  YYSYMBOL_from_spec = 40,                 /* from_spec  */
+  YYSYMBOL_stage_def = 41,                 /* stage_def  */
+  YYSYMBOL_42_9 = 42                       /* $@9  */
+};
+typedef enum yysymbol_kind_t yysymbol_kind_t;
+
+
+
+
+#ifdef short
+# undef short
+#endif
+
+/* On compilers that do not define __PTRDIFF_MAX__ etc., make sure
+   <limits.h> and (if available) <stdint.h> are included
+   so that the code can choose integer types of a good width.  */
+
+#ifndef __PTRDIFF_MAX__
+# include <limits.h> /* INFRINGES ON USER NAME SPACE */
+# if defined __STDC_VERSION__ && 199901 <= __STDC_VERSION__
+#  include <stdint.h> /* INFRINGES ON USER NAME SPACE */
+#  define YY_STDINT_H
+# endif
+#endif
+
+/* Narrow types that promote to a signed type and that can represent a
+   signed or unsigned integer of at least N bits.  In tables they can
+   save space and decrease cache pressure.  Promoting to a signed type
+   helps avoid bugs in integer arithmetic.  */
+
+#ifdef __INT_LEAST8_MAX__
+typedef __INT_LEAST8_TYPE__ yytype_int8;
+#elif defined YY_STDINT_H
+typedef int_least8_t yytype_int8;
+#else
+typedef signed char yytype_int8;
+#endif
+
+#ifdef __INT_LEAST16_MAX__
+typedef __INT_LEAST16_TYPE__ yytype_int16;
+#elif defined YY_STDINT_H
+typedef int_least16_t yytype_int16;
+#else
+typedef short yytype_int16;
+#endif
+
+/* Work around bug in HP-UX 11.23, which defines these macros
+   incorrectly for preprocessor constants.  This workaround can likely
+   be removed in 2023, as HPE has promised support for HP-UX 11.23
+   (aka HP-UX 11i v2) only through the end of 2022; see Table 2 of
+   <https://h20195.www2.hpe.com/V2/getpdf.aspx/4AA4-7673ENW.pdf>.  */
+#ifdef __hpux
+# undef UINT_LEAST8_MAX
+# undef UINT_LEAST16_MAX
+# define UINT_LEAST8_MAX 255
+# define UINT_LEAST16_MAX 65535
+#endif
+
+#if defined __UINT_LEAST8_MAX__ && __UINT_LEAST8_MAX__ <= __INT_MAX__
+typedef __UINT_LEAST8_TYPE__ yytype_uint8;
+#elif (!defined __UINT_LEAST8_MAX__ && defined YY_STDINT_H \
+       && UINT_LEAST8_MAX <= INT_MAX)
+typedef uint_least8_t yytype_uint8;
+#elif !defined __UINT_LEAST8_MAX__ && UCHAR_MAX <= INT_MAX
+typedef unsigned char yytype_uint8;
+#else
+typedef short yytype_uint8;
+#endif
+
+#if defined __UINT_LEAST16_MAX__ && __UINT_LEAST16_MAX__ <= __INT_MAX__
+typedef __UINT_LEAST16_TYPE__ yytype_uint16;
+#elif (!defined __UINT_LEAST16_MAX__ && defined YY_STDINT_H \
+       && UINT_LEAST16_MAX <= INT_MAX)
+typedef uint_least16_t yytype_uint16;
+#elif !defined __UINT_LEAST16_MAX__ && USHRT_MAX <= INT_MAX
+typedef unsigned short yytype_uint16;
+#else
+typedef int yytype_uint16;
+#endif
+
+#ifndef YYPTRDIFF_T
+# if defined __PTRDIFF_TYPE__ && defined __PTRDIFF_MAX__
+#  define YYPTRDIFF_T __PTRDIFF_TYPE__
+#  define YYPTRDIFF_MAXIMUM __PTRDIFF_MAX__
+# elif defined PTRDIFF_MAX
+#  ifndef ptrdiff_t
+#   include <stddef.h> /* INFRINGES ON USER NAME SPACE */
+#  endif
+#  define YYPTRDIFF_T ptrdiff_t
+#  define YYPTRDIFF_MAXIMUM PTRDIFF_MAX
+# else
+#  define YYPTRDIFF_T long
+#  define YYPTRDIFF_MAXIMUM LONG_MAX
+# endif
+#endif
+
+#ifndef YYSIZE_T
+# ifdef __SIZE_TYPE__
+#  define YYSIZE_T __SIZE_TYPE__
+# elif defined size_t
+#  define YYSIZE_T size_t
+# elif defined __STDC_VERSION__ && 199901 <= __STDC_VERSION__
+#  include <stddef.h> /* INFRINGES ON USER NAME SPACE */
+#  define YYSIZE_T size_t
+# else
+#  define YYSIZE_T unsigned
+# endif
+#endif
+
+#define YYSIZE_MAXIMUM                                  \
+  YY_CAST (YYPTRDIFF_T,                                 \
+           (YYPTRDIFF_MAXIMUM < YY_CAST (YYSIZE_T, -1)  \
+            ? YYPTRDIFF_MAXIMUM                         \
+            : YY_CAST (YYSIZE_T, -1)))
+
+#define YYSIZEOF(X) YY_CAST (YYPTRDIFF_T, sizeof (X))
+
+
+/* Stored state numbers (used for stacks). */
+typedef yytype_int8 yy_state_t;
+
+/* State numbers in computations.  */
+typedef int yy_state_fast_t;
+
+#ifndef YY_
+# if defined YYENABLE_NLS && YYENABLE_NLS
+#  if ENABLE_NLS
+#   include <libintl.h> /* INFRINGES ON USER NAME SPACE */
+#   define YY_(Msgid) dgettext ("bison-runtime", Msgid)
+#  endif
+# endif
+# ifndef YY_
+#  define YY_(Msgid) Msgid
+# endif
+#endif
+
+
+#ifndef YY_ATTRIBUTE_PURE
+# if defined __GNUC__ && 2 < __GNUC__ + (96 <= __GNUC_MINOR__)
+#  define YY_ATTRIBUTE_PURE __attribute__ ((__pure__))
+# else
+#  define YY_ATTRIBUTE_PURE
+# endif
+#endif
+
+#ifndef YY_ATTRIBUTE_UNUSED
+# if defined __GNUC__ && 2 < __GNUC__ + (7 <= __GNUC_MINOR__)
+#  define YY_ATTRIBUTE_UNUSED __attribute__ ((__unused__))
+# else
+#  define YY_ATTRIBUTE_UNUSED
+# endif
+#endif
+
+/* Suppress unused-variable warnings by "using" E.  */
+#if ! defined lint || defined __GNUC__
+# define YY_USE(E) ((void) (E))
+#else
+# define YY_USE(E) /* empty */
+#endif
+
+/* Suppress an incorrect diagnostic about yylval being uninitialized.  */
+#if defined __GNUC__ && ! defined __ICC && 406 <= __GNUC__ * 100 + __GNUC_MINOR__
+# if __GNUC__ * 100 + __GNUC_MINOR__ < 407
+#  define YY_IGNORE_MAYBE_UNINITIALIZED_BEGIN                           \
+    _Pragma ("GCC diagnostic push")                                     \
+    _Pragma ("GCC diagnostic ignored \"-Wuninitialized\"")
+# else
+#  define YY_IGNORE_MAYBE_UNINITIALIZED_BEGIN                           \
+    _Pragma ("GCC diagnostic push")                                     \
+    _Pragma ("GCC diagnostic ignored \"-Wuninitialized\"")              \
+    _Pragma ("GCC diagnostic ignored \"-Wmaybe-uninitialized\"")
+# endif
+# define YY_IGNORE_MAYBE_UNINITIALIZED_END      \
+    _Pragma ("GCC diagnostic pop")
+#else
+# define YY_INITIAL_VALUE(Value) Value
+#endif
+#ifndef YY_IGNORE_MAYBE_UNINITIALIZED_BEGIN
+# define YY_IGNORE_MAYBE_UNINITIALIZED_BEGIN
+# define YY_IGNORE_MAYBE_UNINITIALIZED_END
+#endif
+#ifndef YY_INITIAL_VALUE
+# define YY_INITIAL_VALUE(Value) /* Nothing. */
+#endif
+
+#if defined __cplusplus && defined __GNUC__ && ! defined __ICC && 6 <= __GNUC__
+# define YY_IGNORE_USELESS_CAST_BEGIN                          \
+    _Pragma ("GCC diagnostic push")                            \
+    _Pragma ("GCC diagnostic ignored \"-Wuseless-cast\"")
+# define YY_IGNORE_USELESS_CAST_END            \
+    _Pragma ("GCC diagnostic pop")
+#endif
+#ifndef YY_IGNORE_USELESS_CAST_BEGIN
+# define YY_IGNORE_USELESS_CAST_BEGIN
+# define YY_IGNORE_USELESS_CAST_END
+#endif
+
+
+#define YY_ASSERT(E) ((void) (0 && (E)))
+
+#if !defined yyoverflow
+
+/* The parser invokes alloca or malloc; define the necessary symbols.  */
+
+# ifdef YYSTACK_USE_ALLOCA
+#  if YYSTACK_USE_ALLOCA
+#   ifdef __GNUC__
+#    define YYSTACK_ALLOC __builtin_alloca
+#   elif defined __BUILTIN_VA_ARG_INCR
+#    include <alloca.h> /* INFRINGES ON USER NAME SPACE */
+#   elif defined _AIX
+#    define YYSTACK_ALLOC __alloca
+#   elif defined _MSC_VER
+#    include <malloc.h> /* INFRINGES ON USER NAME SPACE */
+#    define alloca _alloca
+#   else
+#    define YYSTACK_ALLOC alloca
+#    if ! defined _ALLOCA_H && ! defined EXIT_SUCCESS
+#     include <stdlib.h> /* INFRINGES ON USER NAME SPACE */
+      /* Use EXIT_SUCCESS as a witness for stdlib.h.  */
+#     ifndef EXIT_SUCCESS
+#      define EXIT_SUCCESS 0
+#     endif
+#    endif
+#   endif
+#  endif
+# endif
+
+# ifdef YYSTACK_ALLOC
+   /* Pacify GCC's 'empty if-body' warning.  */
+#  define YYSTACK_FREE(Ptr) do { /* empty */; } while (0)
+#  ifndef YYSTACK_ALLOC_MAXIMUM
+    /* The OS might guarantee only one guard page at the bottom of the stack,
+       and a page size can be as small as 4096 bytes.  So we cannot safely
+       invoke alloca (N) if N exceeds 4096.  Use a slightly smaller number
+       to allow for a few compiler-allocated temporary stack slots.  */
+#   define YYSTACK_ALLOC_MAXIMUM 4032 /* reasonable circa 2006 */
+#  endif
+# else
+#  define YYSTACK_ALLOC YYMALLOC
+#  define YYSTACK_FREE YYFREE
+#  ifndef YYSTACK_ALLOC_MAXIMUM
+#   define YYSTACK_ALLOC_MAXIMUM YYSIZE_MAXIMUM
+#  endif
+#  if (defined __cplusplus && ! defined EXIT_SUCCESS \
+       && ! ((defined YYMALLOC || defined malloc) \
+             && (defined YYFREE || defined free)))
+#   include <stdlib.h> /* INFRINGES ON USER NAME SPACE */
+#   ifndef EXIT_SUCCESS
+#    define EXIT_SUCCESS 0
+#   endif
+#  endif
+#  ifndef YYMALLOC
+#   define YYMALLOC malloc
+#   if ! defined malloc && ! defined EXIT_SUCCESS
+void *malloc (YYSIZE_T); /* INFRINGES ON USER NAME SPACE */
+#   endif
+#  endif
+#  ifndef YYFREE
+#   define YYFREE free
+#   if ! defined free && ! defined EXIT_SUCCESS
+void free (void *); /* INFRINGES ON USER NAME SPACE */
+#   endif
+#  endif
+# endif
+#endif /* !defined yyoverflow */
+
+#if (! defined yyoverflow \
+     && (! defined __cplusplus \
+         || (defined YYSTYPE_IS_TRIVIAL && YYSTYPE_IS_TRIVIAL)))
+
+/* A type that is properly aligned for any stack member.  */
+union yyalloc
+{
+  yy_state_t yyss_alloc;
+  YYSTYPE yyvs_alloc;
+};
+
+/* The size of the maximum gap between one aligned stack and the next.  */
+# define YYSTACK_GAP_MAXIMUM (YYSIZEOF (union yyalloc) - 1)
+
+/* The size of an array large to enough to hold all stacks, each with
+   N elements.  */
+# define YYSTACK_BYTES(N) \
+     ((N) * (YYSIZEOF (yy_state_t) + YYSIZEOF (YYSTYPE)) \
+      + YYSTACK_GAP_MAXIMUM)
+
+# define YYCOPY_NEEDED 1
+
+/* Relocate STACK from its old location to the new one.  The
+   local variables YYSIZE and YYSTACKSIZE give the old and new number of
+   elements in the stack, and YYPTR gives the new location of the
+   stack.  Advance YYPTR to a properly aligned location for the next
+   stack.  */
+# define YYSTACK_RELOCATE(Stack_alloc, Stack)                           \
+    do                                                                  \
+      {                                                                 \
+        YYPTRDIFF_T yynewbytes;                                         \
+        YYCOPY (&yyptr->Stack_alloc, Stack, yysize);                    \
+        Stack = &yyptr->Stack_alloc;                                    \
+        yynewbytes = yystacksize * YYSIZEOF (*Stack) + YYSTACK_GAP_MAXIMUM; \
+        yyptr += yynewbytes / YYSIZEOF (*yyptr);                        \
+      }                                                                 \
+    while (0)
+
+#endif
+
+#if defined YYCOPY_NEEDED && YYCOPY_NEEDED
+/* Copy COUNT objects from SRC to DST.  The source and destination do
+   not overlap.  */
+# ifndef YYCOPY
+#  if defined __GNUC__ && 1 < __GNUC__
+#   define YYCOPY(Dst, Src, Count) \
+      __builtin_memcpy (Dst, Src, YY_CAST (YYSIZE_T, (Count)) * sizeof (*(Src)))
+#  else
+#   define YYCOPY(Dst, Src, Count)              \
+      do                                        \
+        {                                       \
+          YYPTRDIFF_T yyi;                      \
+          for (yyi = 0; yyi < (Count); yyi++)   \
+            (Dst)[yyi] = (Src)[yyi];            \
+        }                                       \
+      while (0)
+#  endif
+# endif
+#endif /* !YYCOPY_NEEDED */
+
+/* YYFINAL -- State number of the termination state.  */
+#define YYFINAL  2
+/* YYLAST -- Last index in YYTABLE.  */
+#define YYLAST   52
+
+/* YYNTOKENS -- Number of terminals.  */
+#define YYNTOKENS  22
+/* YYNNTS -- Number of nonterminals.  */
+#define YYNNTS  21
+/* YYNRULES -- Number of rules.  */
+#define YYNRULES  38
+/* YYNSTATES -- Number of states.  */
+#define YYNSTATES  63
+
+/* YYMAXUTOK -- Last valid token kind.  */
+#define YYMAXUTOK   276
+
+
+/* YYTRANSLATE(TOKEN-NUM) -- Symbol number corresponding to TOKEN-NUM
+   as returned by yylex, with out-of-bounds checking.  */
+#define YYTRANSLATE(YYX)                                \
+  (0 <= (YYX) && (YYX) <= YYMAXUTOK                     \
+   ? YY_CAST (yysymbol_kind_t, yytranslate[YYX])        \
+   : YYSYMBOL_YYUNDEF)
+
+/* YYTRANSLATE[TOKEN-NUM] -- Symbol number corresponding to TOKEN-NUM
+   as returned by yylex.  */
+static const yytype_int8 yytranslate[] =
+{
+       0,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+       2,     2,     2,     2,     2,     2,     1,     2,     3,     4,
+       5,     6,     7,     8,     9,    10,    11,    12,    13,    14,
+      15,    16,    17,    18,    19,    20,    21
+};
+
+#if YYDEBUG
+/* YYRLINE[YYN] -- Source line where rule number YYN was defined.  */
+static const yytype_int16 yyrline[] =
+{
+       0,    77,    77,    78,    82,    83,    84,    87,    88,    96,
+      97,   102,   101,   135,   134,   158,   189,   205,   240,   275,
+     298,   297,   326,   325,   390,   389,   401,   400,   429,   428,
+     458,   457,   487,   488,   491,   492,   501,   515,   514
+};
+#endif
+
+/** Accessing symbol of state STATE.  */
+#define YY_ACCESSING_SYMBOL(State) YY_CAST (yysymbol_kind_t, yystos[State])
+
+#if YYDEBUG || 0
+/* The user-facing name of the symbol whose (internal) number is
+   YYSYMBOL.  No bounds checking.  */
+static const char *yysymbol_name (yysymbol_kind_t yysymbol) YY_ATTRIBUTE_UNUSED;
+
+/* YYTNAME[SYMBOL-NUM] -- String name of the symbol SYMBOL-NUM.
+   First, the terminals, then, starting at YYNTOKENS, nonterminals.  */
+static const char *const yytname[] =
+{
+  "\"end of file\"", "error", "\"invalid token\"", "FROM", "AS", "COPY",
+  "ADD", "RUN", "ENTRYPOINT", "STRING", "WORKDIR", "OPEN_SQUARE_BRACKET",
+  "CLOSE_SQUARE_BRACKET", "COPY_FROM", "ENV", "EQ", "INTEGER", "COMMA",
+  "CMD", "ROOTPIVOT", "OSRELEASE", "AUDITCFG", "$accept", "root", "stage",
+  "list_item", "list", "cmd_def", "$@1", "entry_def", "$@2", "copy_spec",
+  "op_spec", "$@3", "$@4", "$@5", "$@6", "$@7", "$@8", "operations",
+  "from_spec", "stage_def", "$@9", YY_NULLPTR
+};
+
+static const char *
+yysymbol_name (yysymbol_kind_t yysymbol)
+{
+  return yytname[yysymbol];
+}
+#endif
+
+#define YYPACT_NINF (-12)
+
+#define yypact_value_is_default(Yyn) \
+  ((Yyn) == YYPACT_NINF)
+
+#define YYTABLE_NINF (-1)
+
+#define yytable_value_is_error(Yyn) \
+  0
+
+/* YYPACT[STATE-NUM] -- Index in YYTABLE of the portion describing
+   STATE-NUM.  */
+static const yytype_int8 yypact[] =
+{
+     -12,     0,   -12,   -12,   -12,   -12,    -5,    -4,   -12,   -12,
+     -12,   -12,    -2,     3,    12,   -12,   -12,    21,   -12,     7,
+       7,    17,     5,   -12,   -12,   -11,    10,   -12,   -12,   -12,
+     -12,   -12,   -12,   -12,   -12,   -12,     7,   -12,     4,    19,
+      20,    22,    23,    24,   -12,    25,    -7,   -12,    26,   -12,
+     -12,    15,   -12,   -12,    27,    28,   -12,    29,    30,    31,
+     -12,   -12,   -12
+};
+
+/* YYDEFACT[STATE-NUM] -- Default reduction number in state STATE-NUM.
+   Performed when YYTABLE does not specify something else to do.  Zero
+   means the default is an error.  */
+static const yytype_int8 yydefact[] =
+{
+       2,     0,     1,    37,    13,    11,     0,     0,     3,     6,
+       5,     4,    34,     0,     0,    16,    15,    35,    32,     7,
+       7,     0,    38,     8,     9,     0,     0,    36,    24,    22,
+      20,    30,    28,    26,    33,    14,     7,    12,     0,     0,
+       0,     0,     0,     0,    10,     0,     0,    25,     0,    21,
+      31,     0,    27,    19,     0,     0,    23,     0,     0,     0,
+      29,    17,    18
+};
+
+/* YYPGOTO[NTERM-NUM].  */
+static const yytype_int8 yypgoto[] =
+{
+     -12,   -12,   -12,     6,    32,   -12,   -12,   -12,   -12,   -12,
+     -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,
+     -12
+};
+
+/* YYDEFGOTO[NTERM-NUM].  */
+static const yytype_int8 yydefgoto[] =
+{
+       0,     1,     8,    24,    25,     9,    14,    10,    13,    47,
+      34,    40,    39,    38,    43,    42,    41,    22,    18,    11,
+      12
+};
+
+/* YYTABLE[YYPACT[STATE-NUM]] -- What to do in state STATE-NUM.  If
+   positive, shift that token.  If negative, reduce the rule whose
+   number is the opposite.  If YYTABLE_NINF, syntax error.  */
+static const yytype_int8 yytable[] =
+{
+       2,    35,    54,     3,    15,    16,    36,    17,     4,    55,
+      28,    29,    30,    45,    19,    31,    23,    46,     5,    32,
+       6,     7,    37,    20,    33,    21,    27,    36,    48,    49,
+      57,    50,    51,    52,    53,    56,    58,    59,    60,    61,
+      62,     0,    44,     0,     0,     0,     0,     0,     0,     0,
+       0,     0,    26
+};
+
+static const yytype_int8 yycheck[] =
+{
+       0,    12,     9,     3,     9,     9,    17,     9,     8,    16,
+       5,     6,     7,     9,    11,    10,     9,    13,    18,    14,
+      20,    21,    12,    11,    19,     4,     9,    17,     9,     9,
+      15,     9,     9,     9,     9,     9,     9,     9,     9,     9,
+       9,    -1,    36,    -1,    -1,    -1,    -1,    -1,    -1,    -1,
+      -1,    -1,    20
+};
+
+/* YYSTOS[STATE-NUM] -- The symbol kind of the accessing symbol of
+   state STATE-NUM.  */
+static const yytype_int8 yystos[] =
+{
+       0,    23,     0,     3,     8,    18,    20,    21,    24,    27,
+      29,    41,    42,    30,    28,     9,     9,     9,    40,    11,
+      11,     4,    39,     9,    25,    26,    26,     9,     5,     6,
+       7,    10,    14,    19,    32,    12,    17,    12,    35,    34,
+      33,    38,    37,    36,    25,     9,    13,    31,     9,     9,
+       9,     9,     9,     9,     9,    16,     9,    15,     9,     9,
+       9,     9,     9
+};
+
+/* YYR1[RULE-NUM] -- Symbol kind of the left-hand side of rule RULE-NUM.  */
+static const yytype_int8 yyr1[] =
+{
+       0,    22,    23,    23,    24,    24,    24,    25,    25,    26,
+      26,    28,    27,    30,    29,    29,    29,    31,    31,    31,
+      33,    32,    34,    32,    35,    32,    36,    32,    37,    32,
+      38,    32,    39,    39,    40,    40,    40,    42,    41
+};
+
+/* YYR2[RULE-NUM] -- Number of symbols on the right-hand side of rule RULE-NUM.  */
+static const yytype_int8 yyr2[] =
+{
+       0,     2,     0,     2,     1,     1,     1,     0,     1,     1,
+       3,     0,     5,     0,     5,     2,     2,     4,     4,     2,
+       0,     3,     0,     4,     0,     3,     0,     3,     0,     5,
+       0,     3,     0,     2,     0,     1,     3,     0,     4
+};
+
+
+enum { YYENOMEM = -2 };
+
+#define yyerrok         (yyerrstatus = 0)
+#define yyclearin       (yychar = YYEMPTY)
+
+#define YYACCEPT        goto yyacceptlab
+#define YYABORT         goto yyabortlab
+#define YYERROR         goto yyerrorlab
+#define YYNOMEM         goto yyexhaustedlab
+
+
+#define YYRECOVERING()  (!!yyerrstatus)
+
+#define YYBACKUP(Token, Value)                                    \
+  do                                                              \
+    if (yychar == YYEMPTY)                                        \
+      {                                                           \
+        yychar = (Token);                                         \
+        yylval = (Value);                                         \
+        YYPOPSTACK (yylen);                                       \
+        yystate = *yyssp;                                         \
+        goto yybackup;                                            \
+      }                                                           \
+    else                                                          \
+      {                                                           \
+        yyerror (YY_("syntax error: cannot back up")); \
+        YYERROR;                                                  \
+      }                                                           \
+  while (0)
+
+/* Backward compatibility with an undocumented macro.
+   Use YYerror or YYUNDEF. */
+#define YYERRCODE YYUNDEF
+
+
+/* Enable debugging if requested.  */
+#if YYDEBUG
+
+# ifndef YYFPRINTF
+#  include <stdio.h> /* INFRINGES ON USER NAME SPACE */
+#  define YYFPRINTF fprintf
+# endif
+
+# define YYDPRINTF(Args)                        \
+do {                                            \
+  if (yydebug)                                  \
+    YYFPRINTF Args;                             \
+} while (0)
+
+
+
+
+# define YY_SYMBOL_PRINT(Title, Kind, Value, Location)                    \
+do {                                                                      \
+  if (yydebug)                                                            \
+    {                                                                     \
+      YYFPRINTF (stderr, "%s ", Title);                                   \
+      yy_symbol_print (stderr,                                            \
+                  Kind, Value); \
+      YYFPRINTF (stderr, "\n");                                           \
+    }                                                                     \
+} while (0)
+
+
+/*-----------------------------------.
+| Print this symbol's value on YYO.  |
+`-----------------------------------*/
+
+static void
+yy_symbol_value_print (FILE *yyo,
+                       yysymbol_kind_t yykind, YYSTYPE const * const yyvaluep)
+{
+  FILE *yyoutput = yyo;
+  YY_USE (yyoutput);
+  if (!yyvaluep)
+    return;
+  YY_IGNORE_MAYBE_UNINITIALIZED_BEGIN
+  YY_USE (yykind);
+  YY_IGNORE_MAYBE_UNINITIALIZED_END
+}
+
+
+/*---------------------------.
+| Print this symbol on YYO.  |
+`---------------------------*/
+
+static void
+yy_symbol_print (FILE *yyo,
+                 yysymbol_kind_t yykind, YYSTYPE const * const yyvaluep)
+{
+  YYFPRINTF (yyo, "%s %s (",
+             yykind < YYNTOKENS ? "token" : "nterm", yysymbol_name (yykind));
+
+  yy_symbol_value_print (yyo, yykind, yyvaluep);
+  YYFPRINTF (yyo, ")");
+}
+
+/*------------------------------------------------------------------.
+| yy_stack_print -- Print the state stack from its BOTTOM up to its |
+| TOP (included).                                                   |
+`------------------------------------------------------------------*/
+
+static void
+yy_stack_print (yy_state_t *yybottom, yy_state_t *yytop)
+{
+  YYFPRINTF (stderr, "Stack now");
+  for (; yybottom <= yytop; yybottom++)
+    {
+      int yybot = *yybottom;
+      YYFPRINTF (stderr, " %d", yybot);
+    }
+  YYFPRINTF (stderr, "\n");
+}
+
+# define YY_STACK_PRINT(Bottom, Top)                            \
+do {                                                            \
+  if (yydebug)                                                  \
+    yy_stack_print ((Bottom), (Top));                           \
+} while (0)
+
+
+/*------------------------------------------------.
+| Report that the YYRULE is going to be reduced.  |
+`------------------------------------------------*/
+
+static void
+yy_reduce_print (yy_state_t *yyssp, YYSTYPE *yyvsp,
+                 int yyrule)
+{
+  int yylno = yyrline[yyrule];
+  int yynrhs = yyr2[yyrule];
+  int yyi;
+  YYFPRINTF (stderr, "Reducing stack by rule %d (line %d):\n",
+             yyrule - 1, yylno);
+  /* The symbols being reduced.  */
+  for (yyi = 0; yyi < yynrhs; yyi++)
+    {
+      YYFPRINTF (stderr, "   $%d = ", yyi + 1);
+      yy_symbol_print (stderr,
+                       YY_ACCESSING_SYMBOL (+yyssp[yyi + 1 - yynrhs]),
+                       &yyvsp[(yyi + 1) - (yynrhs)]);
+      YYFPRINTF (stderr, "\n");
+    }
+}
+
+# define YY_REDUCE_PRINT(Rule)          \
+do {                                    \
+  if (yydebug)                          \
+    yy_reduce_print (yyssp, yyvsp, Rule); \
+} while (0)
+
+/* Nonzero means print parse trace.  It is left uninitialized so that
+   multiple parsers can coexist.  */
+int yydebug;
+#else /* !YYDEBUG */
+# define YYDPRINTF(Args) ((void) 0)
+# define YY_SYMBOL_PRINT(Title, Kind, Value, Location)
+# define YY_STACK_PRINT(Bottom, Top)
+# define YY_REDUCE_PRINT(Rule)
+#endif /* !YYDEBUG */
+
+
+/* YYINITDEPTH -- initial size of the parser's stacks.  */
+#ifndef YYINITDEPTH
+# define YYINITDEPTH 200
+#endif
+
+/* YYMAXDEPTH -- maximum size the stacks can grow to (effective only
+   if the built-in stack extension method is used).
+
+   Do not make this value too large; the results are undefined if
+   YYSTACK_ALLOC_MAXIMUM < YYSTACK_BYTES (YYMAXDEPTH)
+   evaluated with infinite-precision integer arithmetic.  */
+
+#ifndef YYMAXDEPTH
+# define YYMAXDEPTH 10000
+#endif
+
+
+
+
+
+
+/*-----------------------------------------------.
+| Release the memory associated to this symbol.  |
+`-----------------------------------------------*/
+
+static void
+yydestruct (const char *yymsg,
+            yysymbol_kind_t yykind, YYSTYPE *yyvaluep)
+{
+  YY_USE (yyvaluep);
+  if (!yymsg)
+    yymsg = "Deleting";
+  YY_SYMBOL_PRINT (yymsg, yykind, yyvaluep, yylocationp);
+
+  YY_IGNORE_MAYBE_UNINITIALIZED_BEGIN
+  YY_USE (yykind);
+  YY_IGNORE_MAYBE_UNINITIALIZED_END
+}
+
+
+/* Lookahead token kind.  */
+int yychar;
+
+/* The semantic value of the lookahead symbol.  */
+YYSTYPE yylval;
+/* Number of syntax errors so far.  */
+int yynerrs;
+
+
+
+
+/*----------.
+| yyparse.  |
+`----------*/
+
+int
+yyparse (void)
+{
+    yy_state_fast_t yystate = 0;
+    /* Number of tokens to shift before error messages enabled.  */
+    int yyerrstatus = 0;
+
+    /* Refer to the stacks through separate pointers, to allow yyoverflow
+       to reallocate them elsewhere.  */
+
+    /* Their size.  */
+    YYPTRDIFF_T yystacksize = YYINITDEPTH;
+
+    /* The state stack: array, bottom, top.  */
+    yy_state_t yyssa[YYINITDEPTH];
+    yy_state_t *yyss = yyssa;
+    yy_state_t *yyssp = yyss;
+
+    /* The semantic value stack: array, bottom, top.  */
+    YYSTYPE yyvsa[YYINITDEPTH];
+    YYSTYPE *yyvs = yyvsa;
+    YYSTYPE *yyvsp = yyvs;
+
+  int yyn;
+  /* The return value of yyparse.  */
+  int yyresult;
+  /* Lookahead symbol kind.  */
+  yysymbol_kind_t yytoken = YYSYMBOL_YYEMPTY;
+  /* The variables used to return semantic value and location from the
+     action routines.  */
+  YYSTYPE yyval;
+
+
+
+#define YYPOPSTACK(N)   (yyvsp -= (N), yyssp -= (N))
+
+  /* The number of symbols on the RHS of the reduced rule.
+     Keep to zero when no symbol should be popped.  */
+  int yylen = 0;
+
+  YYDPRINTF ((stderr, "Starting parse\n"));
+
+  yychar = YYEMPTY; /* Cause a token to be read.  */
+
+  goto yysetstate;
+
+
+/*------------------------------------------------------------.
+| yynewstate -- push a new state, which is found in yystate.  |
+`------------------------------------------------------------*/
+yynewstate:
+  /* In all cases, when you get here, the value and location stacks
+     have just been pushed.  So pushing a state here evens the stacks.  */
+  yyssp++;
+
+
+/*--------------------------------------------------------------------.
+| yysetstate -- set current state (the top of the stack) to yystate.  |
+`--------------------------------------------------------------------*/
+yysetstate:
+  YYDPRINTF ((stderr, "Entering state %d\n", yystate));
+  YY_ASSERT (0 <= yystate && yystate < YYNSTATES);
+  YY_IGNORE_USELESS_CAST_BEGIN
+  *yyssp = YY_CAST (yy_state_t, yystate);
+  YY_IGNORE_USELESS_CAST_END
+  YY_STACK_PRINT (yyss, yyssp);
+
+  if (yyss + yystacksize - 1 <= yyssp)
+#if !defined yyoverflow && !defined YYSTACK_RELOCATE
+    YYNOMEM;
+#else
+    {
+      /* Get the current used size of the three stacks, in elements.  */
+      YYPTRDIFF_T yysize = yyssp - yyss + 1;
+
+# if defined yyoverflow
+      {
+        /* Give user a chance to reallocate the stack.  Use copies of
+           these so that the &'s don't force the real ones into
+           memory.  */
+        yy_state_t *yyss1 = yyss;
+        YYSTYPE *yyvs1 = yyvs;
+
+        /* Each stack pointer address is followed by the size of the
+           data in use in that stack, in bytes.  This used to be a
+           conditional around just the two extra args, but that might
+           be undefined if yyoverflow is a macro.  */
+        yyoverflow (YY_("memory exhausted"),
+                    &yyss1, yysize * YYSIZEOF (*yyssp),
+                    &yyvs1, yysize * YYSIZEOF (*yyvsp),
+                    &yystacksize);
+        yyss = yyss1;
+        yyvs = yyvs1;
+      }
+# else /* defined YYSTACK_RELOCATE */
+      /* Extend the stack our own way.  */
+      if (YYMAXDEPTH <= yystacksize)
+        YYNOMEM;
+      yystacksize *= 2;
+      if (YYMAXDEPTH < yystacksize)
+        yystacksize = YYMAXDEPTH;
+
+      {
+        yy_state_t *yyss1 = yyss;
+        union yyalloc *yyptr =
+          YY_CAST (union yyalloc *,
+                   YYSTACK_ALLOC (YY_CAST (YYSIZE_T, YYSTACK_BYTES (yystacksize))));
+        if (! yyptr)
+          YYNOMEM;
+        YYSTACK_RELOCATE (yyss_alloc, yyss);
+        YYSTACK_RELOCATE (yyvs_alloc, yyvs);
+#  undef YYSTACK_RELOCATE
+        if (yyss1 != yyssa)
+          YYSTACK_FREE (yyss1);
+      }
+# endif
+
+      yyssp = yyss + yysize - 1;
+      yyvsp = yyvs + yysize - 1;
+
+      YY_IGNORE_USELESS_CAST_BEGIN
+      YYDPRINTF ((stderr, "Stack size increased to %ld\n",
+                  YY_CAST (long, yystacksize)));
+      YY_IGNORE_USELESS_CAST_END
+
+      if (yyss + yystacksize - 1 <= yyssp)
+        YYABORT;
+    }
+#endif /* !defined yyoverflow && !defined YYSTACK_RELOCATE */
+
+
+  if (yystate == YYFINAL)
+    YYACCEPT;
+
+  goto yybackup;
+
+
+/*-----------.
+| yybackup.  |
+`-----------*/
+yybackup:
+  /* Do appropriate processing given the current state.  Read a
+     lookahead token if we need one and don't already have one.  */
+
+  /* First try to decide what to do without reference to lookahead token.  */
+  yyn = yypact[yystate];
+  if (yypact_value_is_default (yyn))
+    goto yydefault;
+
+  /* Not known => get a lookahead token if don't already have one.  */
+
+  /* YYCHAR is either empty, or end-of-input, or a valid lookahead.  */
+  if (yychar == YYEMPTY)
+    {
+      YYDPRINTF ((stderr, "Reading a token\n"));
+      yychar = yylex ();
+    }
+
+  if (yychar <= YYEOF)
+    {
+      yychar = YYEOF;
+      yytoken = YYSYMBOL_YYEOF;
+      YYDPRINTF ((stderr, "Now at end of input.\n"));
+    }
+  else if (yychar == YYerror)
+    {
+      /* The scanner already issued an error message, process directly
+         to error recovery.  But do not keep the error token as
+         lookahead, it is too special and may lead us to an endless
+         loop in error recovery. */
+      yychar = YYUNDEF;
+      yytoken = YYSYMBOL_YYerror;
+      goto yyerrlab1;
+    }
+  else
+    {
+      yytoken = YYTRANSLATE (yychar);
+      YY_SYMBOL_PRINT ("Next token is", yytoken, &yylval, &yylloc);
+    }
+
+  /* If the proper action on seeing token YYTOKEN is to reduce or to
+     detect an error, take that action.  */
+  yyn += yytoken;
+  if (yyn < 0 || YYLAST < yyn || yycheck[yyn] != yytoken)
+    goto yydefault;
+  yyn = yytable[yyn];
+  if (yyn <= 0)
+    {
+      if (yytable_value_is_error (yyn))
+        goto yyerrlab;
+      yyn = -yyn;
+      goto yyreduce;
+    }
+
+  /* Count tokens shifted since error; after three, turn off error
+     status.  */
+  if (yyerrstatus)
+    yyerrstatus--;
+
+  /* Shift the lookahead token.  */
+  YY_SYMBOL_PRINT ("Shifting", yytoken, &yylval, &yylloc);
+  yystate = yyn;
+  YY_IGNORE_MAYBE_UNINITIALIZED_BEGIN
+  *++yyvsp = yylval;
+  YY_IGNORE_MAYBE_UNINITIALIZED_END
+
+  /* Discard the shifted token.  */
+  yychar = YYEMPTY;
+  goto yynewstate;
+
+
+/*-----------------------------------------------------------.
+| yydefault -- do the default action for the current state.  |
+`-----------------------------------------------------------*/
+yydefault:
+  yyn = yydefact[yystate];
+  if (yyn == 0)
+    goto yyerrlab;
+  goto yyreduce;
+
+
+/*-----------------------------.
+| yyreduce -- do a reduction.  |
+`-----------------------------*/
+yyreduce:
+  /* yyn is the number of a rule to reduce with.  */
+  yylen = yyr2[yyn];
+
+  /* If YYLEN is nonzero, implement the default value of the action:
+     '$$ = $1'.
+
+     Otherwise, the following line sets YYVAL to garbage.
+     This behavior is undocumented and Bison
+     users should not rely upon it.  Assigning to YYVAL
+     unconditionally makes the parser a bit smaller, and it avoids a
+     GCC warning that YYVAL may be used uninitialized.  */
+  yyval = yyvsp[1-yylen];
+
+
+  YY_REDUCE_PRINT (yyn);
+  switch (yyn)
+    {
+  case 8: /* list_item: STRING  */
+#line 89 "grammar.y"
+        {
+		assert(vec != NULL);
+		vec_append(vec, (yyvsp[0].c_string));
+	}
+#line 1291 "y.tab.c"
+    break;
+
+  case 11: /* $@1: %empty  */
+#line 102 "grammar.y"
+        {
+		assert(vec == NULL);
+		vec = vec_init(512);
+		if (vec == NULL) {
+			errx(1, "could not allocate CMD vector");
+		}
+	}
+#line 1303 "y.tab.c"
+    break;
+
+  case 12: /* cmd_def: CMD $@1 OPEN_SQUARE_BRACKET list CLOSE_SQUARE_BRACKET  */
+#line 110 "grammar.y"
+        {
+		struct build_manifest *bmp;
+		char *cmd_string;
+
+		bmp = get_current_build_manifest();
+		vec_finalize(vec);
+		cmd_string = vec_join(vec, ' ');
+		if (cmd_string == NULL) {
+			bmp->entry_point_args = "";
+		} else {
+			bmp->entry_point_args = strdup(cmd_string);
+		}
+		if (bmp->entry_point_args == NULL) {
+			err(1, "strdup: entrypoint failed");
+		}
+		if (cmd_string != NULL) {
+			free(cmd_string);
+		}
+		vec_free(vec);
+		vec = NULL;
+	}
+#line 1329 "y.tab.c"
+    break;
+
+  case 13: /* $@2: %empty  */
+#line 135 "grammar.y"
+        {
+		assert(vec == NULL);
+		vec = vec_init(512);
+	}
+#line 1338 "y.tab.c"
+    break;
+
+  case 14: /* entry_def: ENTRYPOINT $@2 OPEN_SQUARE_BRACKET list CLOSE_SQUARE_BRACKET  */
+#line 140 "grammar.y"
+        {
+		struct build_manifest *bmp;
+		char *cmd_string;
+
+		vec_finalize(vec);
+		cmd_string = vec_join(vec, ' ');
+		bmp = get_current_build_manifest();
+		if (bmp->entry_point != NULL) {
+			errx(1, "ENTRPOINT: only one entry point per build specification");
+		}
+		bmp->entry_point = strdup(cmd_string);
+		if (bmp->entry_point == NULL) {
+			err(1, "strdup: entrypoint failed");
+		}
+		free(cmd_string);
+		vec_free(vec);
+		vec = NULL;
+        }
+#line 1361 "y.tab.c"
+    break;
+
+  case 15: /* entry_def: AUDITCFG STRING  */
+#line 159 "grammar.y"
+        {
+		struct build_manifest *bmp;
+		struct au_class_ent *acp;
+		char *ap, *bp, *copy;
+
+		bmp = get_current_build_manifest();
+		if (bmp->auditcfg != NULL) {
+			errx(1, "AUDITCFG: has already been specified");
+		}
+		bmp->auditcfg = strdup((yyvsp[0].c_string));
+		if (bmp->auditcfg == NULL) {
+			err(1, "failed to dup audit config");
+		}
+		copy = strdup((yyvsp[0].c_string));
+		bp = copy;
+		/*
+		 * Maybe we should make this into an actual list instead
+		 * of a string?
+		 */
+		while ((ap = strsep(&copy, ",")) != NULL) {
+			if (strlen(ap) == 0) {
+				continue;
+			}
+			acp = getauclassnam(ap);
+			if (acp == NULL) {
+				errx(1, "invalid audit class name: %s", ap);
+			}
+		}
+		free(bp);
+	}
+#line 1396 "y.tab.c"
+    break;
+
+  case 16: /* entry_def: OSRELEASE STRING  */
+#line 190 "grammar.y"
+        {
+		struct build_manifest *bmp;
+
+		bmp = get_current_build_manifest();
+		if (bmp->osrelease != NULL) {
+			errx(1, "OSRELEASE: has already been specified");
+		}
+		bmp->osrelease = strdup((yyvsp[0].c_string));
+		if (bmp->osrelease == NULL) {
+			err(1, "failed to dup os release");
+		}
+        }
+#line 1413 "y.tab.c"
+    break;
+
+  case 17: /* copy_spec: COPY_FROM STRING STRING STRING  */
+#line 206 "grammar.y"
+        {
+		struct build_manifest *bmp;
+		struct build_step *b_step;
+		struct build_stage *bsp;
+		int match;
+
+		assert(cur_build_step != NULL);
+		assert(cur_build_stage != NULL);
+		b_step = cur_build_step;
+		b_step->step_op = STEP_COPY_FROM;
+		match = 0;
+		bmp = get_current_build_manifest();
+		assert(bmp != NULL);
+		assert(!TAILQ_EMPTY(&bmp->stage_head));
+		TAILQ_FOREACH(bsp, &bmp->stage_head, stage_glue) {
+			if (strcmp((yyvsp[-2].c_string), bsp->bs_name) == 0) {
+				match = 1;
+				b_step->step_data.step_copy_from.sc_stage =
+				    bsp->bs_index;
+			}
+		}
+		if (!match) {
+			errx(1, "stage specification %sdoes not exist", (yyvsp[-2].c_string));
+		}
+		strlcpy(b_step->step_data.step_copy_from.sc_source, (yyvsp[-1].c_string),
+		    sizeof(b_step->step_data.step_copy_from.sc_source));
+		strlcpy(b_step->step_data.step_copy_from.sc_dest, (yyvsp[0].c_string),
+		    sizeof(b_step->step_data.step_copy_from.sc_dest));
+		cur_build_step->stage_index = stage_counter;
+		snprintf(b_step->step_string, sizeof(b_step->step_string),
+		    "COPY --FROM %s %s %s", (yyvsp[-2].c_string), (yyvsp[-1].c_string), (yyvsp[0].c_string));
+		bsp = cur_build_stage;
+		TAILQ_INSERT_HEAD(&bsp->step_head, b_step, step_glue);
+	}
+#line 1452 "y.tab.c"
+    break;
+
+  case 18: /* copy_spec: COPY_FROM INTEGER STRING STRING  */
+#line 241 "grammar.y"
+        {
+		struct build_manifest *bmp;
+		struct build_step *b_step;
+		struct build_stage *bsp;
+		int match;
+
+		assert(cur_build_step != NULL);
+		assert(cur_build_stage != NULL);
+		b_step = cur_build_step;
+		b_step->step_op = STEP_COPY_FROM;
+		b_step->step_data.step_copy_from.sc_stage = (yyvsp[-2].num);
+		match = 0;
+		bmp = get_current_build_manifest();
+		assert(bmp != NULL);
+		assert(!TAILQ_EMPTY(&bmp->stage_head));
+		TAILQ_FOREACH(bsp, &bmp->stage_head, stage_glue) {
+			if (b_step->step_data.step_copy_from.sc_stage ==
+			    bsp->bs_index) {
+				match = 1;
+			}
+		}
+		if (!match) {
+			errx(1, "stage specification %d does not exist", (yyvsp[-2].num));
+		}
+		strlcpy(b_step->step_data.step_copy_from.sc_source, (yyvsp[-1].c_string),
+		    sizeof(b_step->step_data.step_copy_from.sc_source));
+		strlcpy(b_step->step_data.step_copy_from.sc_dest, (yyvsp[0].c_string),
+		    sizeof(b_step->step_data.step_copy_from.sc_dest));
+		cur_build_step->stage_index = stage_counter;
+		snprintf(b_step->step_string, sizeof(b_step->step_string),
+		    "COPY --FROM %d %s %s", (yyvsp[-2].num), (yyvsp[-1].c_string), (yyvsp[0].c_string));
+		bsp = cur_build_stage;
+		TAILQ_INSERT_HEAD(&bsp->step_head, b_step, step_glue);
+	}
+#line 1491 "y.tab.c"
+    break;
+
+  case 19: /* copy_spec: STRING STRING  */
+#line 276 "grammar.y"
+        {
+		struct build_step *b_step;
+		struct build_stage *bsp;
+
+		assert(cur_build_step != NULL);
+		assert(cur_build_stage != NULL);
+		bsp = cur_build_stage;
+		b_step = cur_build_step;
+		strlcpy(b_step->step_data.step_copy.sc_source, (yyvsp[-1].c_string),
+		    sizeof(b_step->step_data.step_copy.sc_source));
+		strlcpy(b_step->step_data.step_copy.sc_dest, (yyvsp[0].c_string),
+		    sizeof(b_step->step_data.step_copy.sc_dest));
+		cur_build_step->stage_index = stage_counter;
+		snprintf(b_step->step_string, sizeof(b_step->step_string),
+		    "COPY %s %s", (yyvsp[-1].c_string), (yyvsp[0].c_string));
+		TAILQ_INSERT_HEAD(&bsp->step_head, b_step, step_glue);
+		cur_build_step = NULL;
+	}
+#line 1514 "y.tab.c"
+    break;
+
+  case 20: /* $@3: %empty  */
+#line 298 "grammar.y"
+        {
+		struct build_step *b_step;
+
+		b_step = calloc(1, sizeof(*b_step));
+		if (b_step == NULL) {
+			err(1, "calloc(build step) faild");
+		}
+		b_step->step_op = STEP_RUN;
+		cur_build_step = b_step;
+	}
+#line 1529 "y.tab.c"
+    break;
+
+  case 21: /* op_spec: RUN $@3 STRING  */
+#line 309 "grammar.y"
+        {
+		struct build_step *b_step;
+		struct build_stage *bsp;
+
+		assert(cur_build_step != NULL);
+		assert(cur_build_stage != NULL);
+		bsp = cur_build_stage;
+		b_step = cur_build_step;
+		strlcpy(b_step->step_data.step_cmd, (yyvsp[0].c_string),
+		    sizeof(b_step->step_data.step_cmd));
+		cur_build_step->stage_index = stage_counter;
+		snprintf(b_step->step_string,
+		    sizeof(b_step->step_string), "RUN %s", (yyvsp[0].c_string));
+		TAILQ_INSERT_HEAD(&bsp->step_head, b_step, step_glue);
+		cur_build_step = NULL;
+	}
+#line 1550 "y.tab.c"
+    break;
+
+  case 22: /* $@4: %empty  */
+#line 326 "grammar.y"
+        {
+		struct build_step *b_step;
+
+		b_step = calloc(1, sizeof(*b_step));
+		if (b_step == NULL) {
+			err(1, "calloc(build step) faild");
+		}
+		b_step->step_op = STEP_ADD;
+		cur_build_step = b_step;
+	}
+#line 1565 "y.tab.c"
+    break;
+
+  case 23: /* op_spec: ADD $@4 STRING STRING  */
+#line 337 "grammar.y"
+        {
+		char **pattern_list, *pat;
+		struct build_step *b_step;
+		struct build_stage *bsp;
+		int match;
+
+		bsp = cur_build_stage;
+		b_step = cur_build_step;
+		snprintf(b_step->step_string, sizeof(b_step->step_string),
+		    "ADD %s %s", (yyvsp[-1].c_string), (yyvsp[0].c_string));
+		/*
+		 * Set the ADD operation to ADD_TYPE_FILE (basic copy) by
+		 * default. We will look at the source operands and change
+		 * it accordinly as need be.
+		 */
+		b_step->step_data.step_add.sa_op = ADD_TYPE_FILE;
+		strlcpy(b_step->step_data.step_add.sa_source, (yyvsp[-1].c_string),
+		    sizeof(b_step->step_data.step_add.sa_source));
+		strlcpy(b_step->step_data.step_add.sa_dest, (yyvsp[0].c_string),
+		    sizeof(b_step->step_data.step_add.sa_dest));
+		/*
+		 * Is this a URL that will need to be fectched?
+		 */
+		if (strncasecmp("http://", (yyvsp[-1].c_string), 7) == 0) {
+			b_step->step_data.step_add.sa_op = ADD_TYPE_URL;
+		} else if (strncasecmp("https://", (yyvsp[-1].c_string), 8) == 0) {
+			b_step->step_data.step_add.sa_op = ADD_TYPE_URL;
+		}
+		/*
+		 * Does the source operand match an tar acrchive name that
+		 * we support? If so, handle is an a tar achive that will
+		 * need to be extracted.
+		 */
+		pattern_list = archive_extensions;
+		match = 0;
+		while ((pat = *pattern_list++)) {
+			if (!fnmatch(pat, (yyvsp[-1].c_string), FNM_CASEFOLD)) {
+				match = 1;
+				break;
+			}
+		}
+		if (match) {
+			if (b_step->step_data.step_add.sa_op == ADD_TYPE_URL) {
+				b_step->step_data.step_add.sa_op = ADD_TYPE_ARCHIVE_URL;
+			} else {
+				b_step->step_data.step_add.sa_op = ADD_TYPE_ARCHIVE;
+			}
+		}
+		cur_build_step->stage_index = stage_counter;
+		TAILQ_INSERT_HEAD(&bsp->step_head, b_step, step_glue);
+		cur_build_step = NULL;
+	}
+#line 1622 "y.tab.c"
+    break;
+
+  case 24: /* $@5: %empty  */
+#line 390 "grammar.y"
+        {
+		struct build_step *b_step;
+
+		b_step = calloc(1, sizeof(*b_step));
+		if (b_step == NULL) {
+			err(1, "calloc(build step) faild");
+		}
+		b_step->step_op = STEP_COPY;
+		cur_build_step = b_step;
+	}
+#line 1637 "y.tab.c"
+    break;
+
+  case 26: /* $@6: %empty  */
+#line 401 "grammar.y"
+        {
+		struct build_step *b_step;
+
+		b_step = calloc(1, sizeof(*b_step));
+		if (b_step == NULL) {
+			err(1, "calloc(build step) faild");
+		}
+		b_step->step_op = STEP_ROOT_PIVOT;
+		cur_build_step = b_step;
+	}
+#line 1652 "y.tab.c"
+    break;
+
+  case 27: /* op_spec: ROOTPIVOT $@6 STRING  */
+#line 412 "grammar.y"
+        {
+		struct build_step *b_step;
+		struct build_stage *bsp;
+
+		b_step = cur_build_step;
+		bsp = cur_build_stage;
+		assert(b_step != NULL);
+		assert(bsp != NULL);
+		strlcpy(b_step->step_data.step_root_pivot.sr_dir,
+                    (yyvsp[0].c_string), sizeof(b_step->step_data.step_root_pivot.sr_dir));
+		cur_build_step->stage_index = stage_counter;
+		snprintf(b_step->step_string, sizeof(b_step->step_string),
+		    "ROOTPIVOT %s", (yyvsp[0].c_string));
+		TAILQ_INSERT_HEAD(&bsp->step_head, b_step, step_glue);
+		cur_build_step = NULL;
+	}
+#line 1673 "y.tab.c"
+    break;
+
+  case 28: /* $@7: %empty  */
+#line 429 "grammar.y"
+        {
+		struct build_step *b_step;
+
+		b_step = calloc(1, sizeof(*b_step));
+		if (b_step == NULL) {
+			err(1, "calloc(build step) faild");
+		}
+		b_step->step_op = STEP_ENV;
+		cur_build_step = b_step;
+	}
+#line 1688 "y.tab.c"
+    break;
+
+  case 29: /* op_spec: ENV $@7 STRING EQ STRING  */
+#line 439 "grammar.y"
+        {
+		struct build_step *b_step;
+		struct build_stage *bsp;
+
+                b_step = cur_build_step;
+                bsp = cur_build_stage;
+                assert(b_step != NULL);
+                assert(bsp != NULL);
+                strlcpy(b_step->step_data.step_env.se_key,
+		    (yyvsp[-2].c_string), sizeof(b_step->step_data.step_env.se_key));
+		strlcpy(b_step->step_data.step_env.se_value,
+		    (yyvsp[0].c_string), sizeof(b_step->step_data.step_env.se_value));
+		cur_build_step->stage_index = stage_counter;
+		snprintf(b_step->step_string, sizeof(b_step->step_string),
+		    "ENV %s=%s", (yyvsp[-2].c_string), (yyvsp[0].c_string));
+		TAILQ_INSERT_HEAD(&bsp->step_head, b_step, step_glue);
+		cur_build_step = NULL;
+	}
+#line 1711 "y.tab.c"
+    break;
+
+  case 30: /* $@8: %empty  */
+#line 458 "grammar.y"
+        {
+		struct build_step *b_step;
+
+		b_step = calloc(1, sizeof(*b_step));
+		if (b_step == NULL) {
+			err(1, "calloc(build step) faild");
+		}
+		b_step->step_op = STEP_WORKDIR;
+		cur_build_step = b_step;
+	}
+#line 1726 "y.tab.c"
+    break;
+
+  case 31: /* op_spec: WORKDIR $@8 STRING  */
+#line 469 "grammar.y"
+        {
+		struct build_step *b_step;
+		struct build_stage *bsp;
+
+		b_step = cur_build_step;
+		bsp = cur_build_stage;
+		assert(b_step != NULL);
+		assert(bsp != NULL);
+		strlcpy(b_step->step_data.step_workdir.sw_dir,
+		    (yyvsp[0].c_string), sizeof(b_step->step_data.step_workdir.sw_dir));
+		cur_build_step->stage_index = stage_counter;
+		snprintf(b_step->step_string, sizeof(b_step->step_string),
+		    "WORKDIR %s", (yyvsp[0].c_string));
+		TAILQ_INSERT_HEAD(&bsp->step_head, b_step, step_glue);
+		cur_build_step = NULL;
+	}
+#line 1747 "y.tab.c"
+    break;
+
+  case 35: /* from_spec: STRING  */
+#line 493 "grammar.y"
+        {
+		struct build_stage *bsp;
+
+		bsp = cur_build_stage;
+		assert(bsp != NULL);
+		strlcpy(bsp->bs_base_container, (yyvsp[0].c_string),
+		    sizeof(bsp->bs_base_container));
+	}
+#line 1760 "y.tab.c"
+    break;
+
+  case 36: /* from_spec: STRING AS STRING  */
+#line 502 "grammar.y"
+        {
+		struct build_stage *bsp;
+
+		bsp = cur_build_stage;
+		assert(bsp != NULL);
+		strlcpy(bsp->bs_name, (yyvsp[0].c_string), sizeof(bsp->bs_name));
+		strlcpy(bsp->bs_base_container, (yyvsp[-2].c_string),
+		    sizeof(bsp->bs_base_container));
+	}
+#line 1774 "y.tab.c"
+    break;
+
+  case 37: /* $@9: %empty  */
+#line 515 "grammar.y"
+        {
+		struct build_stage *bsp;
+
+		bsp = calloc(1, sizeof(*bsp));
+		if (bsp == NULL) {
+			err(1, "calloc(build stage) failed");
+		}
+		cur_build_stage = bsp;
+	}
+#line 1788 "y.tab.c"
+    break;
+
+  case 38: /* stage_def: FROM $@9 from_spec operations  */
+#line 525 "grammar.y"
+        {
+		struct build_manifest *bmp;
+		struct build_stage *bsp;
+
+		bmp = get_current_build_manifest();
+		bsp = cur_build_stage;
+		bsp->bs_index = stage_counter++;
+		TAILQ_INSERT_HEAD(&bmp->stage_head, bsp, stage_glue);
+		cur_build_stage = NULL;
+	}
+#line 1803 "y.tab.c"
+    break;
+
+
+#line 1807 "y.tab.c"
+
+      default: break;
+    }
+  /* User semantic actions sometimes alter yychar, and that requires
+     that yytoken be updated with the new translation.  We take the
+     approach of translating immediately before every use of yytoken.
+     One alternative is translating here after every semantic action,
+     but that translation would be missed if the semantic action invokes
+     YYABORT, YYACCEPT, or YYERROR immediately after altering yychar or
+     if it invokes YYBACKUP.  In the case of YYABORT or YYACCEPT, an
+     incorrect destructor might then be invoked immediately.  In the
+     case of YYERROR or YYBACKUP, subsequent parser actions might lead
+     to an incorrect destructor call or verbose syntax error message
+     before the lookahead is translated.  */
+  YY_SYMBOL_PRINT ("-> $$ =", YY_CAST (yysymbol_kind_t, yyr1[yyn]), &yyval, &yyloc);
+
+  YYPOPSTACK (yylen);
+  yylen = 0;
+
+  *++yyvsp = yyval;
+
+  /* Now 'shift' the result of the reduction.  Determine what state
+     that goes to, based on the state we popped back to and the rule
+     number reduced by.  */
+  {
+    const int yylhs = yyr1[yyn] - YYNTOKENS;
+    const int yyi = yypgoto[yylhs] + *yyssp;
+    yystate = (0 <= yyi && yyi <= YYLAST && yycheck[yyi] == *yyssp
+               ? yytable[yyi]
+               : yydefgoto[yylhs]);
+  }
+
+  goto yynewstate;
+
+
+/*--------------------------------------.
+| yyerrlab -- here on detecting error.  |
+`--------------------------------------*/
+yyerrlab:
+  /* Make sure we have latest lookahead translation.  See comments at
+     user semantic actions for why this is necessary.  */
+  yytoken = yychar == YYEMPTY ? YYSYMBOL_YYEMPTY : YYTRANSLATE (yychar);
+  /* If not already recovering from an error, report this error.  */
+  if (!yyerrstatus)
+    {
+      ++yynerrs;
+      yyerror (YY_("syntax error"));
+    }
+
+  if (yyerrstatus == 3)
+    {
+      /* If just tried and failed to reuse lookahead token after an
+         error, discard it.  */
+
+      if (yychar <= YYEOF)
+        {
+          /* Return failure if at end of input.  */
+          if (yychar == YYEOF)
+            YYABORT;
+        }
+      else
+        {
+          yydestruct ("Error: discarding",
+                      yytoken, &yylval);
+          yychar = YYEMPTY;
+        }
+    }
+
+  /* Else will try to reuse lookahead token after shifting the error
+     token.  */
+  goto yyerrlab1;
+
+
+/*---------------------------------------------------.
+| yyerrorlab -- error raised explicitly by YYERROR.  |
+`---------------------------------------------------*/
+yyerrorlab:
+  /* Pacify compilers when the user code never invokes YYERROR and the
+     label yyerrorlab therefore never appears in user code.  */
+  if (0)
+    YYERROR;
+  ++yynerrs;
+
+  /* Do not reclaim the symbols of the rule whose action triggered
+     this YYERROR.  */
+  YYPOPSTACK (yylen);
+  yylen = 0;
+  YY_STACK_PRINT (yyss, yyssp);
+  yystate = *yyssp;
+  goto yyerrlab1;
+
+
+/*-------------------------------------------------------------.
+| yyerrlab1 -- common code for both syntax error and YYERROR.  |
+`-------------------------------------------------------------*/
+yyerrlab1:
+  yyerrstatus = 3;      /* Each real token shifted decrements this.  */
+
+  /* Pop stack until we find a state that shifts the error token.  */
+  for (;;)
+    {
+      yyn = yypact[yystate];
+      if (!yypact_value_is_default (yyn))
+        {
+          yyn += YYSYMBOL_YYerror;
+          if (0 <= yyn && yyn <= YYLAST && yycheck[yyn] == YYSYMBOL_YYerror)
+            {
+              yyn = yytable[yyn];
+              if (0 < yyn)
+                break;
+            }
+        }
+
+      /* Pop the current state because it cannot handle the error token.  */
+      if (yyssp == yyss)
+        YYABORT;
+
+
+      yydestruct ("Error: popping",
+                  YY_ACCESSING_SYMBOL (yystate), yyvsp);
+      YYPOPSTACK (1);
+      yystate = *yyssp;
+      YY_STACK_PRINT (yyss, yyssp);
+    }
+
+  YY_IGNORE_MAYBE_UNINITIALIZED_BEGIN
+  *++yyvsp = yylval;
+  YY_IGNORE_MAYBE_UNINITIALIZED_END
+
+
+  /* Shift the error token.  */
+  YY_SYMBOL_PRINT ("Shifting", YY_ACCESSING_SYMBOL (yyn), yyvsp, yylsp);
+
+  yystate = yyn;
+  goto yynewstate;
+
+
+/*-------------------------------------.
+| yyacceptlab -- YYACCEPT comes here.  |
+`-------------------------------------*/
+yyacceptlab:
+  yyresult = 0;
+  goto yyreturnlab;
+
+
+/*-----------------------------------.
+| yyabortlab -- YYABORT comes here.  |
+`-----------------------------------*/
+yyabortlab:
+  yyresult = 1;
+  goto yyreturnlab;
+
+
+/*-----------------------------------------------------------.
+| yyexhaustedlab -- YYNOMEM (memory exhaustion) comes here.  |
+`-----------------------------------------------------------*/
+yyexhaustedlab:
+  yyerror (YY_("memory exhausted"));
+  yyresult = 2;
+  goto yyreturnlab;
+
+
+/*----------------------------------------------------------.
+| yyreturnlab -- parsing is finished, clean up and return.  |
+`----------------------------------------------------------*/
+yyreturnlab:
+  if (yychar != YYEMPTY)
+    {
+      /* Make sure we have latest lookahead translation.  See comments at
+         user semantic actions for why this is necessary.  */
+      yytoken = YYTRANSLATE (yychar);
+      yydestruct ("Cleanup: discarding lookahead",
+                  yytoken, &yylval);
+    }
+  /* Do not reclaim the symbols of the rule whose action triggered
+     this YYABORT or YYACCEPT.  */
+  YYPOPSTACK (yylen);
+  YY_STACK_PRINT (yyss, yyssp);
+  while (yyssp != yyss)
+    {
+      yydestruct ("Cleanup: popping",
+                  YY_ACCESSING_SYMBOL (+*yyssp), yyvsp);
+      YYPOPSTACK (1);
+    }
+#ifndef yyoverflow
+  if (yyss != yyssa)
+    YYSTACK_FREE (yyss);
+#endif
+
+  return yyresult;
+}
+
+#line 536 "grammar.y"
+
+
+struct build_manifest *
+build_manifest_init(void)
+{
+	struct build_manifest *bmp;
+
+	bmp = calloc(1, sizeof(*bmp));
+	if (bmp == NULL) {
+		err(1, "calloc(build_manifest_init) failed");
+	}
+	bmp->entry_point = NULL;
+	bmp->entry_point_args = NULL;
+	TAILQ_INIT(&bmp->stage_head);
+	return (bmp);
+}
+
+void
+set_current_build_manifest(struct build_manifest *bmp)
+{
+
+	cur_build_manifest = bmp;
+}
+
+struct build_manifest *
+get_current_build_manifest(void)
+{
+
+	assert(cur_build_manifest != NULL);
+	return (cur_build_manifest);
+}
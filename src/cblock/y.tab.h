@@ -0,0 +1,128 @@
+/* A Bison parser, made by GNU Bison 3.8.2.  */
+
+/* Bison interface for Yacc-like parsers in C
+
+   Copyright (C) 1984, 1989-1990, 2000-2015, 2018-2021 Free Software Foundation,
+   Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+/* As a special exception, you may create a larger work that contains
+   part or all of the Bison parser skeleton and distribute that work
+   under terms of your choice, so long as that work isn't itself a
+   parser generator using the skeleton or a modified version thereof
+   as a parser skeleton.  Alternatively, if you modify or redistribute
+   the parser skeleton itself, you may (at your option) remove this
+   special exception, which will cause the skeleton and the resulting
+   Bison output files to be licensed under the GNU General Public
+   License without this special exception.
+
+   This special exception was added by the Free Software Foundation in
+   version 2.2 of Bison.  */
+
+/* DO NOT RELY ON FEATURES THAT ARE NOT DOCUMENTED in the manual,
+   especially those whose name start with YY_ or yy_.  They are
+   private implementation details that can be changed or removed.  */
+
+#ifndef YY_YY_Y_TAB_H_INCLUDED
+# define YY_YY_Y_TAB_H_INCLUDED
+/* Debug traces.  */
+#ifndef YYDEBUG
+# define YYDEBUG 0
+#endif
+#if YYDEBUG
+extern int yydebug;
+#endif
+
+/* Token kinds.  */
+#ifndef YYTOKENTYPE
+# define YYTOKENTYPE
+  enum yytokentype
+  {
+    YYEMPTY = -2,
+    YYEOF = 0,                     /* "end of file"  */
+    YYerror = 256,                 /* error  */
+    YYUNDEF = 257,                 /* "invalid token"  */
+    FROM = 258,                    /* FROM  */
+    AS = 259,                      /* AS  */
+    COPY = 260,                    /* COPY  */
+    ADD = 261,                     /* ADD  */
+    RUN = 262,                     /* RUN  */
+    ENTRYPOINT = 263,              /* ENTRYPOINT  */
+    STRING = 264,                  /* STRING  */
+    WORKDIR = 265,                 /* WORKDIR  */
+    OPEN_SQUARE_BRACKET = 266,     /* OPEN_SQUARE_BRACKET  */
+    CLOSE_SQUARE_BRACKET = 267,    /* CLOSE_SQUARE_BRACKET  */
+    COPY_FROM = 268,               /* COPY_FROM  */
+    ENV = 269,                     /* ENV  */
+    EQ = 270,                      /* EQ  */
+    INTEGER = 271,                 /* INTEGER  */
+    COMMA = 272,                   /* COMMA  */
+    CMD = 273,                     /* CMD  */
+    ROOTPIVOT = 274,               /* ROOTPIVOT  */
+    OSRELEASE = 275,               /* OSRELEASE  */
+    AUDITCFG = 276                 /* AUDITCFG  */
+  };
+  typedef enum yytokentype yytoken_kind_t;
+#endif
+/* Token kinds.  */
+#define YYEMPTY -2
+#define YYEOF 0
+#define YYerror 256
+#define YYUNDEF 257
+#define FROM 258
+#define AS 259
+#define COPY 260
+#define ADD 261
+#define RUN 262
+#define ENTRYPOINT 263
+#define STRING 264
+#define WORKDIR 265
+#define OPEN_SQUARE_BRACKET 266
+#define CLOSE_SQUARE_BRACKET 267
+#define COPY_FROM 268
+#define ENV 269
+#define EQ 270
+#define INTEGER 271
+#define COMMA 272
+#define CMD 273
+#define ROOTPIVOT 274
+#define OSRELEASE 275
+#define AUDITCFG 276
+
+/* Value type.  */
+#if ! defined YYSTYPE && ! defined YYSTYPE_IS_DECLARED
+union YYSTYPE
+{
+#line 63 "grammar.y"
+
+	uint32_t	 num;
+        char		*c_string;
+
+#line 114 "y.tab.h"
+
+};
+typedef union YYSTYPE YYSTYPE;
+# define YYSTYPE_IS_TRIVIAL 1
+# define YYSTYPE_IS_DECLARED 1
+#endif
+
+
+extern YYSTYPE yylval;
+
+
+int yyparse (void);
+
+
+#endif /* !YY_YY_Y_TAB_H_INCLUDED  */
@@ -30,8 +30,11 @@
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
+#ifdef __FreeBSD__
 #include <sys/ttycom.h>
+#endif
 
+#include <poll.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <pthread.h>
@@ -43,7 +46,11 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <termios.h>
+#ifdef __FreeBSD__
 #include <libutil.h>
+#else
+#include <pty.h>
+#endif
 #include <signal.h>
 #include <string.h>
 
@@ -53,19 +60,38 @@
 #include "cblock.h"
 #include "sock_ipc.h"
 #include "config.h"
+#include "stats.h"
 
 #include "probes.h"
 
 #include <cblock/libcblock.h>
 
+#include "journal.h"
+#include "trace.h"
+#include "cache.h"
+#include "context.h"
+#include "fim.h"
+#include "report.h"
+#include "peer.h"
+#include "fetch.h"
+#include "buildq.h"
+
 TAILQ_HEAD( , build_context) bc_head;
 
-struct build_copy_from {
-        int                             stage;
-        vec_t                           *pathv;
-        TAILQ_ENTRY(build_copy_from)    glue;
+struct build_job {
+	int				bj_state;
+#define	BUILD_JOB_PENDING	0
+#define	BUILD_JOB_RUNNING	1
+#define	BUILD_JOB_DONE		2
+#define	BUILD_JOB_FAILED	3
+#define	BUILD_JOB_CANCELLED	4
+	pid_t				bj_pid;
+	int				bj_fd;
+	char				bj_prefix[MAXPATHLEN + 2];
+	char				bj_buf[4096];
+	size_t				bj_len;
+	char				bj_peer[MAXHOSTNAMELEN + 8];
 };
-typedef TAILQ_HEAD( , build_copy_from) build_copy_from_t;
 
 pid_t
 waitpid_ignore_intr(pid_t pid, int *status)
@@ -84,13 +110,63 @@ waitpid_ignore_intr(pid_t pid, int *status)
 	return (rpid);
 }
 
+/*
+ * The name fetch(1) would give what it fetches from a URL: the last
+ * component of its path.
+ */
+static void
+build_url_name(const char *url, char *buf, size_t len)
+{
+	const char *p, *name;
+	size_t n;
+
+	p = strstr(url, "://");
+	p = p != NULL ? p + 3 : url;
+	p += strcspn(p, "/?#");
+	for (name = p; *p != '\0' && *p != '?' && *p != '#'; p++) {
+		if (*p == '/') {
+			name = p + 1;
+		}
+	}
+	n = p - name;
+	if (n == 0 || n >= len) {
+		(void) snprintf(buf, len, "index.html");
+		return;
+	}
+	memcpy(buf, name, n);
+	buf[n] = '\0';
+}
+
 static int
 build_emit_add_instruction(struct build_step *bsp, FILE *fp)
 {
 	struct build_step_add *sap;
+	char name[MAXPATHLEN];
 
 	assert(bsp->step_op == STEP_ADD);
 	sap = &bsp->step_data.step_add;
+	/*
+	 * URLs have been resolved by fetch_prefetch, copy their content from
+	 * the build's fetch directory.
+	 */
+	if (bsp->step_digest[0] != '\0') {
+		switch (sap->sa_op) {
+		case ADD_TYPE_URL:
+			build_url_name(sap->sa_source, name, sizeof(name));
+			fprintf(fp, "if [ -d %s ]; then\n"
+			    "    cp -p \"%s/%s\" %s/%s\n"
+			    "else\n"
+			    "    cp -p \"%s/%s\" %s\n"
+			    "fi\n", sap->sa_dest,
+			    FETCH_STAGE_DIR, bsp->step_digest, sap->sa_dest, name,
+			    FETCH_STAGE_DIR, bsp->step_digest, sap->sa_dest);
+			return (0);
+		case ADD_TYPE_ARCHIVE_URL:
+			fprintf(fp, "tar -C %s -zpxf \"%s/%s\"\n",
+			    sap->sa_dest, FETCH_STAGE_DIR, bsp->step_digest);
+			return (0);
+		}
+	}
 	switch (sap->sa_op) {
 	case ADD_TYPE_FILE:
 		fprintf(fp, "cp -pr \"${stage_tmp_dir}/%s\" %s\n",
@@ -152,195 +228,176 @@ build_get_stage_deps(struct build_context *bcp, int stage_index)
 	return (strdup(p));
 }
 
-struct build_copy_from *
-build_stage_find_copy_from(int stage, build_copy_from_t *head)
+/*
+ * Emit the instructions a step runs, without its Step banner.
+ */
+static void
+build_emit_step(struct build_step *bsp, FILE *fp)
 {
-	struct build_copy_from *cfp;
 
-	TAILQ_FOREACH(cfp, head, glue) {
-		if (cfp->stage != stage) {
-			continue;
-		}
-		return (cfp);
+	switch (bsp->step_op) {
+	case STEP_ENV:
+		fprintf(fp, "export %s=\"%s\"\n",
+		    bsp->step_data.step_env.se_key,
+		    bsp->step_data.step_env.se_value);
+		break;
+	case STEP_ROOT_PIVOT:
+		fprintf(fp, "ln -s %s /cellblock-root-ptr\n",
+		    bsp->step_data.step_root_pivot.sr_dir);
+		break;
+	case STEP_ADD:
+		build_emit_add_instruction(bsp, fp);
+		break;
+	case STEP_COPY:
+		fprintf(fp, "cp -pr \"${stage_tmp_dir}/%s\" %s\n",
+		    bsp->step_data.step_copy.sc_source,
+		    bsp->step_data.step_copy.sc_dest);
+		break;
+	case STEP_RUN:
+		fprintf(fp, "%s\n", bsp->step_data.step_cmd);
+		break;
+	case STEP_COPY_FROM:
+		/*
+		 * The source stage's root is mounted read-only at
+		 * /tmp/stage<N>, so this is the only copy that is made.
+		 */
+		fprintf(fp, "cp -pr /tmp/stage%d/%s %s\n",
+		    bsp->step_data.step_copy_from.sc_stage,
+		    bsp->step_data.step_copy_from.sc_source,
+		    bsp->step_data.step_copy_from.sc_dest);
+		fprintf(fp, "_bytes=$(find /tmp/stage%d/%s -type f -exec "
+		    "stat -f %%z {} + | awk '{ s += $1 } END "
+		    "{ printf \"%%d\", s }')\n",
+		    bsp->step_data.step_copy_from.sc_stage,
+		    bsp->step_data.step_copy_from.sc_source);
+		fprintf(fp, "echo \"COPY --FROM stage %d: ${_bytes} bytes "
+		    "copied\"\n", bsp->step_data.step_copy_from.sc_stage);
+		break;
+	case STEP_WORKDIR:
+		fprintf(fp, "cd %s\n",
+		    bsp->step_data.step_workdir.sw_dir);
+		break;
 	}
-	return (NULL);
 }
 
-static int
-build_stage_compile_copy_from(struct build_context *bcp, int stage_index)
+static FILE *
+build_open_step_script(struct build_context *bcp, int stage_index,
+    const char *step)
 {
-	char tar_path[MAXPATHLEN], root_path[MAXPATHLEN], *src, **argv;
-	extern struct global_params gcfg;
-	build_copy_from_t stage_deps;
-	struct build_copy_from *cfp;
-	int k, this_stage, status;
-	struct build_step *bsp;
-	vec_t *vec;
-	pid_t pid;
+	char script[MAXPATHLEN];
+	FILE *fp;
 
-	TAILQ_INIT(&stage_deps);
-	for (k = 0; k < bcp->pbc.p_nsteps; k++) {
-		bsp = &bcp->steps[k];
-		if (bsp->stage_index != stage_index) {
-			continue;
-		}
-		if (bsp->step_op != STEP_COPY_FROM) {
-			continue;
-		}
-		this_stage = bsp->step_data.step_copy_from.sc_stage;
-		cfp = build_stage_find_copy_from(this_stage, &stage_deps);
-		if (cfp == NULL) {
-			cfp = calloc(1, sizeof(*cfp));
-			if (cfp == NULL) {
-				warn("allocation failure");
-				return (-1);
-			}
-			cfp->stage = this_stage;
-			cfp->pathv = vec_init(32);
-			TAILQ_INSERT_HEAD(&stage_deps, cfp, glue);
-		}
-		src = bsp->step_data.step_copy_from.sc_source;
-		if (*src == '/') {
-			src++;
-		}
-		vec_append(cfp->pathv, src);
+	if (snprintf(script, sizeof(script), "%s.%d.%s.sh",
+	    bcp->build_root, stage_index, step) >= (int)sizeof(script)) {
+		errx(1, "%s: build root path too long", bcp->build_root);
 	}
-	if (TAILQ_EMPTY(&stage_deps)) {
-		return (0);
+	fp = fopen(script, "w+");
+	if (fp == NULL) {
+		err(1, "failed to create bootstrap script");
 	}
-	TAILQ_FOREACH(cfp, &stage_deps, glue) {
-		snprintf(root_path, sizeof(root_path),
-		    "%s/instances/%s/%d/root", gcfg.c_data_dir,
-		    bcp->instance, cfp->stage);
-		snprintf(tar_path, sizeof(tar_path),
-		    "%s/instances/copy_from_%s_%d.tar",
-                    gcfg.c_data_dir, bcp->instance, cfp->stage);
-		/*
-		 * NB: we have the data to figure out exactly how many
-		 * Items we will need.
-		 */
-		vec = vec_init(128);
-		vec_append(vec, "/usr/bin/tar");
-		vec_append(vec, "-C");
-		vec_append(vec, root_path);
-		vec_append(vec, "-cf");
-		vec_append(vec, tar_path);
-		vec_merge(cfp->pathv, vec);
-		vec_finalize(vec);
-		pid = fork();
-		if (pid == -1) {
-			warn("fork failed");
-			return (-1);
-		}
-		if (pid == 0) {
-			argv = vec_return(vec);
-			execve(*argv, argv, NULL);
-			err(1, "execve failed");
-		}
-		vec_free(vec);
-		waitpid_ignore_intr(pid, &status);
+	fprintf(fp, "#!/bin/sh\n\n");
+	fprintf(fp, ". /tmp/cblock_build_variables.sh\n");
+	fprintf(fp, "set -e\n");
+	if (bcp->pbc.p_verbose > 0) {
+		fprintf(fp, "set -x\n");
 	}
-	return (0);
+	return (fp);
 }
 
+/*
+ * Without the cache all the steps of a stage run from a single script, in
+ * one shell and one jail. With the cache each step gets a script of its
+ * own, so that the stage root can be snapshotted into the cache in between
+ * steps. Since those steps no longer share a shell, every script first
+ * replays the ENV and WORKDIR steps that came before it, but anything else
+ * a step leaves in the shell (variables it sets, background processes) is
+ * gone by the next step. Steps up to and including "hit" were restored
+ * from the cache and do not need a script.
+ */
 static int
-build_emit_shell_script(struct build_context *bcp, int stage_index)
+build_emit_shell_script(struct build_context *bcp, int stage_index,
+    struct cache_step *csp, int nsteps, int hit)
 {
-	int steps, k, header, taken;
-	char script[MAXPATHLEN];
-	struct build_step *bsp;
+	struct build_step *bsp, *prev;
+	char step[16];
+	int k, j;
 	FILE *fp;
 
-	(void) snprintf(script, sizeof(script), "%s.%d.sh",
-	    bcp->build_root, stage_index);
-	fp = fopen(script, "w+");
-	if (fp == NULL) {
-		err(1, "failed to create bootstrap script");
-	}
-	for (steps = 0, k = 0; k < bcp->pbc.p_nsteps; k++) {
-		bsp = &bcp->steps[k];
-		if (bsp->stage_index != stage_index) {
-			continue;
+	if (!cache_enabled(bcp)) {
+		fp = build_open_step_script(bcp, stage_index, "all");
+		for (k = 0; k < nsteps; k++) {
+			bsp = &bcp->steps[csp[k].cs_step];
+			fprintf(fp, "echo -n \033[1m--\033[0m\n");
+			fprintf(fp, "echo ' Step %d/%d : %s'\n",
+			    k + 1, nsteps, bsp->step_string);
+			build_emit_step(bsp, fp);
 		}
-		steps++;
+		fclose(fp);
+		return (0);
 	}
-	header = 0;
-	for (taken = 0, k = 0; k < bcp->pbc.p_nsteps; k++) {
-		bsp = &bcp->steps[k];
-		if (bsp->stage_index != stage_index) {
-			continue;
-		}
-		if (!header) {
-			fprintf(fp, "#!/bin/sh\n\n");
-			fprintf(fp, ". /tmp/cblock_build_variables.sh\n");
-			fprintf(fp, "set -e\n");
-			if (bcp->pbc.p_verbose > 0) {
-				fprintf(fp, "set -x\n");
+	for (k = hit + 1; k < nsteps; k++) {
+		(void) snprintf(step, sizeof(step), "%d", k);
+		fp = build_open_step_script(bcp, stage_index, step);
+		for (j = 0; j < k; j++) {
+			prev = &bcp->steps[csp[j].cs_step];
+			if (prev->step_op == STEP_ENV ||
+			    prev->step_op == STEP_WORKDIR) {
+				build_emit_step(prev, fp);
 			}
-			header = 1;
 		}
+		bsp = &bcp->steps[csp[k].cs_step];
 		fprintf(fp, "echo -n \033[1m--\033[0m\n");
-		fprintf(fp, "echo ' Step %d/%d : %s'\n",
-		    ++taken, steps, bsp->step_string);
-		switch (bsp->step_op) {
-		case STEP_ENV:
-			fprintf(fp, "export %s=\"%s\"\n",
-			    bsp->step_data.step_env.se_key,
-			    bsp->step_data.step_env.se_value);
-			break;
-		case STEP_ROOT_PIVOT:
-			fprintf(fp, "ln -s %s /cellblock-root-ptr\n",
-			    bsp->step_data.step_root_pivot.sr_dir);
-			break;
-		case STEP_ADD:
-			build_emit_add_instruction(bsp, fp);
-			break;
-		case STEP_COPY:
-			fprintf(fp, "cp -pr \"${stage_tmp_dir}/%s\" %s\n",
-			    bsp->step_data.step_copy.sc_source,
-			    bsp->step_data.step_copy.sc_dest);
-			break;
-		case STEP_RUN:
-			fprintf(fp, "%s\n", bsp->step_data.step_cmd);
-			break;
-		case STEP_COPY_FROM:
-			fprintf(fp, "cp -pr /tmp/stage%d/%s %s\n",
-			    bsp->step_data.step_copy_from.sc_stage,
-			    bsp->step_data.step_copy_from.sc_source,
-			    bsp->step_data.step_copy_from.sc_dest);
-			break;
-		case STEP_WORKDIR:
-			fprintf(fp, "cd %s\n",
-			    bsp->step_data.step_workdir.sw_dir);
-			break;
-		}
+		fprintf(fp, "echo ' Step %d/%d : %s%s'\n",
+		    k + 1, nsteps, bsp->step_string,
+		    csp[k].cs_key[0] != '\0' ? " (cache miss)" : "");
+		build_emit_step(bsp, fp);
+		fclose(fp);
 	}
-	fclose(fp);
 	return (0);
 }
 
 static int
-build_init_stage(struct build_context *bcp, struct build_stage *stage)
+build_init_stage(struct build_context *bcp, struct build_stage *stage,
+    const char *layer)
 {
-	char script[128], index[16], context_archive[128], **argv, buf[128];
+	char script[128], index[16], context_dir[MAXPATHLEN + 8], **argv;
+	char buf[128];
+	char layer_env[MAXPATHLEN + 32];
 	extern struct global_params gcfg;
+	uint64_t start, tstart;
 	vec_t *vec, *vec_env;
-	int status;
+	int status, tfds[2];
 	pid_t pid;
 
 	(void) snprintf(script, sizeof(script),
 	    "%s/lib/stage_bootstrap_build.sh", gcfg.c_data_dir);
 	(void) snprintf(index, sizeof(index), "%d", stage->bs_index);
-	(void) snprintf(context_archive, sizeof(context_archive),
-	    "%s/instances/%s.tar.gz", gcfg.c_data_dir, bcp->instance);
+	(void) snprintf(context_dir, sizeof(context_dir), "%s.ctx",
+	    bcp->build_root);
+	(void) trace_marker_pipe(bcp->pbc.p_trace_id, tfds);
+	start = stats_now_usec();
+	tstart = trace_now_usec();
 	pid = fork();
 	if (pid == -1) {
 		err(1, "fork failed");
 	}
 	if (pid != 0) {
+		CBLOCKD_HELPER_EXEC("stage_bootstrap_build.sh", bcp->instance,
+		    pid);
+		if (tfds[1] != -1) {
+			(void) close(tfds[1]);
+			trace_marker_drain(bcp->pbc.p_trace_id, tfds[0], pid,
+			    "stage_bootstrap_build.sh");
+		}
 		waitpid_ignore_intr(pid, &status);
+		CBLOCKD_HELPER_DONE("stage_bootstrap_build.sh", bcp->instance,
+		    status, stats_now_usec() - start);
+		trace_span(bcp->pbc.p_trace_id, "bootstrap", "cblockd", tstart);
+		report_record(bcp, stage->bs_index, "bootstrap %ju",
+		    (uintmax_t)(stats_now_usec() - start));
 		return (status);
 	}
+	trace_marker_child(tfds);
 	/*
 	 * Redirect any messages from the build container bootstrap
 	 * processes to the console.
@@ -349,6 +406,18 @@ build_init_stage(struct build_context *bcp, struct build_stage *stage)
 	vec_append(vec_env, DEFAULT_PATH);
 	sprintf(buf, "CBLOCK_FS=%s", gcfg.c_underlying_fs);
 	vec_append(vec_env, buf);
+	if (tfds[1] != -1) {
+		sprintf(buf, "CBLOCK_TRACE_FD=%d", CBLOCK_TRACE_FD);
+		vec_append(vec_env, buf);
+	}
+	/*
+	 * Start the stage from a cached layer rather than its base image.
+	 */
+	if (layer != NULL) {
+		(void) snprintf(layer_env, sizeof(layer_env),
+		    "CBLOCK_CACHE_LAYER=%s", layer);
+		vec_append(vec_env, layer_env);
+	}
 	vec_finalize(vec_env);
 	vec = vec_init(32);
 	vec_append(vec, "/bin/sh");
@@ -360,7 +429,7 @@ build_init_stage(struct build_context *bcp, struct build_stage *stage)
 	vec_append(vec, index);
 	vec_append(vec, stage->bs_base_container);
 	vec_append(vec, gcfg.c_data_dir);
-	vec_append(vec, context_archive);
+	vec_append(vec, context_dir);
 	vec_append(vec, build_get_stage_deps(bcp, stage->bs_index));
 	vec_append(vec, bcp->instance);
 	if (stage->bs_name[0] != '\0') {
@@ -377,16 +446,117 @@ build_init_stage(struct build_context *bcp, struct build_stage *stage)
 	return (-1);
 }
 
+/*
+ * The image is made from the root of the final stage, or if the root was
+ * pivoted, from the directory the pivot points to.
+ */
+static void
+build_commit_root(struct build_context *bcp, int last, char *root,
+    size_t len)
+{
+	char ptr[MAXPATHLEN];
+	ssize_t cc;
+
+	(void) snprintf(root, len, "%s/%d/root/cellblock-root-ptr",
+	    bcp->build_root, last);
+	cc = readlink(root, ptr, sizeof(ptr) - 1);
+	if (cc != -1) {
+		ptr[cc] = '\0';
+		(void) snprintf(root, len, "%s/%d/root/%s", bcp->build_root,
+		    last, ptr);
+		return;
+	}
+	(void) snprintf(root, len, "%s/%d", bcp->build_root, last);
+}
+
+/*
+ * Write the FIM spec for the image into its root. Files
+ * the final stage did not touch keep the digests recorded in the index of
+ * the image it was built from. The index of this image is written once it
+ * has been committed, see build_fim_index.
+ */
+static int
+build_fim_spec(struct build_context *bcp, struct build_stage *bsp,
+    const char *root)
+{
+	char parent[MAXPATHLEN], index[MAXPATHLEN];
+	extern struct global_params gcfg;
+	struct fim_stats fs;
+	uint64_t tstart;
+	double secs, gb;
+	int ret;
+
+	print_bold_prefix(stdout);
+	fprintf(stdout,
+	    "Generating cryptographic checksums for container image files\n");
+	fflush(stdout);
+	(void) snprintf(parent, sizeof(parent), "%s/images/%s%s",
+	    gcfg.c_data_dir, bsp->bs_base_container,
+	    strchr(bsp->bs_base_container, ':') == NULL ? ":latest" : "");
+	tstart = trace_now_usec();
+	ret = fim_generate(root, parent, &fs);
+	trace_span(bcp->pbc.p_trace_id, "fim_spec", "cblockd", tstart);
+	if (ret != 0) {
+		return (ret);
+	}
+	report_record(bcp, REPORT_STAGE_BUILD, "fim_spec %ju",
+	    (uintmax_t)fs.fs_usec);
+	/*
+	 * The root may have the index of the image it was built from.
+	 */
+	(void) snprintf(index, sizeof(index), "%s/%s", root, FIM_INDEX_FILE);
+	if (unlink(index) == -1 && errno != ENOENT) {
+		warn("unlink(%s)", index);
+		return (-1);
+	}
+	secs = fs.fs_usec / 1000000.0;
+	gb = fs.fs_bytes / (1024.0 * 1024.0 * 1024.0);
+	print_bold_prefix(stdout);
+	fprintf(stdout, "FIM spec: %ju files, %ju MB (%ju reused from parent) "
+	    "in %.2fs, %.2fs/GB\n", fs.fs_files, fs.fs_bytes / (1024 * 1024),
+	    fs.fs_reused, secs, gb > 0 ? secs / gb : 0);
+	fflush(stdout);
+	return (0);
+}
+
+/*
+ * Index the spec of the committed image. Failing to do so does not fail
+ * the build: the index is built the first time it is needed instead.
+ */
+static void
+build_fim_index(struct build_context *bcp)
+{
+	char image[MAXPATHLEN];
+	extern struct global_params gcfg;
+	uint64_t tstart;
+
+	if (snprintf(image, sizeof(image), "%s/images/%s.%s",
+	    gcfg.c_data_dir, bcp->pbc.p_image_name, bcp->instance) >=
+	    (int)sizeof(image)) {
+		warnx("%s: image path too long", bcp->pbc.p_image_name);
+		return;
+	}
+	tstart = trace_now_usec();
+	if (fim_index_build(image) != 0) {
+		warnx("failed to index FIM spec of %s", image);
+		return;
+	}
+	trace_span(bcp->pbc.p_trace_id, "fim_index", "cblockd", tstart);
+	report_record(bcp, REPORT_STAGE_BUILD, "fim_index %ju",
+	    (uintmax_t)(trace_now_usec() - tstart));
+}
+
 static int
 build_commit_image(struct build_context *bcp)
 {
 	char commit_cmd[128], **argv, s_index[32], nstages[32];
 	extern struct global_params gcfg;
-	char path[1024], *do_fim, buf[64];
+	char path[MAXPATHLEN], buf[64], root[MAXPATHLEN];
 	struct build_stage *bsp;
-	int status, k, last;
-	FILE *fp;
+	int status, k, last, tfds[2];
+	uint64_t start, tstart;
 	vec_t *vec, *vec_env;
+	FILE *fp;
 	pid_t pid;
 
 	last = -1;
@@ -398,9 +568,15 @@ build_commit_image(struct build_context *bcp)
 		last = bsp->bs_index;
 		break;
 	}
+	/*
+	 * The image metadata goes into the root the image is made from.
+	 */
+	build_commit_root(bcp, last, root, sizeof(root));
 	if (bcp->pbc.p_auditcfg[0] != '\0') {
-		snprintf(path, sizeof(path), "%s/%d/AUDITCFG",
-		    bcp->build_root, last);
+		if (snprintf(path, sizeof(path), "%s/AUDITCFG", root) >=
+		    (int)sizeof(path)) {
+			errx(1, "%s: path too long", root);
+		}
 		fp = fopen(path, "w+");
 		if (fp == NULL) {
 			err(1, "fopen(%s) failed", path);
@@ -413,8 +589,10 @@ build_commit_image(struct build_context *bcp)
 	 * one. If not, the default OS of the host environment will be used.
 	 */
 	if (bcp->pbc.p_os_release[0] != '\0') {
-		snprintf(path, sizeof(path), "%s/%d/OSRELEASE",
-		    bcp->build_root, last);
+		if (snprintf(path, sizeof(path), "%s/OSRELEASE", root) >=
+		    (int)sizeof(path)) {
+			errx(1, "%s: path too long", root);
+		}
 		fp = fopen(path, "w+");
 		if (fp == NULL) {
 			err(1, "fopen(%s) failed", path);
@@ -426,8 +604,10 @@ build_commit_image(struct build_context *bcp)
 	 * Write out entry point and enty point args (CMD) for the final stage
 	 */
 	if (bcp->pbc.p_entry_point[0] != '\0') {
-		snprintf(path, sizeof(path), "%s/%d/ENTRYPOINT",
-		    bcp->build_root, last);
+		if (snprintf(path, sizeof(path), "%s/ENTRYPOINT", root) >=
+		    (int)sizeof(path)) {
+			errx(1, "%s: path too long", root);
+		}
 		fp = fopen(path, "w+");
 		if (fp == NULL) {
 			err(1, "fopen(%s) failed", path);
@@ -436,8 +616,10 @@ build_commit_image(struct build_context *bcp)
 		fclose(fp);
 	}
 	if (bcp->pbc.p_entry_point_args[0] != '\0') {
-		snprintf(path, sizeof(path), "%s/%d/ARGS",
-		    bcp->build_root, last);
+		if (snprintf(path, sizeof(path), "%s/ARGS", root) >=
+		    (int)sizeof(path)) {
+			errx(1, "%s: path too long", root);
+		}
 		fp = fopen(path, "w+");
 		if (fp == NULL) {
 			err(1, "fopen(%s) failed", path);
@@ -446,22 +628,43 @@ build_commit_image(struct build_context *bcp)
 		    bcp->pbc.p_entry_point_args);
 		fclose(fp);
 	}
+	if (bcp->pbc.p_build_fim_spec &&
+	    build_fim_spec(bcp, bsp, root) != 0) {
+		warnx("failed to generate FIM spec");
+		return (1);
+	}
+	(void) trace_marker_pipe(bcp->pbc.p_trace_id, tfds);
+	start = stats_now_usec();
+	tstart = trace_now_usec();
 	pid = fork();
 	if (pid == -1) {
 		err(1, "%s: fork failed", __func__);
 	}
 	if (pid != 0) {
+		CBLOCKD_HELPER_EXEC("stage_commit.sh", bcp->instance, pid);
+		if (tfds[1] != -1) {
+			(void) close(tfds[1]);
+			trace_marker_drain(bcp->pbc.p_trace_id, tfds[0], pid,
+			    "stage_commit.sh");
+		}
 		waitpid_ignore_intr(pid, &status);
+		CBLOCKD_HELPER_DONE("stage_commit.sh", bcp->instance, status,
+		    stats_now_usec() - start);
+		trace_span(bcp->pbc.p_trace_id, "commit", "cblockd", tstart);
+		report_record(bcp, REPORT_STAGE_BUILD, "commit %ju",
+		    (uintmax_t)(stats_now_usec() - start));
 		if (status != 0) {
 			warnx("failed to commit image");
+		} else if (bcp->pbc.p_build_fim_spec) {
+			build_fim_index(bcp);
 		}
 		return (status);
 	}
+	trace_marker_child(tfds);
 	snprintf(commit_cmd, sizeof(commit_cmd), "%s/lib/stage_commit.sh",
 	    gcfg.c_data_dir);
 	snprintf(nstages, sizeof(nstages), "%d", bcp->pbc.p_nstages);
 	snprintf(s_index, sizeof(s_index), "%d", last);
-	do_fim = "OFF";
 	vec_env = vec_init(16);
 	sprintf(buf, "CBLOCK_FS=%s", gcfg.c_underlying_fs);
 	vec_append(vec_env, buf);
@@ -474,6 +677,10 @@ build_commit_image(struct build_context *bcp)
 	vec_append(vec_env, buf);
 	sprintf(buf, "TAR_WRITER_OPTIONS=hdrcharset=BINARY");
 	vec_append(vec_env, buf);
+	if (tfds[1] != -1) {
+		sprintf(buf, "CBLOCK_TRACE_FD=%d", CBLOCK_TRACE_FD);
+		vec_append(vec_env, buf);
+	}
 	vec_finalize(vec_env);
 	vec = vec_init(16);
 	vec_append(vec, "/bin/sh");
@@ -487,10 +694,6 @@ build_commit_image(struct build_context *bcp)
 	vec_append(vec, bcp->pbc.p_image_name);
 	vec_append(vec, nstages);
 	vec_append(vec, bcp->instance);
-	if (bcp->pbc.p_build_fim_spec) {
-		do_fim = "ON";
-	}
-	vec_append(vec, do_fim);
 	vec_append(vec, bcp->pbc.p_tag);
 	vec_finalize(vec);
 	argv = vec_return(vec);
@@ -500,260 +703,1239 @@ build_commit_image(struct build_context *bcp)
 	return (1);
 }
 
+/*
+ * Run a single stage to completion: bootstrap its root, then execute its
+ * steps. This runs in a process of its own so that independent stages can
+ * be run concurrently (see build_run_build_stage).
+ */
 static int
-build_run_build_stage(struct build_context *bcp)
+build_run_stage(struct build_context *bcp, int k)
 {
 	char stage_root[MAXPATHLEN], **argv, builder[1024], buf[512];
+	char layer[MAXPATHLEN], cache_env[2][MAXPATHLEN + 32];
 	extern struct global_params gcfg;
+	char span[64], step[CBLOCK_DIGEST_LEN + 16];
+	uint64_t start, usec, tstart, tstep;
 	struct build_stage *bstg;
+	struct cache_step *csp;
+	int status, nsteps, hit, j;
 	vec_t *vec, *vec_env;
-	int status, k;
 	pid_t pid;
 
-	(void) snprintf(bcp->build_root, sizeof(bcp->build_root),
-	    "%s/instances/%s", gcfg.c_data_dir, bcp->instance);
+	bstg = &bcp->stages[k];
+	(void) snprintf(span, sizeof(span), "stage %d", bstg->bs_index);
+	trace_process_name(bcp->pbc.p_trace_id, span, getpid());
         sprintf(builder, "%s/lib/stage_build.sh", gcfg.c_data_dir);
-	for (k = 0; k < bcp->pbc.p_nstages; k++) {
-		bstg = &bcp->stages[k];
-		snprintf(stage_root, sizeof(stage_root),
-		    "%s/%d", bcp->build_root, bstg->bs_index);
-		if (mkdir(stage_root, 0755) == -1) {
-			err(1, "mkdir(%s) stage root", stage_root);
+	start = stats_now_usec();
+	tstart = trace_now_usec();
+	stats_counter_add(STATS_BUILD_STAGES, 1);
+	CBLOCKD_BUILD_STAGE_START(bcp->instance, bstg->bs_index,
+	    bcp->pbc.p_nstages);
+	if (snprintf(stage_root, sizeof(stage_root), "%s/%d",
+	    bcp->build_root, bstg->bs_index) >= (int)sizeof(stage_root)) {
+		errx(1, "%s: build root path too long", bcp->build_root);
+	}
+	if (mkdir(stage_root, 0755) == -1) {
+		err(1, "mkdir(%s) stage root", stage_root);
+	}
+	if (snprintf(stage_root, sizeof(stage_root), "%s/%d/root",
+	    bcp->build_root, bstg->bs_index) >= (int)sizeof(stage_root)) {
+		errx(1, "%s: build root path too long", bcp->build_root);
+	}
+	if (mkdir(stage_root, 0755) == -1) {
+		err(1, "mkdir(%s) stage root mount failed", stage_root);
+	}
+	csp = cache_stage_keys(bcp, bstg->bs_index, &nsteps);
+	hit = -1;
+	if (cache_enabled(bcp)) {
+		hit = cache_lookup(csp, nsteps, layer, sizeof(layer));
+	}
+	build_emit_shell_script(bcp, bstg->bs_index, csp, nsteps, hit);
+	status = build_init_stage(bcp, bstg, hit == -1 ? NULL : layer);
+	if (status != 0) {
+		free(csp);
+		print_bold_prefix(stdout);
+		fprintf(stdout,
+		    "Stage index %d failed with %d code. Exiting\n",
+		    bstg->bs_index,
+		    WEXITSTATUS(status));
+		fflush(stdout);
+		return (status);
+	}
+	print_bold_prefix(stdout);
+	if (bstg->bs_name[0] != '\0') {
+		fprintf(stdout,
+		    "Executing stage (%d/%d) : FROM %s AS %s\n",
+		    k + 1, bcp->pbc.p_nstages, bstg->bs_base_container,
+		    bstg->bs_name);
+	} else {
+		fprintf(stdout,
+		    "Executing stage (%d/%d) : FROM %s\n",
+		    k + 1, bcp->pbc.p_nstages,
+		    bstg->bs_base_container);
+	}
+	for (j = 0; j <= hit; j++) {
+		print_bold_prefix(stdout);
+		fprintf(stdout, "Step %d/%d : %s (cache hit)\n", j + 1,
+		    nsteps, bcp->steps[csp[j].cs_step].step_string);
+		report_record(bcp, bstg->bs_index, "cached %d", j);
+	}
+	for (j = hit + 1; j < nsteps; j++) {
+		if (csp[j].cs_key[0] != '\0' && cache_enabled(bcp)) {
+			stats_counter_add(STATS_BUILD_CACHE_MISSES, 1);
+		}
+	}
+	if (hit != -1) {
+		stats_counter_add(STATS_BUILD_CACHE_HITS, hit + 1);
+	}
+	fflush(stdout);
+	tstep = trace_now_usec();
+	pid = fork();
+	if (pid == -1) {
+		err(1, "pid failed");
+	}
+	if (pid == 0) {
+		/*
+		 * We need to setup a functional environment here,
+		 * especially for build containers. PATH is really
+		 * important.
+		 */
+		sprintf(buf, "CBLOCK_FS=%s", gcfg.c_underlying_fs);
+		vec_env = vec_init(16);
+		vec_append(vec_env, buf);
+		(void) snprintf(cache_env[0], sizeof(cache_env[0]),
+		    "CBLOCK_CACHE_DIR=%s/%s", gcfg.c_data_dir, CACHE_DIR);
+		vec_append(vec_env, cache_env[0]);
+		(void) snprintf(cache_env[1], sizeof(cache_env[1]),
+		    "CBLOCK_CACHE_SIZE=%lu", gcfg.c_build_cache_size);
+		vec_append(vec_env, cache_env[1]);
+		vec_append(vec_env, "USER=root");
+		vec_append(vec_env, "HOME=/root");
+		vec_append(vec_env, DEFAULT_PATH);
+		vec_append(vec_env, "TERM=xterm");
+		vec_append(vec_env, "BLOCKSIZE=K");
+		vec_append(vec_env, "SHELL=/bin/sh");
+		vec_finalize(vec_env);
+
+		vec = vec_init(nsteps + 16);
+		vec_append(vec, "/bin/sh");
+		if (bcp->pbc.p_verbose > 0) {
+			vec_append(vec, "-x");
 		}
-		snprintf(stage_root, sizeof(stage_root),
-		    "%s/%d/root", bcp->build_root, bstg->bs_index);
-		if (mkdir(stage_root, 0755) == -1) {
-			err(1, "mkdir(%s) stage root mount failed", stage_root);
+		vec_append(vec, builder);
+		vec_append(vec, stage_root);
+		vec_append(vec, bcp->instance);
+		vec_append(vec, bcp->pbc.p_os_release);
+		/*
+		 * The steps left to run, each with the key to store its
+		 * result under, or "-" if it should not be cached. Without
+		 * the cache there is a single script for all of them.
+		 */
+		if (!cache_enabled(bcp)) {
+			vec_append(vec, "all:-");
 		}
-		build_emit_shell_script(bcp, bstg->bs_index);
-		if (build_stage_compile_copy_from(bcp, bstg->bs_index)) { 
-			printf("Stage has COPY FROM instruction\n");
+		for (j = hit + 1; j < nsteps && cache_enabled(bcp); j++) {
+			(void) snprintf(step, sizeof(step), "%d:%s", j,
+			    csp[j].cs_key[0] != '\0' ? csp[j].cs_key : "-");
+			vec_append(vec, step);
 		}
-		status = build_init_stage(bcp, bstg);
-		if (status != 0) {
-			print_bold_prefix(stdout);
-			fprintf(stdout,
-			    "Stage index %d failed with %d code. Exiting\n",
-                            bstg->bs_index,
-			    WEXITSTATUS(status));
-			fflush(stdout);
-			break;
+		if (vec_finalize(vec) != 0) {
+			errx(1, "failed to construct command line");
 		}
+		argv = vec_return(vec);
+		execve(*argv, argv, vec_return(vec_env));
+		err(1, "execve failed");
+	}
+	CBLOCKD_HELPER_EXEC("stage_build.sh", bcp->instance, pid);
+	free(csp);
+	waitpid_ignore_intr(pid, &status);
+	usec = stats_now_usec() - start;
+	CBLOCKD_HELPER_DONE("stage_build.sh", bcp->instance, status,
+	    usec);
+	CBLOCKD_BUILD_STAGE_DONE(bcp->instance, bstg->bs_index,
+	    status, usec);
+	stats_hist_observe(STATS_H_BUILD_STAGE, usec);
+	report_record(bcp, bstg->bs_index, "total %ju %d", (uintmax_t)usec,
+	    status);
+	trace_span(bcp->pbc.p_trace_id, "stage_build.sh", "cblockd", tstep);
+	trace_span(bcp->pbc.p_trace_id, span, "cblockd", tstart);
+	if (status != 0) {
 		print_bold_prefix(stdout);
-		if (bstg->bs_name[0] != '\0') {
-			fprintf(stdout,
-			    "Executing stage (%d/%d) : FROM %s AS %s\n",
-			    k + 1, bcp->pbc.p_nstages, bstg->bs_base_container,
-			    bstg->bs_name);
-		} else {
-			fprintf(stdout,
-			    "Executing stage (%d/%d) : FROM %s\n",
-			    k + 1, bcp->pbc.p_nstages,
-			    bstg->bs_base_container);
-		}
+		fprintf(stdout,
+		    "Execution of stage of %d ", k + 1);
+		print_red(stdout, "failed");
+		fprintf(stdout,
+		    ". Terminating.\n");
 		fflush(stdout);
-		snprintf(stage_root, sizeof(stage_root),
-		    "%s/%d/root", bcp->build_root, bstg->bs_index);
-		pid = fork();
-		if (pid == -1) {
-			err(1, "pid failed");
+	}
+	return (status);
+}
+
+static int
+build_stage_lookup_index(struct build_context *bcp, int index)
+{
+	int k;
+
+	for (k = 0; k < bcp->pbc.p_nstages; k++) {
+		if (bcp->stages[k].bs_index == index) {
+			return (k);
 		}
-		if (pid == 0) {
-			/*
-			 * We need to setup a functional environment here,
-			 * especially for build containers. PATH is really
-			 * important.
-			 */
-			sprintf(buf, "CBLOCK_FS=%s", gcfg.c_underlying_fs);
-			vec_env = vec_init(8);
-			vec_append(vec_env, buf);
-			vec_append(vec_env, "USER=root");
-			vec_append(vec_env, "HOME=/root");
-			vec_append(vec_env, DEFAULT_PATH);
-			vec_append(vec_env, "TERM=xterm");
-			vec_append(vec_env, "BLOCKSIZE=K");
-			vec_append(vec_env, "SHELL=/bin/sh");
-			vec_finalize(vec_env);
-
-			vec = vec_init(32);
-			vec_append(vec, "/bin/sh");
-			if (bcp->pbc.p_verbose > 0) {
-				vec_append(vec, "-x");
-			}
-			vec_append(vec, builder);
-			vec_append(vec, stage_root);
-			vec_append(vec, bcp->instance);
-			vec_append(vec, bcp->pbc.p_os_release);
-			vec_finalize(vec);
-			argv = vec_return(vec);
-			execve(*argv, argv, vec_return(vec_env));
-			err(1, "execve failed");
+	}
+	return (-1);
+}
+
+/*
+ * Compute the stage dependency graph. Stage k depends on stage j if it
+ * copies files out of j (COPY --FROM) or if it is built FROM j by name.
+ * deps[k * nstages + j] is set for each such edge.
+ */
+static u_char *
+build_stage_graph(struct build_context *bcp)
+{
+	struct build_stage *bstg;
+	struct build_step *bsp;
+	int n, k, j, s;
+	u_char *deps;
+
+	n = bcp->pbc.p_nstages;
+	deps = calloc(n * n, sizeof(*deps));
+	if (deps == NULL) {
+		err(1, "calloc stage graph failed");
+	}
+	for (s = 0; s < bcp->pbc.p_nsteps; s++) {
+		bsp = &bcp->steps[s];
+		if (bsp->step_op != STEP_COPY_FROM) {
+			continue;
 		}
-		waitpid_ignore_intr(pid, &status);
-		if (status != 0) {
-			print_bold_prefix(stdout);
-			fprintf(stdout,
-			    "Execution of stage of %d ", k + 1);
-			print_red(stdout, "failed");
-			fprintf(stdout,
-			    ". Terminating.\n");
-			fflush(stdout);
-			break;
+		j = build_stage_lookup_index(bcp,
+		    bsp->step_data.step_copy_from.sc_stage);
+		k = build_stage_lookup_index(bcp, bsp->stage_index);
+		if (j != -1 && k != -1 && j != k) {
+			deps[k * n + j] = 1;
 		}
 	}
-	if (status == 0) {
-		bstg = &bcp->stages[k - 1];
-		bstg->bs_is_last = 1;
+	for (k = 0; k < n; k++) {
+		bstg = &bcp->stages[k];
+		for (j = 0; j < n; j++) {
+			if (j == k || bcp->stages[j].bs_name[0] == '\0') {
+				continue;
+			}
+			if (strcmp(bcp->stages[j].bs_name,
+			    bstg->bs_base_container) == 0) {
+				deps[k * n + j] = 1;
+			}
+		}
 	}
-	return (status);
+	return (deps);
 }
 
-static int
-dispatch_build_set_outfile(struct build_context *bcp,
-    char *ebuf, size_t len)
+/*
+ * Forward a stage's output to the build console a line at a time, so that
+ * output from concurrently running stages is not interleaved mid-line.
+ */
+static void
+build_job_output(struct build_job *bj, int flush)
 {
-	extern struct global_params gcfg;
-	char path[512], build_root[512];
-	int fd;
+	char *nl, *line;
+	size_t len;
 
-	(void) snprintf(path, sizeof(path),
-	    "%s/instances/%s.tar.gz", gcfg.c_data_dir, bcp->instance);
-	fd = open(path, O_RDWR | O_EXCL | O_CREAT, 0600);
-	if (fd == -1) {
-		snprintf(ebuf, len, "could not write to build spool: %s",
-		    strerror(errno));
-		return (-1);
+	line = bj->bj_buf;
+	while ((nl = memchr(line, '\n', bj->bj_len - (line - bj->bj_buf)))
+	    != NULL) {
+		len = nl - line + 1;
+		fprintf(stdout, "\033[1m%s\033[0m ", bj->bj_prefix);
+		fwrite(line, 1, len, stdout);
+		line += len;
 	}
-	(void) snprintf(build_root, sizeof(build_root),
-	    "%s/instances/%s", gcfg.c_data_dir, bcp->instance);
-	if (mkdir(build_root, 0755) == -1) {
-		snprintf(ebuf, len, "failed to initialize build env: %s",
-		    strerror(errno));
-		(void) unlink(path);
-		close(fd);
-		return (-1);
+	len = bj->bj_len - (line - bj->bj_buf);
+	if (len > 0 && (flush || len == sizeof(bj->bj_buf))) {
+		fprintf(stdout, "\033[1m%s\033[0m ", bj->bj_prefix);
+		fwrite(line, 1, len, stdout);
+		fputc('\n', stdout);
+		len = 0;
 	}
-	return (fd);
+	memmove(bj->bj_buf, line, len);
+	bj->bj_len = len;
+	fflush(stdout);
 }
 
-int
-dispatch_build_recieve(int sock)
+/*
+ * Whether a stage needs nothing but its base image and the build context,
+ * that is, it neither copies from nor is built FROM another stage. Only
+ * such stages are run by peers.
+ */
+static int
+build_stage_independent(struct build_context *bcp, int k)
 {
-	extern cblock_instance_head_t pr_head;
-	extern pthread_mutex_t cblock_mutex;
-	struct cblock_instance *pi;
-
-	struct cblock_response resp;
-	struct build_context bctx;
-	ssize_t cc;
-	int fd;
+	struct build_stage *bstg;
+	int j;
 
-	bzero(&bctx, sizeof(bctx));
-	bzero(&resp, sizeof(resp));
-	cc = sock_ipc_must_read(sock, &bctx.pbc, sizeof(bctx.pbc));
-	if (cc == 0) {
-		printf("didn't get proper build context headers\n");
-		return (0);
+	bstg = &bcp->stages[k];
+	for (j = 0; j < bcp->pbc.p_nsteps; j++) {
+		if (bcp->steps[j].stage_index == bstg->bs_index &&
+		    bcp->steps[j].step_op == STEP_COPY_FROM) {
+			return (0);
+		}
 	}
-	if (bctx.pbc.p_nstages > MAX_BUILD_STAGES ||
-	    bctx.pbc.p_nsteps > MAX_BUILD_STEPS) {
-		resp.p_ecode = -1;
-		sprintf(resp.p_errbuf, "too many build stages/steps\n");
-		sock_ipc_must_write(sock, &resp, sizeof(resp));
-		return (1);
+	for (j = 0; j < bcp->pbc.p_nstages; j++) {
+		if (j != k && bcp->stages[j].bs_name[0] != '\0' &&
+		    strcmp(bcp->stages[j].bs_name,
+		    bstg->bs_base_container) == 0) {
+			return (0);
+		}
 	}
-	bctx.stages = calloc(bctx.pbc.p_nstages, sizeof(*bctx.stages));
-	if (bctx.stages == NULL) {
-		resp.p_ecode = -1;
-		sprintf(resp.p_errbuf, "out of memory");
-		sock_ipc_must_write(sock, &resp, sizeof(resp));
-		return (1);
+	return (1);
+}
+
+/*
+ * Start stage k, given the number of stages already running. A stage that
+ * can be run by a peer is, if a peer is less loaded than we are (see
+ * peer.c).
+ */
+static void
+build_job_start(struct build_context *bcp, struct build_job *jobs, int k,
+    int prefix, int running)
+{
+	struct build_job *bj;
+	int fds[2], j, status;
+	pid_t pid;
+
+	bj = &jobs[k];
+	if (!build_stage_independent(bcp, k) ||
+	    peer_select(running, bj->bj_peer, sizeof(bj->bj_peer)) == -1) {
+		bj->bj_peer[0] = '\0';
 	}
-	bctx.steps = calloc(bctx.pbc.p_nsteps, sizeof(*bctx.steps));
-	if (bctx.steps == NULL) {
-		resp.p_ecode = -1;
-		sprintf(resp.p_errbuf, "out of memory");
-		sock_ipc_must_write(sock, &resp, sizeof(resp));
-		return (1);
+	fds[0] = fds[1] = -1;
+	if (prefix && pipe2(fds, O_CLOEXEC) == -1) {
+		err(1, "pipe failed");
 	}
-	sock_ipc_must_read(sock, bctx.stages,
-	    bctx.pbc.p_nstages * sizeof(*bctx.stages));
-	sock_ipc_must_read(sock, bctx.steps,
-	    bctx.pbc.p_nsteps * sizeof(*bctx.steps));
-	bctx.instance = gen_sha256_instance_id(bctx.pbc.p_image_name);
-	fd = dispatch_build_set_outfile(&bctx, resp.p_errbuf,
-	    sizeof(resp.p_errbuf));
-	if (fd == -1) {
-		warn("dispatch_build_set_outfile: failed");
-		free(bctx.steps);
-		free(bctx.stages);
-		free(bctx.instance);
-		resp.p_ecode = -1;
-		sock_ipc_must_write(sock, &resp, sizeof(resp));
-		return (1);
-        }
-	if (sock_ipc_from_to(sock, fd, bctx.pbc.p_context_size) == -1) {
-		free(bctx.steps);
-		free(bctx.stages);
-		free(bctx.instance);
-		close(fd);
-		warn("sock_ipc_from_to failed");
-		return (1);
+	fflush(stdout);
+	pid = fork();
+	if (pid == -1) {
+		err(1, "fork failed");
 	}
-	close(fd);
-	pi = calloc(1, sizeof(*pi));
-	if (pi == NULL) {
-		err(1, "calloc failed");
+	if (pid == 0) {
+		if (prefix) {
+			if (dup2(fds[1], STDOUT_FILENO) == -1 ||
+			    dup2(fds[1], STDERR_FILENO) == -1) {
+				err(1, "dup2 failed");
+			}
+			for (j = 0; j < bcp->pbc.p_nstages; j++) {
+				if (jobs[j].bj_fd != -1) {
+					(void) close(jobs[j].bj_fd);
+				}
+			}
+		}
+		/*
+		 * A stage the peer did not start is run here.
+		 */
+		if (bj->bj_peer[0] != '\0') {
+			status = peer_run_stage(bcp, k, bj->bj_peer);
+			if (status != -1) {
+				_exit(status == 0 ? 0 : 1);
+			}
+		}
+		_exit(build_run_stage(bcp, k) == 0 ? 0 : 1);
+	}
+	if (prefix) {
+		(void) close(fds[1]);
+	}
+	bj->bj_fd = fds[0];
+	bj->bj_pid = pid;
+	bj->bj_state = BUILD_JOB_RUNNING;
+}
+
+/*
+ * Mark everything that depends on a failed or cancelled stage as cancelled.
+ * Returns the number of stages cancelled.
+ */
+static int
+build_job_cancel_dependents(struct build_context *bcp, struct build_job *jobs,
+    u_char *deps)
+{
+	int n, k, j, cancelled, changed;
+
+	n = bcp->pbc.p_nstages;
+	cancelled = 0;
+	do {
+		changed = 0;
+		for (k = 0; k < n; k++) {
+			if (jobs[k].bj_state != BUILD_JOB_PENDING) {
+				continue;
+			}
+			for (j = 0; j < n; j++) {
+				if (!deps[k * n + j]) {
+					continue;
+				}
+				if (jobs[j].bj_state != BUILD_JOB_FAILED &&
+				    jobs[j].bj_state != BUILD_JOB_CANCELLED) {
+					continue;
+				}
+				print_bold_prefix(stdout);
+				fprintf(stdout, "Stage %d cancelled: it depends "
+				    "on stage %d which did not complete\n",
+				    k + 1, j + 1);
+				jobs[k].bj_state = BUILD_JOB_CANCELLED;
+				cancelled++;
+				changed = 1;
+				break;
+			}
+		}
+	} while (changed);
+	fflush(stdout);
+	return (cancelled);
+}
+
+static int
+build_job_runnable(struct build_context *bcp, struct build_job *jobs,
+    u_char *deps, int k)
+{
+	int n, j;
+
+	n = bcp->pbc.p_nstages;
+	if (jobs[k].bj_state != BUILD_JOB_PENDING) {
+		return (0);
+	}
+	for (j = 0; j < n; j++) {
+		if (deps[k * n + j] && jobs[j].bj_state != BUILD_JOB_DONE) {
+			return (0);
+		}
+	}
+	return (1);
+}
+
+static void
+build_job_reap(struct build_job *bj, int *statusp)
+{
+	int status;
+
+	waitpid_ignore_intr(bj->bj_pid, &status);
+	bj->bj_pid = -1;
+	if (status == 0) {
+		bj->bj_state = BUILD_JOB_DONE;
+		return;
+	}
+	bj->bj_state = BUILD_JOB_FAILED;
+	if (*statusp == 0) {
+		*statusp = status;
+	}
+}
+
+/*
+ * Wait for at least one running stage to finish, forwarding output from
+ * the running stages in the meantime.
+ */
+static void
+build_job_wait(struct build_context *bcp, struct build_job *jobs,
+    int *statusp)
+{
+	struct pollfd pfd[MAX_BUILD_JOBS];
+	int n, k, nfds, map[MAX_BUILD_JOBS], error, reaped;
+	struct build_job *bj;
+	ssize_t cc;
+
+	n = bcp->pbc.p_nstages;
+	reaped = 0;
+	while (!reaped) {
+		nfds = 0;
+		for (k = 0; k < n; k++) {
+			bj = &jobs[k];
+			if (bj->bj_state != BUILD_JOB_RUNNING) {
+				continue;
+			}
+			/*
+			 * Output is not being prefixed, so this is the only
+			 * stage running.
+			 */
+			if (bj->bj_fd == -1) {
+				build_job_reap(bj, statusp);
+				return;
+			}
+			pfd[nfds].fd = bj->bj_fd;
+			pfd[nfds].events = POLLIN;
+			map[nfds++] = k;
+		}
+		if (nfds == 0) {
+			return;
+		}
+		error = poll(pfd, nfds, -1);
+		if (error == -1 && errno == EINTR) {
+			continue;
+		}
+		if (error == -1) {
+			err(1, "poll(build stages) failed");
+		}
+		for (k = 0; k < nfds; k++) {
+			if ((pfd[k].revents & (POLLIN | POLLHUP | POLLERR))
+			    == 0) {
+				continue;
+			}
+			bj = &jobs[map[k]];
+			cc = read(bj->bj_fd, &bj->bj_buf[bj->bj_len],
+			    sizeof(bj->bj_buf) - bj->bj_len);
+			if (cc == -1 && errno == EINTR) {
+				continue;
+			}
+			if (cc > 0) {
+				bj->bj_len += cc;
+				build_job_output(bj, 0);
+				continue;
+			}
+			/*
+			 * The stage and everything it started are done with
+			 * the output pipe.
+			 */
+			build_job_output(bj, 1);
+			(void) close(bj->bj_fd);
+			bj->bj_fd = -1;
+			build_job_reap(bj, statusp);
+			reaped = 1;
+		}
+	}
+}
+
+/*
+ * Run the build stages as a DAG: a stage is started once every stage it
+ * depends on has completed, with at most p_jobs stages running at once.
+ * When a stage fails, the stages that depend on it are cancelled. Stages
+ * that do not depend on it are still run, but the build fails.
+ */
+static int
+build_run_build_stage(struct build_context *bcp)
+{
+	extern struct global_params gcfg;
+	int n, k, running, remaining, jobs_max, prefix, status;
+	struct build_job *jobs;
+	u_char *deps;
+
+	(void) snprintf(bcp->build_root, sizeof(bcp->build_root),
+	    "%s/instances/%s", gcfg.c_data_dir, bcp->instance);
+	if (fetch_prefetch(bcp, -1) != 0) {
+		return (1);
+	}
+	n = bcp->pbc.p_nstages;
+	jobs_max = bcp->pbc.p_jobs;
+	if (jobs_max < 1) {
+		jobs_max = 1;
+	} else if (jobs_max > MAX_BUILD_JOBS) {
+		jobs_max = MAX_BUILD_JOBS;
+	}
+	/*
+	 * Prefixing means stages write to a pipe rather than the pty, so only
+	 * do it when output from several stages can be interleaved.
+	 */
+	prefix = (jobs_max > 1 && n > 1);
+	deps = build_stage_graph(bcp);
+	jobs = calloc(n, sizeof(*jobs));
+	if (jobs == NULL) {
+		err(1, "calloc build jobs failed");
+	}
+	for (k = 0; k < n; k++) {
+		jobs[k].bj_state = BUILD_JOB_PENDING;
+		jobs[k].bj_fd = -1;
+		jobs[k].bj_pid = -1;
+		if (bcp->stages[k].bs_name[0] != '\0') {
+			(void) snprintf(jobs[k].bj_prefix,
+			    sizeof(jobs[k].bj_prefix), "[%s]",
+			    bcp->stages[k].bs_name);
+		} else {
+			(void) snprintf(jobs[k].bj_prefix,
+			    sizeof(jobs[k].bj_prefix), "[stage %d]", k + 1);
+		}
+	}
+	if (prefix) {
+		print_bold_prefix(stdout);
+		fprintf(stdout, "Running up to %d stages concurrently\n",
+		    jobs_max);
+		fflush(stdout);
+	}
+	status = 0;
+	running = 0;
+	remaining = n;
+	while (remaining > 0) {
+		remaining -= build_job_cancel_dependents(bcp, jobs, deps);
+		for (k = 0; k < n && running < jobs_max; k++) {
+			if (!build_job_runnable(bcp, jobs, deps, k)) {
+				continue;
+			}
+			build_job_start(bcp, jobs, k, prefix, running);
+			running++;
+		}
+		if (running == 0) {
+			break;
+		}
+		build_job_wait(bcp, jobs, &status);
+		for (running = 0, remaining = 0, k = 0; k < n; k++) {
+			switch (jobs[k].bj_state) {
+			case BUILD_JOB_RUNNING:
+				running++;
+				/* FALLTHROUGH */
+			case BUILD_JOB_PENDING:
+				remaining++;
+				break;
+			}
+		}
+	}
+	/*
+	 * Stages left pending with nothing running depend on each other.
+	 */
+	if (remaining > 0) {
+		print_bold_prefix(stdout);
+		fprintf(stdout, "Build stages have a dependency cycle. ");
+		print_red(stdout, "Terminating");
+		fprintf(stdout, ".\n");
+		fflush(stdout);
+		if (status == 0) {
+			status = 1;
+		}
+	}
+	if (status == 0) {
+		bcp->stages[n - 1].bs_is_last = 1;
+	}
+	free(jobs);
+	free(deps);
+	return (status);
+}
+
+/*
+ * Receive the packed stages and steps of a build (see build_manifest_pack).
+ * Returns 0 if the peer went away and -1 if the manifest is not acceptable.
+ */
+static int
+build_receive_manifest(struct build_context *bcp, int sock, char *ebuf,
+    size_t len)
+{
+
+	if (bcp->pbc.p_nstages < 0 || bcp->pbc.p_nstages > MAX_BUILD_STAGES ||
+	    bcp->pbc.p_nsteps < 0 || bcp->pbc.p_nsteps > MAX_BUILD_STEPS) {
+		snprintf(ebuf, len, "too many build stages/steps");
+		return (-1);
+	}
+	if (bcp->pbc.p_manifest_len > MAX_BUILD_MANIFEST) {
+		snprintf(ebuf, len, "build manifest is too large");
+		return (-1);
+	}
+	bcp->manifest_len = bcp->pbc.p_manifest_len;
+	bcp->manifest = malloc(bcp->manifest_len);
+	if (bcp->manifest == NULL) {
+		snprintf(ebuf, len, "out of memory");
+		return (-1);
+	}
+	if (sock_ipc_must_read(sock, bcp->manifest, bcp->manifest_len) == 0) {
+		free(bcp->manifest);
+		bcp->manifest = NULL;
+		return (0);
+	}
+	if (build_manifest_unpack(bcp->manifest, bcp->manifest_len,
+	    bcp->pbc.p_nstages, bcp->pbc.p_nsteps, &bcp->stages,
+	    &bcp->steps) == -1) {
+		free(bcp->manifest);
+		bcp->manifest = NULL;
+		snprintf(ebuf, len, "invalid build manifest");
+		return (-1);
+	}
+	return (1);
+}
+
+static int
+dispatch_build_set_root(struct build_context *bcp, char *ebuf, size_t len)
+{
+	extern struct global_params gcfg;
+
+	(void) snprintf(bcp->build_root, sizeof(bcp->build_root),
+	    "%s/instances/%s", gcfg.c_data_dir, bcp->instance);
+	if (mkdir(bcp->build_root, 0755) == -1) {
+		snprintf(ebuf, len, "failed to initialize build env: %s",
+		    strerror(errno));
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Progress through the build queue is reported to attached clients. A
+ * client that goes away while its build is queued does not cancel it, it
+ * can still be followed.
+ */
+struct build_queue_waiter {
+	int		bw_sock;
+	int		bw_gone;
+};
+
+static void
+build_queued(void *arg, u_int pos)
+{
+	struct build_queue_waiter *bw;
+	struct cblock_response resp;
+
+	bw = arg;
+	if (bw->bw_gone) {
+		return;
+	}
+	bzero(&resp, sizeof(resp));
+	resp.p_ecode = CBLOCK_RESP_QUEUED;
+	snprintf(resp.p_errbuf, sizeof(resp.p_errbuf), "%u", pos);
+	if (sock_ipc_may_write(bw->bw_sock, &resp, sizeof(resp)) != 0) {
+		bw->bw_gone = 1;
+	}
+}
+
+/*
+ * Hand the client the output and exit status of the identical build it is
+ * sharing, as if it had attached to its console.
+ */
+static void
+build_share(struct buildq_entry *be, int sock, struct build_queue_waiter *bw)
+{
+	extern pthread_mutex_t cblock_mutex;
+	char instance[MAX_PRISON_NAME];
+	struct cblock_response resp;
+	struct cblock_instance *pi;
+	uint32_t cmd;
+	int status;
+
+	bzero(&resp, sizeof(resp));
+	if (buildq_wait_shared(be, build_queued, bw) == -1) {
+		resp.p_ecode = -1;
+		snprintf(resp.p_errbuf, sizeof(resp.p_errbuf),
+		    "shared build was cancelled or failed to start");
+		if (!bw->bw_gone) {
+			(void) sock_ipc_may_write(sock, &resp, sizeof(resp));
+		}
+		return;
+	}
+	strlcpy(instance, be->be_info.p_instance, sizeof(instance));
+	resp.p_ecode = CBLOCK_RESP_SHARED;
+	snprintf(resp.p_errbuf, sizeof(resp.p_errbuf), "%s", instance);
+	if (bw->bw_gone ||
+	    sock_ipc_may_write(sock, &resp, sizeof(resp)) != 0) {
+		return;
+	}
+	pthread_mutex_lock(&cblock_mutex);
+	pi = cblock_lookup_instance(instance);
+	if (pi != NULL && cblock_follow_console(pi, sock) == 0) {
+		pthread_mutex_unlock(&cblock_mutex);
+		tty_follow_session(sock);
+		cblock_unfollow_console(instance, sock);
+		return;
+	}
+	pthread_mutex_unlock(&cblock_mutex);
+	/*
+	 * The build completed before we got here, or has as many consoles
+	 * as it can take, in which case only its status is passed on.
+	 */
+	status = buildq_wait_status(be);
+	cmd = PRISON_IPC_CONSOLE_SESSION_DONE;
+	if (sock_ipc_may_write(sock, &cmd, sizeof(cmd)) == 0) {
+		(void) sock_ipc_may_write(sock, &status, sizeof(status));
+	}
+}
+
+/*
+ * Fork the build job under a pty and register it as an instance so that
+ * clients can attach to its console. Returns the pid of the build job.
+ */
+static pid_t
+build_start(struct build_context *bcp)
+{
+	extern cblock_instance_head_t pr_head;
+	extern pthread_mutex_t cblock_mutex;
+	struct cblock_instance *pi;
+
+	pi = calloc(1, sizeof(*pi));
+	if (pi == NULL) {
+		err(1, "calloc failed");
 	}
 	pi->p_type = PRISON_TYPE_BUILD;
-	pi->p_instance_tag = strdup(bctx.instance);
-	strlcpy(pi->p_image_name, bctx.pbc.p_image_name, sizeof(pi->p_image_name));
+	if (bcp->pbc.p_trace_id[0] != '\0') {
+		pi->p_trace_id = strdup(bcp->pbc.p_trace_id);
+		if (pi->p_trace_id == NULL) {
+			err(1, "strdup failed");
+		}
+	}
+	pi->p_instance_tag = strdup(bcp->instance);
+	strlcpy(pi->p_image_name, bcp->pbc.p_image_name, sizeof(pi->p_image_name));
 	pi->p_launch_time = time(NULL);
 	pi->p_pid = forkpty(&pi->p_ttyfd, pi->p_ttyname, NULL, NULL);
 	if (pi->p_pid == -1) {
 		warn("failed to fork build job");
-		return (1);
+		free(pi->p_instance_tag);
+		free(pi->p_trace_id);
+		free(pi);
+		return (-1);
 	}
 	if (pi->p_pid > 0) {
 		CBLOCKD_CBLOCK_CREATE(pi->p_instance_tag);
 		TAILQ_INIT(&pi->p_ttybuf.t_head);
 		cblock_create_pid_file(pi);
+		journal_record_launch(pi, NULL);
 		pi->p_ttybuf.t_tot_len = 0;
 		pthread_mutex_lock(&cblock_mutex);
 		TAILQ_INSERT_HEAD(&pr_head, pi, p_glue);
 		pthread_mutex_unlock(&cblock_mutex);
-		snprintf(resp.p_errbuf, sizeof(resp.p_errbuf), "%s",
-		    pi->p_instance_tag);
-		sock_ipc_must_write(sock, &resp, sizeof(resp));
-		free(bctx.steps);
-		free(bctx.stages);
-		free(bctx.instance);
-		return (1);
+		tty_io_wakeup();
+		return (pi->p_pid);
 	}
 	/*
 	 * Child process, all stdout/stdin is routed to the PTY
 	 */
+	trace_process_name(bcp->pbc.p_trace_id, "cblockd build", getpid());
 	print_bold_prefix(stdout);
-	printf("Bootstrapping build stages 1 through %d\n", bctx.pbc.p_nstages); 
+	printf("Bootstrapping build stages 1 through %d\n", bcp->pbc.p_nstages); 
 	fflush(stdout);
-	if (build_run_build_stage(&bctx) != 0) {
+	if (build_run_build_stage(bcp) != 0) {
 		fprintf(stdout, "build_run_build_stage failed\n");
+		report_finish(bcp, 1);
 		_exit(1);
 	}
 	print_bold_prefix(stdout);
 	fprintf(stdout,
 	    "Build Stage(s) complete. Writing container image...\n");
 	fflush(stdout);
-	if (build_commit_image(&bctx) != 0) {
+	if (build_commit_image(bcp) != 0) {
 		fprintf(stdout, "build_commit_image: failed\n");
+		report_finish(bcp, 1);
 		_exit(1);
 	}
+	report_finish(bcp, 0);
 	print_bold_prefix(stdout);
 	fprintf(stdout,
 	    "Cleaning up ephemeral images and build artifacts\n");
 	fflush(stdout);
-	free(bctx.instance);
 	_exit(0);
 	/* NOT REACHED */
+	return (-1);
+}
+
+/*
+ * Receive a build and queue it. Unless the client detached, the response
+ * carrying the instance is only sent once the build has been started, so
+ * that the client can attach to its console straight away.
+ */
+int
+dispatch_build_recieve(int sock, uid_t uid)
+{
+	extern struct global_params gcfg;
+	struct build_queue_waiter bw;
+	struct cblock_response resp;
+	struct buildq_entry *be;
+	struct build_context bctx;
+	uint64_t tstart, start, qstart, qtrace;
+	pid_t pid;
+	time_t started;
+	ssize_t cc;
+	int shared;
+
+	bzero(&bctx, sizeof(bctx));
+	bzero(&resp, sizeof(resp));
+	cc = sock_ipc_must_read(sock, &bctx.pbc, sizeof(bctx.pbc));
+	if (cc == 0) {
+		printf("didn't get proper build context headers\n");
+		return (0);
+	}
+	tstart = trace_now_usec();
+	start = stats_now_usec();
+	started = time(NULL);
+	bctx.pbc.p_trace_id[sizeof(bctx.pbc.p_trace_id) - 1] = '\0';
+	if (!trace_id_valid(bctx.pbc.p_trace_id)) {
+		bctx.pbc.p_trace_id[0] = '\0';
+	}
+	trace_process_name(bctx.pbc.p_trace_id, "cblockd", getpid());
+	trace_spool_prune();
+	switch (build_receive_manifest(&bctx, sock, resp.p_errbuf,
+	    sizeof(resp.p_errbuf))) {
+	case 0:
+		return (0);
+	case -1:
+		resp.p_ecode = -1;
+		sock_ipc_must_write(sock, &resp, sizeof(resp));
+		return (1);
+	}
+	bctx.instance = gen_sha256_instance_id(bctx.pbc.p_image_name);
+	if (dispatch_build_set_root(&bctx, resp.p_errbuf,
+	    sizeof(resp.p_errbuf)) == -1) {
+		warnx("build context: %s", resp.p_errbuf);
+		free(bctx.manifest);
+		free(bctx.instance);
+		resp.p_ecode = -1;
+		sock_ipc_must_write(sock, &resp, sizeof(resp));
+		return (1);
+	}
+	if (context_receive(&bctx, sock, resp.p_errbuf,
+	    sizeof(resp.p_errbuf)) == -1) {
+		warnx("build context: %s", resp.p_errbuf);
+		resp.p_ecode = -1;
+		sock_ipc_must_write(sock, &resp, sizeof(resp));
+		cblock_fork_cleanup(bctx.instance, "build", -1, gcfg.c_verbose);
+		free(bctx.manifest);
+		free(bctx.instance);
+		return (1);
+	}
+	trace_span(bctx.pbc.p_trace_id, "receive context", "cblockd", tstart);
+	report_record(&bctx, REPORT_STAGE_BUILD, "start %jd %ju",
+	    (intmax_t)started, (uintmax_t)start);
+	report_record(&bctx, REPORT_STAGE_BUILD, "context %ju",
+	    (uintmax_t)(stats_now_usec() - start));
+	be = buildq_submit(&bctx, uid, &shared);
+	bw.bw_sock = sock;
+	bw.bw_gone = 0;
+	if (shared) {
+		/*
+		 * An identical build is in flight: its output and tag are
+		 * ours, so nothing of this one is needed any more.
+		 */
+		printf("build %s shares build %s\n", bctx.instance,
+		    be->be_info.p_instance);
+		cblock_fork_cleanup(bctx.instance, "build", -1,
+		    gcfg.c_verbose);
+		qtrace = trace_now_usec();
+		if (bctx.pbc.p_detach) {
+			snprintf(resp.p_errbuf, sizeof(resp.p_errbuf), "%s",
+			    be->be_info.p_instance);
+			(void) sock_ipc_may_write(sock, &resp, sizeof(resp));
+		} else {
+			build_share(be, sock, &bw);
+		}
+		trace_span(bctx.pbc.p_trace_id, "shared build", "cblockd",
+		    qtrace);
+		buildq_leave(be);
+		free(bctx.manifest);
+		free(bctx.instance);
+		return (1);
+	}
+	if (bctx.pbc.p_detach) {
+		snprintf(resp.p_errbuf, sizeof(resp.p_errbuf), "%s",
+		    bctx.instance);
+		(void) sock_ipc_may_write(sock, &resp, sizeof(resp));
+		bw.bw_gone = 1;
+	}
+	qstart = stats_now_usec();
+	qtrace = trace_now_usec();
+	if (buildq_wait(be, build_queued, &bw) == -1) {
+		snprintf(resp.p_errbuf, sizeof(resp.p_errbuf),
+		    "build cancelled while queued");
+		pid = -1;
+	} else {
+		report_record(&bctx, REPORT_STAGE_BUILD, "queued %ju",
+		    (uintmax_t)(stats_now_usec() - qstart));
+		trace_span(bctx.pbc.p_trace_id, "build queue", "cblockd",
+		    qtrace);
+		pid = build_start(&bctx);
+		buildq_started(be, pid);
+		snprintf(resp.p_errbuf, sizeof(resp.p_errbuf), "%s",
+		    pid == -1 ? "failed to fork build job" : bctx.instance);
+	}
+	if (pid == -1) {
+		cblock_fork_cleanup(bctx.instance, "build", -1,
+		    gcfg.c_verbose);
+		resp.p_ecode = -1;
+	}
+	if (!bw.bw_gone) {
+		(void) sock_ipc_may_write(sock, &resp, sizeof(resp));
+	}
+	free(bctx.manifest);
+	free(bctx.instance);
+	return (1);
+}
+
+/*
+ * A peer may only ask us to run a stage that needs nothing but the build
+ * context and a base image that we have.
+ */
+static int
+build_peer_stage_check(struct build_context *bcp, int k, char *ebuf,
+    size_t len)
+{
+	extern struct global_params gcfg;
+	char path[MAXPATHLEN];
+	const char *base;
+
+	if (k < 0 || k >= bcp->pbc.p_nstages) {
+		snprintf(ebuf, len, "invalid stage %d", k);
+		return (-1);
+	}
+	if (!build_stage_independent(bcp, k)) {
+		snprintf(ebuf, len, "stage depends on other stages");
+		return (-1);
+	}
+	base = bcp->stages[k].bs_base_container;
+	if (base[0] == '\0' || base[0] == '.' || strchr(base, '/') != NULL) {
+		snprintf(ebuf, len, "%s: invalid image name", base);
+		return (-1);
+	}
+	(void) snprintf(path, sizeof(path), "%s/images/%s%s", gcfg.c_data_dir,
+	    base, strchr(base, ':') == NULL ? ":latest" : "");
+	if (access(path, F_OK) == -1) {
+		snprintf(ebuf, len, "no image %s", base);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Run a stage for a peer, forwarding its output as console messages. If the
+ * peer goes away the stage is left to finish, so that it can be cleaned up.
+ */
+static int
+build_peer_stage_run(struct build_context *bcp, int k, int sock)
+{
+	int fds[2], status, gone;
+	char buf[8192];
+	uint32_t cmd;
+	size_t len;
+	ssize_t cc;
+	pid_t pid;
+
+	if (pipe2(fds, O_CLOEXEC) == -1) {
+		err(1, "pipe failed");
+	}
+	fflush(stdout);
+	pid = fork();
+	if (pid == -1) {
+		err(1, "fork failed");
+	}
+	if (pid == 0) {
+		if (dup2(fds[1], STDOUT_FILENO) == -1 ||
+		    dup2(fds[1], STDERR_FILENO) == -1) {
+			err(1, "dup2 failed");
+		}
+		(void) close(sock);
+		_exit(fetch_prefetch(bcp, k) == 0 &&
+		    build_run_stage(bcp, k) == 0 ? 0 : 1);
+	}
+	(void) close(fds[1]);
+	cmd = PRISON_IPC_CONSOLE_TO_CLIENT;
+	gone = 0;
+	for (;;) {
+		cc = read(fds[0], buf, sizeof(buf));
+		if (cc == -1 && errno == EINTR) {
+			continue;
+		}
+		if (cc <= 0) {
+			break;
+		}
+		len = cc;
+		if (!gone && (sock_ipc_may_write(sock, &cmd, sizeof(cmd)) ||
+		    sock_ipc_may_write(sock, &len, sizeof(len)) ||
+		    sock_ipc_may_write(sock, buf, len))) {
+			gone = 1;
+		}
+	}
+	(void) close(fds[0]);
+	waitpid_ignore_intr(pid, &status);
+	return (gone ? -1 : status);
+}
+
+static char *
+build_peer_stage_report(struct build_context *bcp, int stage, uint64_t *lenp)
+{
+	char path[MAXPATHLEN], *buf;
+	struct stat sb;
+	int fd;
+
+	*lenp = 0;
+	report_path(bcp, stage, path, sizeof(path));
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return (NULL);
+	}
+	if (fstat(fd, &sb) == -1 || sb.st_size > BUILD_PEER_REPORT_MAX) {
+		(void) close(fd);
+		return (NULL);
+	}
+	buf = malloc(sb.st_size + 1);
+	if (buf == NULL) {
+		err(1, "malloc failed");
+	}
+	if (sock_ipc_must_read(fd, buf, sb.st_size) != sb.st_size) {
+		(void) close(fd);
+		free(buf);
+		return (NULL);
+	}
+	(void) close(fd);
+	*lenp = sb.st_size;
+	return (buf);
+}
+
+/*
+ * Send the stage root to the peer, as produced by stage_export.sh, followed
+ * by the script's exit status.
+ */
+static int
+build_peer_stage_export(struct build_context *bcp, int k, uint32_t tree,
+    int sock)
+{
+	char script[MAXPATHLEN], index[16], buf[64], **argv;
+	extern struct global_params gcfg;
+	int fds[2], status, ret;
+	vec_t *vec, *vec_env;
+	u_char *frame;
+	uint32_t len;
+	ssize_t cc;
+	pid_t pid;
+
+	if (pipe2(fds, O_CLOEXEC) == -1) {
+		err(1, "pipe failed");
+	}
+	pid = fork();
+	if (pid == -1) {
+		err(1, "fork failed");
+	}
+	if (pid == 0) {
+		if (dup2(fds[1], STDOUT_FILENO) == -1) {
+			err(1, "dup2 failed");
+		}
+		(void) close(fds[0]);
+		(void) close(fds[1]);
+		(void) close(sock);
+		vec_env = vec_init(8);
+		vec_append(vec_env, DEFAULT_PATH);
+		(void) snprintf(buf, sizeof(buf), "CBLOCK_FS=%s",
+		    gcfg.c_underlying_fs);
+		vec_append(vec_env, buf);
+		vec_append(vec_env, "LC_ALL=C");
+		vec_append(vec_env, "TAR_WRITER_OPTIONS=hdrcharset=BINARY");
+		vec_finalize(vec_env);
+		(void) snprintf(script, sizeof(script),
+		    "%s/lib/stage_export.sh", gcfg.c_data_dir);
+		(void) snprintf(index, sizeof(index), "%d",
+		    bcp->stages[k].bs_index);
+		vec = vec_init(8);
+		vec_append(vec, "/bin/sh");
+		vec_append(vec, script);
+		vec_append(vec, bcp->build_root);
+		vec_append(vec, index);
+		vec_append(vec, tree == CBLOCK_TREE_ZFS ? "zfs" : "tar");
+		if (vec_finalize(vec) != 0) {
+			errx(1, "failed to construct command line");
+		}
+		argv = vec_return(vec);
+		execve(*argv, argv, vec_return(vec_env));
+		err(1, "execve failed");
+	}
+	(void) close(fds[1]);
+	frame = malloc(CBLOCK_TREE_FRAME_MAX);
+	if (frame == NULL) {
+		err(1, "malloc failed");
+	}
+	ret = 0;
+	for (;;) {
+		cc = read(fds[0], frame, CBLOCK_TREE_FRAME_MAX);
+		if (cc == -1 && errno == EINTR) {
+			continue;
+		}
+		len = cc > 0 ? cc : 0;
+		if (sock_ipc_may_write(sock, &len, sizeof(len)) ||
+		    (len > 0 && sock_ipc_may_write(sock, frame, len))) {
+			(void) kill(pid, SIGTERM);
+			ret = -1;
+			break;
+		}
+		if (len == 0) {
+			break;
+		}
+	}
+	free(frame);
+	(void) close(fds[0]);
+	waitpid_ignore_intr(pid, &status);
+	if (ret == 0 && sock_ipc_may_write(sock, &status, sizeof(status))) {
+		ret = -1;
+	}
+	return (ret);
+}
+
+/*
+ * Run a stage of another cblockd's build (see peer.c). The stage is built
+ * under a build root of our own, which is cleaned up once its root has
+ * been sent back.
+ */
+int
+dispatch_stage_exec(int sock)
+{
+	extern struct global_params gcfg;
+	struct cblock_stage_done sd;
+	struct cblock_stage_exec se;
+	struct cblock_response resp;
+	struct build_context bctx;
+	uint32_t cmd, tree;
+	char *report;
+	int status;
+
+	bzero(&bctx, sizeof(bctx));
+	bzero(&resp, sizeof(resp));
+	if (sock_ipc_must_read(sock, &se, sizeof(se)) == 0 ||
+	    sock_ipc_must_read(sock, &bctx.pbc, sizeof(bctx.pbc)) == 0) {
+		return (0);
+	}
+	bctx.pbc.p_image_name[sizeof(bctx.pbc.p_image_name) - 1] = '\0';
+	bctx.pbc.p_trace_id[sizeof(bctx.pbc.p_trace_id) - 1] = '\0';
+	if (!trace_id_valid(bctx.pbc.p_trace_id)) {
+		bctx.pbc.p_trace_id[0] = '\0';
+	}
+	switch (build_receive_manifest(&bctx, sock, resp.p_errbuf,
+	    sizeof(resp.p_errbuf))) {
+	case 0:
+		return (0);
+	case -1:
+		resp.p_ecode = -1;
+		sock_ipc_must_write(sock, &resp, sizeof(resp));
+		return (1);
+	}
+	if (build_peer_stage_check(&bctx, se.p_stage, resp.p_errbuf,
+	    sizeof(resp.p_errbuf)) == -1) {
+		goto declined;
+	}
+	bctx.instance = gen_sha256_instance_id(bctx.pbc.p_image_name);
+	if (dispatch_build_set_root(&bctx, resp.p_errbuf,
+	    sizeof(resp.p_errbuf)) == -1) {
+		free(bctx.instance);
+		goto declined;
+	}
+	sock_ipc_must_write(sock, &resp, sizeof(resp));
+	if (context_receive(&bctx, sock, resp.p_errbuf,
+	    sizeof(resp.p_errbuf)) == -1) {
+		warnx("build context: %s", resp.p_errbuf);
+		resp.p_ecode = -1;
+		sock_ipc_must_write(sock, &resp, sizeof(resp));
+		cblock_fork_cleanup(bctx.instance, "build", -1, gcfg.c_verbose);
+		goto done;
+	}
+	sock_ipc_must_write(sock, &resp, sizeof(resp));
+	peer_stage_hold();
+	status = build_peer_stage_run(&bctx, se.p_stage, sock);
+	if (status != -1) {
+		tree = CBLOCK_TREE_TAR;
+		if ((se.p_trees & CBLOCK_TREE_ZFS) != 0 &&
+		    strcmp(gcfg.c_underlying_fs, "zfs") == 0) {
+			tree = CBLOCK_TREE_ZFS;
+		}
+		bzero(&sd, sizeof(sd));
+		sd.p_status = status;
+		sd.p_tree = tree;
+		report = NULL;
+		if (status == 0) {
+			report = build_peer_stage_report(&bctx,
+			    bctx.stages[se.p_stage].bs_index, &sd.p_report_len);
+		}
+		cmd = PRISON_IPC_STAGE_DONE;
+		if (sock_ipc_may_write(sock, &cmd, sizeof(cmd)) == 0 &&
+		    sock_ipc_may_write(sock, &sd, sizeof(sd)) == 0 &&
+		    status == 0 &&
+		    sock_ipc_may_write(sock, report, sd.p_report_len) == 0) {
+			(void) build_peer_stage_export(&bctx, se.p_stage, tree,
+			    sock);
+		}
+		free(report);
+	}
+	peer_stage_release();
+	cblock_fork_cleanup(bctx.instance, "build", -1, gcfg.c_verbose);
+done:
+	free(bctx.instance);
+	free(bctx.manifest);
+	return (1);
+declined:
+	resp.p_ecode = -1;
+	sock_ipc_must_write(sock, &resp, sizeof(resp));
+	free(bctx.manifest);
 	return (1);
 }
@@ -0,0 +1,736 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+
+#include <stdio.h>
+#include <pthread.h>
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include <openssl/evp.h>
+
+#include <cblock/libcblock.h>
+
+#include "termbuf.h"
+#include "main.h"
+#include "dispatch.h"
+#include "cblock.h"
+#include "sock_ipc.h"
+#include "config.h"
+#include "buildq.h"
+
+static pthread_mutex_t bq_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bq_cv = PTHREAD_COND_INITIALIZER;
+static TAILQ_HEAD(, buildq_entry) bq_queued =
+    TAILQ_HEAD_INITIALIZER(bq_queued);
+static TAILQ_HEAD(, buildq_entry) bq_running =
+    TAILQ_HEAD_INITIALIZER(bq_running);
+static struct buildq_stats bq_stats;
+
+void
+buildq_init(u_int limit)
+{
+
+	bq_stats.bs_limit = limit;
+}
+
+/*
+ * A limit of zero means builds are started as soon as they are received.
+ */
+static int
+buildq_has_slot(void)
+{
+
+	return (bq_stats.bs_limit == 0 ||
+	    bq_stats.bs_running < bq_stats.bs_limit);
+}
+
+static struct buildq_entry *
+buildq_lookup(const char *instance)
+{
+	struct buildq_entry *e;
+
+	TAILQ_FOREACH(e, &bq_running, be_glue) {
+		if (cblock_instance_match(e->be_info.p_instance, instance)) {
+			return (e);
+		}
+	}
+	TAILQ_FOREACH(e, &bq_queued, be_glue) {
+		if (cblock_instance_match(e->be_info.p_instance, instance)) {
+			return (e);
+		}
+	}
+	return (NULL);
+}
+
+static u_int
+buildq_position(struct buildq_entry *be)
+{
+	struct buildq_entry *e;
+	u_int pos;
+
+	pos = 1;
+	TAILQ_FOREACH(e, &bq_queued, be_glue) {
+		if (e == be) {
+			break;
+		}
+		pos++;
+	}
+	return (pos);
+}
+
+/*
+ * Hand out free slots to the head of the queue. The submitting thread is
+ * woken up to start the build itself. Must be called with bq_mutex held.
+ */
+static void
+buildq_dispatch(void)
+{
+	struct buildq_entry *e;
+
+	while (buildq_has_slot() && !TAILQ_EMPTY(&bq_queued)) {
+		e = TAILQ_FIRST(&bq_queued);
+		TAILQ_REMOVE(&bq_queued, e, be_glue);
+		bq_stats.bs_queued--;
+		e->be_flags |= BUILDQ_ADMITTED;
+		e->be_info.p_state = BUILD_STATE_RUNNING;
+		e->be_info.p_position = 0;
+		e->be_info.p_started = time(NULL);
+		TAILQ_INSERT_TAIL(&bq_running, e, be_glue);
+		bq_stats.bs_running++;
+		bq_stats.bs_started++;
+	}
+	pthread_cond_broadcast(&bq_cv);
+}
+
+/*
+ * Drop a reference to an entry. Must be called with bq_mutex held.
+ */
+static void
+buildq_put(struct buildq_entry *be)
+{
+
+	assert(be->be_refs > 0);
+	be->be_refs--;
+	if (be->be_refs == 0 &&
+	    (be->be_flags & (BUILDQ_CANCELLED | BUILDQ_RELEASED)) != 0) {
+		free(be);
+	}
+}
+
+/*
+ * Queue a build behind everything of the same or higher priority. Must be
+ * called with bq_mutex held.
+ */
+static void
+buildq_insert(struct buildq_entry *be)
+{
+	struct buildq_entry *e;
+
+	TAILQ_FOREACH(e, &bq_queued, be_glue) {
+		if (e->be_info.p_priority < be->be_info.p_priority) {
+			break;
+		}
+	}
+	if (e != NULL) {
+		TAILQ_INSERT_BEFORE(e, be, be_glue);
+	} else {
+		TAILQ_INSERT_TAIL(&bq_queued, be, be_glue);
+	}
+}
+
+static void
+buildq_hash(EVP_MD_CTX *ctx, ...)
+{
+	va_list ap;
+	char *s;
+
+	va_start(ap, ctx);
+	while ((s = va_arg(ap, char *)) != NULL) {
+		EVP_DigestUpdate(ctx, s, strlen(s) + 1);
+	}
+	va_end(ap);
+}
+
+/*
+ * Builds are identical if the same user submitted them from the same
+ * manifest and build context, with the same options as far as they change
+ * what gets built. The fingerprint is left empty, so that the build is
+ * never shared, if the digest of the context is not known.
+ */
+static void
+buildq_fingerprint(struct build_context *bcp, uid_t uid, char *fp)
+{
+	struct cblock_build_context *pbc;
+	u_char hash[EVP_MAX_MD_SIZE];
+	struct build_stage *bsp;
+	struct build_step *stp;
+	EVP_MD_CTX *ctx;
+	char buf[64];
+	u_int dlen;
+	int k, arg;
+
+	fp[0] = '\0';
+	pbc = &bcp->pbc;
+	if (bcp->context_digest[0] == '\0') {
+		return;
+	}
+	ctx = EVP_MD_CTX_new();
+	if (ctx == NULL) {
+		return;
+	}
+	if (!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
+		goto out;
+	}
+	(void) snprintf(buf, sizeof(buf), "%u %d %d %d %d", (u_int)uid,
+	    pbc->p_nstages, pbc->p_nsteps, pbc->p_no_cache,
+	    pbc->p_build_fim_spec);
+	buildq_hash(ctx, buf, pbc->p_image_name, pbc->p_tag,
+	    pbc->p_entry_point, pbc->p_entry_point_args, pbc->p_os_release,
+	    pbc->p_auditcfg, bcp->context_digest, (char *)NULL);
+	for (k = 0; k < pbc->p_nstages; k++) {
+		bsp = &bcp->stages[k];
+		(void) snprintf(buf, sizeof(buf), "%d", bsp->bs_index);
+		buildq_hash(ctx, buf, bsp->bs_name, bsp->bs_base_container,
+		    (char *)NULL);
+	}
+	for (k = 0; k < pbc->p_nsteps; k++) {
+		stp = &bcp->steps[k];
+		switch (stp->step_op) {
+		case STEP_ADD:
+			arg = stp->step_data.step_add.sa_op;
+			break;
+		case STEP_COPY_FROM:
+			arg = stp->step_data.step_copy_from.sc_stage;
+			break;
+		default:
+			arg = 0;
+		}
+		(void) snprintf(buf, sizeof(buf), "%d %d %d", stp->step_op,
+		    stp->stage_index, arg);
+		buildq_hash(ctx, buf, stp->step_string, stp->step_digest,
+		    (char *)NULL);
+	}
+	if (!EVP_DigestFinal_ex(ctx, hash, &dlen)) {
+		goto out;
+	}
+	bzero(fp, CBLOCK_DIGEST_LEN);
+	gen_sha256_string(hash, fp, dlen);
+out:
+	EVP_MD_CTX_free(ctx);
+}
+
+/*
+ * Find a build in flight that a build with this fingerprint can share.
+ * Must be called with bq_mutex held.
+ */
+static struct buildq_entry *
+buildq_lookup_shared(const char *fp)
+{
+	struct buildq_entry *e;
+
+	if (fp[0] == '\0') {
+		return (NULL);
+	}
+	TAILQ_FOREACH(e, &bq_running, be_glue) {
+		if (strcmp(e->be_fingerprint, fp) == 0 &&
+		    e->be_info.p_shared < MAX_CONSOLE_FOLLOWERS) {
+			return (e);
+		}
+	}
+	TAILQ_FOREACH(e, &bq_queued, be_glue) {
+		if (strcmp(e->be_fingerprint, fp) == 0 &&
+		    e->be_info.p_shared < MAX_CONSOLE_FOLLOWERS) {
+			return (e);
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Queue a build behind everything of the same or higher priority. Only
+ * root may queue ahead of the default priority.
+ *
+ * If an identical build is already queued or running, nothing is queued:
+ * *sharedp is set and a reference to that build is returned instead. The
+ * caller follows it with buildq_wait_shared() and drops the reference
+ * with buildq_leave(). A queued build is moved up to the priority of the
+ * most urgent build sharing it.
+ */
+struct buildq_entry *
+buildq_submit(struct build_context *bcp, uid_t uid, int *sharedp)
+{
+	char fp[CBLOCK_DIGEST_LEN];
+	struct buildq_entry *be, *nbe;
+	int priority;
+
+	priority = bcp->pbc.p_priority;
+	if (uid != 0 && priority > 0) {
+		priority = 0;
+	}
+	buildq_fingerprint(bcp, uid, fp);
+	/*
+	 * The entry is set up before taking the lock, so that the lookup and
+	 * the insert happen in one critical section and two identical
+	 * submissions can not both end up queued.
+	 */
+	nbe = calloc(1, sizeof(*nbe));
+	if (nbe == NULL) {
+		err(1, "buildq: calloc failed");
+	}
+	strlcpy(nbe->be_info.p_instance, bcp->instance,
+	    sizeof(nbe->be_info.p_instance));
+	strlcpy(nbe->be_info.p_image_name, bcp->pbc.p_image_name,
+	    sizeof(nbe->be_info.p_image_name));
+	strlcpy(nbe->be_info.p_tag, bcp->pbc.p_tag,
+	    sizeof(nbe->be_info.p_tag));
+	strlcpy(nbe->be_fingerprint, fp, sizeof(nbe->be_fingerprint));
+	nbe->be_info.p_state = BUILD_STATE_QUEUED;
+	nbe->be_info.p_priority = priority;
+	nbe->be_info.p_nstages = bcp->pbc.p_nstages;
+	nbe->be_info.p_uid = uid;
+	nbe->be_info.p_submitted = time(NULL);
+	nbe->be_refs = 1;
+	pthread_mutex_lock(&bq_mutex);
+	be = buildq_lookup_shared(fp);
+	if (be != NULL) {
+		be->be_refs++;
+		be->be_info.p_shared++;
+		bq_stats.bs_shared++;
+		if (be->be_info.p_state == BUILD_STATE_QUEUED &&
+		    be->be_info.p_priority < priority) {
+			TAILQ_REMOVE(&bq_queued, be, be_glue);
+			be->be_info.p_priority = priority;
+			buildq_insert(be);
+			pthread_cond_broadcast(&bq_cv);
+		}
+		pthread_mutex_unlock(&bq_mutex);
+		free(nbe);
+		*sharedp = 1;
+		return (be);
+	}
+	be = nbe;
+	buildq_insert(be);
+	bq_stats.bs_queued++;
+	buildq_dispatch();
+	pthread_mutex_unlock(&bq_mutex);
+	*sharedp = 0;
+	return (be);
+}
+
+/*
+ * Block until the build has been granted a slot, in which case the caller
+ * must start it and report the outcome with buildq_started(). Returns -1 if
+ * the build was cancelled while queued, the caller's reference is gone.
+ */
+int
+buildq_wait(struct buildq_entry *be, buildq_notify_t *notify, void *arg)
+{
+	struct timespec deadline;
+	u_int pos, last;
+
+	last = 0;
+	pthread_mutex_lock(&bq_mutex);
+	while ((be->be_flags & (BUILDQ_ADMITTED | BUILDQ_CANCELLED)) == 0) {
+		pos = buildq_position(be);
+		be->be_info.p_position = pos;
+		if (pos != last && notify != NULL) {
+			last = pos;
+			pthread_mutex_unlock(&bq_mutex);
+			(*notify)(arg, pos);
+			pthread_mutex_lock(&bq_mutex);
+			continue;
+		}
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec++;
+		(void) pthread_cond_timedwait(&bq_cv, &bq_mutex, &deadline);
+	}
+	if ((be->be_flags & BUILDQ_CANCELLED) != 0) {
+		buildq_put(be);
+		pthread_mutex_unlock(&bq_mutex);
+		return (-1);
+	}
+	pthread_mutex_unlock(&bq_mutex);
+	return (0);
+}
+
+/*
+ * Record the pid of an admitted build, or give its slot back if it could
+ * not be started (pid == -1), and drop the submitting thread's reference.
+ * The build may already have exited and been released.
+ */
+void
+buildq_started(struct buildq_entry *be, pid_t pid)
+{
+
+	pthread_mutex_lock(&bq_mutex);
+	assert((be->be_flags & BUILDQ_ADMITTED) != 0);
+	be->be_flags &= ~BUILDQ_ADMITTED;
+	be->be_info.p_pid = pid;
+	if (pid == -1) {
+		TAILQ_REMOVE(&bq_running, be, be_glue);
+		bq_stats.bs_running--;
+		be->be_flags |= BUILDQ_RELEASED;
+		be->be_status = -1;
+		buildq_dispatch();
+	}
+	pthread_cond_broadcast(&bq_cv);
+	buildq_put(be);
+	pthread_mutex_unlock(&bq_mutex);
+}
+
+/*
+ * Wait for a shared build to start. Returns 0 once it is running or has
+ * already completed, and -1 if it was cancelled while queued or could not
+ * be started.
+ */
+int
+buildq_wait_shared(struct buildq_entry *be, buildq_notify_t *notify,
+    void *arg)
+{
+	struct timespec deadline;
+	u_int pos, last;
+	int ret;
+
+	last = 0;
+	pthread_mutex_lock(&bq_mutex);
+	while ((be->be_flags & (BUILDQ_CANCELLED | BUILDQ_RELEASED)) == 0) {
+		if (be->be_info.p_state == BUILD_STATE_RUNNING &&
+		    (be->be_flags & BUILDQ_ADMITTED) == 0) {
+			break;
+		}
+		pos = be->be_info.p_state == BUILD_STATE_QUEUED ?
+		    buildq_position(be) : 0;
+		if (pos != 0 && pos != last && notify != NULL) {
+			last = pos;
+			pthread_mutex_unlock(&bq_mutex);
+			(*notify)(arg, pos);
+			pthread_mutex_lock(&bq_mutex);
+			continue;
+		}
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec++;
+		(void) pthread_cond_timedwait(&bq_cv, &bq_mutex, &deadline);
+	}
+	ret = 0;
+	if ((be->be_flags & BUILDQ_CANCELLED) != 0) {
+		ret = -1;
+	}
+	if ((be->be_flags & BUILDQ_RELEASED) != 0 && be->be_info.p_pid == -1) {
+		ret = -1;
+	}
+	pthread_mutex_unlock(&bq_mutex);
+	return (ret);
+}
+
+/*
+ * Wait for a shared build to be released and return its exit status.
+ * buildq_release wakes us up through buildq_dispatch.
+ */
+int
+buildq_wait_status(struct buildq_entry *be)
+{
+	int status;
+
+	pthread_mutex_lock(&bq_mutex);
+	while ((be->be_flags & BUILDQ_RELEASED) == 0) {
+		pthread_cond_wait(&bq_cv, &bq_mutex);
+	}
+	status = be->be_status;
+	pthread_mutex_unlock(&bq_mutex);
+	return (status);
+}
+
+void
+buildq_leave(struct buildq_entry *be)
+{
+
+	pthread_mutex_lock(&bq_mutex);
+	buildq_put(be);
+	pthread_mutex_unlock(&bq_mutex);
+}
+
+/*
+ * Called when a build instance goes away to free up its slot. The exit
+ * status is kept for the builds sharing it.
+ */
+void
+buildq_release(const char *instance, int status)
+{
+	struct buildq_entry *e;
+
+	pthread_mutex_lock(&bq_mutex);
+	TAILQ_FOREACH(e, &bq_running, be_glue) {
+		if (strcmp(e->be_info.p_instance, instance) == 0) {
+			break;
+		}
+	}
+	if (e == NULL) {
+		pthread_mutex_unlock(&bq_mutex);
+		return;
+	}
+	TAILQ_REMOVE(&bq_running, e, be_glue);
+	bq_stats.bs_running--;
+	e->be_flags |= BUILDQ_RELEASED;
+	e->be_status = status;
+	buildq_dispatch();
+	if (e->be_refs == 0) {
+		free(e);
+	}
+	pthread_mutex_unlock(&bq_mutex);
+}
+
+/*
+ * Wait for a queued build to start. Returns 0 once it is running and -1 if
+ * there is no such build, or it was cancelled while we were waiting.
+ */
+int
+buildq_follow(const char *instance, buildq_notify_t *notify, void *arg)
+{
+	struct timespec deadline;
+	struct buildq_entry *e;
+	u_int pos, last;
+
+	last = 0;
+	pthread_mutex_lock(&bq_mutex);
+	while (1) {
+		e = buildq_lookup(instance);
+		if (e == NULL) {
+			pthread_mutex_unlock(&bq_mutex);
+			return (-1);
+		}
+		if (e->be_info.p_state == BUILD_STATE_RUNNING &&
+		    (e->be_flags & BUILDQ_ADMITTED) == 0) {
+			break;
+		}
+		pos = e->be_info.p_state == BUILD_STATE_QUEUED ?
+		    buildq_position(e) : 0;
+		if (pos != 0 && pos != last && notify != NULL) {
+			last = pos;
+			pthread_mutex_unlock(&bq_mutex);
+			(*notify)(arg, pos);
+			pthread_mutex_lock(&bq_mutex);
+			continue;
+		}
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec++;
+		(void) pthread_cond_timedwait(&bq_cv, &bq_mutex, &deadline);
+	}
+	pthread_mutex_unlock(&bq_mutex);
+	return (0);
+}
+
+/*
+ * Queued builds are dropped from the queue, the submitting thread cleans up
+ * after them. Running builds are sent SIGTERM: forkpty(3) makes the build
+ * a session leader so this reaches every stage job and helper script, and
+ * the build is reaped like any other.
+ */
+int
+buildq_cancel(const char *instance, uid_t uid, char *ebuf, size_t len)
+{
+	struct buildq_entry *e;
+	pid_t pid;
+
+	pthread_mutex_lock(&bq_mutex);
+	e = buildq_lookup(instance);
+	if (e == NULL) {
+		pthread_mutex_unlock(&bq_mutex);
+		snprintf(ebuf, len, "%.64s: no such build", instance);
+		return (-1);
+	}
+	if (uid != 0 && uid != (uid_t)e->be_info.p_uid) {
+		pthread_mutex_unlock(&bq_mutex);
+		snprintf(ebuf, len, "%s: permission denied", instance);
+		return (-1);
+	}
+	if (e->be_info.p_state == BUILD_STATE_QUEUED) {
+		TAILQ_REMOVE(&bq_queued, e, be_glue);
+		bq_stats.bs_queued--;
+		bq_stats.bs_cancelled++;
+		e->be_flags |= BUILDQ_CANCELLED;
+		pthread_cond_broadcast(&bq_cv);
+		pthread_mutex_unlock(&bq_mutex);
+		return (0);
+	}
+	pid = e->be_info.p_pid;
+	if ((e->be_flags & BUILDQ_ADMITTED) != 0 || pid <= 0) {
+		pthread_mutex_unlock(&bq_mutex);
+		snprintf(ebuf, len, "%s: build is starting, try again",
+		    instance);
+		return (-1);
+	}
+	bq_stats.bs_cancelled++;
+	pthread_mutex_unlock(&bq_mutex);
+	if (kill(-pid, SIGTERM) == -1) {
+		snprintf(ebuf, len, "%s: kill failed: %s", instance,
+		    strerror(errno));
+		return (-1);
+	}
+	return (0);
+}
+
+int
+buildq_inspect(const char *instance, struct cblock_build_info *bip)
+{
+	struct buildq_entry *e;
+
+	pthread_mutex_lock(&bq_mutex);
+	e = buildq_lookup(instance);
+	if (e == NULL) {
+		pthread_mutex_unlock(&bq_mutex);
+		return (-1);
+	}
+	*bip = e->be_info;
+	if (e->be_info.p_state == BUILD_STATE_QUEUED) {
+		bip->p_position = buildq_position(e);
+	}
+	pthread_mutex_unlock(&bq_mutex);
+	return (0);
+}
+
+/*
+ * Snapshot the running builds followed by the queue, in the order the
+ * queued builds will be started.
+ */
+struct cblock_build_info *
+buildq_list(uint32_t *countp)
+{
+	struct cblock_build_info *vec;
+	struct buildq_entry *e;
+	uint32_t n;
+
+	pthread_mutex_lock(&bq_mutex);
+	n = bq_stats.bs_running + bq_stats.bs_queued;
+	vec = calloc(n + 1, sizeof(*vec));
+	if (vec == NULL) {
+		err(1, "buildq: calloc failed");
+	}
+	n = 0;
+	TAILQ_FOREACH(e, &bq_running, be_glue) {
+		vec[n++] = e->be_info;
+	}
+	TAILQ_FOREACH(e, &bq_queued, be_glue) {
+		vec[n] = e->be_info;
+		vec[n].p_position = n - bq_stats.bs_running + 1;
+		n++;
+	}
+	pthread_mutex_unlock(&bq_mutex);
+	*countp = n;
+	return (vec);
+}
+
+void
+buildq_get_stats(struct buildq_stats *bsp)
+{
+
+	pthread_mutex_lock(&bq_mutex);
+	*bsp = bq_stats;
+	pthread_mutex_unlock(&bq_mutex);
+}
+
+static void
+buildq_follow_queued(void *arg, u_int pos)
+{
+	struct cblock_response resp;
+	int sock;
+
+	sock = *(int *)arg;
+	bzero(&resp, sizeof(resp));
+	resp.p_ecode = CBLOCK_RESP_QUEUED;
+	snprintf(resp.p_errbuf, sizeof(resp.p_errbuf), "%u", pos);
+	(void) sock_ipc_may_write(sock, &resp, sizeof(resp));
+}
+
+int
+dispatch_build_ctl(int sock, uid_t uid)
+{
+	struct cblock_build_info *vec, bi;
+	struct cblock_response resp;
+	struct cblock_build_ctl bc;
+	uint32_t count;
+	ssize_t cc;
+
+	cc = sock_ipc_must_read(sock, &bc, sizeof(bc));
+	if (cc == 0) {
+		return (0);
+	}
+	bc.p_instance[sizeof(bc.p_instance) - 1] = '\0';
+	bzero(&resp, sizeof(resp));
+	switch (bc.p_op) {
+	case BUILD_CTL_LIST:
+		vec = buildq_list(&count);
+		sock_ipc_must_write(sock, &count, sizeof(count));
+		sock_ipc_must_write(sock, vec, count * sizeof(*vec));
+		free(vec);
+		return (1);
+	case BUILD_CTL_INSPECT:
+		if (buildq_inspect(bc.p_instance, &bi) == -1) {
+			resp.p_ecode = -1;
+			snprintf(resp.p_errbuf, sizeof(resp.p_errbuf),
+			    "%.64s: no such build", bc.p_instance);
+			sock_ipc_must_write(sock, &resp, sizeof(resp));
+			return (1);
+		}
+		sock_ipc_must_write(sock, &resp, sizeof(resp));
+		sock_ipc_must_write(sock, &bi, sizeof(bi));
+		return (1);
+	case BUILD_CTL_FOLLOW:
+		if (buildq_follow(bc.p_instance, buildq_follow_queued,
+		    &sock) == -1 || buildq_inspect(bc.p_instance, &bi) == -1) {
+			resp.p_ecode = -1;
+			snprintf(resp.p_errbuf, sizeof(resp.p_errbuf),
+			    "%.64s: no such build", bc.p_instance);
+		} else {
+			snprintf(resp.p_errbuf, sizeof(resp.p_errbuf), "%s",
+			    bi.p_instance);
+		}
+		(void) sock_ipc_may_write(sock, &resp, sizeof(resp));
+		return (1);
+	case BUILD_CTL_CANCEL:
+		if (buildq_cancel(bc.p_instance, uid, resp.p_errbuf,
+		    sizeof(resp.p_errbuf)) == -1) {
+			resp.p_ecode = -1;
+		}
+		sock_ipc_must_write(sock, &resp, sizeof(resp));
+		return (1);
+	}
+	resp.p_ecode = -1;
+	snprintf(resp.p_errbuf, sizeof(resp.p_errbuf),
+	    "invalid build control operation %u", bc.p_op);
+	sock_ipc_must_write(sock, &resp, sizeof(resp));
+	return (1);
+}
@@ -0,0 +1,87 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef BUILDQ_DOT_H_
+#define	BUILDQ_DOT_H_
+
+struct build_context;
+
+/*
+ * Build queue: at most bq_limit builds run at any one time. Queued builds
+ * are started highest priority first, and in order of submission within a
+ * priority. A build that is identical to one already queued or running
+ * shares it rather than being queued itself (see buildq_submit).
+ *
+ * Entries are reference counted. The submitting thread holds a reference
+ * until the build has been started, as does every build sharing it. An
+ * entry is freed once it has been cancelled while queued, or its build
+ * instance removed (see buildq_release), and the last reference is gone.
+ */
+struct buildq_entry {
+	struct cblock_build_info	be_info;
+	char				be_fingerprint[CBLOCK_DIGEST_LEN];
+	int				be_flags;
+#define	BUILDQ_ADMITTED		0x00000001	/* slot granted, starting */
+#define	BUILDQ_CANCELLED	0x00000002
+#define	BUILDQ_RELEASED		0x00000004	/* build instance removed */
+	u_int				be_refs;
+	int				be_status;	/* once released */
+	TAILQ_ENTRY(buildq_entry)	be_glue;
+};
+
+struct buildq_stats {
+	u_int			bs_limit;
+	u_int			bs_running;
+	u_int			bs_queued;
+	uint64_t		bs_started;
+	uint64_t		bs_cancelled;
+	uint64_t		bs_shared;
+};
+
+/*
+ * Called (with no locks held) while a build is waiting, whenever its
+ * position in the queue changes. Position 1 is next in line.
+ */
+typedef void	buildq_notify_t(void *, u_int);
+
+void	buildq_init(u_int);
+struct buildq_entry *
+	buildq_submit(struct build_context *, uid_t, int *);
+int	buildq_wait(struct buildq_entry *, buildq_notify_t *, void *);
+void	buildq_started(struct buildq_entry *, pid_t);
+int	buildq_wait_shared(struct buildq_entry *, buildq_notify_t *, void *);
+int	buildq_wait_status(struct buildq_entry *);
+void	buildq_leave(struct buildq_entry *);
+void	buildq_release(const char *, int);
+int	buildq_follow(const char *, buildq_notify_t *, void *);
+int	buildq_cancel(const char *, uid_t, char *, size_t);
+int	buildq_inspect(const char *, struct cblock_build_info *);
+struct cblock_build_info *
+	buildq_list(uint32_t *);
+void	buildq_get_stats(struct buildq_stats *);
+int	dispatch_build_ctl(int, uid_t);
+
+#endif	/* BUILDQ_DOT_H_ */
@@ -0,0 +1,321 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+
+#include <cblock/libcblock.h>
+
+#include "termbuf.h"
+#include "main.h"
+#include "dispatch.h"
+#include "config.h"
+#include "cache.h"
+
+static int	cache_stage_digest(struct build_context *, int, char *, int);
+
+int
+cache_enabled(struct build_context *bcp)
+{
+	extern struct global_params gcfg;
+
+	return (gcfg.c_build_cache_size != 0 && !bcp->pbc.p_no_cache);
+}
+
+/*
+ * Hash a list of strings into a hex digest. Each string is terminated so
+ * that ("ab", "c") and ("a", "bc") do not collide.
+ */
+static int
+cache_hash(char *digest, ...)
+{
+	u_char hash[EVP_MAX_MD_SIZE];
+	EVP_MD_CTX *ctx;
+	va_list ap;
+	u_int dlen;
+	char *s;
+	int ret;
+
+	ctx = EVP_MD_CTX_new();
+	if (ctx == NULL) {
+		return (-1);
+	}
+	ret = -1;
+	if (!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
+		goto out;
+	}
+	va_start(ap, digest);
+	while ((s = va_arg(ap, char *)) != NULL) {
+		EVP_DigestUpdate(ctx, s, strlen(s) + 1);
+	}
+	va_end(ap);
+	if (!EVP_DigestFinal_ex(ctx, hash, &dlen)) {
+		goto out;
+	}
+	bzero(digest, CBLOCK_DIGEST_LEN);
+	gen_sha256_string(hash, digest, dlen);
+	ret = 0;
+out:
+	EVP_MD_CTX_free(ctx);
+	return (ret);
+}
+
+static struct build_stage *
+cache_lookup_stage(struct build_context *bcp, int index)
+{
+	int k;
+
+	for (k = 0; k < bcp->pbc.p_nstages; k++) {
+		if (bcp->stages[k].bs_index == index) {
+			return (&bcp->stages[k]);
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * The digest of the root file system a stage starts from. For a stage
+ * built FROM an earlier stage this is that stage's final step key. For an
+ * image it is the directory the tag currently points to, which is unique
+ * to the build that committed the image.
+ */
+static int
+cache_base_digest(struct build_context *bcp, struct build_stage *stage,
+    char *digest, int depth)
+{
+	char path[MAXPATHLEN], real[MAXPATHLEN];
+	extern struct global_params gcfg;
+	struct build_stage *bstg;
+	int k;
+
+	for (k = 0; k < bcp->pbc.p_nstages; k++) {
+		bstg = &bcp->stages[k];
+		if (bstg == stage || bstg->bs_name[0] == '\0') {
+			continue;
+		}
+		if (strcmp(bstg->bs_name, stage->bs_base_container) == 0) {
+			return (cache_stage_digest(bcp, bstg->bs_index,
+			    digest, depth + 1));
+		}
+	}
+	if (strchr(stage->bs_base_container, ':') != NULL) {
+		(void) snprintf(path, sizeof(path), "%s/images/%s",
+		    gcfg.c_data_dir, stage->bs_base_container);
+	} else {
+		(void) snprintf(path, sizeof(path), "%s/images/%s:latest",
+		    gcfg.c_data_dir, stage->bs_base_container);
+	}
+	if (realpath(path, real) == NULL) {
+		return (-1);
+	}
+	return (cache_hash(digest, "image", real, bcp->pbc.p_os_release,
+	    (char *)NULL));
+}
+
+static int
+cache_stage_keys_depth(struct build_context *bcp, int stage_index,
+    struct cache_step *csp, int depth)
+{
+	char parent[CBLOCK_DIGEST_LEN], env[CBLOCK_DIGEST_LEN];
+	char from[CBLOCK_DIGEST_LEN], *input;
+	struct build_stage *stage;
+	struct build_step *bsp;
+	int k, n;
+
+	if (depth > MAX_BUILD_STAGES) {
+		return (-1);
+	}
+	stage = cache_lookup_stage(bcp, stage_index);
+	if (stage == NULL) {
+		return (-1);
+	}
+	if (cache_base_digest(bcp, stage, parent, depth) == -1) {
+		parent[0] = '\0';
+	}
+	bzero(env, sizeof(env));
+	for (n = 0, k = 0; k < bcp->pbc.p_nsteps; k++) {
+		bsp = &bcp->steps[k];
+		if (bsp->stage_index != stage_index) {
+			continue;
+		}
+		csp[n].cs_step = k;
+		csp[n].cs_key[0] = '\0';
+		input = "";
+		switch (bsp->step_op) {
+		case STEP_COPY:
+			input = bsp->step_digest;
+			if (*input == '\0') {
+				parent[0] = '\0';
+			}
+			break;
+		case STEP_ADD:
+			/*
+			 * For URLs this is the digest of what fetch_prefetch
+			 * resolved them to.
+			 */
+			input = bsp->step_digest;
+			if (*input == '\0') {
+				parent[0] = '\0';
+			}
+			break;
+		case STEP_COPY_FROM:
+			if (cache_stage_digest(bcp,
+			    bsp->step_data.step_copy_from.sc_stage, from,
+			    depth + 1) == -1) {
+				parent[0] = '\0';
+			}
+			input = from;
+			break;
+		}
+		if (parent[0] != '\0') {
+			if (cache_hash(csp[n].cs_key, parent, bsp->step_string,
+			    env, input, (char *)NULL) == -1) {
+				csp[n].cs_key[0] = '\0';
+			}
+			strlcpy(parent, csp[n].cs_key, sizeof(parent));
+		}
+		if (bsp->step_op == STEP_ENV || bsp->step_op == STEP_WORKDIR) {
+			(void) cache_hash(env, env, bsp->step_string,
+			    (char *)NULL);
+		}
+		n++;
+	}
+	return (n);
+}
+
+static int
+cache_stage_count(struct build_context *bcp, int stage_index)
+{
+	int k, n;
+
+	for (n = 0, k = 0; k < bcp->pbc.p_nsteps; k++) {
+		if (bcp->steps[k].stage_index == stage_index) {
+			n++;
+		}
+	}
+	return (n);
+}
+
+/*
+ * The key of the last step of a stage, i.e. the state of its root once it
+ * has been built. Used by stages that start from or copy out of it.
+ */
+static int
+cache_stage_digest(struct build_context *bcp, int stage_index, char *digest,
+    int depth)
+{
+	struct cache_step *csp;
+	struct build_stage *stage;
+	int n, ret;
+
+	n = cache_stage_count(bcp, stage_index);
+	if (n == 0) {
+		stage = cache_lookup_stage(bcp, stage_index);
+		if (stage == NULL || depth > MAX_BUILD_STAGES) {
+			return (-1);
+		}
+		return (cache_base_digest(bcp, stage, digest, depth));
+	}
+	csp = calloc(n, sizeof(*csp));
+	if (csp == NULL) {
+		return (-1);
+	}
+	ret = -1;
+	if (cache_stage_keys_depth(bcp, stage_index, csp, depth) == n &&
+	    csp[n - 1].cs_key[0] != '\0') {
+		strlcpy(digest, csp[n - 1].cs_key, CBLOCK_DIGEST_LEN);
+		ret = 0;
+	}
+	free(csp);
+	return (ret);
+}
+
+/*
+ * Compute the cache keys for each step of a stage, in the order the steps
+ * are run. The caller frees the returned array.
+ */
+struct cache_step *
+cache_stage_keys(struct build_context *bcp, int stage_index, int *nsteps)
+{
+	struct cache_step *csp;
+	int n;
+
+	n = cache_stage_count(bcp, stage_index);
+	csp = calloc(n + 1, sizeof(*csp));
+	if (csp == NULL) {
+		err(1, "calloc cache keys failed");
+	}
+	if (cache_stage_keys_depth(bcp, stage_index, csp, 0) != n) {
+		bzero(csp, (n + 1) * sizeof(*csp));
+	}
+	*nsteps = n;
+	return (csp);
+}
+
+/*
+ * Find the last step of the stage that has a layer in the cache. Since keys
+ * are chained, that layer holds the result of every step up to and
+ * including it. The layer is touched so that it is the most recently used
+ * as far as eviction is concerned.
+ */
+int
+cache_lookup(struct cache_step *csp, int nsteps, char *layer, size_t len)
+{
+	extern struct global_params gcfg;
+	char path[MAXPATHLEN];
+	int k;
+
+	for (k = nsteps - 1; k >= 0; k--) {
+		if (csp[k].cs_key[0] == '\0') {
+			continue;
+		}
+		(void) snprintf(path, sizeof(path), "%s/%s/%s/%s",
+		    gcfg.c_data_dir, CACHE_DIR, csp[k].cs_key,
+		    CACHE_LAYER_FILE);
+		if (access(path, F_OK) == -1) {
+			continue;
+		}
+		(void) utimes(path, NULL);
+		(void) snprintf(layer, len, "%s/%s/%s", gcfg.c_data_dir,
+		    CACHE_DIR, csp[k].cs_key);
+		return (k);
+	}
+	return (-1);
+}
@@ -0,0 +1,49 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef CACHE_DOT_H_
+#define	CACHE_DOT_H_
+
+#define	CACHE_DIR		"cache"
+#define	CACHE_LAYER_FILE	"LAYER"	/* size of a completed layer */
+
+/*
+ * Each step of a stage is keyed by the key of the step before it (or the
+ * base image for the first step), the step itself, the ENV and WORKDIR
+ * state it runs under and the content of any files it reads. A step whose
+ * inputs can not be pinned down (ADD of a URL, for example) has an empty
+ * key, as do all of the steps after it.
+ */
+struct cache_step {
+	int				cs_step;	/* index into bcp->steps */
+	char				cs_key[CBLOCK_DIGEST_LEN];
+};
+
+int			cache_enabled(struct build_context *);
+struct cache_step *	cache_stage_keys(struct build_context *, int, int *);
+int			cache_lookup(struct cache_step *, int, char *, size_t);
+
+#endif	/* CACHE_DOT_H_ */
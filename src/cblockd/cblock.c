@@ -30,7 +30,9 @@
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
+#ifdef __FreeBSD__
 #include <sys/ttycom.h>
+#endif
 
 #include <stdio.h>
 #include <ctype.h>
@@ -43,7 +45,11 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <termios.h>
+#ifdef __FreeBSD__
 #include <libutil.h>
+#else
+#include <pty.h>
+#endif
 #include <signal.h>
 #include <assert.h>
 #include <string.h>
@@ -55,12 +61,18 @@
 #include "dispatch.h"
 #include "sock_ipc.h"
 #include "cblock.h"
+#include "sched.h"
+#include "stats.h"
 #include "config.h"
 
 #include "probes.h"
 
 #include <cblock/libcblock.h>
 
+#include "journal.h"
+#include "buildq.h"
+#include "trace.h"
+
 static int reap_children;
 cblock_peer_head_t p_head;
 cblock_instance_head_t pr_head;
@@ -87,6 +99,10 @@ cblock_create_pid_file(struct cblock_instance *p)
 		warn("open(%s)", pid_path);
 		return (-1);
 	}
+	if (cblock_lock_fd(p->p_pid_file, flags) == -1) {
+		warn("lock(%s)", pid_path);
+		return (-1);
+	}
 	if (write(p->p_pid_file, pid_buf, strlen(pid_buf)) == -1) {
 		warn("write pid file failed");
 		return (-1);
@@ -94,6 +110,35 @@ cblock_create_pid_file(struct cblock_instance *p)
 	return (0);
 }
 
+/*
+ * Re-acquire the lock on the pid file of an instance launched by a previous
+ * instance of the daemon.
+ */
+int
+cblock_reopen_pid_file(struct cblock_instance *p)
+{
+	extern struct global_params gcfg;
+	char pid_path[1024];
+	int flags;
+
+	flags = O_WRONLY | O_EXLOCK | O_NONBLOCK;
+	snprintf(pid_path, sizeof(pid_path), "%s/locks/%s.pid",
+	    gcfg.c_data_dir, p->p_instance_tag);
+	p->p_pid_file = open(pid_path, flags);
+	if (p->p_pid_file == -1) {
+		warn("open(%s)", pid_path);
+		return (-1);
+	}
+	if (cblock_lock_fd(p->p_pid_file, flags) == -1) {
+		warn("lock(%s)", pid_path);
+		(void) close(p->p_pid_file);
+		p->p_pid_file = -1;
+		return (-1);
+	}
+	p->p_pid_file_path = strdup(pid_path);
+	return (0);
+}
+
 size_t
 cblock_instance_get_count(void)
 {
@@ -147,6 +192,10 @@ cblock_populate_instance_entries(size_t max_ents)
 			(void) snprintf(cur->p_type, sizeof(cur->p_type),
 			    "assembled");
 			break;
+		case PRISON_TYPE_SYNTHETIC:
+			(void) snprintf(cur->p_type, sizeof(cur->p_type),
+			    "synthetic");
+			break;
 		default:
 			assert(0);
 		}
@@ -177,12 +226,17 @@ cblock_fork_cleanup(char *instance, char *type, int dup_sock, int verbose)
 	extern struct global_params gcfg;
         char buf[128], **argv;
         vec_t *vec, *vec_env;
+	uint64_t start, usec;
         int status;
 
+	start = stats_now_usec();
         pid_t pid = fork();
         if (pid == -1) {
                 err(1, "cblock_remove: failed to execute cleanup handlers");
         }
+	if (pid > 0) {
+		CBLOCKD_HELPER_EXEC("stage_launch_cleanup.sh", instance, pid);
+	}
         if (pid == 0) {
 		vec_env = vec_init(8);
 		sprintf(buf, "CBLOCK_FS=%s", gcfg.c_underlying_fs);
@@ -210,9 +264,35 @@ cblock_fork_cleanup(char *instance, char *type, int dup_sock, int verbose)
 		err(1, "cblock_remove: execve failed");
 	}
 	waitpid_ignore_intr(pid, &status);
+	usec = stats_now_usec() - start;
+	stats_hist_observe(STATS_H_CLEANUP, usec);
+	CBLOCKD_HELPER_DONE("stage_launch_cleanup.sh", instance, status, usec);
 	CBLOCKD_CBLOCK_CLEANUP(instance, status, type);
 }
 
+/*
+ * Give up the launch slot held by this instance, if any.
+ */
+void
+cblock_launch_release(struct cblock_instance *pi)
+{
+	extern struct sched launch_sched;
+	struct sched_stats ss;
+
+	if ((pi->p_state & STATE_LAUNCHING) == 0) {
+		return;
+	}
+	pi->p_state &= ~STATE_LAUNCHING;
+	(void) close(pi->p_pipe[0]);
+	pi->p_pipe[0] = -1;
+	sched_leave(&launch_sched);
+	stats_hist_observe(STATS_H_LAUNCH,
+	    stats_now_usec() - pi->p_launch_start);
+	sched_get_stats(&launch_sched, &ss);
+	CBLOCKD_LAUNCH_RELEASE(pi->p_instance_tag, ss.ss_inflight);
+	trace_span(pi->p_trace_id, "launch", "cblockd", pi->p_trace_start);
+}
+
 void
 cblock_remove(struct cblock_instance *pi)
 {
@@ -220,6 +300,7 @@ cblock_remove(struct cblock_instance *pi)
 	char *instance_type;
 	uint32_t cmd;
 	size_t cur;
+	u_int k;
 
 	/*
 	 * Tell the remote side to dis-connect.
@@ -229,14 +310,22 @@ cblock_remove(struct cblock_instance *pi)
 	 */
 	if ((pi->p_state & STATE_CONNECTED) != 0) {
 		cmd = PRISON_IPC_CONSOLE_SESSION_DONE;
-		sock_ipc_must_write(pi->p_peer_sock, &cmd, sizeof(cmd));
 		/*
 		 * If this is a cellblock build, the peer will be waiting for
 		 * ultimate status code of the build job, so send it.
 		 */
-		if (pi->p_type == PRISON_TYPE_BUILD) {
-			sock_ipc_must_write(pi->p_peer_sock, &pi->p_status,
-			    sizeof(pi->p_status));
+		if (sock_ipc_may_write(pi->p_peer_sock, &cmd,
+		    sizeof(cmd)) == 0 && pi->p_type == PRISON_TYPE_BUILD) {
+			(void) sock_ipc_may_write(pi->p_peer_sock,
+			    &pi->p_status, sizeof(pi->p_status));
+		}
+	}
+	for (k = 0; k < pi->p_nfollowers; k++) {
+		cmd = PRISON_IPC_CONSOLE_SESSION_DONE;
+		if (sock_ipc_may_write(pi->p_followers[k], &cmd,
+		    sizeof(cmd)) == 0) {
+			(void) sock_ipc_may_write(pi->p_followers[k],
+			    &pi->p_status, sizeof(pi->p_status));
 		}
 	}
 	switch (pi->p_type) {
@@ -246,13 +335,32 @@ cblock_remove(struct cblock_instance *pi)
 	case PRISON_TYPE_REGULAR:
 		instance_type = "regular";
 		break;
+	case PRISON_TYPE_SYNTHETIC:
+		instance_type = "synthetic";
+		break;
 	default:
 		assert(0);
 	}
 	CBLOCKD_CBLOCK_DESTROY(pi->p_instance_tag, pi->p_status);
-	cblock_fork_cleanup(pi->p_instance_tag, instance_type, -1, gcfg.c_verbose);
-	assert(pi->p_ttyfd != -1);
-	(void) close(pi->p_ttyfd);
+	/*
+	 * Synthetic instances have nothing to tear down and are not
+	 * journaled.
+	 */
+	if (pi->p_type != PRISON_TYPE_SYNTHETIC) {
+		cblock_fork_cleanup(pi->p_instance_tag, instance_type, -1,
+		    gcfg.c_verbose);
+		journal_record_exit(pi);
+	}
+	cblock_launch_release(pi);
+	if (pi->p_type == PRISON_TYPE_BUILD) {
+		buildq_release(pi->p_instance_tag, pi->p_status);
+	}
+	/*
+	 * Instances adopted from a previous daemon do not have a tty.
+	 */
+	if (pi->p_ttyfd != -1) {
+		(void) close(pi->p_ttyfd);
+	}
 	TAILQ_REMOVE(&pr_head, pi, p_glue);
 	cur = pi->p_ttybuf.t_tot_len;
 	while (cur > 0) {
@@ -265,9 +373,85 @@ cblock_remove(struct cblock_instance *pi)
 	}
 	free(pi->p_pid_file_path);
 	free(pi->p_instance_tag);
+	free(pi->p_trace_id);
+	free(pi->p_followers);
 	free(pi);
 }
 
+/*
+ * Send a chunk of console output to a client. Returns -1 if the client has
+ * gone away.
+ */
+int
+cblock_console_write(int sock, void *buf, size_t len)
+{
+	uint32_t cmd;
+
+	cmd = PRISON_IPC_CONSOLE_TO_CLIENT;
+	if (sock_ipc_may_write(sock, &cmd, sizeof(cmd)) ||
+	    sock_ipc_may_write(sock, &len, sizeof(len)) ||
+	    sock_ipc_may_write(sock, buf, len)) {
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Add a read-only console to a build instance: the client is sent what the
+ * build has output so far, then everything it outputs from here on, and its
+ * exit status once it is done. Must be called with cblock_mutex held, so
+ * that the replay can not be overtaken by new output.
+ */
+int
+cblock_follow_console(struct cblock_instance *pi, int sock)
+{
+	char *tty_block, *trimmed;
+	size_t len;
+	int *vec;
+
+	if (pi->p_type != PRISON_TYPE_BUILD ||
+	    pi->p_nfollowers >= MAX_CONSOLE_FOLLOWERS) {
+		return (-1);
+	}
+	vec = realloc(pi->p_followers, (pi->p_nfollowers + 1) * sizeof(*vec));
+	if (vec == NULL) {
+		err(1, "realloc failed");
+	}
+	pi->p_followers = vec;
+	tty_block = termbuf_to_contig(&pi->p_ttybuf);
+	if (tty_block != NULL) {
+		trimmed = tty_trim_buffer(tty_block, pi->p_ttybuf.t_tot_len,
+		    &len);
+		if (len > 0 && cblock_console_write(sock, trimmed, len) == -1) {
+			free(tty_block);
+			return (-1);
+		}
+		free(tty_block);
+	}
+	pi->p_followers[pi->p_nfollowers++] = sock;
+	CBLOCKD_CBLOCK_CONSOLE_ATTACH(pi->p_instance_tag);
+	return (0);
+}
+
+void
+cblock_unfollow_console(const char *instance, int sock)
+{
+	struct cblock_instance *pi;
+	u_int k;
+
+	pthread_mutex_lock(&cblock_mutex);
+	pi = cblock_lookup_instance(instance);
+	for (k = 0; pi != NULL && k < pi->p_nfollowers; k++) {
+		if (pi->p_followers[k] != sock) {
+			continue;
+		}
+		pi->p_followers[k] = pi->p_followers[--pi->p_nfollowers];
+		CBLOCKD_CBLOCK_CONSOLE_DETACH(pi->p_instance_tag);
+		break;
+	}
+	pthread_mutex_unlock(&cblock_mutex);
+}
+
 void
 cblock_detach_console(const char *instance)
 {
@@ -295,14 +479,27 @@ void
 cblock_reap_children(void)
 {
 	struct cblock_instance *pi, *p_temp;
+	char jail[288];
 	int status;
 	pid_t pid;
 
 	pthread_mutex_lock(&cblock_mutex);
 	TAILQ_FOREACH_SAFE(pi, &pr_head, p_glue, p_temp) {
-		pid = waitpid(pi->p_pid, &status, WNOHANG);
-		if (pid != pi->p_pid) {
-			continue;
+		/*
+		 * Adopted instances are not our children, so we can not
+		 * wait on them. Poll for their jails instead.
+		 */
+		if ((pi->p_state & STATE_ADOPTED) != 0) {
+			journal_jail_name(pi, jail, sizeof(jail));
+			if (journal_jail_alive(jail)) {
+				continue;
+			}
+			status = 0;
+		} else {
+			pid = waitpid(pi->p_pid, &status, WNOHANG);
+			if (pid != pi->p_pid) {
+				continue;
+			}
 		}
 		pi->p_state |= STATE_DEAD;
 		pi->p_status = status;
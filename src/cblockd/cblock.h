@@ -2,13 +2,18 @@
 #define CBLOCK_DOT_H_
 
 int		cblock_create_pid_file(struct cblock_instance *);
+int		cblock_reopen_pid_file(struct cblock_instance *);
 size_t		cblock_instance_get_count(void);
 struct instance_ent *
 		cblock_populate_instance_entries(size_t);
 int		cblock_instance_match(char *, const char *);
 void		cblock_fork_cleanup(char *, char *, int, int);
+void		cblock_launch_release(struct cblock_instance *);
 void		cblock_remove(struct cblock_instance *);
 void		cblock_detach_console(const char *);
+int		cblock_console_write(int, void *, size_t);
+int		cblock_follow_console(struct cblock_instance *, int);
+void		cblock_unfollow_console(const char *, int);
 void		cblock_reap_children(void);
 int		cblock_instance_is_dead(const char *);
 struct cblock_instance *
@@ -4,6 +4,23 @@
 #define	DEFAULT_DATA_DIR	"/usr/local/lib/cblockd"
 #define	MAX_BUILD_STAGES	256
 #define	MAX_BUILD_STEPS		(512*MAX_BUILD_STAGES)
+#define	MAX_BUILD_MANIFEST	(64 * 1024 * 1024)	/* packed stages/steps */
+#define	MAX_BUILD_JOBS		32	/* stages built concurrently */
+#define	MAX_CONTEXT_MANIFEST	(256 * 1024 * 1024)
+#define	CONTEXT_BUF_SIZE	(1024 * 1024)	/* context receive and copy */
+#define	FIM_BUF_SIZE		(1024 * 1024)
+#define	FIM_MAX_THREADS		16	/* FIM spec hashing threads */
+#define	DEFAULT_FIM_INTERVAL	60	/* seconds between drift checks */
+#define	DEFAULT_MAX_BUILDS	4	/* builds run concurrently */
+#define	MAX_CONSOLE_FOLLOWERS	64	/* read-only consoles per build */
+#define	DEFAULT_BUILD_CACHE_MB	10240	/* step cache size before eviction */
+#define	CBLOCK_READY_FD		3	/* launch script readiness pipe */
+#define	CBLOCK_TRACE_FD		4	/* helper script trace markers */
+#define	PEER_WRITE_STALL_USEC	10000	/* console writes slower than this */
+#define	BUILD_PEER_PORT		"7070"	/* default port of --peer */
+#define	BUILD_PEER_TIMEOUT_MS	2000	/* connecting to, polling peers */
+#define	BUILD_FETCH_JOBS	8	/* URLs of ADD steps fetched at once */
+#define	BUILD_PEER_REPORT_MAX	(1024 * 1024)
 #define	DEFAULT_PATH		"PATH=/tmp/cblock_forge/bin:/bin:/sbin:/usr/bin:/usr/sbin:/usr/local/bin:/usr/local/sbin"
 
 #endif
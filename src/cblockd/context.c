@@ -0,0 +1,1180 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include <openssl/evp.h>
+#include <zlib.h>
+
+#include <cblock/libcblock.h>
+
+#include "termbuf.h"
+#include "main.h"
+#include "dispatch.h"
+#include "config.h"
+#include "context.h"
+
+/*
+ * Build contexts arrive as a manifest (see struct cblock_context_entry).
+ * File contents are kept in a store under the data directory named by
+ * their SHA-256, so that files which have not changed since an earlier
+ * build do not need to be sent again. The context is materialized as a
+ * directory tree next to the build root, from which each stage copies it.
+ *
+ * Receiving and materializing overlap: a second thread lays out the tree
+ * while contents are still arriving, waiting only for the files whose
+ * contents have not been received yet. The manifest is kept next to the
+ * build root, so that the context can be sent on to a peer that is to run
+ * one of the stages (see peer.c).
+ */
+struct context_ent {
+	struct cblock_context_entry	 ce;
+	char				*path;
+	char				*link;
+};
+
+struct context_stream {
+	int				 cs_sock;
+	int				 cs_transfer;
+	z_stream			 cs_zs;
+	u_char				*cs_frame;
+	int				 cs_end;
+};
+
+struct context_recv {
+	pthread_mutex_t			 cr_lock;
+	pthread_cond_t			 cr_cv;
+	int				 cr_done;
+	struct build_context		*cr_bcp;
+	struct context_ent		*cr_ents;
+	int				 cr_n;
+	char				 cr_ebuf[MAX_ERR_BUF];
+	int				 cr_ret;
+};
+
+static void
+context_blob_path(const char *digest, char *buf, size_t len)
+{
+	extern struct global_params gcfg;
+
+	(void) snprintf(buf, len, "%s/%s/%.2s/%s", gcfg.c_data_dir,
+	    CONTEXT_BLOB_DIR, digest, digest);
+}
+
+static void
+context_manifest_path(struct build_context *bcp, char *buf, size_t len)
+{
+
+	(void) snprintf(buf, len, "%s.%s", bcp->build_root,
+	    CONTEXT_MANIFEST_FILE);
+}
+
+int
+context_digest_valid(const char *digest)
+{
+	int k;
+
+	for (k = 0; k < CBLOCK_DIGEST_LEN - 1; k++) {
+		if (!isxdigit((u_char)digest[k]) || isupper((u_char)digest[k])) {
+			return (0);
+		}
+	}
+	return (digest[k] == '\0');
+}
+
+/*
+ * Paths are relative to the context root and may not climb out of it.
+ */
+static int
+context_path_valid(const char *path)
+{
+	const char *c, *p;
+	size_t seg;
+
+	if (*path == '/') {
+		return (0);
+	}
+	for (c = path; ; c = p + 1) {
+		p = strchr(c, '/');
+		seg = p != NULL ? (size_t)(p - c) : strlen(c);
+		if (seg == 0 || (seg == 1 && c[0] == '.') ||
+		    (seg == 2 && c[0] == '.' && c[1] == '.')) {
+			return (0);
+		}
+		if (p == NULL) {
+			break;
+		}
+	}
+	return (1);
+}
+
+static int
+context_parse(char *buf, size_t len, struct context_ent *ents, int n,
+    char *ebuf, size_t elen)
+{
+	struct context_ent *cep;
+	size_t off;
+	int k;
+
+	off = 0;
+	for (k = 0; k < n; k++) {
+		cep = &ents[k];
+		if (len - off < sizeof(cep->ce)) {
+			snprintf(ebuf, elen, "truncated context manifest");
+			return (-1);
+		}
+		bcopy(buf + off, &cep->ce, sizeof(cep->ce));
+		off += sizeof(cep->ce);
+		if (cep->ce.ce_path_len == 0 ||
+		    cep->ce.ce_path_len > MAXPATHLEN ||
+		    cep->ce.ce_link_len > MAXPATHLEN ||
+		    len - off < cep->ce.ce_path_len + cep->ce.ce_link_len) {
+			snprintf(ebuf, elen, "malformed context manifest");
+			return (-1);
+		}
+		cep->path = buf + off;
+		off += cep->ce.ce_path_len;
+		if (cep->path[cep->ce.ce_path_len - 1] != '\0' ||
+		    !context_path_valid(cep->path)) {
+			snprintf(ebuf, elen, "invalid context path");
+			return (-1);
+		}
+		if (cep->ce.ce_link_len != 0) {
+			cep->link = buf + off;
+			off += cep->ce.ce_link_len;
+			if (cep->link[cep->ce.ce_link_len - 1] != '\0') {
+				snprintf(ebuf, elen, "invalid link target");
+				return (-1);
+			}
+		}
+		if (S_ISLNK(cep->ce.ce_mode) != (cep->link != NULL)) {
+			snprintf(ebuf, elen, "%s: invalid link", cep->path);
+			return (-1);
+		}
+		if (S_ISREG(cep->ce.ce_mode) && cep->ce.ce_size != 0 &&
+		    !context_digest_valid(cep->ce.ce_digest)) {
+			snprintf(ebuf, elen, "%s: invalid digest", cep->path);
+			return (-1);
+		}
+	}
+	if (off != len) {
+		snprintf(ebuf, elen, "trailing data in context manifest");
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+context_ent_cmp(const void *a, const void *b)
+{
+	struct context_ent * const *x = a, * const *y = b;
+
+	return (strcmp((*x)->ce.ce_digest, (*y)->ce.ce_digest));
+}
+
+/*
+ * Collect the (unique) contents that are not in the store yet.
+ */
+static struct context_ent **
+context_missing(struct context_ent *ents, int n, uint32_t *countp)
+{
+	struct context_ent **sorted, **want;
+	char path[MAXPATHLEN];
+	uint32_t count;
+	int k, j;
+
+	sorted = calloc(n + 1, sizeof(*sorted));
+	want = calloc(n + 1, sizeof(*want));
+	if (sorted == NULL || want == NULL) {
+		err(1, "calloc failed");
+	}
+	for (j = 0, k = 0; k < n; k++) {
+		if (S_ISREG(ents[k].ce.ce_mode) && ents[k].ce.ce_size != 0) {
+			sorted[j++] = &ents[k];
+		}
+	}
+	qsort(sorted, j, sizeof(*sorted), context_ent_cmp);
+	count = 0;
+	for (k = 0; k < j; k++) {
+		if (k > 0 && context_ent_cmp(&sorted[k], &sorted[k - 1]) == 0) {
+			continue;
+		}
+		context_blob_path(sorted[k]->ce.ce_digest, path, sizeof(path));
+		if (access(path, F_OK) == 0) {
+			continue;
+		}
+		want[count++] = sorted[k];
+	}
+	free(sorted);
+	*countp = count;
+	return (want);
+}
+
+static int
+context_stream_init(struct context_stream *csp, int sock, int transfer)
+{
+
+	bzero(csp, sizeof(*csp));
+	csp->cs_sock = sock;
+	csp->cs_transfer = transfer;
+	if (transfer != CBLOCK_TRANSFER_ZLIB) {
+		return (0);
+	}
+	csp->cs_frame = malloc(CBLOCK_COMPRESS_FRAME_MAX);
+	if (csp->cs_frame == NULL) {
+		err(1, "malloc failed");
+	}
+	if (inflateInit(&csp->cs_zs) != Z_OK) {
+		free(csp->cs_frame);
+		return (-1);
+	}
+	return (0);
+}
+
+static void
+context_stream_free(struct context_stream *csp)
+{
+
+	if (csp->cs_transfer != CBLOCK_TRANSFER_ZLIB) {
+		return;
+	}
+	(void) inflateEnd(&csp->cs_zs);
+	free(csp->cs_frame);
+}
+
+/*
+ * Read the next frame of the compressed stream. Returns the frame length,
+ * which is zero at the end of the stream, or -1.
+ */
+static ssize_t
+context_stream_frame(struct context_stream *csp)
+{
+	uint32_t len;
+
+	if (sock_ipc_must_read(csp->cs_sock, &len, sizeof(len)) !=
+	    sizeof(len) || len > CBLOCK_COMPRESS_FRAME_MAX) {
+		return (-1);
+	}
+	if (len != 0 && sock_ipc_must_read(csp->cs_sock, csp->cs_frame,
+	    len) != (ssize_t)len) {
+		return (-1);
+	}
+	csp->cs_zs.next_in = csp->cs_frame;
+	csp->cs_zs.avail_in = len;
+	return (len);
+}
+
+static int
+context_stream_read(struct context_stream *csp, void *buf, size_t len)
+{
+	int ret;
+
+	if (csp->cs_transfer != CBLOCK_TRANSFER_ZLIB) {
+		if (sock_ipc_must_read(csp->cs_sock, buf, len) !=
+		    (ssize_t)len) {
+			return (-1);
+		}
+		return (0);
+	}
+	csp->cs_zs.next_out = buf;
+	csp->cs_zs.avail_out = len;
+	while (csp->cs_zs.avail_out > 0) {
+		if (csp->cs_end) {
+			return (-1);
+		}
+		if (csp->cs_zs.avail_in == 0 &&
+		    context_stream_frame(csp) <= 0) {
+			return (-1);
+		}
+		ret = inflate(&csp->cs_zs, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END) {
+			csp->cs_end = 1;
+		} else if (ret != Z_OK) {
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Consume the rest of a compressed stream, which must not decompress to
+ * anything, and its terminating frame.
+ */
+static int
+context_stream_finish(struct context_stream *csp)
+{
+	u_char scratch[64];
+	ssize_t cc;
+	int ret;
+
+	if (csp->cs_transfer != CBLOCK_TRANSFER_ZLIB) {
+		return (0);
+	}
+	for (;;) {
+		if (csp->cs_zs.avail_in == 0) {
+			cc = context_stream_frame(csp);
+			if (cc == -1) {
+				return (-1);
+			}
+			if (cc == 0) {
+				break;
+			}
+		}
+		if (csp->cs_end) {
+			return (-1);
+		}
+		csp->cs_zs.next_out = scratch;
+		csp->cs_zs.avail_out = sizeof(scratch);
+		ret = inflate(&csp->cs_zs, Z_NO_FLUSH);
+		if (csp->cs_zs.avail_out != sizeof(scratch) ||
+		    (ret != Z_OK && ret != Z_STREAM_END)) {
+			return (-1);
+		}
+		if (ret == Z_STREAM_END) {
+			csp->cs_end = 1;
+		}
+	}
+	return (csp->cs_end ? 0 : -1);
+}
+
+/*
+ * Copy len bytes with copy_file_range(2), which lets the kernel skip the
+ * trip through user space (or share blocks, where the file system can),
+ * and fall back to read(2) and write(2) where it is not supported.
+ */
+static int
+context_copy_fd(int in, int out, uint64_t len)
+{
+	char *buf;
+	ssize_t cc;
+
+	while (len > 0) {
+		cc = copy_file_range(in, NULL, out, NULL, len, 0);
+		if (cc == -1 && errno == EINTR) {
+			continue;
+		}
+		if (cc <= 0) {
+			break;
+		}
+		len -= cc;
+	}
+	if (len == 0) {
+		return (0);
+	}
+	buf = malloc(CONTEXT_BUF_SIZE);
+	if (buf == NULL) {
+		err(1, "malloc failed");
+	}
+	while (len > 0) {
+		cc = read(in, buf, MIN(len, CONTEXT_BUF_SIZE));
+		if (cc == -1 && errno == EINTR) {
+			continue;
+		}
+		if (cc <= 0 || sock_ipc_must_write(out, buf, cc) != cc) {
+			break;
+		}
+		len -= cc;
+	}
+	free(buf);
+	return (len == 0 ? 0 : -1);
+}
+
+/*
+ * Read one file's contents off the socket, or from the descriptor the
+ * client passed for it, into the store. The contents are checked against
+ * the digest they are being stored under, and only renamed into place once
+ * complete, so concurrent builds sending the same file are harmless. A
+ * passed descriptor is copied first and the copy hashed, since the client
+ * can still modify the original.
+ */
+static int
+context_blob_receive(struct context_stream *csp, int from,
+    struct context_ent *cep, char *buf, char *ebuf, size_t elen)
+{
+	char path[MAXPATHLEN], tmp[MAXPATHLEN + 16], dir[MAXPATHLEN];
+	char digest[CBLOCK_DIGEST_LEN];
+	u_char hash[EVP_MAX_MD_SIZE];
+	extern struct global_params gcfg;
+	uint64_t resid;
+	EVP_MD_CTX *ctx;
+	size_t toread;
+	u_int dlen;
+	int fd;
+
+	(void) snprintf(dir, sizeof(dir), "%s/%s/%.2s", gcfg.c_data_dir,
+	    CONTEXT_BLOB_DIR, cep->ce.ce_digest);
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+		snprintf(ebuf, elen, "mkdir(%s): %s", dir, strerror(errno));
+		return (-1);
+	}
+	context_blob_path(cep->ce.ce_digest, path, sizeof(path));
+	(void) snprintf(tmp, sizeof(tmp), "%s.XXXXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd == -1) {
+		snprintf(ebuf, elen, "mkstemp: %s", strerror(errno));
+		return (-1);
+	}
+	ctx = EVP_MD_CTX_new();
+	if (ctx == NULL || !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
+		err(1, "EVP_DigestInit_ex failed");
+	}
+	if (from != -1) {
+		if (context_copy_fd(from, fd, cep->ce.ce_size) == -1 ||
+		    lseek(fd, 0, SEEK_SET) == -1) {
+			snprintf(ebuf, elen, "%s: copy failed", cep->path);
+			goto fail;
+		}
+	}
+	for (resid = cep->ce.ce_size; resid > 0; resid -= toread) {
+		toread = resid > CONTEXT_BUF_SIZE ? CONTEXT_BUF_SIZE : resid;
+		if (from != -1) {
+			if (sock_ipc_must_read(fd, buf, toread) !=
+			    (ssize_t)toread) {
+				snprintf(ebuf, elen, "read blob: %s",
+				    strerror(errno));
+				goto fail;
+			}
+			EVP_DigestUpdate(ctx, buf, toread);
+			continue;
+		}
+		if (context_stream_read(csp, buf, toread) == -1) {
+			snprintf(ebuf, elen, "short read of build context");
+			goto fail;
+		}
+		EVP_DigestUpdate(ctx, buf, toread);
+		if (sock_ipc_must_write(fd, buf, toread) != (ssize_t)toread) {
+			snprintf(ebuf, elen, "write blob: %s", strerror(errno));
+			goto fail;
+		}
+	}
+	if (!EVP_DigestFinal_ex(ctx, hash, &dlen)) {
+		err(1, "EVP_DigestFinal_ex failed");
+	}
+	bzero(digest, sizeof(digest));
+	gen_sha256_string(hash, digest, dlen);
+	if (strcmp(digest, cep->ce.ce_digest) != 0) {
+		snprintf(ebuf, elen, "%s: content does not match digest",
+		    cep->path);
+		goto fail;
+	}
+	EVP_MD_CTX_free(ctx);
+	(void) close(fd);
+	if (rename(tmp, path) == -1) {
+		(void) unlink(tmp);
+		snprintf(ebuf, elen, "rename blob: %s", strerror(errno));
+		return (-1);
+	}
+	return (0);
+fail:
+	EVP_MD_CTX_free(ctx);
+	(void) close(fd);
+	(void) unlink(tmp);
+	return (-1);
+}
+
+static int
+context_copy_blob(int dirfd, struct context_ent *cep, char *ebuf, size_t elen)
+{
+	struct timespec ts[2];
+	char path[MAXPATHLEN];
+	int in, out, ret;
+
+	out = openat(dirfd, cep->path, O_WRONLY | O_CREAT | O_EXCL |
+	    O_NOFOLLOW, 0600);
+	if (out == -1) {
+		snprintf(ebuf, elen, "%s: %s", cep->path, strerror(errno));
+		return (-1);
+	}
+	ret = 0;
+	if (cep->ce.ce_size != 0) {
+		context_blob_path(cep->ce.ce_digest, path, sizeof(path));
+		in = open(path, O_RDONLY);
+		if (in == -1) {
+			snprintf(ebuf, elen, "%s: %s", path, strerror(errno));
+			(void) close(out);
+			return (-1);
+		}
+		if (context_copy_fd(in, out, cep->ce.ce_size) == -1) {
+			snprintf(ebuf, elen, "%s: copy failed", cep->path);
+			ret = -1;
+		}
+		(void) close(in);
+	}
+	ts[0].tv_sec = ts[1].tv_sec = cep->ce.ce_mtime;
+	ts[0].tv_nsec = ts[1].tv_nsec = 0;
+	(void) fchmod(out, cep->ce.ce_mode & ALLPERMS);
+	(void) futimens(out, ts);
+	(void) close(out);
+	return (ret);
+}
+
+/*
+ * Wait until the contents of a file have been received into the store.
+ * Contents arrive in the order they were asked for, so this only blocks
+ * when the materializer has caught up with the socket.
+ */
+static int
+context_wait_blob(struct context_recv *crp, struct context_ent *cep)
+{
+	char path[MAXPATHLEN];
+	int done;
+
+	if (cep->ce.ce_size == 0) {
+		return (0);
+	}
+	context_blob_path(cep->ce.ce_digest, path, sizeof(path));
+	pthread_mutex_lock(&crp->cr_lock);
+	for (;;) {
+		done = crp->cr_done;
+		if (access(path, F_OK) == 0) {
+			pthread_mutex_unlock(&crp->cr_lock);
+			return (0);
+		}
+		if (done) {
+			break;
+		}
+		pthread_cond_wait(&crp->cr_cv, &crp->cr_lock);
+	}
+	pthread_mutex_unlock(&crp->cr_lock);
+	return (-1);
+}
+
+/*
+ * Lay the context out under <build root>.ctx. Directories are created
+ * first and their modes applied last, so that read-only directories can
+ * still be populated. Symbolic links are created after everything else so
+ * that nothing is ever written through one.
+ */
+static int
+context_materialize(struct context_recv *crp, char *ebuf, size_t elen)
+{
+	struct context_ent *ents;
+	char root[MAXPATHLEN];
+	struct timespec ts[2];
+	int k, n, dirfd;
+
+	ents = crp->cr_ents;
+	n = crp->cr_n;
+
+	if (snprintf(root, sizeof(root), "%s.ctx", crp->cr_bcp->build_root) >=
+	    (int)sizeof(root)) {
+		snprintf(ebuf, elen, "%s: path too long",
+		    crp->cr_bcp->build_root);
+		return (-1);
+	}
+	if (mkdir(root, 0755) == -1) {
+		snprintf(ebuf, elen, "mkdir(%s): %s", root, strerror(errno));
+		return (-1);
+	}
+	dirfd = open(root, O_RDONLY | O_DIRECTORY);
+	if (dirfd == -1) {
+		snprintf(ebuf, elen, "open(%s): %s", root, strerror(errno));
+		return (-1);
+	}
+	for (k = 0; k < n; k++) {
+		if (S_ISDIR(ents[k].ce.ce_mode)) {
+			if (mkdirat(dirfd, ents[k].path, 0700) == -1) {
+				snprintf(ebuf, elen, "%s: %s", ents[k].path,
+				    strerror(errno));
+				goto fail;
+			}
+		} else if (S_ISREG(ents[k].ce.ce_mode)) {
+			if (context_wait_blob(crp, &ents[k]) == -1) {
+				snprintf(ebuf, elen, "%s: contents not received",
+				    ents[k].path);
+				goto fail;
+			}
+			if (context_copy_blob(dirfd, &ents[k], ebuf,
+			    elen) == -1) {
+				goto fail;
+			}
+		}
+	}
+	for (k = 0; k < n; k++) {
+		if (!S_ISLNK(ents[k].ce.ce_mode)) {
+			continue;
+		}
+		if (symlinkat(ents[k].link, dirfd, ents[k].path) == -1) {
+			snprintf(ebuf, elen, "%s: %s", ents[k].path,
+			    strerror(errno));
+			goto fail;
+		}
+	}
+	for (k = n - 1; k >= 0; k--) {
+		if (!S_ISDIR(ents[k].ce.ce_mode)) {
+			continue;
+		}
+		ts[0].tv_sec = ts[1].tv_sec = ents[k].ce.ce_mtime;
+		ts[0].tv_nsec = ts[1].tv_nsec = 0;
+		(void) fchmodat(dirfd, ents[k].path,
+		    ents[k].ce.ce_mode & ALLPERMS, AT_SYMLINK_NOFOLLOW);
+		(void) utimensat(dirfd, ents[k].path, ts, AT_SYMLINK_NOFOLLOW);
+	}
+	(void) close(dirfd);
+	return (0);
+fail:
+	(void) close(dirfd);
+	return (-1);
+}
+
+/*
+ * Receive the next batch of n descriptors passed with SCM_RIGHTS. Each
+ * batch travels with a single byte of data.
+ */
+static int
+context_recv_fds(int sock, int *fds, int n)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * CBLOCK_TRANSFER_FDS_MAX)];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t cc;
+	char byte;
+	int got, j, k, fd;
+
+	bzero(&msg, sizeof(msg));
+	iov.iov_base = &byte;
+	iov.iov_len = sizeof(byte);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+	/*
+	 * The descriptors must not leak into the helpers other threads
+	 * fork and exec while they are being received.
+	 */
+	do {
+		cc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (cc == -1 && errno == EINTR);
+	if (cc != 1) {
+		return (-1);
+	}
+	got = 0;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		k = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (j = 0; j < k; j++) {
+			bcopy(CMSG_DATA(cmsg) + j * sizeof(int), &fd,
+			    sizeof(fd));
+			if (got < n) {
+				fds[got] = fd;
+			} else {
+				(void) close(fd);
+			}
+			got++;
+		}
+	}
+	if (got != n || (msg.msg_flags & MSG_CTRUNC) != 0) {
+		for (k = 0; k < got && k < n; k++) {
+			(void) close(fds[k]);
+		}
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Descriptors can only be passed by a client on this host.
+ */
+static int
+context_sock_is_local(int sock)
+{
+	struct sockaddr_storage ss;
+	socklen_t len;
+
+	len = sizeof(ss);
+	if (getsockname(sock, (struct sockaddr *)&ss, &len) == -1) {
+		return (0);
+	}
+	return (ss.ss_family == AF_UNIX);
+}
+
+static int
+context_receive_fds(struct context_stream *csp, struct context_recv *crp,
+    struct context_ent **want, uint32_t count, char *buf, char *ebuf,
+    size_t elen)
+{
+	int fds[CBLOCK_TRANSFER_FDS_MAX];
+	uint32_t k, j, n;
+	struct stat sb;
+	int ret;
+
+	ret = 0;
+	for (k = 0; k < count; k += n) {
+		n = MIN(count - k, CBLOCK_TRANSFER_FDS_MAX);
+		if (context_recv_fds(csp->cs_sock, fds, n) == -1) {
+			snprintf(ebuf, elen, "failed to receive context "
+			    "descriptors");
+			return (-1);
+		}
+		for (j = 0; j < n; j++) {
+			if (ret == 0 && (fstat(fds[j], &sb) == -1 ||
+			    !S_ISREG(sb.st_mode))) {
+				snprintf(ebuf, elen, "%s: not a regular file",
+				    want[k + j]->path);
+				ret = -1;
+			}
+			if (ret == 0 && context_blob_receive(csp, fds[j],
+			    want[k + j], buf, ebuf, elen) == -1) {
+				ret = -1;
+			}
+			(void) close(fds[j]);
+			pthread_mutex_lock(&crp->cr_lock);
+			pthread_cond_broadcast(&crp->cr_cv);
+			pthread_mutex_unlock(&crp->cr_lock);
+		}
+		if (ret == -1) {
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+static void
+context_digest_ent(EVP_MD_CTX *ctx, struct context_ent *cep)
+{
+	char buf[64];
+
+	(void) snprintf(buf, sizeof(buf), "%o %ju", cep->ce.ce_mode,
+	    (uintmax_t)cep->ce.ce_size);
+	EVP_DigestUpdate(ctx, buf, strlen(buf) + 1);
+	EVP_DigestUpdate(ctx, cep->path, strlen(cep->path) + 1);
+	if (cep->link != NULL) {
+		EVP_DigestUpdate(ctx, cep->link, strlen(cep->link) + 1);
+	}
+	if (S_ISREG(cep->ce.ce_mode) && cep->ce.ce_size != 0) {
+		EVP_DigestUpdate(ctx, cep->ce.ce_digest,
+		    strlen(cep->ce.ce_digest) + 1);
+	}
+}
+
+/*
+ * A digest of what the context holds, for telling identical builds apart
+ * (see buildq.c). Like the step cache keys, it leaves out modification
+ * times, which differ between checkouts of the same tree.
+ */
+static int
+context_digest(struct context_ent *ents, int n, char *digest)
+{
+	u_char hash[EVP_MAX_MD_SIZE];
+	EVP_MD_CTX *ctx;
+	u_int dlen;
+	int k, ret;
+
+	ctx = EVP_MD_CTX_new();
+	if (ctx == NULL) {
+		return (-1);
+	}
+	ret = -1;
+	if (!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
+		goto out;
+	}
+	for (k = 0; k < n; k++) {
+		context_digest_ent(ctx, &ents[k]);
+	}
+	if (!EVP_DigestFinal_ex(ctx, hash, &dlen)) {
+		goto out;
+	}
+	bzero(digest, CBLOCK_DIGEST_LEN);
+	gen_sha256_string(hash, digest, dlen);
+	ret = 0;
+out:
+	EVP_MD_CTX_free(ctx);
+	return (ret);
+}
+
+static int
+context_path_cmp(const void *a, const void *b)
+{
+	struct context_ent * const *x = a, * const *y = b;
+
+	return (strcmp((*x)->path, (*y)->path));
+}
+
+/*
+ * Digest of the context entries a COPY or ADD source names: the path
+ * itself and, for a directory, everything below it. Returns -1 if the
+ * source names nothing in the context.
+ */
+static int
+context_source_digest(struct context_ent **sorted, int n, const char *source,
+    char *digest)
+{
+	u_char hash[EVP_MAX_MD_SIZE];
+	EVP_MD_CTX *ctx;
+	size_t len;
+	u_int dlen;
+	int k, found, ret;
+
+	while (source[0] == '/' || (source[0] == '.' && source[1] == '/')) {
+		source += source[0] == '/' ? 1 : 2;
+	}
+	len = strlen(source);
+	while (len > 0 && source[len - 1] == '/') {
+		len--;
+	}
+	if (len == 1 && source[0] == '.') {
+		len = 0;
+	}
+	ctx = EVP_MD_CTX_new();
+	if (ctx == NULL) {
+		return (-1);
+	}
+	ret = -1;
+	if (!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
+		goto out;
+	}
+	for (found = 0, k = 0; k < n; k++) {
+		if (len != 0 && (strncmp(sorted[k]->path, source, len) != 0 ||
+		    (sorted[k]->path[len] != '\0' &&
+		    sorted[k]->path[len] != '/'))) {
+			continue;
+		}
+		context_digest_ent(ctx, sorted[k]);
+		found++;
+	}
+	if (found == 0 || !EVP_DigestFinal_ex(ctx, hash, &dlen)) {
+		goto out;
+	}
+	bzero(digest, CBLOCK_DIGEST_LEN);
+	gen_sha256_string(hash, digest, dlen);
+	ret = 0;
+out:
+	EVP_MD_CTX_free(ctx);
+	return (ret);
+}
+
+/*
+ * The step cache keys (see cache.c) take in the content a COPY or ADD
+ * step reads. The client computes that too, but what it sends is not
+ * trusted: the digests are worked out again here from the manifest,
+ * whose contents have been checked against their digests, so that a
+ * step can only ever hit a layer made from the same files. Pinned URL
+ * digests are left alone, stage_fetch.sh checks those.
+ */
+static void
+context_step_digests(struct build_context *bcp, struct context_ent *ents,
+    int n)
+{
+	struct context_ent **sorted;
+	struct build_step *bsp;
+	const char *source;
+	int k;
+
+	sorted = calloc(n + 1, sizeof(*sorted));
+	if (sorted == NULL) {
+		err(1, "calloc failed");
+	}
+	for (k = 0; k < n; k++) {
+		sorted[k] = &ents[k];
+	}
+	qsort(sorted, n, sizeof(*sorted), context_path_cmp);
+	for (k = 0; k < bcp->pbc.p_nsteps; k++) {
+		bsp = &bcp->steps[k];
+		switch (bsp->step_op) {
+		case STEP_COPY:
+			source = bsp->step_data.step_copy.sc_source;
+			break;
+		case STEP_ADD:
+			if (bsp->step_data.step_add.sa_op == ADD_TYPE_URL ||
+			    bsp->step_data.step_add.sa_op ==
+			    ADD_TYPE_ARCHIVE_URL) {
+				continue;
+			}
+			source = bsp->step_data.step_add.sa_source;
+			break;
+		default:
+			bsp->step_digest[0] = '\0';
+			continue;
+		}
+		if (context_source_digest(sorted, n, source,
+		    bsp->step_digest) == -1) {
+			bsp->step_digest[0] = '\0';
+		}
+	}
+	free(sorted);
+}
+
+/*
+ * Failing to keep the manifest only means that the build can not be
+ * offloaded, so it is not an error.
+ */
+static void
+context_save_manifest(struct build_context *bcp, char *manifest, size_t len)
+{
+	char path[MAXPATHLEN];
+	int fd;
+
+	context_manifest_path(bcp, path, sizeof(path));
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		warn("open(%s)", path);
+		return;
+	}
+	if (sock_ipc_must_write(fd, manifest, len) != (ssize_t)len) {
+		warnx("%s: short write", path);
+		(void) unlink(path);
+	}
+	(void) close(fd);
+}
+
+static void *
+context_materialize_thread(void *arg)
+{
+	struct context_recv *crp;
+
+	crp = arg;
+	crp->cr_ret = context_materialize(crp, crp->cr_ebuf,
+	    sizeof(crp->cr_ebuf));
+	return (NULL);
+}
+
+static void
+context_recv_done(struct context_recv *crp)
+{
+
+	pthread_mutex_lock(&crp->cr_lock);
+	crp->cr_done = 1;
+	pthread_cond_broadcast(&crp->cr_cv);
+	pthread_mutex_unlock(&crp->cr_lock);
+}
+
+int
+context_receive(struct build_context *bcp, int sock, char *ebuf, size_t elen)
+{
+	struct context_ent *ents, **want;
+	struct cblock_response resp;
+	struct context_stream cs;
+	struct context_recv cr;
+	uint32_t transfer, count, k;
+	char *manifest, *buf;
+	pthread_t thr;
+	size_t len;
+	int n, ret;
+
+	len = bcp->pbc.p_context_size;
+	n = bcp->pbc.p_context_entries;
+	if (bcp->pbc.p_context_size < 0 ||
+	    bcp->pbc.p_context_size > MAX_CONTEXT_MANIFEST || n < 0 ||
+	    (size_t)n > len / sizeof(struct cblock_context_entry)) {
+		snprintf(ebuf, elen, "invalid build context manifest size");
+		return (-1);
+	}
+	manifest = malloc(len + 1);
+	ents = calloc(n + 1, sizeof(*ents));
+	if (manifest == NULL || ents == NULL) {
+		err(1, "malloc failed");
+	}
+	if (sock_ipc_must_read(sock, manifest, len) != (ssize_t)len) {
+		snprintf(ebuf, elen, "short read of context manifest");
+		goto fail;
+	}
+	if (context_parse(manifest, len, ents, n, ebuf, elen) == -1) {
+		goto fail;
+	}
+	if (context_digest(ents, n, bcp->context_digest) == -1) {
+		bcp->context_digest[0] = '\0';
+	}
+	transfer = CBLOCK_TRANSFER_RAW;
+	if (bcp->pbc.p_context_transfer == CBLOCK_TRANSFER_ZLIB ||
+	    (bcp->pbc.p_context_transfer == CBLOCK_TRANSFER_FDS &&
+	    context_sock_is_local(sock))) {
+		transfer = bcp->pbc.p_context_transfer;
+	}
+	if (context_stream_init(&cs, sock, transfer) == -1) {
+		snprintf(ebuf, elen, "failed to initialize decompression");
+		goto fail;
+	}
+	want = context_missing(ents, n, &count);
+	bzero(&resp, sizeof(resp));
+	sock_ipc_must_write(sock, &resp, sizeof(resp));
+	sock_ipc_must_write(sock, &transfer, sizeof(transfer));
+	sock_ipc_must_write(sock, &count, sizeof(count));
+	for (k = 0; k < count; k++) {
+		sock_ipc_must_write(sock, want[k]->ce.ce_digest,
+		    sizeof(want[k]->ce.ce_digest));
+	}
+	bzero(&cr, sizeof(cr));
+	pthread_mutex_init(&cr.cr_lock, NULL);
+	pthread_cond_init(&cr.cr_cv, NULL);
+	cr.cr_bcp = bcp;
+	cr.cr_ents = ents;
+	cr.cr_n = n;
+	if (pthread_create(&thr, NULL, context_materialize_thread,
+	    &cr) != 0) {
+		err(1, "pthread_create failed");
+	}
+	buf = malloc(CONTEXT_BUF_SIZE);
+	if (buf == NULL) {
+		err(1, "malloc failed");
+	}
+	ret = 0;
+	if (transfer == CBLOCK_TRANSFER_FDS) {
+		ret = context_receive_fds(&cs, &cr, want, count, buf, ebuf,
+		    elen);
+	}
+	for (k = 0; transfer != CBLOCK_TRANSFER_FDS && k < count; k++) {
+		if (context_blob_receive(&cs, -1, want[k], buf, ebuf,
+		    elen) == -1) {
+			ret = -1;
+			break;
+		}
+		pthread_mutex_lock(&cr.cr_lock);
+		pthread_cond_broadcast(&cr.cr_cv);
+		pthread_mutex_unlock(&cr.cr_lock);
+	}
+	if (ret == 0 && context_stream_finish(&cs) == -1) {
+		snprintf(ebuf, elen, "malformed compressed build context");
+		ret = -1;
+	}
+	context_recv_done(&cr);
+	(void) pthread_join(thr, NULL);
+	if (ret == 0 && cr.cr_ret == -1) {
+		strlcpy(ebuf, cr.cr_ebuf, elen);
+		ret = -1;
+	}
+	pthread_cond_destroy(&cr.cr_cv);
+	pthread_mutex_destroy(&cr.cr_lock);
+	context_stream_free(&cs);
+	free(buf);
+	free(want);
+	if (ret == -1) {
+		goto fail;
+	}
+	context_step_digests(bcp, ents, n);
+	context_save_manifest(bcp, manifest, len);
+	free(ents);
+	free(manifest);
+	return (0);
+fail:
+	free(ents);
+	free(manifest);
+	return (-1);
+}
+
+/*
+ * Send the context of a build to a peer, as the client sent it to us: the
+ * manifest, then the contents the peer asks for, out of the store.
+ */
+int
+context_send(struct build_context *bcp, int sock, char *ebuf, size_t elen)
+{
+	char path[MAXPATHLEN], digest[CBLOCK_DIGEST_LEN], *manifest;
+	struct cblock_response resp;
+	uint32_t transfer, count, k;
+	struct stat sb;
+	size_t len;
+	int fd;
+
+	len = bcp->pbc.p_context_size;
+	manifest = malloc(len + 1);
+	if (manifest == NULL) {
+		err(1, "malloc failed");
+	}
+	context_manifest_path(bcp, path, sizeof(path));
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		snprintf(ebuf, elen, "%s: %s", path, strerror(errno));
+		free(manifest);
+		return (-1);
+	}
+	if (sock_ipc_must_read(fd, manifest, len) != (ssize_t)len) {
+		snprintf(ebuf, elen, "%s: short read", path);
+		(void) close(fd);
+		free(manifest);
+		return (-1);
+	}
+	(void) close(fd);
+	sock_ipc_must_write(sock, manifest, len);
+	free(manifest);
+	if (sock_ipc_must_read(sock, &resp, sizeof(resp)) != sizeof(resp)) {
+		snprintf(ebuf, elen, "peer closed the connection");
+		return (-1);
+	}
+	if (resp.p_ecode != 0) {
+		strlcpy(ebuf, resp.p_errbuf, elen);
+		return (-1);
+	}
+	if (sock_ipc_must_read(sock, &transfer, sizeof(transfer)) !=
+	    sizeof(transfer) ||
+	    sock_ipc_must_read(sock, &count, sizeof(count)) != sizeof(count)) {
+		snprintf(ebuf, elen, "peer closed the connection");
+		return (-1);
+	}
+	if (transfer != CBLOCK_TRANSFER_RAW) {
+		snprintf(ebuf, elen, "unexpected transfer method %u", transfer);
+		return (-1);
+	}
+	for (k = 0; k < count; k++) {
+		if (sock_ipc_must_read(sock, digest, sizeof(digest)) !=
+		    sizeof(digest)) {
+			snprintf(ebuf, elen, "peer closed the connection");
+			return (-1);
+		}
+		digest[sizeof(digest) - 1] = '\0';
+		if (!context_digest_valid(digest)) {
+			snprintf(ebuf, elen, "peer asked for an invalid digest");
+			return (-1);
+		}
+		context_blob_path(digest, path, sizeof(path));
+		fd = open(path, O_RDONLY);
+		if (fd == -1 || fstat(fd, &sb) == -1) {
+			snprintf(ebuf, elen, "%s: %s", path, strerror(errno));
+			if (fd != -1) {
+				(void) close(fd);
+			}
+			return (-1);
+		}
+		if (sock_ipc_from_to(fd, sock, sb.st_size) != sb.st_size) {
+			snprintf(ebuf, elen, "failed to send %s", digest);
+			(void) close(fd);
+			return (-1);
+		}
+		(void) close(fd);
+	}
+	return (0);
+}
@@ -30,8 +30,11 @@
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
+#ifdef __FreeBSD__
 #include <sys/ttycom.h>
+#endif
 
+#include <poll.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <paths.h>
@@ -43,7 +46,11 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <termios.h>
+#ifdef __FreeBSD__
 #include <libutil.h>
+#else
+#include <pty.h>
+#endif
 #include <signal.h>
 #include <assert.h>
 #include <string.h>
@@ -56,42 +63,131 @@
 #include "sock_ipc.h"
 #include "config.h"
 #include "cblock.h"
+#include "sched.h"
+#include "stats.h"
+#include "drift.h"
+#include "peer.h"
 
 #include "probes.h"
 
 #include <cblock/libcblock.h>
 
+#include "journal.h"
+#include "buildq.h"
+#include "trace.h"
+#include "fim.h"
+
 static int reap_children;
+struct sched launch_sched;
+
+/*
+ * Written to whenever an instance is added or a child exits, so that the
+ * tty loop picks up the change right away rather than when the current
+ * poll times out: SIGCHLD is usually taken by some other thread. A launch
+ * holds its admission slot until its ready pipe has been seen or it has
+ * been reaped.
+ */
+static int tty_wakeup_fds[2] = { -1, -1 };
 
 static void
 handle_reap_children(int sig __attribute__((unused)))
 {
+	int save_errno;
 
+	save_errno = errno;
 	reap_children = 1;
+	tty_io_wakeup();
+	errno = save_errno;
 }
 
-static int
-tty_initialize_fdset(fd_set *rfds)
+void
+tty_io_init(void)
+{
+
+	if (pipe2(tty_wakeup_fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+		err(1, "pipe(tty wakeup) failed");
+	}
+}
+
+void
+tty_io_wakeup(void)
+{
+	char byte;
+
+	byte = 0;
+	/* A full pipe means a wakeup is already pending */
+	(void) write(tty_wakeup_fds[1], &byte, sizeof(byte));
+}
+
+/*
+ * Build the set of descriptors the tty loop waits on. poll(2) is used rather
+ * than select(2) so that the number of instances is not bounded by
+ * FD_SETSIZE. Each instance records where its descriptors landed in the
+ * set so the results can be matched up without searching.
+ */
+static nfds_t
+tty_initialize_pollset(struct pollfd **fdsp, nfds_t *nallocp)
 {
 	extern cblock_instance_head_t pr_head;
 	extern pthread_mutex_t cblock_mutex;
 	struct cblock_instance *pi, *p_temp;
-	int maxfd;
+	struct pollfd *fds;
+	nfds_t nfds, need;
 
-	FD_ZERO(rfds);
-	maxfd = 0;
 	pthread_mutex_lock(&cblock_mutex);
+	need = 1;
+	TAILQ_FOREACH(pi, &pr_head, p_glue) {
+		need += 2;
+	}
+	if (need > *nallocp) {
+		fds = realloc(*fdsp, need * sizeof(*fds));
+		if (fds == NULL) {
+			err(1, "realloc pollset failed");
+		}
+		*fdsp = fds;
+		*nallocp = need;
+	}
+	fds = *fdsp;
+	fds[0].fd = tty_wakeup_fds[0];
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+	nfds = 1;
 	TAILQ_FOREACH_SAFE(pi, &pr_head, p_glue, p_temp) {
+		pi->p_tty_pollidx = -1;
+		pi->p_pipe_pollidx = -1;
 		if ((pi->p_state & STATE_DEAD) != 0) {
 			continue;
 		}
-		if (pi->p_ttyfd > maxfd) {
-			maxfd = pi->p_ttyfd;
+		if ((pi->p_state & STATE_LAUNCHING) != 0) {
+			pi->p_pipe_pollidx = nfds;
+			fds[nfds].fd = pi->p_pipe[0];
+			fds[nfds].events = POLLIN;
+			fds[nfds++].revents = 0;
+		}
+		if (pi->p_ttyfd == -1) {
+			continue;
 		}
-		FD_SET(pi->p_ttyfd, rfds);
+		pi->p_tty_pollidx = nfds;
+		fds[nfds].fd = pi->p_ttyfd;
+		fds[nfds].events = POLLIN;
+		fds[nfds++].revents = 0;
 	}
 	pthread_mutex_unlock(&cblock_mutex);
-	return (maxfd);
+	return (nfds);
+}
+
+/*
+ * Instances inserted after the poll set was built have stale indices, so
+ * also check that the slot still refers to the descriptor in question.
+ */
+static int
+tty_poll_ready(struct pollfd *fds, nfds_t nfds, int idx, int fd)
+{
+
+	if (idx < 0 || (nfds_t)idx >= nfds || fds[idx].fd != fd) {
+		return (0);
+	}
+	return ((fds[idx].revents & (POLLIN | POLLHUP | POLLERR)) != 0);
 }
 
 void *
@@ -100,37 +196,58 @@ tty_io_queue_loop(void *arg __attribute__((unused)))
 	extern cblock_instance_head_t pr_head;
 	extern pthread_mutex_t cblock_mutex;
 	struct cblock_instance *pi;
-	struct timeval tv;
+	struct pollfd *fds;
+	nfds_t nfds, nalloc;
 	u_char buf[8192];
-	int maxfd, error;
-	uint32_t cmd;
-	fd_set rfds;
+	int error;
+	size_t trimmed;
+	uint64_t start, usec;
 	ssize_t cc;
-	size_t len;
+	u_int k;
 
+	fds = NULL;
+	nalloc = 0;
 	while (1) {
 		cblock_reap_children();
-		maxfd = tty_initialize_fdset(&rfds);
-		tv.tv_sec = 0;
-		tv.tv_usec = 500000;
-		error = select(maxfd + 1, &rfds, NULL, NULL, &tv);
+		nfds = tty_initialize_pollset(&fds, &nalloc);
+		error = poll(fds, nfds, 500);
 		if (error == -1 && errno == EINTR) {
-			printf("select interrupted\n");
+			printf("poll interrupted\n");
 			continue;
 		}
 		if (error == -1) {
-			err(1, "select(tty io) failed");
+			err(1, "poll(tty io) failed");
 		}
 		if (error == 0) {
 			continue;
 		}
+		if ((fds[0].revents & POLLIN) != 0) {
+			while (read(tty_wakeup_fds[0], buf, sizeof(buf)) > 0)
+				;
+		}
 		pthread_mutex_lock(&cblock_mutex);
 		TAILQ_FOREACH(pi, &pr_head, p_glue) {
-			if (!FD_ISSET(pi->p_ttyfd, &rfds)) {
+			/*
+			 * The launch script has either told us it is done
+			 * with the expensive part of the launch, or it went
+			 * away. Either way, the launch slot can be released.
+			 */
+			if ((pi->p_state & STATE_LAUNCHING) != 0 &&
+			    tty_poll_ready(fds, nfds, pi->p_pipe_pollidx,
+			    pi->p_pipe[0])) {
+				cblock_launch_release(pi);
+			}
+			if (pi->p_ttyfd == -1 ||
+			    !tty_poll_ready(fds, nfds, pi->p_tty_pollidx,
+			    pi->p_ttyfd)) {
 				continue;
 			}
 			cc = read(pi->p_ttyfd, buf, sizeof(buf));
-			if (cc == 0) {
+			/*
+			 * Linux reports EIO rather than EOF on the pty master
+			 * once the last slave descriptor is gone.
+			 */
+			if (cc == 0 || (cc == -1 && errno == EIO)) {
 				reap_children = 1;
 				pi->p_state |= STATE_DEAD;
 				continue;
@@ -138,15 +255,54 @@ tty_io_queue_loop(void *arg __attribute__((unused)))
 			if (cc == -1) {
 				err(1, "%s: read failed:", __func__);
 			}
-			termbuf_append(&pi->p_ttybuf, buf, cc);
+			pi->p_tty_bytes += cc;
+			pi->p_tty_reads++;
+			stats_counter_add(STATS_TTY_BYTES, cc);
+			stats_counter_add(STATS_TTY_READS, 1);
+			trimmed = termbuf_append(&pi->p_ttybuf, buf, cc);
+			CBLOCKD_TERMBUF_APPEND(pi->p_instance_tag, cc,
+			    pi->p_ttybuf.t_tot_len);
+			if (trimmed > 0) {
+				CBLOCKD_TERMBUF_TRIM(pi->p_instance_tag, trimmed);
+				stats_counter_add(STATS_TERMBUF_TRIMS, 1);
+				stats_counter_add(STATS_TERMBUF_TRIM_BYTES, trimmed);
+			}
+			/*
+			 * Read-only consoles that went away are dropped here,
+			 * their session threads find them gone.
+			 */
+			for (k = 0; k < pi->p_nfollowers; ) {
+				if (cblock_console_write(pi->p_followers[k],
+				    buf, cc) == -1) {
+					pi->p_followers[k] =
+					    pi->p_followers[--pi->p_nfollowers];
+					continue;
+				}
+				k++;
+			}
 			if ((pi->p_state & STATE_CONNECTED) == 0) {
 				continue;
 			}
-			len = cc;
-			cmd = PRISON_IPC_CONSOLE_TO_CLIENT;
-			sock_ipc_must_write(pi->p_peer_sock, &cmd, sizeof(cmd));
-			sock_ipc_must_write(pi->p_peer_sock, &len, sizeof(len));
-			sock_ipc_must_write(pi->p_peer_sock, buf, cc);
+			start = stats_now_usec();
+			/*
+			 * The client may have gone away while its console
+			 * session is being torn down. Stop forwarding and let
+			 * the session thread detach it.
+			 */
+			if (cblock_console_write(pi->p_peer_sock, buf,
+			    cc) == -1) {
+				pi->p_state &= ~STATE_CONNECTED;
+				continue;
+			}
+			/*
+			 * A slow console client blocks console processing for
+			 * every instance, so make it visible.
+			 */
+			usec = stats_now_usec() - start;
+			if (usec > PEER_WRITE_STALL_USEC) {
+				CBLOCKD_PEER_WRITE_STALL(pi->p_instance_tag,
+				    pi->p_peer_sock, usec);
+			}
 		}
 		pthread_mutex_unlock(&cblock_mutex);
 	}
@@ -218,6 +374,24 @@ dispatch_connect_console(int sock)
 		sock_ipc_must_write(sock, &resp, sizeof(resp));
 		return (1);
 	}
+	/*
+	 * A build can be watched by other clients too, but only the first
+	 * can type into it.
+	 */
+	if ((pi->p_state & STATE_CONNECTED) != 0 &&
+	    pi->p_type == PRISON_TYPE_BUILD &&
+	    pi->p_nfollowers < MAX_CONSOLE_FOLLOWERS) {
+		resp.p_ecode = 0;
+		if (sock_ipc_may_write(sock, &resp, sizeof(resp)) == 0 &&
+		    cblock_follow_console(pi, sock) == 0) {
+			pthread_mutex_unlock(&cblock_mutex);
+			tty_follow_session(sock);
+			cblock_unfollow_console(pcc.p_instance, sock);
+			return (1);
+		}
+		pthread_mutex_unlock(&cblock_mutex);
+		return (1);
+	}
 	if ((pi->p_state & STATE_CONNECTED) != 0) {
 		pthread_mutex_unlock(&cblock_mutex);
 		snprintf(resp.p_errbuf, sizeof(resp.p_errbuf),
@@ -226,8 +400,21 @@ dispatch_connect_console(int sock)
 		sock_ipc_must_write(sock, &resp, sizeof(resp));
 		return (1);
 	}
+	/*
+	 * The tty of an instance adopted from a previous daemon was owned by
+	 * that daemon and went away with it.
+	 */
+	if ((pi->p_state & STATE_ADOPTED) != 0) {
+		pthread_mutex_unlock(&cblock_mutex);
+		snprintf(resp.p_errbuf, sizeof(resp.p_errbuf),
+		    "%.64s console unavailable (instance adopted on restart)",
+		    pcc.p_instance);
+		resp.p_ecode = 1;
+		sock_ipc_must_write(sock, &resp, sizeof(resp));
+		return (1);
+	}
 	CBLOCKD_CBLOCK_CONSOLE_ATTACH(pcc.p_instance);
-	pi->p_state = STATE_CONNECTED;
+	pi->p_state |= STATE_CONNECTED;
 	ttyfd = pi->p_ttyfd;
 	tty_block = termbuf_to_contig(&pi->p_ttybuf);
 	tty_buflen = pi->p_ttybuf.t_tot_len;
@@ -254,8 +441,59 @@ dispatch_connect_console(int sock)
 	return (1);
 }
 
+/*
+ * A client waiting for a launch slot is sent its position as it changes.
+ * One that goes away while queued must not take the daemon with it: it is
+ * marked gone and its launch is dropped once admitted.
+ */
+struct launch_waiter {
+	int		lw_sock;
+	int		lw_gone;
+};
+
+static void
+dispatch_launch_queued(void *arg, u_int pos)
+{
+	struct launch_waiter *lw;
+	struct cblock_response resp;
+
+	lw = arg;
+	CBLOCKD_LAUNCH_QUEUED(pos);
+	if (lw->lw_gone) {
+		return;
+	}
+	bzero(&resp, sizeof(resp));
+	resp.p_ecode = CBLOCK_RESP_QUEUED;
+	snprintf(resp.p_errbuf, sizeof(resp.p_errbuf), "%u", pos);
+	if (sock_ipc_may_write(lw->lw_sock, &resp, sizeof(resp)) != 0) {
+		lw->lw_gone = 1;
+	}
+}
+
+/*
+ * Synthetic instances run a simulator under the pty instead of a jail, so
+ * the console, termbuf and reaping paths can be loaded on hosts without
+ * jails. The entry point arguments are passed to the simulator as options.
+ */
+static void
+dispatch_synthetic_argv(vec_t *cmd_vec, struct cblock_launch *pl, char *tag)
+{
+	extern struct global_params gcfg;
+	char *args, *word;
+
+	vec_append(cmd_vec, gcfg.c_synthetic);
+	vec_append(cmd_vec, "--name");
+	vec_append(cmd_vec, tag);
+	args = pl->p_entry_point_args;
+	while ((word = strsep(&args, " ")) != NULL) {
+		if (*word != '\0') {
+			vec_append(cmd_vec, word);
+		}
+	}
+}
+
 int
-dispatch_launch_cblock(int sock)
+dispatch_launch_cblock(int sock, uid_t uid)
 {
 	extern cblock_instance_head_t pr_head;
 	extern pthread_mutex_t cblock_mutex;
@@ -265,17 +503,55 @@ dispatch_launch_cblock(int sock)
 	struct cblock_instance *pi;
 	vec_t *cmd_vec, *env_vec;
 	struct cblock_launch pl;
+	struct launch_waiter lw;
+	struct sched_stats ss;
+	uint64_t wait_usec, tstart;
+	int tfds[2];
 	ssize_t cc;
 
 	cc = sock_ipc_must_read(sock, &pl, sizeof(pl));
 	if (cc == 0) {
 		return (0);
 	}
+	pl.p_trace_id[sizeof(pl.p_trace_id) - 1] = '\0';
+	if (!trace_id_valid(pl.p_trace_id)) {
+		pl.p_trace_id[0] = '\0';
+	}
+	trace_process_name(pl.p_trace_id, "cblockd", getpid());
+	trace_spool_prune();
+	tstart = trace_now_usec();
+	/*
+	 * Wait for a launch slot. The slot is held until the launch script
+	 * signals that the instance has been set up (see cblock_launch_release)
+	 * so that a burst of launches does not hammer zfs/ifconfig/pfctl all
+	 * at once.
+	 */
+	lw.lw_sock = sock;
+	lw.lw_gone = 0;
+	wait_usec = sched_enter(&launch_sched, uid, dispatch_launch_queued,
+	    &lw);
+	if (lw.lw_gone) {
+		sched_leave(&launch_sched);
+		return (0);
+	}
+	trace_span(pl.p_trace_id, "admission", "cblockd", tstart);
+	sched_get_stats(&launch_sched, &ss);
+	CBLOCKD_LAUNCH_ADMIT(pl.p_name, uid, wait_usec, ss.ss_inflight);
+	stats_hist_observe(STATS_H_LAUNCH_WAIT, wait_usec);
+	stats_counter_add(STATS_LAUNCHES, 1);
 	pi = calloc(1, sizeof(*pi));
 	if (pi == NULL) {
 		err(1, "calloc failed");
 	}
 	pi->p_type = PRISON_TYPE_REGULAR;
+	pi->p_launch_start = stats_now_usec();
+	pi->p_trace_start = trace_now_usec();
+	if (pl.p_trace_id[0] != '\0') {
+		pi->p_trace_id = strdup(pl.p_trace_id);
+		if (pi->p_trace_id == NULL) {
+			err(1, "strdup failed");
+		}
+	}
 	strlcpy(pi->p_image_name, pl.p_name, sizeof(pi->p_image_name));
 	cmd_vec = vec_init(32);
 	env_vec = vec_init(32);
@@ -295,44 +571,102 @@ dispatch_launch_cblock(int sock)
 
 	sprintf(buf, "CBLOCK_FS=%s", gcfg.c_underlying_fs);
 	vec_append(env_vec, buf);
-	vec_finalize(env_vec);
-	sprintf(buf, "%s/lib/stage_launch.sh", gcfg.c_data_dir);
-	vec_append(cmd_vec, "/bin/sh");
-	if (pl.p_verbose > 0) {
-		vec_append(cmd_vec, "-x");
-	}
-	vec_append(cmd_vec, buf);
-	vec_append(cmd_vec, gcfg.c_data_dir);
-	vec_append(cmd_vec, pl.p_name);
+	sprintf(buf, "CBLOCK_READY_FD=%d", CBLOCK_READY_FD);
+	vec_append(env_vec, buf);
 	pi->p_instance_tag = gen_sha256_instance_id(pl.p_name);
 	pi->p_launch_time = time(NULL);
-	vec_append(cmd_vec, pi->p_instance_tag);
-	vec_append(cmd_vec, pl.p_volumes);
-	if (pl.p_network[0] != '\0') {
-		vec_append(cmd_vec, pl.p_network);
+	tfds[0] = tfds[1] = -1;
+	if (gcfg.c_synthetic != NULL) {
+		pi->p_type = PRISON_TYPE_SYNTHETIC;
+		dispatch_synthetic_argv(cmd_vec, &pl, pi->p_instance_tag);
 	} else {
-		vec_append(cmd_vec, "default");
-	}
-	vec_append(cmd_vec, pl.p_tag);
-	vec_append(cmd_vec, pl.p_ports);
-	if (pl.p_entry_point_args[0] != '\0') {
-		vec_append(cmd_vec, pl.p_entry_point_args);
+		if (trace_marker_pipe(pl.p_trace_id, tfds) == 0) {
+			sprintf(buf, "CBLOCK_TRACE_FD=%d", CBLOCK_TRACE_FD);
+			vec_append(env_vec, buf);
+		}
+		sprintf(buf, "%s/lib/stage_launch.sh", gcfg.c_data_dir);
+		vec_append(cmd_vec, "/bin/sh");
+		if (pl.p_verbose > 0) {
+			vec_append(cmd_vec, "-x");
+		}
+		vec_append(cmd_vec, buf);
+		vec_append(cmd_vec, gcfg.c_data_dir);
+		vec_append(cmd_vec, pl.p_name);
+		vec_append(cmd_vec, pi->p_instance_tag);
+		vec_append(cmd_vec, pl.p_volumes);
+		if (pl.p_network[0] != '\0') {
+			vec_append(cmd_vec, pl.p_network);
+		} else {
+			vec_append(cmd_vec, "default");
+		}
+		vec_append(cmd_vec, pl.p_tag);
+		vec_append(cmd_vec, pl.p_ports);
+		if (pl.p_entry_point_args[0] != '\0') {
+			vec_append(cmd_vec, pl.p_entry_point_args);
+		}
 	}
 	vec_finalize(cmd_vec);
+	vec_finalize(env_vec);
+	/*
+	 * Close-on-exec, so that children forked by other threads in the
+	 * meantime do not hold the write end open and delay the release of
+	 * the launch slot until they exit.
+	 */
+	if (pipe2(pi->p_pipe, O_CLOEXEC) == -1) {
+		err(1, "pipe failed");
+	}
+	tstart = trace_now_usec();
 	pi->p_pid = forkpty(&pi->p_ttyfd, pi->p_ttyname, NULL, NULL);
+	if (pi->p_pid > 0) {
+		CBLOCKD_HELPER_EXEC("stage_launch.sh", pi->p_instance_tag,
+		    pi->p_pid);
+		trace_span(pi->p_trace_id, "forkpty", "cblockd", tstart);
+	}
 	if (pi->p_pid == 0) {
+		(void) close(pi->p_pipe[0]);
+		if (pi->p_pipe[1] != CBLOCK_READY_FD) {
+			if (dup2(pi->p_pipe[1], CBLOCK_READY_FD) == -1) {
+				err(1, "dup2 failed");
+			}
+			(void) close(pi->p_pipe[1]);
+		} else if (fcntl(CBLOCK_READY_FD, F_SETFD, 0) == -1) {
+			err(1, "fcntl failed");
+		}
+		if (tfds[1] != -1) {
+			trace_marker_child(tfds);
+		} else {
+			(void) close(CBLOCK_TRACE_FD);
+		}
+		/*
+		 * Do not leak the consoles of other instances, or client
+		 * sockets, into the instance. A console master held open by
+		 * another instance also keeps its tty from seeing a hangup.
+		 */
+		closefrom(CBLOCK_TRACE_FD + 1);
 		argv = vec_return(cmd_vec);
 		env = vec_return(env_vec);
 		execve(*argv, argv, env);
 		err(1, "execve failed");
 	}
+	(void) close(pi->p_pipe[1]);
+	pi->p_pipe[1] = -1;
+	if (tfds[1] != -1) {
+		(void) close(tfds[1]);
+		trace_marker_spawn(pi->p_trace_id, tfds[0], pi->p_pid,
+		    "stage_launch.sh");
+	}
+	pi->p_state |= STATE_LAUNCHING;
 	cblock_create_pid_file(pi);
+	if (pi->p_type != PRISON_TYPE_SYNTHETIC) {
+		journal_record_launch(pi, pl.p_network);
+	}
 	TAILQ_INIT(&pi->p_ttybuf.t_head);
 	pi->p_ttybuf.t_tot_len = 0;
 	pthread_mutex_lock(&cblock_mutex);
 	CBLOCKD_CBLOCK_CREATE(pi->p_instance_tag);
 	TAILQ_INSERT_HEAD(&pr_head, pi, p_glue);
 	pthread_mutex_unlock(&cblock_mutex);
+	tty_io_wakeup();
 	bzero(&resp, sizeof(resp));
 	resp.p_ecode = 0;
 	snprintf(resp.p_errbuf, sizeof(resp.p_errbuf), "%s",
@@ -349,6 +683,7 @@ dispatch_work(void *arg)
 	extern pthread_mutex_t peer_mutex;
 	extern cblock_peer_head_t p_head;
 	struct cblock_peer *p;
+	uint64_t start, usec;
 	uint32_t cmd;
 	ssize_t cc;
 	int done;
@@ -363,6 +698,8 @@ dispatch_work(void *arg)
 		if (cc == 1) {
 			break;
 		}
+		start = stats_now_usec();
+		CBLOCKD_IPC_START(cmd, p->p_sock);
 		switch (cmd) {
 		case PRISON_IPC_SIGNAL_INSTANCE:
 			cc = dispatch_signal_instance(p->p_sock);
@@ -376,14 +713,39 @@ dispatch_work(void *arg)
 			cc = dispatch_get_instances(p->p_sock);
 			break;
 		case PRISON_IPC_SEND_BUILD_CTX:
-			cc = dispatch_build_recieve(p->p_sock);
+			cc = dispatch_build_recieve(p->p_sock, p->p_uid);
 			break;
 		case PRISON_IPC_CONSOLE_CONNECT:
 			cc = dispatch_connect_console(p->p_sock);
 			done = 1;
 			break;
 		case PRISON_IPC_LAUNCH_PRISON:
-			cc = dispatch_launch_cblock(p->p_sock);
+			cc = dispatch_launch_cblock(p->p_sock, p->p_uid);
+			break;
+		case PRISON_IPC_GET_STATS:
+			cc = dispatch_get_stats(p->p_sock);
+			break;
+		case PRISON_IPC_GET_TRACE:
+			cc = dispatch_get_trace(p->p_sock);
+			break;
+		case PRISON_IPC_GET_FIM_DRIFT:
+			cc = dispatch_get_fim_drift(p->p_sock);
+			break;
+		case PRISON_IPC_FIM_DIFF:
+			cc = dispatch_fim_diff(p->p_sock);
+			break;
+		case PRISON_IPC_FIM_VERIFY:
+			cc = dispatch_fim_verify(p->p_sock);
+			break;
+		case PRISON_IPC_GET_BUILD_LOAD:
+			cc = dispatch_get_build_load(p->p_sock);
+			break;
+		case PRISON_IPC_STAGE_EXEC:
+			cc = dispatch_stage_exec(p->p_sock);
+			done = 1;
+			break;
+		case PRISON_IPC_BUILD_CTL:
+			cc = dispatch_build_ctl(p->p_sock, p->p_uid);
 			break;
 		default:
 			/*
@@ -393,6 +755,9 @@ dispatch_work(void *arg)
 			done = 1;
 			break;
 		}
+		usec = stats_now_usec() - start;
+		CBLOCKD_IPC_DONE(cmd, p->p_sock, usec);
+		stats_ipc_observe(cmd, usec);
 	}
 	close(p->p_sock);
 	pthread_mutex_lock(&peer_mutex);
@@ -32,6 +32,8 @@ struct cblock_instance {
         uint32_t                        p_state;
 #define STATE_DEAD              0x00000001
 #define STATE_CONNECTED         0x00000002
+#define STATE_ADOPTED           0x00000004
+#define STATE_LAUNCHING         0x00000008
         char                            p_name[256];
         pid_t                           p_pid;
         int                             p_ttyfd;
@@ -46,18 +48,31 @@ struct cblock_instance {
 	int				p_pid_file;
 	int				p_status;
 	char				*p_pid_file_path;
+	uint64_t			p_launch_start;
+	uint64_t			p_tty_bytes;
+	uint64_t			p_tty_reads;
+	int				p_tty_pollidx;
+	int				p_pipe_pollidx;
+	char				*p_trace_id;
+	uint64_t			p_trace_start;
+	int				*p_followers;	/* read-only consoles */
+	u_int				p_nfollowers;
 };
 typedef TAILQ_HEAD( , cblock_peer) cblock_peer_head_t;
 typedef TAILQ_HEAD( , cblock_instance) cblock_instance_head_t;
 
 int		dispatch_get_instances(int);
 int		dispatch_generic_command(int);
+void		tty_io_init(void);
+void		tty_io_wakeup(void);
 void *		tty_io_queue_loop(void *);
-int		dispatch_build_recieve(int);
+int		dispatch_build_recieve(int, uid_t);
+int		dispatch_stage_exec(int);
 char *		gen_sha256_instance_id(char *instance_name);
 void		cblock_fork_cleanup(char *instance, char *, int, int);
 void		tty_handle_resize(int, struct winsize *);
 void		tty_console_session(const char *, int, int);
+void		tty_follow_session(int);
 char *		tty_trim_buffer(char *, size_t, size_t *);
 void		gen_sha256_string(unsigned char *, char *, u_int);
 char *		gen_sha256_instance_id(char *);
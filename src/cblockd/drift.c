@@ -0,0 +1,803 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fts.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <cblock/libcblock.h>
+
+#include "termbuf.h"
+#include "main.h"
+#include "dispatch.h"
+#include "cblock.h"
+#include "sock_ipc.h"
+#include "config.h"
+#include "stats.h"
+#include "fim.h"
+#include "drift.h"
+
+#include "probes.h"
+
+/*
+ * The drift monitor checks running instances against the FIM spec of the
+ * image they were launched from. Rather than rescanning whole roots, each
+ * pass only looks at what an instance has written: on ZFS, what zfs diff
+ * reports between the instance and the snapshot it was cloned from, and on
+ * UFS, the upper layer of the union mount, which holds nothing but the
+ * files the instance created or modified and whiteouts for those it
+ * removed. A path is only checked again once its ctime moves, so the cost
+ * of a pass follows what the instances write, not the size of the images.
+ */
+struct drift_path {
+	char				*dp_path;
+	struct timespec			 dp_ctime;
+	off_t				 dp_size;
+	int				 dp_checked;
+	int				 dp_kind;
+	time_t				 dp_detected;
+	u_int				 dp_pass;
+	LIST_ENTRY(drift_path)		 dp_glue;
+};
+
+struct drift_spec {
+	char				 ds_image[MAXPATHLEN];
+	struct fim_index		*ds_index;
+	int				 ds_refs;
+	TAILQ_ENTRY(drift_spec)		 ds_glue;
+};
+
+struct drift_instance {
+	char				*di_instance;
+	char				 di_root[MAXPATHLEN];
+	int				 di_rootfd;
+	char				 di_origin[MAXPATHLEN];
+	struct drift_spec		*di_spec;
+	u_int				 di_pass;
+	u_int				 di_gen;
+	LIST_HEAD(, drift_path)		 di_hash[DRIFT_HASH_SIZE];
+	TAILQ_ENTRY(drift_instance)	 di_glue;
+};
+
+/*
+ * Only the monitor thread changes the state below. The mutex keeps it
+ * consistent for dispatch_get_fim_drift.
+ */
+static TAILQ_HEAD(, drift_instance) drift_head =
+    TAILQ_HEAD_INITIALIZER(drift_head);
+static TAILQ_HEAD(, drift_spec) drift_specs =
+    TAILQ_HEAD_INITIALIZER(drift_specs);
+static pthread_mutex_t drift_mutex = PTHREAD_MUTEX_INITIALIZER;
+static u_int drift_gen;
+
+static const char *
+drift_kind_name(int kind)
+{
+
+	switch (kind) {
+	case FIM_DRIFT_CONTENT:
+		return ("content");
+	case FIM_DRIFT_ATTR:
+		return ("attributes");
+	case FIM_DRIFT_EXTRA:
+		return ("extra");
+	case FIM_DRIFT_MISSING:
+		return ("missing");
+	}
+	return ("unknown");
+}
+
+/*
+ * Paths are kept relative to the instance directory, as in the spec, and
+ * shown relative to the root of the container.
+ */
+static const char *
+drift_display_path(const char *rel)
+{
+
+	return (strcmp(rel, "./root") == 0 ? "/" : rel + 6);
+}
+
+static u_int
+drift_hash(const char *s)
+{
+	u_int h;
+
+	/* FNV-1a */
+	for (h = 2166136261U; *s != '\0'; s++) {
+		h = (h ^ (u_char)*s) * 16777619U;
+	}
+	return (h % DRIFT_HASH_SIZE);
+}
+
+static struct drift_spec *
+drift_spec_get(const char *image)
+{
+	struct drift_spec *dsp;
+	struct fim_index *fx;
+
+	TAILQ_FOREACH(dsp, &drift_specs, ds_glue) {
+		if (strcmp(dsp->ds_image, image) == 0) {
+			dsp->ds_refs++;
+			return (dsp);
+		}
+	}
+	fx = fim_index_open(image);
+	if (fx == NULL) {
+		return (NULL);
+	}
+	dsp = calloc(1, sizeof(*dsp));
+	if (dsp == NULL) {
+		err(1, "calloc failed");
+	}
+	strlcpy(dsp->ds_image, image, sizeof(dsp->ds_image));
+	dsp->ds_index = fx;
+	dsp->ds_refs = 1;
+	TAILQ_INSERT_HEAD(&drift_specs, dsp, ds_glue);
+	return (dsp);
+}
+
+static void
+drift_spec_release(struct drift_spec *dsp)
+{
+
+	if (dsp == NULL || --dsp->ds_refs > 0) {
+		return;
+	}
+	TAILQ_REMOVE(&drift_specs, dsp, ds_glue);
+	fim_index_close(dsp->ds_index);
+	free(dsp);
+}
+
+/*
+ * The launch records the image directory in the instance directory. Images
+ * which were built without a FIM spec have nothing to check against.
+ */
+static int
+drift_attach_spec(struct drift_instance *dip)
+{
+	char path[MAXPATHLEN], image[MAXPATHLEN];
+	size_t len;
+	FILE *fp;
+
+	if (snprintf(path, sizeof(path), "%s/%s", dip->di_root,
+	    DRIFT_IMAGE_FILE) >= (int)sizeof(path)) {
+		return (-1);
+	}
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return (-1);
+	}
+	if (fgets(image, sizeof(image), fp) == NULL) {
+		(void) fclose(fp);
+		return (-1);
+	}
+	(void) fclose(fp);
+	len = strlen(image);
+	if (len > 0 && image[len - 1] == '\n') {
+		image[len - 1] = '\0';
+	}
+	dip->di_spec = drift_spec_get(image);
+	return (dip->di_spec == NULL ? -1 : 0);
+}
+
+static struct drift_path *
+drift_path_get(struct drift_instance *dip, const char *rel)
+{
+	struct drift_path *dpp;
+	u_int h;
+
+	h = drift_hash(rel);
+	LIST_FOREACH(dpp, &dip->di_hash[h], dp_glue) {
+		if (strcmp(dpp->dp_path, rel) == 0) {
+			return (dpp);
+		}
+	}
+	dpp = calloc(1, sizeof(*dpp));
+	if (dpp == NULL) {
+		err(1, "calloc failed");
+	}
+	dpp->dp_path = strdup(rel);
+	if (dpp->dp_path == NULL) {
+		err(1, "strdup failed");
+	}
+	pthread_mutex_lock(&drift_mutex);
+	LIST_INSERT_HEAD(&dip->di_hash[h], dpp, dp_glue);
+	pthread_mutex_unlock(&drift_mutex);
+	return (dpp);
+}
+
+/*
+ * Compare a file against its spec entry. Returns -1 if the file could not
+ * be read, in which case it will be looked at again on the next pass.
+ * Whatever the instance wrote is hashed: the modification time of a file
+ * it rewrote is whatever the instance wants it to be.
+ */
+static int
+drift_verify(struct drift_instance *dip, const char *rel, int dirfd,
+    const char *name, struct stat *sbp)
+{
+	const struct fim_index_ent *fep;
+
+	fep = fim_index_lookup(dip->di_spec->ds_index, rel);
+	if (fep == NULL) {
+		return (FIM_DRIFT_EXTRA);
+	}
+	return (fim_index_check(dip->di_spec->ds_index, fep, dirfd, name, sbp,
+	    1));
+}
+
+/*
+ * Open the directory holding rel ("./root/..."), one component at a time
+ * from the instance directory, so that a directory the instance replaced
+ * with a symlink is never followed out of its root. Returns the descriptor
+ * and points *namep at the last component, within buf.
+ */
+static int
+drift_open_parent(struct drift_instance *dip, const char *rel, char *buf,
+    size_t len, const char **namep)
+{
+	char *comp, *last, *p;
+	int fd, nfd;
+
+	if (dip->di_rootfd == -1) {
+		dip->di_rootfd = open(dip->di_root,
+		    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dip->di_rootfd == -1) {
+			return (-1);
+		}
+	}
+	if (strlcpy(buf, rel + 2, len) >= len) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	fd = fcntl(dip->di_rootfd, F_DUPFD_CLOEXEC, 0);
+	if (fd == -1) {
+		return (-1);
+	}
+	last = strrchr(buf, '/');
+	if (last == NULL) {
+		*namep = buf;
+		return (fd);
+	}
+	*last++ = '\0';
+	p = buf;
+	while ((comp = strsep(&p, "/")) != NULL) {
+		if (*comp == '\0' || strcmp(comp, ".") == 0) {
+			continue;
+		}
+		if (strcmp(comp, "..") == 0) {
+			(void) close(fd);
+			errno = EINVAL;
+			return (-1);
+		}
+		nfd = openat(fd, comp,
+		    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		(void) close(fd);
+		if (nfd == -1) {
+			return (-1);
+		}
+		fd = nfd;
+	}
+	*namep = last;
+	return (fd);
+}
+
+static void
+drift_record(struct drift_instance *dip, struct drift_path *dpp, int kind)
+{
+
+	if (kind == dpp->dp_kind) {
+		return;
+	}
+	pthread_mutex_lock(&drift_mutex);
+	dpp->dp_kind = kind;
+	dpp->dp_detected = time(NULL);
+	pthread_mutex_unlock(&drift_mutex);
+	if (kind == 0) {
+		return;
+	}
+	CBLOCKD_FIM_DRIFT(dip->di_instance, dpp->dp_path, kind);
+	stats_counter_add(STATS_FIM_DRIFT, 1);
+	printf("%.10s: integrity drift (%s): %s\n", dip->di_instance,
+	    drift_kind_name(kind), drift_display_path(dpp->dp_path));
+}
+
+/*
+ * A path (relative to the instance directory, as in the spec) which the
+ * instance has written to.
+ */
+static void
+drift_touch(struct drift_instance *dip, const char *rel)
+{
+	char buf[MAXPATHLEN];
+	struct drift_path *dpp;
+	const char *name;
+	struct stat sb;
+	int dirfd, kind;
+
+	/*
+	 * Only the root of the container is checked, devfs is mounted over
+	 * its /dev.
+	 */
+	if (strcmp(rel, "./root") != 0 && strncmp(rel, "./root/", 7) != 0) {
+		return;
+	}
+	if (strcmp(rel, "./root/dev") == 0 ||
+	    strncmp(rel, "./root/dev/", 11) == 0) {
+		return;
+	}
+	dpp = drift_path_get(dip, rel);
+	if (dpp->dp_pass == dip->di_pass) {
+		return;
+	}
+	dpp->dp_pass = dip->di_pass;
+	/*
+	 * The path is resolved beneath the instance directory and looked up
+	 * and hashed relative to its parent, which the instance can not swap
+	 * for a symlink to somewhere on the host.
+	 */
+	dirfd = drift_open_parent(dip, rel, buf, sizeof(buf), &name);
+	if (dirfd == -1 ||
+	    fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+		if (dirfd != -1) {
+			(void) close(dirfd);
+		}
+		dpp->dp_checked = 0;
+		kind = 0;
+		if (fim_index_lookup(dip->di_spec->ds_index, rel) != NULL) {
+			kind = FIM_DRIFT_MISSING;
+		}
+		drift_record(dip, dpp, kind);
+		return;
+	}
+	if (dpp->dp_checked && dpp->dp_size == sb.st_size &&
+	    dpp->dp_ctime.tv_sec == sb.st_ctim.tv_sec &&
+	    dpp->dp_ctime.tv_nsec == sb.st_ctim.tv_nsec) {
+		(void) close(dirfd);
+		return;
+	}
+	kind = drift_verify(dip, rel, dirfd, name, &sb);
+	(void) close(dirfd);
+	if (kind == -1) {
+		return;
+	}
+	stats_counter_add(STATS_FIM_CHECKED, 1);
+	dpp->dp_ctime = sb.st_ctim;
+	dpp->dp_size = sb.st_size;
+	dpp->dp_checked = 1;
+	drift_record(dip, dpp, kind);
+}
+
+/*
+ * Run a command, handing each line it prints to fn.
+ */
+static int
+drift_run(char *const argv[], void (*fn)(struct drift_instance *, char *),
+    struct drift_instance *dip)
+{
+	static char *envp[] = { DEFAULT_PATH, NULL };
+	int fds[2], status;
+	char *line;
+	size_t cap;
+	ssize_t cc;
+	FILE *fp;
+	pid_t pid;
+
+	/*
+	 * Other threads fork and exec too, keep both ends out of them: a
+	 * leaked copy of the write end would keep the pipe from reaching EOF.
+	 */
+	if (pipe2(fds, O_CLOEXEC) == -1) {
+		warn("pipe failed");
+		return (-1);
+	}
+	pid = fork();
+	if (pid == -1) {
+		warn("fork failed");
+		(void) close(fds[0]);
+		(void) close(fds[1]);
+		return (-1);
+	}
+	if (pid == 0) {
+		(void) dup2(fds[1], STDOUT_FILENO);
+		(void) close(fds[0]);
+		(void) close(fds[1]);
+		execve(argv[0], argv, envp);
+		_exit(127);
+	}
+	(void) close(fds[1]);
+	fp = fdopen(fds[0], "r");
+	if (fp == NULL) {
+		err(1, "fdopen failed");
+	}
+	line = NULL;
+	cap = 0;
+	while ((cc = getline(&line, &cap, fp)) != -1) {
+		if (cc > 0 && line[cc - 1] == '\n') {
+			line[cc - 1] = '\0';
+		}
+		fn(dip, line);
+	}
+	free(line);
+	(void) fclose(fp);
+	waitpid_ignore_intr(pid, &status);
+	return (WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1);
+}
+
+static void
+drift_zfs_origin(struct drift_instance *dip, char *line)
+{
+
+	if (strcmp(line, "-") != 0) {
+		strlcpy(dip->di_origin, line, sizeof(dip->di_origin));
+	}
+}
+
+/*
+ * zfs diff escapes unprintable characters in paths as \0ooo.
+ */
+static void
+drift_zfs_unescape(char *s)
+{
+	char *d;
+	int k, c;
+
+	for (d = s; *s != '\0'; s++) {
+		if (*s != '\\') {
+			*d++ = *s;
+			continue;
+		}
+		for (c = 0, k = 0; k < 4 && s[1] >= '0' && s[1] <= '7'; k++) {
+			c = c * 8 + (*++s - '0');
+		}
+		*d++ = k == 0 ? '\\' : c;
+	}
+	*d = '\0';
+}
+
+static void
+drift_zfs_line(struct drift_instance *dip, char *line)
+{
+	char rel[MAXPATHLEN], *field;
+	size_t len;
+	int k;
+
+	len = strlen(dip->di_root);
+	/* change, file type, path and for renames, the new path */
+	for (k = 0; (field = strsep(&line, "\t")) != NULL; k++) {
+		if (k < 2) {
+			continue;
+		}
+		drift_zfs_unescape(field);
+		if (strncmp(field, dip->di_root, len) != 0 ||
+		    (field[len] != '/' && field[len] != '\0')) {
+			continue;
+		}
+		(void) snprintf(rel, sizeof(rel), ".%s", field + len);
+		drift_touch(dip, rel);
+	}
+}
+
+static int
+drift_scan_zfs(struct drift_instance *dip)
+{
+	char vol[MAXPATHLEN];
+	char *argv[8];
+
+	/* See path_to_vol in common.sh */
+	strlcpy(vol, dip->di_root + 1, sizeof(vol));
+	argv[0] = "/sbin/zfs";
+	if (dip->di_origin[0] == '\0') {
+		argv[1] = "get";
+		argv[2] = "-H";
+		argv[3] = "-o";
+		argv[4] = "value";
+		argv[5] = "origin";
+		argv[6] = vol;
+		argv[7] = NULL;
+		if (drift_run(argv, drift_zfs_origin, dip) == -1 ||
+		    dip->di_origin[0] == '\0') {
+			return (-1);
+		}
+	}
+	argv[1] = "diff";
+	argv[2] = "-FH";
+	argv[3] = dip->di_origin;
+	argv[4] = vol;
+	argv[5] = NULL;
+	return (drift_run(argv, drift_zfs_line, dip));
+}
+
+static int
+drift_scan_upper(struct drift_instance *dip)
+{
+	char upper[MAXPATHLEN], rel[MAXPATHLEN];
+	char *paths[2];
+	FTSENT *ent;
+	size_t len;
+	FTS *fts;
+	int opts;
+
+	if (snprintf(upper, sizeof(upper), "%s/%s", dip->di_root,
+	    DRIFT_UPPER_DIR) >= (int)sizeof(upper)) {
+		warnx("%s: path too long", dip->di_root);
+		return (-1);
+	}
+	paths[0] = upper;
+	paths[1] = NULL;
+	opts = FTS_PHYSICAL | FTS_NOCHDIR;
+#ifdef FTS_WHITEOUT
+	opts |= FTS_WHITEOUT;
+#endif
+	fts = fts_open(paths, opts, NULL);
+	if (fts == NULL) {
+		warn("fts_open(%s)", upper);
+		return (-1);
+	}
+	len = strlen(upper);
+	while ((ent = fts_read(fts)) != NULL) {
+		switch (ent->fts_info) {
+		case FTS_DP:
+		case FTS_DNR:
+		case FTS_ERR:
+		case FTS_NS:
+			continue;
+		}
+		(void) snprintf(rel, sizeof(rel), "./root%s",
+		    ent->fts_path + len);
+		drift_touch(dip, rel);
+	}
+	(void) fts_close(fts);
+	return (0);
+}
+
+static void
+drift_check_instance(struct drift_instance *dip)
+{
+	extern struct global_params gcfg;
+	struct drift_path *dpp, *dtmp;
+	int k, ret;
+
+	if (dip->di_spec == NULL && drift_attach_spec(dip) == -1) {
+		return;
+	}
+	dip->di_pass++;
+	if (strcmp(gcfg.c_underlying_fs, "zfs") == 0) {
+		ret = drift_scan_zfs(dip);
+	} else if (strcmp(gcfg.c_underlying_fs, "ufs") == 0) {
+		ret = drift_scan_upper(dip);
+	} else {
+		return;
+	}
+	if (ret == -1) {
+		return;
+	}
+	/*
+	 * Paths which are no longer reported are the same as in the image
+	 * again.
+	 */
+	pthread_mutex_lock(&drift_mutex);
+	for (k = 0; k < DRIFT_HASH_SIZE; k++) {
+		LIST_FOREACH_SAFE(dpp, &dip->di_hash[k], dp_glue, dtmp) {
+			if (dpp->dp_pass == dip->di_pass) {
+				continue;
+			}
+			LIST_REMOVE(dpp, dp_glue);
+			free(dpp->dp_path);
+			free(dpp);
+		}
+	}
+	pthread_mutex_unlock(&drift_mutex);
+}
+
+static struct drift_instance *
+drift_instance_get(const char *instance)
+{
+	extern struct global_params gcfg;
+	struct drift_instance *dip;
+	int k;
+
+	TAILQ_FOREACH(dip, &drift_head, di_glue) {
+		if (strcmp(dip->di_instance, instance) == 0) {
+			return (dip);
+		}
+	}
+	dip = calloc(1, sizeof(*dip));
+	if (dip == NULL) {
+		err(1, "calloc failed");
+	}
+	dip->di_instance = strdup(instance);
+	if (dip->di_instance == NULL) {
+		err(1, "strdup failed");
+	}
+	(void) snprintf(dip->di_root, sizeof(dip->di_root), "%s/instances/%s",
+	    gcfg.c_data_dir, instance);
+	dip->di_rootfd = -1;
+	for (k = 0; k < DRIFT_HASH_SIZE; k++) {
+		LIST_INIT(&dip->di_hash[k]);
+	}
+	pthread_mutex_lock(&drift_mutex);
+	TAILQ_INSERT_TAIL(&drift_head, dip, di_glue);
+	pthread_mutex_unlock(&drift_mutex);
+	return (dip);
+}
+
+static void
+drift_instance_free(struct drift_instance *dip)
+{
+	struct drift_path *dpp;
+	int k;
+
+	for (k = 0; k < DRIFT_HASH_SIZE; k++) {
+		while ((dpp = LIST_FIRST(&dip->di_hash[k])) != NULL) {
+			LIST_REMOVE(dpp, dp_glue);
+			free(dpp->dp_path);
+			free(dpp);
+		}
+	}
+	drift_spec_release(dip->di_spec);
+	if (dip->di_rootfd != -1) {
+		(void) close(dip->di_rootfd);
+	}
+	free(dip->di_instance);
+	free(dip);
+}
+
+static void
+drift_pass(void)
+{
+	extern cblock_instance_head_t pr_head;
+	extern pthread_mutex_t cblock_mutex;
+	struct drift_instance *dip, *dtmp;
+	struct cblock_instance *pi;
+	size_t n, k, alloc;
+	char **names;
+
+	names = NULL;
+	n = alloc = 0;
+	pthread_mutex_lock(&cblock_mutex);
+	TAILQ_FOREACH(pi, &pr_head, p_glue) {
+		if (pi->p_type != PRISON_TYPE_REGULAR ||
+		    (pi->p_state & (STATE_DEAD | STATE_LAUNCHING)) != 0) {
+			continue;
+		}
+		if (n == alloc) {
+			alloc = alloc == 0 ? 64 : alloc * 2;
+			names = realloc(names, alloc * sizeof(*names));
+			if (names == NULL) {
+				err(1, "realloc failed");
+			}
+		}
+		names[n] = strdup(pi->p_instance_tag);
+		if (names[n] == NULL) {
+			err(1, "strdup failed");
+		}
+		n++;
+	}
+	pthread_mutex_unlock(&cblock_mutex);
+	drift_gen++;
+	for (k = 0; k < n; k++) {
+		dip = drift_instance_get(names[k]);
+		dip->di_gen = drift_gen;
+		drift_check_instance(dip);
+		free(names[k]);
+	}
+	free(names);
+	TAILQ_FOREACH_SAFE(dip, &drift_head, di_glue, dtmp) {
+		if (dip->di_gen == drift_gen) {
+			continue;
+		}
+		pthread_mutex_lock(&drift_mutex);
+		TAILQ_REMOVE(&drift_head, dip, di_glue);
+		pthread_mutex_unlock(&drift_mutex);
+		drift_instance_free(dip);
+	}
+}
+
+void *
+drift_monitor_loop(void *arg __attribute__((unused)))
+{
+	extern struct global_params gcfg;
+
+	for (;;) {
+		sleep(gcfg.c_fim_interval);
+		drift_pass();
+	}
+	return (NULL);
+}
+
+int
+dispatch_get_fim_drift(int sock)
+{
+	struct cblock_get_fim_drift req;
+	struct cblock_fim_drift *recs, *rp;
+	struct drift_instance *dip;
+	struct drift_path *dpp;
+	size_t n, alloc;
+	uint32_t count;
+	int k;
+
+	if (sock_ipc_must_read(sock, &req, sizeof(req)) == 0) {
+		return (0);
+	}
+	req.p_instance[sizeof(req.p_instance) - 1] = '\0';
+	recs = NULL;
+	n = alloc = 0;
+	pthread_mutex_lock(&drift_mutex);
+	TAILQ_FOREACH(dip, &drift_head, di_glue) {
+		if (req.p_instance[0] != '\0' &&
+		    !cblock_instance_match(dip->di_instance, req.p_instance)) {
+			continue;
+		}
+		for (k = 0; k < DRIFT_HASH_SIZE; k++) {
+			LIST_FOREACH(dpp, &dip->di_hash[k], dp_glue) {
+				if (dpp->dp_kind == 0) {
+					continue;
+				}
+				if (n == alloc) {
+					alloc = alloc == 0 ? 64 : alloc * 2;
+					recs = realloc(recs,
+					    alloc * sizeof(*recs));
+					if (recs == NULL) {
+						err(1, "realloc failed");
+					}
+				}
+				rp = &recs[n++];
+				bzero(rp, sizeof(*rp));
+				strlcpy(rp->p_instance, dip->di_instance,
+				    sizeof(rp->p_instance));
+				strlcpy(rp->p_path,
+				    drift_display_path(dpp->dp_path),
+				    sizeof(rp->p_path));
+				rp->p_kind = dpp->dp_kind;
+				rp->p_detected = dpp->dp_detected;
+			}
+		}
+	}
+	pthread_mutex_unlock(&drift_mutex);
+	count = n;
+	sock_ipc_must_write(sock, &count, sizeof(count));
+	if (n > 0) {
+		sock_ipc_must_write(sock, recs, n * sizeof(*recs));
+	}
+	free(recs);
+	return (1);
+}
@@ -25,16 +25,22 @@
  * SUCH DAMAGE.
  */
 #include <sys/types.h>
+#include <sys/ioctl.h>
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
+#include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <err.h>
 #include <errno.h>
+#ifdef __FreeBSD__
 #include <libutil.h>
+#else
+#include <pty.h>
+#endif
 #include <stdlib.h>
 #include <string.h>
 
@@ -43,6 +49,9 @@
 #include "dispatch.h"
 #include "sock_ipc.h"
 #include "config.h"
+#include "stats.h"
+
+#include "probes.h"
 
 #include <cblock/libcblock.h>
 
@@ -81,6 +90,7 @@ dispatch_generic_command(int sock)
 	extern struct global_params gcfg;
 	char *marshalled,*script;
 	int pipefds[2], error;
+	uint64_t start;
 	ssize_t cc;
 	vec_t *vec;
 	pid_t pid;
@@ -112,11 +122,15 @@ dispatch_generic_command(int sock)
 		warn("pipe2 failed");
 		return (1); 
 	}
+	start = stats_now_usec();
 	pid = fork();
 	if (pid == -1) {
 		warn("fork failed");
 		return (1);
 	}
+	if (pid > 0) {
+		CBLOCKD_HELPER_EXEC(script, arg.p_cmdname, pid);
+	}
 	if (pid == 0) {
 		char script_path[1024], **argv;
 		vec_t *cmd_vec, *vec_env;
@@ -168,5 +182,7 @@ dispatch_generic_command(int sock)
 		break;
 	}
 	waitpid_ignore_intr(pid, &error);
+	CBLOCKD_HELPER_DONE(script, arg.p_cmdname, error,
+	    stats_now_usec() - start);
 	return (error);
 }
@@ -0,0 +1,310 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/wait.h>
+
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cblock/libcblock.h>
+
+#include "termbuf.h"
+#include "main.h"
+#include "dispatch.h"
+#include "config.h"
+#include "stats.h"
+#include "context.h"
+#include "report.h"
+#include "fetch.h"
+
+/*
+ * The URLs that ADD steps name are fetched before any stage starts, at most
+ * BUILD_FETCH_JOBS at a time, by stage_fetch.sh. It keeps what it fetched
+ * in the blob store that build contexts use, so the same content is only
+ * stored once, and remembers which digest each URL last resolved to. A
+ * URL that was fetched before is revalidated with If-Modified-Since, and
+ * one pinned with ADD --CHECKSUM is not fetched at all if its content is
+ * already stored.
+ *
+ * The resolved digest becomes the step digest, which makes the step
+ * cacheable. The content is linked into <build root>.fetch, which the
+ * stages see read-only at FETCH_STAGE_DIR.
+ */
+struct fetch_job {
+	struct build_step	*fj_step;
+	pid_t			 fj_pid;
+	int			 fj_fd;
+	int			 fj_status;
+	char			 fj_result[CBLOCK_DIGEST_LEN + 32];
+	size_t			 fj_len;
+};
+
+static int
+fetch_is_url(struct build_step *bsp)
+{
+
+	return (bsp->step_op == STEP_ADD &&
+	    (bsp->step_data.step_add.sa_op == ADD_TYPE_URL ||
+	    bsp->step_data.step_add.sa_op == ADD_TYPE_ARCHIVE_URL));
+}
+
+static int
+fetch_same(struct build_step *a, struct build_step *b)
+{
+
+	return (strcmp(a->step_data.step_add.sa_source,
+	    b->step_data.step_add.sa_source) == 0 &&
+	    strcmp(a->step_digest, b->step_digest) == 0);
+}
+
+static void
+fetch_start(struct build_context *bcp, struct fetch_job *fjp)
+{
+	char script[MAXPATHLEN], **argv;
+	extern struct global_params gcfg;
+	vec_t *vec, *vec_env;
+	int fds[2];
+
+	if (pipe(fds) == -1) {
+		err(1, "pipe failed");
+	}
+	fjp->fj_pid = fork();
+	if (fjp->fj_pid == -1) {
+		err(1, "fork failed");
+	}
+	if (fjp->fj_pid == 0) {
+		if (dup2(fds[1], STDOUT_FILENO) == -1) {
+			err(1, "dup2 failed");
+		}
+		(void) close(fds[0]);
+		(void) close(fds[1]);
+		vec_env = vec_init(8);
+		vec_append(vec_env, DEFAULT_PATH);
+		vec_append(vec_env, "LC_ALL=C");
+		vec_finalize(vec_env);
+		(void) snprintf(script, sizeof(script),
+		    "%s/lib/stage_fetch.sh", gcfg.c_data_dir);
+		vec = vec_init(16);
+		vec_append(vec, "/bin/sh");
+		if (bcp->pbc.p_verbose > 0) {
+			vec_append(vec, "-x");
+		}
+		vec_append(vec, script);
+		vec_append(vec, gcfg.c_data_dir);
+		vec_append(vec, bcp->build_root);
+		vec_append(vec, fjp->fj_step->step_data.step_add.sa_source);
+		if (fjp->fj_step->step_digest[0] != '\0') {
+			vec_append(vec, fjp->fj_step->step_digest);
+		}
+		if (vec_finalize(vec) != 0) {
+			errx(1, "failed to construct command line");
+		}
+		argv = vec_return(vec);
+		execve(*argv, argv, vec_return(vec_env));
+		err(1, "execve failed");
+	}
+	(void) close(fds[1]);
+	fjp->fj_fd = fds[0];
+}
+
+/*
+ * Wait for at least one fetch to finish and return how many did.
+ * stage_fetch.sh writes nothing but "<digest> <how>" to stdout, so its
+ * pipe closing means it is done.
+ */
+static int
+fetch_wait(struct fetch_job *jobs, int n)
+{
+	struct pollfd pfd[BUILD_FETCH_JOBS];
+	int k, nfds, map[BUILD_FETCH_JOBS], error, reaped;
+	struct fetch_job *fjp;
+	ssize_t cc;
+
+	reaped = 0;
+	while (!reaped) {
+		for (nfds = 0, k = 0; k < n; k++) {
+			if (jobs[k].fj_fd != -1) {
+				pfd[nfds].fd = jobs[k].fj_fd;
+				pfd[nfds].events = POLLIN;
+				map[nfds++] = k;
+			}
+		}
+		if (nfds == 0) {
+			return (0);
+		}
+		error = poll(pfd, nfds, -1);
+		if (error == -1 && errno == EINTR) {
+			continue;
+		}
+		if (error == -1) {
+			err(1, "poll(fetch) failed");
+		}
+		for (k = 0; k < nfds; k++) {
+			if ((pfd[k].revents & (POLLIN | POLLHUP | POLLERR))
+			    == 0) {
+				continue;
+			}
+			fjp = &jobs[map[k]];
+			cc = read(fjp->fj_fd, &fjp->fj_result[fjp->fj_len],
+			    sizeof(fjp->fj_result) - fjp->fj_len - 1);
+			if (cc == -1 && errno == EINTR) {
+				continue;
+			}
+			if (cc > 0) {
+				fjp->fj_len += cc;
+				continue;
+			}
+			(void) close(fjp->fj_fd);
+			fjp->fj_fd = -1;
+			fjp->fj_result[fjp->fj_len] = '\0';
+			waitpid_ignore_intr(fjp->fj_pid, &fjp->fj_status);
+			reaped++;
+		}
+	}
+	return (reaped);
+}
+
+/*
+ * Apply the outcome of a fetch to every step that names the URL. Returns
+ * -1 if the URL could not be resolved.
+ */
+static int
+fetch_finish(struct build_context *bcp, struct fetch_job *fjp)
+{
+	char digest[CBLOCK_DIGEST_LEN], how[16];
+	struct build_step *bsp;
+	int k;
+
+	if (fjp->fj_status != 0 ||
+	    sscanf(fjp->fj_result, "%64s %15s", digest, how) != 2 ||
+	    !context_digest_valid(digest)) {
+		print_bold_prefix(stdout);
+		fprintf(stdout, "Failed to fetch %s\n",
+		    fjp->fj_step->step_data.step_add.sa_source);
+		return (-1);
+	}
+	if (strcmp(how, "fetched") == 0) {
+		stats_counter_add(STATS_BUILD_FETCH_MISSES, 1);
+	} else {
+		stats_counter_add(STATS_BUILD_FETCH_HITS, 1);
+	}
+	fprintf(stdout, "   %s (%s)\n",
+	    fjp->fj_step->step_data.step_add.sa_source, how);
+	for (k = 0; k < bcp->pbc.p_nsteps; k++) {
+		bsp = &bcp->steps[k];
+		if (fetch_is_url(bsp) && bsp->step_digest[0] == '\0' &&
+		    strcmp(bsp->step_data.step_add.sa_source,
+		    fjp->fj_step->step_data.step_add.sa_source) == 0) {
+			strlcpy(bsp->step_digest, digest,
+			    sizeof(bsp->step_digest));
+		}
+	}
+	return (0);
+}
+
+/*
+ * Resolve the URLs of a stage's ADD steps, or of every stage if stage is
+ * -1. Stages run for a peer get the digests the peer resolved, so they
+ * end up with the same content.
+ */
+int
+fetch_prefetch(struct build_context *bcp, int stage)
+{
+	int k, j, n, next, running, ret;
+	struct fetch_job *jobs;
+	struct build_step *bsp;
+	uint64_t start;
+
+	jobs = calloc(bcp->pbc.p_nsteps + 1, sizeof(*jobs));
+	if (jobs == NULL) {
+		err(1, "calloc failed");
+	}
+	for (n = 0, k = 0; k < bcp->pbc.p_nsteps; k++) {
+		bsp = &bcp->steps[k];
+		if (!fetch_is_url(bsp) ||
+		    (stage != -1 && bsp->stage_index != stage)) {
+			continue;
+		}
+		if (bsp->step_digest[0] != '\0' &&
+		    !context_digest_valid(bsp->step_digest)) {
+			print_bold_prefix(stdout);
+			fprintf(stdout, "%s: invalid checksum\n",
+			    bsp->step_data.step_add.sa_source);
+			free(jobs);
+			return (-1);
+		}
+		for (j = 0; j < n; j++) {
+			if (fetch_same(jobs[j].fj_step, bsp)) {
+				break;
+			}
+		}
+		if (j == n) {
+			jobs[n].fj_step = bsp;
+			jobs[n++].fj_fd = -1;
+		}
+	}
+	if (n == 0) {
+		free(jobs);
+		return (0);
+	}
+	start = stats_now_usec();
+	print_bold_prefix(stdout);
+	fprintf(stdout, "Fetching %d remote source%s\n", n, n == 1 ? "" : "s");
+	fflush(stdout);
+	ret = 0;
+	for (next = 0, running = 0; next < n || running > 0;) {
+		for (; next < n && running < BUILD_FETCH_JOBS; next++) {
+			fetch_start(bcp, &jobs[next]);
+			running++;
+		}
+		running -= fetch_wait(jobs, next);
+	}
+	/*
+	 * Report in manifest order once everything is in, rather than in
+	 * whatever order the fetches completed.
+	 */
+	for (k = 0; k < n; k++) {
+		if (fetch_finish(bcp, &jobs[k]) == -1) {
+			ret = -1;
+		}
+	}
+	fflush(stdout);
+	if (stage == -1) {
+		report_record(bcp, REPORT_STAGE_BUILD, "fetch %ju",
+		    (uintmax_t)(stats_now_usec() - start));
+	}
+	free(jobs);
+	return (ret);
+}
@@ -0,0 +1,972 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <time.h>
+
+#include <openssl/evp.h>
+
+#include <cblock/libcblock.h>
+
+#include "termbuf.h"
+#include "main.h"
+#include "dispatch.h"
+#include "config.h"
+#include "stats.h"
+#include "fim.h"
+
+/*
+ * FIM specs are mtree(8) specs carrying a SHA-256 digest for each file,
+ * so that "mtree -p <root> -f FIM.spec" can verify an image. They are
+ * generated here rather than with mtree -c so the files can be hashed on
+ * all cores. Most of an image is usually the image it was built from, so
+ * files that are still the very files of that image keep the digest its
+ * index has for them instead of being read again. A build step can set a
+ * file's size and modification time to anything, but not its change time,
+ * so a file counts as unchanged only if its inode number and change time
+ * are the ones the index recorded from the image as well.
+ */
+#define	FIM_OP_FILE	0
+#define	FIM_OP_DIR	1
+#define	FIM_OP_UP	2	/* end of a directory, ".." */
+
+struct fim_node {
+	int			 fn_op;
+	char			*fn_name;
+	struct fim_entry	 fn_ent;
+};
+
+struct fim_walk {
+	const char		*fw_root;
+	struct fim_node		*fw_nodes;	/* in spec order */
+	size_t			 fw_nnodes;
+	size_t			 fw_alloc;
+	size_t			*fw_hash;	/* nodes to be hashed */
+	size_t			 fw_nhash;
+	size_t			 fw_hash_alloc;
+	size_t			 fw_next;
+	int			 fw_error;
+	pthread_mutex_t		 fw_lock;
+	struct fim_index	*fw_parent;
+	struct fim_stats	*fw_stats;
+};
+
+static const struct {
+	const char	*name;
+	mode_t		 mode;
+} fim_types[] = {
+	{ "file",	S_IFREG },
+	{ "dir",	S_IFDIR },
+	{ "link",	S_IFLNK },
+	{ "char",	S_IFCHR },
+	{ "block",	S_IFBLK },
+	{ "fifo",	S_IFIFO },
+	{ "socket",	S_IFSOCK },
+	{ NULL,		0 }
+};
+
+static const struct {
+	const char	*name;
+	int		 key;
+} fim_keys[] = {
+	{ "type",		FIM_KEY_TYPE },
+	{ "mode",		FIM_KEY_MODE },
+	{ "uid",		FIM_KEY_UID },
+	{ "gid",		FIM_KEY_GID },
+	{ "nlink",		FIM_KEY_NLINK },
+	{ "size",		FIM_KEY_SIZE },
+	{ "time",		FIM_KEY_TIME },
+	{ "link",		FIM_KEY_LINK },
+	{ "flags",		FIM_KEY_FLAGS },
+	{ "sha256",		FIM_KEY_SHA256 },
+	{ "sha256digest",	FIM_KEY_SHA256 },
+	{ NULL,			0 }
+};
+
+static char *
+fim_strdup(const char *s)
+{
+	char *ret;
+
+	ret = strdup(s);
+	if (ret == NULL) {
+		err(1, "strdup failed");
+	}
+	return (ret);
+}
+
+static const char *
+fim_type_name(mode_t mode)
+{
+	int k;
+
+	for (k = 0; fim_types[k].name != NULL; k++) {
+		if ((mode & S_IFMT) == fim_types[k].mode) {
+			return (fim_types[k].name);
+		}
+	}
+	return ("file");
+}
+
+static int
+fim_key_bit(const char *name)
+{
+	int k;
+
+	for (k = 0; fim_keys[k].name != NULL; k++) {
+		if (strcmp(fim_keys[k].name, name) == 0) {
+			return (fim_keys[k].key);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Names are encoded the way mtree encodes them: white space, the glob
+ * characters, '#' and '\' and anything unprintable as a backslash and three
+ * octal digits.
+ */
+static void
+fim_putvis(FILE *fp, const char *s)
+{
+	u_char c;
+
+	for (; *s != '\0'; s++) {
+		c = *s;
+		if (c <= ' ' || c >= 0x7f || strchr("\\#*?[", c) != NULL) {
+			fprintf(fp, "\\%03o", c);
+			continue;
+		}
+		putc(c, fp);
+	}
+}
+
+static void
+fim_unvis(char *s)
+{
+	char *d;
+	int k, c;
+
+	for (d = s; *s != '\0'; s++) {
+		if (*s != '\\' || s[1] == '\0') {
+			*d++ = *s;
+			continue;
+		}
+		s++;
+		if (*s >= '0' && *s <= '7') {
+			for (c = 0, k = 0; k < 3 && *s >= '0' && *s <= '7';
+			    k++, s++) {
+				c = c * 8 + (*s - '0');
+			}
+			s--;
+			*d++ = c;
+			continue;
+		}
+		switch (*s) {
+		case 's':
+			*d++ = ' ';
+			break;
+		case 't':
+			*d++ = '\t';
+			break;
+		case 'n':
+			*d++ = '\n';
+			break;
+		default:
+			*d++ = *s;
+			break;
+		}
+	}
+	*d = '\0';
+}
+
+static void
+fim_parse_time(const char *val, struct timespec *tsp)
+{
+	char *ep;
+	int k;
+
+	tsp->tv_sec = strtoll(val, &ep, 10);
+	tsp->tv_nsec = 0;
+	if (*ep != '.') {
+		return;
+	}
+	for (ep++, k = 0; k < 9; k++) {
+		tsp->tv_nsec *= 10;
+		if (*ep >= '0' && *ep <= '9') {
+			tsp->tv_nsec += *ep++ - '0';
+		}
+	}
+}
+
+static void
+fim_parse_keyword(struct fim_entry *fep, char *kw)
+{
+	char *val;
+	int k, bit;
+#ifdef __FreeBSD__
+	u_long set, clr;
+#endif
+
+	val = strchr(kw, '=');
+	if (val == NULL) {
+		return;
+	}
+	*val++ = '\0';
+	bit = fim_key_bit(kw);
+	switch (bit) {
+	case FIM_KEY_TYPE:
+		for (k = 0; fim_types[k].name != NULL; k++) {
+			if (strcmp(fim_types[k].name, val) == 0) {
+				break;
+			}
+		}
+		fep->fe_mode = (fep->fe_mode & ~S_IFMT) | fim_types[k].mode;
+		break;
+	case FIM_KEY_MODE:
+		fep->fe_mode = (fep->fe_mode & S_IFMT) |
+		    (strtoul(val, NULL, 8) & ALLPERMS);
+		break;
+	case FIM_KEY_UID:
+		fep->fe_uid = strtoul(val, NULL, 10);
+		break;
+	case FIM_KEY_GID:
+		fep->fe_gid = strtoul(val, NULL, 10);
+		break;
+	case FIM_KEY_NLINK:
+		fep->fe_nlink = strtoul(val, NULL, 10);
+		break;
+	case FIM_KEY_SIZE:
+		fep->fe_size = strtoll(val, NULL, 10);
+		break;
+	case FIM_KEY_TIME:
+		fim_parse_time(val, &fep->fe_mtime);
+		break;
+	case FIM_KEY_LINK:
+		fim_unvis(val);
+		free(fep->fe_link);
+		fep->fe_link = fim_strdup(val);
+		break;
+	case FIM_KEY_FLAGS:
+#ifdef __FreeBSD__
+		if (strcmp(val, "none") == 0) {
+			fep->fe_flags = 0;
+		} else if (strtofflags(&val, &set, &clr) == 0) {
+			fep->fe_flags = set;
+		} else {
+			bit = 0;
+		}
+#else
+		bit = 0;
+#endif
+		break;
+	case FIM_KEY_SHA256:
+		strlcpy(fep->fe_digest, val, sizeof(fep->fe_digest));
+		break;
+	default:
+		/* uname, gname, ignore, optional and the like */
+		return;
+	}
+	fep->fe_keys |= bit;
+}
+
+static int
+fim_entry_cmp(const void *a, const void *b)
+{
+	const struct fim_entry *fa, *fb;
+
+	fa = a;
+	fb = b;
+	return (strcmp(fa->fe_path, fb->fe_path));
+}
+
+static struct fim_entry *
+fim_spec_add(struct fim_spec *fsp)
+{
+	struct fim_entry *fep;
+
+	if (fsp->fs_nents == fsp->fs_alloc) {
+		fsp->fs_alloc = fsp->fs_alloc == 0 ? 1024 : fsp->fs_alloc * 2;
+		fsp->fs_ents = realloc(fsp->fs_ents,
+		    fsp->fs_alloc * sizeof(*fsp->fs_ents));
+		if (fsp->fs_ents == NULL) {
+			err(1, "realloc FIM entries failed");
+		}
+	}
+	fep = &fsp->fs_ents[fsp->fs_nents++];
+	bzero(fep, sizeof(*fep));
+	return (fep);
+}
+
+/*
+ * Read a line, joining lines continued with a trailing backslash. An
+ * encoded name never ends with one, so it can only be a continuation.
+ */
+static ssize_t
+fim_getline(char **linep, size_t *capp, FILE *fp)
+{
+	char *more;
+	size_t mcap, len;
+	ssize_t cc, mc;
+
+	cc = getline(linep, capp, fp);
+	if (cc == -1) {
+		return (-1);
+	}
+	more = NULL;
+	mcap = 0;
+	for (;;) {
+		while (cc > 0 && (*linep)[cc - 1] == '\n') {
+			(*linep)[--cc] = '\0';
+		}
+		if (cc == 0 || (*linep)[cc - 1] != '\\') {
+			break;
+		}
+		(*linep)[--cc] = '\0';
+		mc = getline(&more, &mcap, fp);
+		if (mc == -1) {
+			break;
+		}
+		len = cc + mc + 1;
+		if (len > *capp) {
+			*linep = realloc(*linep, len);
+			if (*linep == NULL) {
+				err(1, "realloc failed");
+			}
+			*capp = len;
+		}
+		memcpy(*linep + cc, more, mc + 1);
+		cc += mc;
+	}
+	free(more);
+	return (cc);
+}
+
+/*
+ * Load an mtree spec, either one written by fim_generate or by mtree -c.
+ * Returns NULL if the spec can not be opened or names a path that is too
+ * long.
+ */
+struct fim_spec *
+fim_spec_load(const char *path)
+{
+	char cwd[MAXPATHLEN], full[MAXPATHLEN], *line, *p, *name, *kw, *s;
+	struct fim_entry defaults, *fep;
+	struct fim_spec *fsp;
+	size_t cap;
+	FILE *fp;
+	int bit;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return (NULL);
+	}
+	fsp = calloc(1, sizeof(*fsp));
+	if (fsp == NULL) {
+		err(1, "calloc failed");
+	}
+	bzero(&defaults, sizeof(defaults));
+	cwd[0] = '\0';
+	line = NULL;
+	cap = 0;
+	while (fim_getline(&line, &cap, fp) != -1) {
+		p = line + strspn(line, " \t");
+		if (*p == '\0' || *p == '#') {
+			continue;
+		}
+		name = strsep(&p, " \t");
+		if (strcmp(name, "/set") == 0) {
+			while ((kw = strsep(&p, " \t")) != NULL) {
+				fim_parse_keyword(&defaults, kw);
+			}
+			/* Links are per entry */
+			free(defaults.fe_link);
+			defaults.fe_link = NULL;
+			defaults.fe_keys &= ~FIM_KEY_LINK;
+			continue;
+		}
+		if (strcmp(name, "/unset") == 0) {
+			while ((kw = strsep(&p, " \t")) != NULL) {
+				if (strcmp(kw, "all") == 0) {
+					bzero(&defaults, sizeof(defaults));
+					break;
+				}
+				bit = fim_key_bit(kw);
+				defaults.fe_keys &= ~bit;
+			}
+			continue;
+		}
+		if (strcmp(name, "..") == 0) {
+			s = strrchr(cwd, '/');
+			if (s != NULL) {
+				*s = '\0';
+			} else {
+				cwd[0] = '\0';
+			}
+			continue;
+		}
+		fim_unvis(name);
+		fep = fim_spec_add(fsp);
+		*fep = defaults;
+		while ((kw = strsep(&p, " \t")) != NULL) {
+			fim_parse_keyword(fep, kw);
+		}
+		/*
+		 * Names with a slash in them are full paths and do not change
+		 * the current directory.
+		 */
+		if (strchr(name, '/') != NULL) {
+			if (strncmp(name, "./", 2) == 0) {
+				fep->fe_path = fim_strdup(name);
+			} else {
+				(void) snprintf(full, sizeof(full), "./%s",
+				    name);
+				fep->fe_path = fim_strdup(full);
+			}
+			continue;
+		}
+		if (cwd[0] == '\0') {
+			(void) snprintf(full, sizeof(full), "%s", name);
+		} else if (snprintf(full, sizeof(full), "%s/%s", cwd,
+		    name) >= (int)sizeof(full)) {
+			warnx("%s: path too long", path);
+			free(line);
+			(void) fclose(fp);
+			fim_spec_free(fsp);
+			return (NULL);
+		}
+		fep->fe_path = fim_strdup(full);
+		if (S_ISDIR(fep->fe_mode)) {
+			strlcpy(cwd, full, sizeof(cwd));
+		}
+	}
+	free(line);
+	(void) fclose(fp);
+	qsort(fsp->fs_ents, fsp->fs_nents, sizeof(*fsp->fs_ents),
+	    fim_entry_cmp);
+	return (fsp);
+}
+
+void
+fim_spec_free(struct fim_spec *fsp)
+{
+	size_t k;
+
+	if (fsp == NULL) {
+		return;
+	}
+	for (k = 0; k < fsp->fs_nents; k++) {
+		free(fsp->fs_ents[k].fe_path);
+		free(fsp->fs_ents[k].fe_link);
+	}
+	free(fsp->fs_ents);
+	free(fsp);
+}
+
+static struct fim_node *
+fim_add_node(struct fim_walk *fwp, int op, const char *name, const char *rel,
+    struct stat *sbp)
+{
+	struct fim_entry *fep;
+	struct fim_node *fnp;
+
+	if (fwp->fw_nnodes == fwp->fw_alloc) {
+		fwp->fw_alloc = fwp->fw_alloc == 0 ? 1024 : fwp->fw_alloc * 2;
+		fwp->fw_nodes = realloc(fwp->fw_nodes,
+		    fwp->fw_alloc * sizeof(*fwp->fw_nodes));
+		if (fwp->fw_nodes == NULL) {
+			err(1, "realloc FIM nodes failed");
+		}
+	}
+	fnp = &fwp->fw_nodes[fwp->fw_nnodes++];
+	bzero(fnp, sizeof(*fnp));
+	fnp->fn_op = op;
+	fnp->fn_name = fim_strdup(name);
+	fep = &fnp->fn_ent;
+	fep->fe_path = fim_strdup(rel);
+	if (sbp == NULL) {
+		return (fnp);
+	}
+	fep->fe_mode = sbp->st_mode;
+	fep->fe_uid = sbp->st_uid;
+	fep->fe_gid = sbp->st_gid;
+	fep->fe_nlink = sbp->st_nlink;
+	fep->fe_size = sbp->st_size;
+	fep->fe_mtime = sbp->st_mtim;
+#ifdef __FreeBSD__
+	fep->fe_flags = sbp->st_flags;
+#endif
+	fep->fe_keys = FIM_KEY_TYPE | FIM_KEY_MODE | FIM_KEY_UID |
+	    FIM_KEY_GID | FIM_KEY_NLINK | FIM_KEY_TIME;
+#ifdef __FreeBSD__
+	fep->fe_keys |= FIM_KEY_FLAGS;
+#endif
+	if (S_ISREG(sbp->st_mode)) {
+		fep->fe_keys |= FIM_KEY_SIZE | FIM_KEY_SHA256;
+	}
+	return (fnp);
+}
+
+/*
+ * Queue a regular file for hashing, unless it is still the very file of the
+ * parent image that the parent's index has a digest for.
+ */
+static void
+fim_add_file(struct fim_walk *fwp, struct fim_node *fnp, struct stat *sbp)
+{
+	const struct fim_index_ent *pep;
+	struct fim_entry *fep;
+	struct fim_stats *fsp;
+
+	fsp = fwp->fw_stats;
+	fep = &fnp->fn_ent;
+	fsp->fs_files++;
+	fsp->fs_bytes += fep->fe_size;
+	if (fwp->fw_parent != NULL) {
+		pep = fim_index_lookup(fwp->fw_parent, fep->fe_path);
+		if (pep != NULL && S_ISREG(pep->fi_mode) &&
+		    (pep->fi_keys & FIM_KEY_SHA256) != 0 &&
+		    fim_index_same_file(pep, sbp)) {
+			fim_index_digest(pep, fep->fe_digest);
+			fsp->fs_reused++;
+			fsp->fs_reused_bytes += fep->fe_size;
+			return;
+		}
+	}
+	if (fwp->fw_nhash == fwp->fw_hash_alloc) {
+		fwp->fw_hash_alloc = fwp->fw_hash_alloc == 0 ? 1024 :
+		    fwp->fw_hash_alloc * 2;
+		fwp->fw_hash = realloc(fwp->fw_hash,
+		    fwp->fw_hash_alloc * sizeof(*fwp->fw_hash));
+		if (fwp->fw_hash == NULL) {
+			err(1, "realloc FIM hash list failed");
+		}
+	}
+	fwp->fw_hash[fwp->fw_nhash++] = fnp - fwp->fw_nodes;
+}
+
+/*
+ * Walk a directory the way mtree -c does: the files in it first, then the
+ * directories, each in name order.
+ */
+static int
+fim_walk(struct fim_walk *fwp, const char *path, const char *rel, int level)
+{
+	char child[MAXPATHLEN], crel[MAXPATHLEN], target[MAXPATHLEN];
+	struct dirent **names;
+	struct fim_node *fnp;
+	struct stat *sbs;
+	int n, k, pass, ret;
+	ssize_t cc;
+
+	n = scandir(path, &names, NULL, alphasort);
+	if (n == -1) {
+		warn("scandir(%s)", path);
+		return (-1);
+	}
+	sbs = calloc(n, sizeof(*sbs));
+	if (sbs == NULL) {
+		err(1, "calloc failed");
+	}
+	ret = 0;
+	for (k = 0; k < n && ret == 0; k++) {
+		/*
+		 * A mode of zero marks entries which are not part of the
+		 * spec, including the spec itself and its index.
+		 */
+		if (strcmp(names[k]->d_name, ".") == 0 ||
+		    strcmp(names[k]->d_name, "..") == 0 ||
+		    (level == 0 &&
+		    (strcmp(names[k]->d_name, FIM_SPEC_FILE) == 0 ||
+		    strcmp(names[k]->d_name, FIM_INDEX_FILE) == 0))) {
+			continue;
+		}
+		(void) snprintf(child, sizeof(child), "%s/%s", path,
+		    names[k]->d_name);
+		if (lstat(child, &sbs[k]) == -1) {
+			warn("lstat(%s)", child);
+			ret = -1;
+		}
+	}
+	for (pass = 0; pass < 2 && ret == 0; pass++) {
+		for (k = 0; k < n && ret == 0; k++) {
+			if (sbs[k].st_mode == 0 ||
+			    (S_ISDIR(sbs[k].st_mode) != 0) != (pass == 1)) {
+				continue;
+			}
+			(void) snprintf(child, sizeof(child), "%s/%s", path,
+			    names[k]->d_name);
+			(void) snprintf(crel, sizeof(crel), "%s/%s", rel,
+			    names[k]->d_name);
+			if (S_ISDIR(sbs[k].st_mode)) {
+				(void) fim_add_node(fwp, FIM_OP_DIR,
+				    names[k]->d_name, crel, &sbs[k]);
+				ret = fim_walk(fwp, child, crel, level + 1);
+				(void) fim_add_node(fwp, FIM_OP_UP, "..",
+				    crel, NULL);
+				continue;
+			}
+			fnp = fim_add_node(fwp, FIM_OP_FILE, names[k]->d_name,
+			    crel, &sbs[k]);
+			if (S_ISLNK(sbs[k].st_mode)) {
+				cc = readlink(child, target,
+				    sizeof(target) - 1);
+				if (cc == -1) {
+					warn("readlink(%s)", child);
+					ret = -1;
+					continue;
+				}
+				target[cc] = '\0';
+				fnp->fn_ent.fe_link = fim_strdup(target);
+				fnp->fn_ent.fe_keys |= FIM_KEY_LINK;
+			} else if (S_ISREG(sbs[k].st_mode)) {
+				fim_add_file(fwp, fnp, &sbs[k]);
+			}
+		}
+	}
+	for (k = 0; k < n; k++) {
+		free(names[k]);
+	}
+	free(names);
+	free(sbs);
+	return (ret);
+}
+
+/*
+ * Open a regular file to hash it. The file may be in the root of a running
+ * instance, which can replace the path between it being looked at and it
+ * being opened: symlinks are not followed, a FIFO can not block the open,
+ * and if sbp is given the file must still be the one it describes.
+ */
+int
+fim_open_file(int dirfd, const char *path, const struct stat *sbp)
+{
+	struct stat sb;
+	int fd;
+
+	fd = openat(dirfd, path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK |
+	    O_CLOEXEC);
+	if (fd == -1) {
+		return (-1);
+	}
+	if (fstat(fd, &sb) == -1) {
+		(void) close(fd);
+		return (-1);
+	}
+	if (!S_ISREG(sb.st_mode) || (sbp != NULL &&
+	    (sb.st_dev != sbp->st_dev || sb.st_ino != sbp->st_ino))) {
+		(void) close(fd);
+		errno = EAGAIN;
+		return (-1);
+	}
+	return (fd);
+}
+
+static int
+fim_hash_file(EVP_MD_CTX *ctx, int dirfd, const char *path,
+    const struct stat *sbp, u_char *buf, char *digest)
+{
+	u_char hash[EVP_MAX_MD_SIZE];
+	ssize_t cc;
+	u_int dlen;
+	int fd;
+
+	fd = fim_open_file(dirfd, path, sbp);
+	if (fd == -1) {
+		warn("open(%s)", path);
+		return (-1);
+	}
+	if (!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
+		err(1, "EVP_DigestInit_ex failed");
+	}
+	while ((cc = read(fd, buf, FIM_BUF_SIZE)) > 0) {
+		EVP_DigestUpdate(ctx, buf, cc);
+	}
+	(void) close(fd);
+	if (cc == -1) {
+		warn("read(%s)", path);
+		return (-1);
+	}
+	if (!EVP_DigestFinal_ex(ctx, hash, &dlen)) {
+		err(1, "EVP_DigestFinal_ex failed");
+	}
+	bzero(digest, CBLOCK_DIGEST_LEN);
+	gen_sha256_string(hash, digest, dlen);
+	return (0);
+}
+
+/*
+ * Hash path, relative to dirfd, if it is still the regular file sbp
+ * describes.
+ */
+int
+fim_digest_file(int dirfd, const char *path, const struct stat *sbp,
+    char *digest)
+{
+	EVP_MD_CTX *ctx;
+	u_char *buf;
+	int ret;
+
+	buf = malloc(FIM_BUF_SIZE);
+	ctx = EVP_MD_CTX_new();
+	if (buf == NULL || ctx == NULL) {
+		err(1, "%s: allocation failed", __func__);
+	}
+	ret = fim_hash_file(ctx, dirfd, path, sbp, buf, digest);
+	EVP_MD_CTX_free(ctx);
+	free(buf);
+	return (ret);
+}
+
+static void *
+fim_hash_worker(void *arg)
+{
+	char path[MAXPATHLEN];
+	struct fim_walk *fwp;
+	struct fim_node *fnp;
+	EVP_MD_CTX *ctx;
+	u_char *buf;
+	size_t k;
+
+	fwp = arg;
+	buf = malloc(FIM_BUF_SIZE);
+	ctx = EVP_MD_CTX_new();
+	if (buf == NULL || ctx == NULL) {
+		err(1, "%s: allocation failed", __func__);
+	}
+	for (;;) {
+		pthread_mutex_lock(&fwp->fw_lock);
+		k = fwp->fw_next++;
+		pthread_mutex_unlock(&fwp->fw_lock);
+		if (k >= fwp->fw_nhash) {
+			break;
+		}
+		fnp = &fwp->fw_nodes[fwp->fw_hash[k]];
+		/* Paths start with "." */
+		(void) snprintf(path, sizeof(path), "%s%s", fwp->fw_root,
+		    fnp->fn_ent.fe_path + 1);
+		if (fim_hash_file(ctx, AT_FDCWD, path, NULL, buf,
+		    fnp->fn_ent.fe_digest) == -1) {
+			pthread_mutex_lock(&fwp->fw_lock);
+			fwp->fw_error = 1;
+			pthread_mutex_unlock(&fwp->fw_lock);
+		}
+	}
+	EVP_MD_CTX_free(ctx);
+	free(buf);
+	return (NULL);
+}
+
+static int
+fim_hash_files(struct fim_walk *fwp)
+{
+	pthread_t thr[FIM_MAX_THREADS];
+	long ncpu;
+	int k, n;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	n = ncpu < 1 ? 1 : MIN(ncpu, FIM_MAX_THREADS);
+	if ((size_t)n > fwp->fw_nhash) {
+		n = fwp->fw_nhash;
+	}
+	if (n <= 1) {
+		(void) fim_hash_worker(fwp);
+		return (fwp->fw_error ? -1 : 0);
+	}
+	for (k = 0; k < n; k++) {
+		if (pthread_create(&thr[k], NULL, fim_hash_worker, fwp) != 0) {
+			errx(1, "pthread_create failed");
+		}
+	}
+	for (k = 0; k < n; k++) {
+		(void) pthread_join(thr[k], NULL);
+	}
+	return (fwp->fw_error ? -1 : 0);
+}
+
+static void
+fim_print_node(FILE *fp, struct fim_node *fnp)
+{
+	struct fim_entry *fep;
+#ifdef __FreeBSD__
+	char *flags;
+#endif
+	int len;
+
+	fep = &fnp->fn_ent;
+	switch (fnp->fn_op) {
+	case FIM_OP_UP:
+		fprintf(fp, "# ");
+		fim_putvis(fp, fep->fe_path);
+		fprintf(fp, "\n..\n\n");
+		return;
+	case FIM_OP_DIR:
+		fprintf(fp, "\n# ");
+		fim_putvis(fp, fep->fe_path);
+		fprintf(fp, "\n");
+		len = 0;
+		break;
+	default:
+		fprintf(fp, "    ");
+		len = 4;
+		break;
+	}
+	fim_putvis(fp, fnp->fn_name);
+	len += strlen(fnp->fn_name);
+	fprintf(fp, "%*s", len < 20 ? 20 - len : 1, "");
+	fprintf(fp, "type=%s uid=%u gid=%u mode=%#o nlink=%ju",
+	    fim_type_name(fep->fe_mode), fep->fe_uid, fep->fe_gid,
+	    fep->fe_mode & ALLPERMS, (uintmax_t)fep->fe_nlink);
+	if (fep->fe_keys & FIM_KEY_SIZE) {
+		fprintf(fp, " size=%jd", (intmax_t)fep->fe_size);
+	}
+	fprintf(fp, " time=%jd.%09ld", (intmax_t)fep->fe_mtime.tv_sec,
+	    fep->fe_mtime.tv_nsec);
+	if (fep->fe_keys & FIM_KEY_LINK) {
+		fprintf(fp, " link=");
+		fim_putvis(fp, fep->fe_link);
+	}
+#ifdef __FreeBSD__
+	flags = fflagstostr(fep->fe_flags);
+	if (flags != NULL) {
+		fprintf(fp, " flags=%s", *flags != '\0' ? flags : "none");
+		free(flags);
+	}
+#endif
+	if (fep->fe_keys & FIM_KEY_SHA256) {
+		fprintf(fp, " sha256digest=%s", fep->fe_digest);
+	}
+	fprintf(fp, "\n");
+}
+
+static int
+fim_write_spec(struct fim_walk *fwp)
+{
+	char path[MAXPATHLEN], tmp[MAXPATHLEN + 8], host[MAXHOSTNAMELEN];
+	struct passwd *pw;
+	time_t now;
+	size_t k;
+	FILE *fp;
+
+	(void) snprintf(path, sizeof(path), "%s/%s", fwp->fw_root,
+	    FIM_SPEC_FILE);
+	(void) snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		warn("fopen(%s)", tmp);
+		return (-1);
+	}
+	if (gethostname(host, sizeof(host)) == -1) {
+		strlcpy(host, "unknown", sizeof(host));
+	}
+	pw = getpwuid(geteuid());
+	now = time(NULL);
+	fprintf(fp, "#\t   user: %s\n", pw != NULL ? pw->pw_name : "unknown");
+	fprintf(fp, "#\tmachine: %s\n", host);
+	fprintf(fp, "#\t   tree: %s\n", fwp->fw_root);
+	fprintf(fp, "#\t   date: %s", ctime(&now));
+	for (k = 0; k < fwp->fw_nnodes; k++) {
+		fim_print_node(fp, &fwp->fw_nodes[k]);
+	}
+	if (fclose(fp) != 0) {
+		warn("write %s", tmp);
+		(void) unlink(tmp);
+		return (-1);
+	}
+	if (rename(tmp, path) == -1) {
+		warn("rename(%s)", tmp);
+		(void) unlink(tmp);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Write an mtree spec of the tree at root to FIM.spec at its top, taking
+ * digests of unchanged files from the index of the image directory parent
+ * if there is one.
+ */
+int
+fim_generate(const char *root, const char *parent, struct fim_stats *fsp)
+{
+	struct fim_walk fw;
+	uint64_t start;
+	struct stat sb;
+	size_t k;
+	int ret;
+
+	start = stats_now_usec();
+	bzero(fsp, sizeof(*fsp));
+	bzero(&fw, sizeof(fw));
+	fw.fw_root = root;
+	fw.fw_stats = fsp;
+	pthread_mutex_init(&fw.fw_lock, NULL);
+	if (parent != NULL) {
+		fw.fw_parent = fim_index_open(parent);
+	}
+	if (lstat(root, &sb) == -1) {
+		warn("lstat(%s)", root);
+		ret = -1;
+		goto out;
+	}
+	(void) fim_add_node(&fw, FIM_OP_DIR, ".", ".", &sb);
+	ret = fim_walk(&fw, root, ".", 0);
+	(void) fim_add_node(&fw, FIM_OP_UP, "..", ".", NULL);
+	if (ret == 0) {
+		ret = fim_hash_files(&fw);
+	}
+	if (ret == 0) {
+		ret = fim_write_spec(&fw);
+	}
+out:
+	for (k = 0; k < fw.fw_nnodes; k++) {
+		free(fw.fw_nodes[k].fn_name);
+		free(fw.fw_nodes[k].fn_ent.fe_path);
+		free(fw.fw_nodes[k].fn_ent.fe_link);
+	}
+	free(fw.fw_nodes);
+	free(fw.fw_hash);
+	fim_index_close(fw.fw_parent);
+	pthread_mutex_destroy(&fw.fw_lock);
+	fsp->fs_usec = stats_now_usec() - start;
+	return (ret);
+}
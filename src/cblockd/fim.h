@@ -0,0 +1,148 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef FIM_DOT_H_
+#define	FIM_DOT_H_
+
+#define	FIM_SPEC_FILE		"FIM.spec"
+#define	FIM_INDEX_FILE		"FIM.idx"
+
+/*
+ * Keywords present for an entry of a spec.
+ */
+#define	FIM_KEY_TYPE		0x0001
+#define	FIM_KEY_MODE		0x0002
+#define	FIM_KEY_UID		0x0004
+#define	FIM_KEY_GID		0x0008
+#define	FIM_KEY_NLINK		0x0010
+#define	FIM_KEY_SIZE		0x0020
+#define	FIM_KEY_TIME		0x0040
+#define	FIM_KEY_LINK		0x0080
+#define	FIM_KEY_FLAGS		0x0100
+#define	FIM_KEY_SHA256		0x0200
+
+/*
+ * A file as described by an mtree(8) spec. Paths are relative to the root
+ * of the tree and start with ".", as mtree writes them.
+ */
+struct fim_entry {
+	char			*fe_path;
+	char			*fe_link;
+	mode_t			 fe_mode;	/* type and permission bits */
+	uid_t			 fe_uid;
+	gid_t			 fe_gid;
+	nlink_t			 fe_nlink;
+	off_t			 fe_size;
+	struct timespec		 fe_mtime;
+	u_long			 fe_flags;
+	int			 fe_keys;
+	char			 fe_digest[CBLOCK_DIGEST_LEN];
+};
+
+struct fim_spec {
+	struct fim_entry	*fs_ents;	/* sorted by path */
+	size_t			 fs_nents;
+	size_t			 fs_alloc;
+};
+
+struct fim_stats {
+	uint64_t		 fs_files;
+	uint64_t		 fs_bytes;
+	uint64_t		 fs_reused;	/* digests taken from the parent */
+	uint64_t		 fs_reused_bytes;
+	uint64_t		 fs_usec;
+};
+
+/*
+ * The binary index of a spec, written next to it at commit. It is mapped
+ * rather than parsed: a header, the entries sorted by the FNV-1a hash of
+ * their path (then by path), and a table of the NUL terminated path and
+ * link strings the entries point into. Offset 0 of the string table is an
+ * empty string. Fields are in host byte order. The inode number and change
+ * time of regular files are those of the image's own files when the index
+ * was written, or zero if they did not match the spec then.
+ */
+#define	FIM_INDEX_MAGIC		"CBFIMIDX"
+#define	FIM_INDEX_VERSION	2
+
+struct fim_index_hdr {
+	char			 fh_magic[8];
+	uint32_t		 fh_version;
+	uint32_t		 fh_nents;
+	uint64_t		 fh_strtab;	/* offset of the string table */
+	uint64_t		 fh_strsize;
+};
+
+struct fim_index_ent {
+	uint64_t		 fi_hash;
+	uint32_t		 fi_path;
+	uint32_t		 fi_link;
+	uint32_t		 fi_mode;
+	uint32_t		 fi_uid;
+	uint32_t		 fi_gid;
+	uint32_t		 fi_keys;
+	uint64_t		 fi_size;
+	uint64_t		 fi_flags;
+	int64_t			 fi_mtime_sec;
+	int64_t			 fi_mtime_nsec;
+	uint64_t		 fi_ino;
+	int64_t			 fi_ctime_sec;
+	int64_t			 fi_ctime_nsec;
+	u_char			 fi_digest[32];
+};
+
+struct fim_index {
+	void			*fx_base;
+	size_t			 fx_len;
+	const struct fim_index_ent *fx_ents;
+	size_t			 fx_nents;
+	const char		*fx_strs;
+};
+
+struct fim_spec *	fim_spec_load(const char *);
+void			fim_spec_free(struct fim_spec *);
+int			fim_generate(const char *, const char *,
+			    struct fim_stats *);
+int			fim_open_file(int, const char *, const struct stat *);
+int			fim_digest_file(int, const char *, const struct stat *,
+			    char *);
+int			fim_index_build(const char *);
+struct fim_index *	fim_index_open(const char *);
+void			fim_index_close(struct fim_index *);
+const struct fim_index_ent *
+			fim_index_lookup(struct fim_index *, const char *);
+const char *		fim_index_path(struct fim_index *,
+			    const struct fim_index_ent *);
+void			fim_index_digest(const struct fim_index_ent *, char *);
+int			fim_index_same_file(const struct fim_index_ent *,
+			    const struct stat *);
+int			fim_index_check(struct fim_index *,
+			    const struct fim_index_ent *, int, const char *,
+			    struct stat *, int);
+int			dispatch_fim_diff(int);
+int			dispatch_fim_verify(int);
+
+#endif	/* FIM_DOT_H_ */
@@ -0,0 +1,1005 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fts.h>
+#include <pthread.h>
+
+#include <cblock/libcblock.h>
+#include <cblock/sbuf.h>
+
+#include "termbuf.h"
+#include "main.h"
+#include "sock_ipc.h"
+#include "config.h"
+#include "fim.h"
+#include "report.h"
+
+/*
+ * Verifying an image or comparing two used to mean parsing whole mtree
+ * specs. The index makes both proportional to the work: a path is found
+ * with a binary search of the mapped entries, and since two indexes are
+ * in the same order, they are compared in a single merge pass.
+ */
+struct fim_index_sort {
+	struct fim_index_ent	 fs_ent;
+	const char		*fs_path;
+};
+
+struct fim_change {
+	int			 fc_kind;
+	const char		*fc_path;
+	char			*fc_copy;	/* path not in an index */
+};
+
+struct fim_changes {
+	struct fim_change	*fc_vec;
+	size_t			 fc_n;
+	size_t			 fc_alloc;
+};
+
+/*
+ * An image is verified by a thread per core, each walking whole
+ * directories FIM_VERIFY_SPLIT levels below the image directory, which is
+ * where most of the files of an image (root/usr/lib, root/usr/share and
+ * so on) divide up.
+ */
+#define	FIM_VERIFY_SPLIT	3
+
+struct fim_verify {
+	struct fim_index	*fv_index;
+	size_t			 fv_rootlen;
+	int			 fv_hash;
+	u_char			*fv_seen;	/* per entry */
+	struct fim_changes	*fv_changes;
+	char			**fv_dirs;	/* left to the workers */
+	size_t			 fv_ndirs;
+	size_t			 fv_alloc;
+	size_t			 fv_next;
+	pthread_mutex_t		 fv_lock;
+};
+
+static const char *fim_diff_names[] = {
+	[FIM_DRIFT_CONTENT] = "modified",
+	[FIM_DRIFT_ATTR] = "attributes",
+	[FIM_DRIFT_EXTRA] = "added",
+	[FIM_DRIFT_MISSING] = "removed",
+};
+
+static const char *fim_verify_names[] = {
+	[FIM_DRIFT_CONTENT] = "modified",
+	[FIM_DRIFT_ATTR] = "attributes",
+	[FIM_DRIFT_EXTRA] = "extra",
+	[FIM_DRIFT_MISSING] = "missing",
+};
+
+/*
+ * Files in an image directory which describe the image rather than being
+ * part of it, and are not in its spec. Temporary files written next to
+ * them are skipped as well.
+ */
+static const char *fim_verify_skip[] = {
+	FIM_SPEC_FILE,
+	FIM_INDEX_FILE,
+	REPORT_IMAGE_FILE,
+	"TOTALS",
+	NULL
+};
+
+static uint64_t
+fim_index_hash(const char *s)
+{
+	uint64_t h;
+
+	/* FNV-1a */
+	for (h = 14695981039346656037ULL; *s != '\0'; s++) {
+		h = (h ^ (u_char)*s) * 1099511628211ULL;
+	}
+	return (h);
+}
+
+static int
+fim_hex_nibble(int c)
+{
+
+	if (c >= '0' && c <= '9') {
+		return (c - '0');
+	}
+	if (c >= 'a' && c <= 'f') {
+		return (c - 'a' + 10);
+	}
+	if (c >= 'A' && c <= 'F') {
+		return (c - 'A' + 10);
+	}
+	return (-1);
+}
+
+static int
+fim_digest_to_bin(const char *hex, u_char *bin)
+{
+	int k, hi, lo;
+
+	for (k = 0; k < 32; k++) {
+		hi = fim_hex_nibble(hex[k * 2]);
+		lo = hi == -1 ? -1 : fim_hex_nibble(hex[k * 2 + 1]);
+		if (lo == -1) {
+			return (-1);
+		}
+		bin[k] = (hi << 4) | lo;
+	}
+	return (hex[64] == '\0' ? 0 : -1);
+}
+
+static void
+fim_digest_to_hex(const u_char *bin, char *hex)
+{
+	static const char digits[] = "0123456789abcdef";
+	int k;
+
+	for (k = 0; k < 32; k++) {
+		hex[k * 2] = digits[bin[k] >> 4];
+		hex[k * 2 + 1] = digits[bin[k] & 0xf];
+	}
+	hex[64] = '\0';
+}
+
+static int
+fim_index_sort_cmp(const void *a, const void *b)
+{
+	const struct fim_index_sort *x = a, *y = b;
+
+	if (x->fs_ent.fi_hash != y->fs_ent.fi_hash) {
+		return (x->fs_ent.fi_hash < y->fs_ent.fi_hash ? -1 : 1);
+	}
+	return (strcmp(x->fs_path, y->fs_path));
+}
+
+/*
+ * Record the inode number and change time of a regular file in the image
+ * directory dir, if it is still the file the spec describes.
+ */
+static void
+fim_index_stat(const char *dir, struct fim_entry *fep,
+    struct fim_index_ent *fip)
+{
+	char path[MAXPATHLEN];
+	struct stat sb;
+
+	if (!S_ISREG(fep->fe_mode) || (fep->fe_keys & FIM_KEY_SIZE) == 0 ||
+	    (fep->fe_keys & FIM_KEY_TIME) == 0) {
+		return;
+	}
+	if (snprintf(path, sizeof(path), "%s/%s", dir, fep->fe_path) >=
+	    (int)sizeof(path) || lstat(path, &sb) == -1) {
+		return;
+	}
+	if (!S_ISREG(sb.st_mode) || sb.st_size != fep->fe_size ||
+	    sb.st_mtim.tv_sec != fep->fe_mtime.tv_sec ||
+	    sb.st_mtim.tv_nsec != fep->fe_mtime.tv_nsec) {
+		return;
+	}
+	fip->fi_ino = sb.st_ino;
+	fip->fi_ctime_sec = sb.st_ctim.tv_sec;
+	fip->fi_ctime_nsec = sb.st_ctim.tv_nsec;
+}
+
+static int
+fim_index_write(struct fim_spec *fsp, const char *dir, const char *path)
+{
+	struct fim_index_sort *ents, *sp;
+	struct fim_entry *fep;
+	struct fim_index_hdr hdr;
+	char tmp[MAXPATHLEN];
+	size_t k, strsize, len;
+	char *strs;
+	FILE *fp;
+	int ret;
+
+	strsize = 1;
+	for (k = 0; k < fsp->fs_nents; k++) {
+		fep = &fsp->fs_ents[k];
+		strsize += strlen(fep->fe_path) + 1;
+		if (fep->fe_link != NULL) {
+			strsize += strlen(fep->fe_link) + 1;
+		}
+	}
+	if (strsize > UINT32_MAX || fsp->fs_nents > UINT32_MAX) {
+		warnx("%s: spec too large to index", path);
+		return (-1);
+	}
+	ents = calloc(fsp->fs_nents + 1, sizeof(*ents));
+	strs = malloc(strsize);
+	if (ents == NULL || strs == NULL) {
+		err(1, "fim_index_write: allocation failed");
+	}
+	strs[0] = '\0';
+	strsize = 1;
+	for (k = 0; k < fsp->fs_nents; k++) {
+		fep = &fsp->fs_ents[k];
+		sp = &ents[k];
+		len = strlen(fep->fe_path) + 1;
+		bcopy(fep->fe_path, strs + strsize, len);
+		sp->fs_path = fep->fe_path;
+		sp->fs_ent.fi_hash = fim_index_hash(fep->fe_path);
+		sp->fs_ent.fi_path = strsize;
+		strsize += len;
+		if (fep->fe_link != NULL) {
+			len = strlen(fep->fe_link) + 1;
+			bcopy(fep->fe_link, strs + strsize, len);
+			sp->fs_ent.fi_link = strsize;
+			strsize += len;
+		}
+		sp->fs_ent.fi_mode = fep->fe_mode;
+		sp->fs_ent.fi_uid = fep->fe_uid;
+		sp->fs_ent.fi_gid = fep->fe_gid;
+		sp->fs_ent.fi_keys = fep->fe_keys;
+		sp->fs_ent.fi_size = fep->fe_size;
+		sp->fs_ent.fi_flags = fep->fe_flags;
+		sp->fs_ent.fi_mtime_sec = fep->fe_mtime.tv_sec;
+		sp->fs_ent.fi_mtime_nsec = fep->fe_mtime.tv_nsec;
+		fim_index_stat(dir, fep, &sp->fs_ent);
+		if ((fep->fe_keys & FIM_KEY_SHA256) != 0 &&
+		    fim_digest_to_bin(fep->fe_digest,
+		    sp->fs_ent.fi_digest) == -1) {
+			sp->fs_ent.fi_keys &= ~FIM_KEY_SHA256;
+		}
+	}
+	qsort(ents, fsp->fs_nents, sizeof(*ents), fim_index_sort_cmp);
+	bzero(&hdr, sizeof(hdr));
+	bcopy(FIM_INDEX_MAGIC, hdr.fh_magic, sizeof(hdr.fh_magic));
+	hdr.fh_version = FIM_INDEX_VERSION;
+	hdr.fh_nents = fsp->fs_nents;
+	hdr.fh_strtab = sizeof(hdr) +
+	    fsp->fs_nents * sizeof(struct fim_index_ent);
+	hdr.fh_strsize = strsize;
+	(void) snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		warn("fopen(%s)", tmp);
+		free(ents);
+		free(strs);
+		return (-1);
+	}
+	ret = 0;
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+		ret = -1;
+	}
+	for (k = 0; k < fsp->fs_nents && ret == 0; k++) {
+		if (fwrite(&ents[k].fs_ent, sizeof(ents[k].fs_ent), 1,
+		    fp) != 1) {
+			ret = -1;
+		}
+	}
+	if (ret == 0 && fwrite(strs, 1, strsize, fp) != strsize) {
+		ret = -1;
+	}
+	if (fclose(fp) != 0) {
+		ret = -1;
+	}
+	free(ents);
+	free(strs);
+	if (ret == 0 && rename(tmp, path) == -1) {
+		ret = -1;
+	}
+	if (ret != 0) {
+		warn("%s: failed to write FIM index", path);
+		(void) unlink(tmp);
+	}
+	return (ret);
+}
+
+/*
+ * Write the index for the spec in an image directory. This is done once the
+ * image has been committed, so that the inode numbers and change times are
+ * those of the image's files rather than of the stage they were made from.
+ */
+int
+fim_index_build(const char *dir)
+{
+	char path[MAXPATHLEN];
+	struct fim_spec *fsp;
+	int ret;
+
+	(void) snprintf(path, sizeof(path), "%s/%s", dir, FIM_SPEC_FILE);
+	fsp = fim_spec_load(path);
+	if (fsp == NULL) {
+		return (-1);
+	}
+	(void) snprintf(path, sizeof(path), "%s/%s", dir, FIM_INDEX_FILE);
+	ret = fim_index_write(fsp, dir, path);
+	fim_spec_free(fsp);
+	return (ret);
+}
+
+static struct fim_index *
+fim_index_map(const char *path)
+{
+	const struct fim_index_hdr *hdr;
+	const struct fim_index_ent *fep;
+	struct fim_index *fx;
+	struct stat sb;
+	void *base;
+	size_t k;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return (NULL);
+	}
+	if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)sizeof(*hdr)) {
+		(void) close(fd);
+		errno = EINVAL;
+		return (NULL);
+	}
+	base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void) close(fd);
+	if (base == MAP_FAILED) {
+		return (NULL);
+	}
+	fx = calloc(1, sizeof(*fx));
+	if (fx == NULL) {
+		err(1, "calloc failed");
+	}
+	fx->fx_base = base;
+	fx->fx_len = sb.st_size;
+	hdr = base;
+	if (bcmp(hdr->fh_magic, FIM_INDEX_MAGIC, sizeof(hdr->fh_magic)) != 0 ||
+	    hdr->fh_version != FIM_INDEX_VERSION ||
+	    hdr->fh_strtab != sizeof(*hdr) +
+	    (uint64_t)hdr->fh_nents * sizeof(*fep) ||
+	    hdr->fh_strsize == 0 ||
+	    hdr->fh_strtab + hdr->fh_strsize != fx->fx_len) {
+		goto invalid;
+	}
+	fx->fx_ents = (const struct fim_index_ent *)(hdr + 1);
+	fx->fx_nents = hdr->fh_nents;
+	fx->fx_strs = (const char *)base + hdr->fh_strtab;
+	if (fx->fx_strs[0] != '\0' ||
+	    fx->fx_strs[hdr->fh_strsize - 1] != '\0') {
+		goto invalid;
+	}
+	for (k = 0; k < fx->fx_nents; k++) {
+		fep = &fx->fx_ents[k];
+		if (fep->fi_path >= hdr->fh_strsize ||
+		    fep->fi_link >= hdr->fh_strsize) {
+			goto invalid;
+		}
+	}
+	return (fx);
+invalid:
+	fim_index_close(fx);
+	errno = EINVAL;
+	return (NULL);
+}
+
+/*
+ * Map the index of an image. Images committed before indexes were written
+ * have one built from their spec the first time it is needed.
+ */
+struct fim_index *
+fim_index_open(const char *dir)
+{
+	char path[MAXPATHLEN];
+	struct fim_index *fx;
+
+	(void) snprintf(path, sizeof(path), "%s/%s", dir, FIM_INDEX_FILE);
+	fx = fim_index_map(path);
+	if (fx != NULL || (errno != ENOENT && errno != EINVAL)) {
+		return (fx);
+	}
+	if (fim_index_build(dir) == -1) {
+		return (NULL);
+	}
+	return (fim_index_map(path));
+}
+
+void
+fim_index_close(struct fim_index *fx)
+{
+
+	if (fx == NULL) {
+		return;
+	}
+	(void) munmap(fx->fx_base, fx->fx_len);
+	free(fx);
+}
+
+const struct fim_index_ent *
+fim_index_lookup(struct fim_index *fx, const char *path)
+{
+	size_t lo, hi, mid;
+	uint64_t h;
+
+	h = fim_index_hash(path);
+	lo = 0;
+	hi = fx->fx_nents;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (fx->fx_ents[mid].fi_hash < h) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	for (; lo < fx->fx_nents && fx->fx_ents[lo].fi_hash == h; lo++) {
+		if (strcmp(fx->fx_strs + fx->fx_ents[lo].fi_path, path) == 0) {
+			return (&fx->fx_ents[lo]);
+		}
+	}
+	return (NULL);
+}
+
+const char *
+fim_index_path(struct fim_index *fx, const struct fim_index_ent *fep)
+{
+
+	return (fx->fx_strs + fep->fi_path);
+}
+
+/*
+ * The digest of an entry, as a hex string.
+ */
+void
+fim_index_digest(const struct fim_index_ent *fep, char *digest)
+{
+
+	fim_digest_to_hex(fep->fi_digest, digest);
+}
+
+/*
+ * Whether a regular file is still the image file the entry was recorded
+ * from: a file in a clone of the image, or below a union mount of it,
+ * that has not been written to or had its attributes changed since.
+ */
+int
+fim_index_same_file(const struct fim_index_ent *fep, const struct stat *sbp)
+{
+
+	return (fep->fi_ino != 0 && fep->fi_ino == (uint64_t)sbp->st_ino &&
+	    fep->fi_ctime_sec == sbp->st_ctim.tv_sec &&
+	    fep->fi_ctime_nsec == sbp->st_ctim.tv_nsec &&
+	    fep->fi_size == (uint64_t)sbp->st_size &&
+	    fep->fi_mtime_sec == sbp->st_mtim.tv_sec &&
+	    fep->fi_mtime_nsec == sbp->st_mtim.tv_nsec);
+}
+
+/*
+ * Compare a file, path relative to dirfd, against its index entry,
+ * returning the kind of drift or zero, or -1 if the file could not be read
+ * or is no longer the one sbp describes. Regular files are hashed when
+ * hash is set, when their modification time is not the one recorded, or
+ * when the index knows the image's own file and this is not it (see
+ * fim_index_same_file).
+ */
+int
+fim_index_check(struct fim_index *fx, const struct fim_index_ent *fep,
+    int dirfd, const char *path, struct stat *sbp, int hash)
+{
+	char digest[CBLOCK_DIGEST_LEN], want[CBLOCK_DIGEST_LEN];
+	char target[MAXPATHLEN];
+	ssize_t cc;
+
+	if ((fep->fi_keys & FIM_KEY_TYPE) != 0 &&
+	    (fep->fi_mode & S_IFMT) != (sbp->st_mode & S_IFMT)) {
+		return (FIM_DRIFT_CONTENT);
+	}
+	if (S_ISREG(sbp->st_mode)) {
+		if ((fep->fi_keys & FIM_KEY_SIZE) != 0 &&
+		    fep->fi_size != (uint64_t)sbp->st_size) {
+			return (FIM_DRIFT_CONTENT);
+		}
+		if ((fep->fi_keys & FIM_KEY_TIME) == 0 ||
+		    fep->fi_mtime_sec != sbp->st_mtim.tv_sec ||
+		    fep->fi_mtime_nsec != sbp->st_mtim.tv_nsec ||
+		    (fep->fi_ino != 0 && !fim_index_same_file(fep, sbp))) {
+			hash = 1;
+		}
+		if ((fep->fi_keys & FIM_KEY_SHA256) != 0 && hash) {
+			if (fim_digest_file(dirfd, path, sbp, digest) == -1) {
+				return (-1);
+			}
+			fim_digest_to_hex(fep->fi_digest, want);
+			if (strcmp(digest, want) != 0) {
+				return (FIM_DRIFT_CONTENT);
+			}
+		}
+	} else if (S_ISLNK(sbp->st_mode) &&
+	    (fep->fi_keys & FIM_KEY_LINK) != 0) {
+		cc = readlinkat(dirfd, path, target, sizeof(target) - 1);
+		if (cc == -1) {
+			return (-1);
+		}
+		target[cc] = '\0';
+		if (strcmp(target, fx->fx_strs + fep->fi_link) != 0) {
+			return (FIM_DRIFT_CONTENT);
+		}
+	}
+	if (((fep->fi_keys & FIM_KEY_MODE) != 0 &&
+	    (fep->fi_mode & ALLPERMS) != (sbp->st_mode & ALLPERMS)) ||
+	    ((fep->fi_keys & FIM_KEY_UID) != 0 &&
+	    fep->fi_uid != sbp->st_uid) ||
+	    ((fep->fi_keys & FIM_KEY_GID) != 0 &&
+	    fep->fi_gid != sbp->st_gid)) {
+		return (FIM_DRIFT_ATTR);
+	}
+#ifdef __FreeBSD__
+	if ((fep->fi_keys & FIM_KEY_FLAGS) != 0 &&
+	    fep->fi_flags != sbp->st_flags) {
+		return (FIM_DRIFT_ATTR);
+	}
+#endif
+	return (0);
+}
+
+/*
+ * Compare the entries for a path in two indexes, using only what both of
+ * them recorded.
+ */
+static int
+fim_index_compare(struct fim_index *a, const struct fim_index_ent *ap,
+    struct fim_index *b, const struct fim_index_ent *bp)
+{
+	uint32_t keys;
+
+	keys = ap->fi_keys & bp->fi_keys;
+	if (((keys & FIM_KEY_TYPE) != 0 &&
+	    (ap->fi_mode & S_IFMT) != (bp->fi_mode & S_IFMT)) ||
+	    ((keys & FIM_KEY_SIZE) != 0 && ap->fi_size != bp->fi_size) ||
+	    ((keys & FIM_KEY_SHA256) != 0 &&
+	    bcmp(ap->fi_digest, bp->fi_digest, sizeof(ap->fi_digest)) != 0) ||
+	    ((keys & FIM_KEY_LINK) != 0 &&
+	    strcmp(a->fx_strs + ap->fi_link, b->fx_strs + bp->fi_link) != 0)) {
+		return (FIM_DRIFT_CONTENT);
+	}
+	if (((keys & FIM_KEY_MODE) != 0 &&
+	    (ap->fi_mode & ALLPERMS) != (bp->fi_mode & ALLPERMS)) ||
+	    ((keys & FIM_KEY_UID) != 0 && ap->fi_uid != bp->fi_uid) ||
+	    ((keys & FIM_KEY_GID) != 0 && ap->fi_gid != bp->fi_gid) ||
+	    ((keys & FIM_KEY_FLAGS) != 0 && ap->fi_flags != bp->fi_flags)) {
+		return (FIM_DRIFT_ATTR);
+	}
+	return (0);
+}
+
+static void
+fim_change_add(struct fim_changes *fcp, int kind, const char *path, int copy)
+{
+	struct fim_change *cp;
+
+	if (fcp->fc_n == fcp->fc_alloc) {
+		fcp->fc_alloc = fcp->fc_alloc == 0 ? 64 : fcp->fc_alloc * 2;
+		fcp->fc_vec = realloc(fcp->fc_vec,
+		    fcp->fc_alloc * sizeof(*fcp->fc_vec));
+		if (fcp->fc_vec == NULL) {
+			err(1, "realloc failed");
+		}
+	}
+	cp = &fcp->fc_vec[fcp->fc_n++];
+	cp->fc_kind = kind;
+	cp->fc_copy = NULL;
+	if (copy) {
+		cp->fc_copy = strdup(path);
+		if (cp->fc_copy == NULL) {
+			err(1, "strdup failed");
+		}
+		path = cp->fc_copy;
+	}
+	cp->fc_path = path;
+}
+
+static int
+fim_change_cmp(const void *a, const void *b)
+{
+	const struct fim_change *x = a, *y = b;
+
+	return (strcmp(x->fc_path, y->fc_path));
+}
+
+/*
+ * Changes are found in hash order; they are reported in path order.
+ */
+static struct sbuf *
+fim_changes_render(struct fim_changes *fcp, const char **names)
+{
+	struct sbuf *sb;
+	size_t k;
+
+	qsort(fcp->fc_vec, fcp->fc_n, sizeof(*fcp->fc_vec), fim_change_cmp);
+	sb = sbuf_new_auto();
+	for (k = 0; k < fcp->fc_n; k++) {
+		sbuf_printf(sb, "%-10s %s\n", names[fcp->fc_vec[k].fc_kind],
+		    fcp->fc_vec[k].fc_path);
+		free(fcp->fc_vec[k].fc_copy);
+	}
+	sbuf_finish(sb);
+	free(fcp->fc_vec);
+	return (sb);
+}
+
+static void
+fim_index_diff(struct fim_index *a, struct fim_index *b,
+    struct fim_changes *fcp)
+{
+	const struct fim_index_ent *ap, *bp;
+	size_t i, j;
+	int cmp, kind;
+
+	i = j = 0;
+	while (i < a->fx_nents || j < b->fx_nents) {
+		ap = i < a->fx_nents ? &a->fx_ents[i] : NULL;
+		bp = j < b->fx_nents ? &b->fx_ents[j] : NULL;
+		if (ap == NULL) {
+			cmp = 1;
+		} else if (bp == NULL) {
+			cmp = -1;
+		} else if (ap->fi_hash != bp->fi_hash) {
+			cmp = ap->fi_hash < bp->fi_hash ? -1 : 1;
+		} else {
+			cmp = strcmp(a->fx_strs + ap->fi_path,
+			    b->fx_strs + bp->fi_path);
+		}
+		if (cmp < 0) {
+			fim_change_add(fcp, FIM_DRIFT_MISSING,
+			    a->fx_strs + ap->fi_path, 0);
+			i++;
+		} else if (cmp > 0) {
+			fim_change_add(fcp, FIM_DRIFT_EXTRA,
+			    b->fx_strs + bp->fi_path, 0);
+			j++;
+		} else {
+			kind = fim_index_compare(a, ap, b, bp);
+			if (kind != 0) {
+				fim_change_add(fcp, kind,
+				    a->fx_strs + ap->fi_path, 0);
+			}
+			i++;
+			j++;
+		}
+	}
+}
+
+static void
+fim_verify_ent(struct fim_verify *fvp, FTSENT *ent)
+{
+	struct fim_index *fx = fvp->fv_index;
+	const struct fim_index_ent *fep;
+	char rel[MAXPATHLEN];
+	int kind;
+
+	(void) snprintf(rel, sizeof(rel), ".%s",
+	    ent->fts_path + fvp->fv_rootlen);
+	fep = fim_index_lookup(fx, rel);
+	if (fep == NULL) {
+		pthread_mutex_lock(&fvp->fv_lock);
+		fim_change_add(fvp->fv_changes, FIM_DRIFT_EXTRA, rel, 1);
+		pthread_mutex_unlock(&fvp->fv_lock);
+		return;
+	}
+	/* Each path is visited once, so no two threads share a byte */
+	fvp->fv_seen[fep - fx->fx_ents] = 1;
+	switch (ent->fts_info) {
+	case FTS_DNR:
+	case FTS_ERR:
+	case FTS_NS:
+		kind = FIM_DRIFT_CONTENT;
+		break;
+	default:
+		kind = fim_index_check(fx, fep, AT_FDCWD, ent->fts_accpath,
+		    ent->fts_statp, fvp->fv_hash);
+		if (kind == -1) {
+			kind = FIM_DRIFT_CONTENT;
+		}
+	}
+	if (kind != 0) {
+		pthread_mutex_lock(&fvp->fv_lock);
+		fim_change_add(fvp->fv_changes, kind, fim_index_path(fx, fep),
+		    0);
+		pthread_mutex_unlock(&fvp->fv_lock);
+	}
+}
+
+static int
+fim_verify_skipped(const char *name)
+{
+	size_t len;
+	int k;
+
+	for (k = 0; fim_verify_skip[k] != NULL; k++) {
+		len = strlen(fim_verify_skip[k]);
+		if (strncmp(name, fim_verify_skip[k], len) == 0 &&
+		    (name[len] == '\0' || strcmp(name + len, ".tmp") == 0)) {
+			return (1);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Walk a tree. The walk of the whole image stops at directories
+ * FIM_VERIFY_SPLIT levels down and leaves them to the worker threads,
+ * which skip the directory itself since it has been checked already.
+ */
+static int
+fim_verify_tree(struct fim_verify *fvp, const char *path, int split)
+{
+	char *paths[2];
+	FTSENT *ent;
+	FTS *fts;
+
+	paths[0] = (char *)path;
+	paths[1] = NULL;
+	fts = fts_open(paths, FTS_PHYSICAL | FTS_COMFOLLOW | FTS_NOCHDIR,
+	    NULL);
+	if (fts == NULL) {
+		return (-1);
+	}
+	while ((ent = fts_read(fts)) != NULL) {
+		if (ent->fts_info == FTS_DP || (!split && ent->fts_level == 0)) {
+			continue;
+		}
+		if (split && ent->fts_level == 1 &&
+		    fim_verify_skipped(ent->fts_name)) {
+			continue;
+		}
+		fim_verify_ent(fvp, ent);
+		if (!split || ent->fts_info != FTS_D ||
+		    ent->fts_level != FIM_VERIFY_SPLIT) {
+			continue;
+		}
+		if (fvp->fv_ndirs == fvp->fv_alloc) {
+			fvp->fv_alloc = fvp->fv_alloc == 0 ? 64 :
+			    fvp->fv_alloc * 2;
+			fvp->fv_dirs = realloc(fvp->fv_dirs,
+			    fvp->fv_alloc * sizeof(*fvp->fv_dirs));
+			if (fvp->fv_dirs == NULL) {
+				err(1, "realloc failed");
+			}
+		}
+		fvp->fv_dirs[fvp->fv_ndirs] = strdup(ent->fts_path);
+		if (fvp->fv_dirs[fvp->fv_ndirs] == NULL) {
+			err(1, "strdup failed");
+		}
+		fvp->fv_ndirs++;
+		(void) fts_set(fts, ent, FTS_SKIP);
+	}
+	(void) fts_close(fts);
+	return (0);
+}
+
+static void *
+fim_verify_worker(void *arg)
+{
+	struct fim_verify *fvp;
+	size_t k;
+
+	fvp = arg;
+	for (;;) {
+		pthread_mutex_lock(&fvp->fv_lock);
+		k = fvp->fv_next++;
+		pthread_mutex_unlock(&fvp->fv_lock);
+		if (k >= fvp->fv_ndirs) {
+			break;
+		}
+		if (fim_verify_tree(fvp, fvp->fv_dirs[k], 0) == -1) {
+			pthread_mutex_lock(&fvp->fv_lock);
+			fim_change_add(fvp->fv_changes, FIM_DRIFT_CONTENT,
+			    fvp->fv_dirs[k] + fvp->fv_rootlen, 1);
+			pthread_mutex_unlock(&fvp->fv_lock);
+		}
+	}
+	return (NULL);
+}
+
+static int
+fim_index_verify(struct fim_index *fx, const char *root, int hash,
+    struct fim_changes *fcp)
+{
+	pthread_t thr[FIM_MAX_THREADS];
+	struct fim_verify fv;
+	long ncpu;
+	size_t k;
+	int n;
+
+	bzero(&fv, sizeof(fv));
+	fv.fv_index = fx;
+	fv.fv_rootlen = strlen(root);
+	fv.fv_hash = hash;
+	fv.fv_changes = fcp;
+	pthread_mutex_init(&fv.fv_lock, NULL);
+	fv.fv_seen = calloc(fx->fx_nents + 1, 1);
+	if (fv.fv_seen == NULL) {
+		err(1, "calloc failed");
+	}
+	if (fim_verify_tree(&fv, root, 1) == -1) {
+		free(fv.fv_seen);
+		pthread_mutex_destroy(&fv.fv_lock);
+		return (-1);
+	}
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	n = ncpu < 1 ? 1 : MIN(ncpu, FIM_MAX_THREADS);
+	if ((size_t)n > fv.fv_ndirs) {
+		n = fv.fv_ndirs;
+	}
+	if (n <= 1) {
+		(void) fim_verify_worker(&fv);
+	} else {
+		for (k = 0; k < (size_t)n; k++) {
+			if (pthread_create(&thr[k], NULL, fim_verify_worker,
+			    &fv) != 0) {
+				errx(1, "pthread_create failed");
+			}
+		}
+		for (k = 0; k < (size_t)n; k++) {
+			(void) pthread_join(thr[k], NULL);
+		}
+	}
+	for (k = 0; k < fx->fx_nents; k++) {
+		if (!fv.fv_seen[k]) {
+			fim_change_add(fcp, FIM_DRIFT_MISSING,
+			    fim_index_path(fx, &fx->fx_ents[k]), 0);
+		}
+	}
+	for (k = 0; k < fv.fv_ndirs; k++) {
+		free(fv.fv_dirs[k]);
+	}
+	free(fv.fv_dirs);
+	free(fv.fv_seen);
+	pthread_mutex_destroy(&fv.fv_lock);
+	return (0);
+}
+
+/*
+ * Resolve an image name to its directory. Names are those of the image
+ * tags, with ":latest" implied.
+ */
+static int
+fim_image_dir(const char *name, char *buf, size_t len)
+{
+	extern struct global_params gcfg;
+
+	if (name[0] == '\0' || name[0] == '.' || strchr(name, '/') != NULL) {
+		return (-1);
+	}
+	(void) snprintf(buf, len, "%s/images/%s%s", gcfg.c_data_dir, name,
+	    strchr(name, ':') == NULL ? ":latest" : "");
+	return (0);
+}
+
+static struct fim_index *
+fim_image_index(const char *name, char *dir, size_t len,
+    struct cblock_response *resp)
+{
+	struct fim_index *fx;
+
+	if (fim_image_dir(name, dir, len) == -1) {
+		resp->p_ecode = 1;
+		snprintf(resp->p_errbuf, sizeof(resp->p_errbuf),
+		    "%s: invalid image name", name);
+		return (NULL);
+	}
+	fx = fim_index_open(dir);
+	if (fx == NULL) {
+		resp->p_ecode = 1;
+		snprintf(resp->p_errbuf, sizeof(resp->p_errbuf),
+		    "%s: no FIM spec for image", name);
+	}
+	return (fx);
+}
+
+static void
+fim_send_report(int sock, struct cblock_response *resp, struct sbuf *sb)
+{
+	size_t len;
+
+	len = sbuf_len(sb);
+	sock_ipc_must_write(sock, resp, sizeof(*resp));
+	sock_ipc_must_write(sock, &len, sizeof(len));
+	sock_ipc_must_write(sock, sbuf_data(sb), len);
+	sbuf_delete(sb);
+}
+
+int
+dispatch_fim_diff(int sock)
+{
+	char dir[MAXPATHLEN], odir[MAXPATHLEN];
+	struct fim_index *a, *b;
+	struct cblock_response resp;
+	struct cblock_fim_diff req;
+	struct fim_changes fc;
+	struct sbuf *sb;
+
+	bzero(&resp, sizeof(resp));
+	if (sock_ipc_must_read(sock, &req, sizeof(req)) == 0) {
+		return (0);
+	}
+	req.p_image[sizeof(req.p_image) - 1] = '\0';
+	req.p_other[sizeof(req.p_other) - 1] = '\0';
+	b = NULL;
+	a = fim_image_index(req.p_image, dir, sizeof(dir), &resp);
+	if (a != NULL) {
+		b = fim_image_index(req.p_other, odir, sizeof(odir), &resp);
+	}
+	if (b == NULL) {
+		fim_index_close(a);
+		sock_ipc_must_write(sock, &resp, sizeof(resp));
+		return (1);
+	}
+	bzero(&fc, sizeof(fc));
+	fim_index_diff(a, b, &fc);
+	sb = fim_changes_render(&fc, fim_diff_names);
+	fim_index_close(a);
+	fim_index_close(b);
+	fim_send_report(sock, &resp, sb);
+	return (1);
+}
+
+int
+dispatch_fim_verify(int sock)
+{
+	struct cblock_response resp;
+	struct cblock_fim_verify req;
+	char dir[MAXPATHLEN];
+	struct fim_changes fc;
+	struct fim_index *fx;
+	struct sbuf *sb;
+
+	bzero(&resp, sizeof(resp));
+	if (sock_ipc_must_read(sock, &req, sizeof(req)) == 0) {
+		return (0);
+	}
+	req.p_image[sizeof(req.p_image) - 1] = '\0';
+	fx = fim_image_index(req.p_image, dir, sizeof(dir), &resp);
+	if (fx == NULL) {
+		sock_ipc_must_write(sock, &resp, sizeof(resp));
+		return (1);
+	}
+	bzero(&fc, sizeof(fc));
+	if (fim_index_verify(fx, dir, req.p_content, &fc) == -1) {
+		resp.p_ecode = 1;
+		snprintf(resp.p_errbuf, sizeof(resp.p_errbuf),
+		    "%.256s: %s", req.p_image, strerror(errno));
+		free(fc.fc_vec);
+		fim_index_close(fx);
+		sock_ipc_must_write(sock, &resp, sizeof(resp));
+		return (1);
+	}
+	sb = fim_changes_render(&fc, fim_verify_names);
+	fim_index_close(fx);
+	fim_send_report(sock, &resp, sb);
+	return (1);
+}
@@ -0,0 +1,129 @@
+#!/bin/sh
+#
+# Copyright (c) 2020 Christian S.J. Peron
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+#
+#
+# Generate the USDT probe definitions for cblockd from probes.d.
+#
+#   gen_probes.sh objname
+#       Print the name of the probe object which must be linked into the
+#       daemon, if any.
+#   gen_probes.sh header probes.d probes.h
+#   gen_probes.sh object probes.d probes.o obj.o ...
+#
+# On FreeBSD, dtrace(1) does all the work. Elsewhere the probes are mapped
+# onto the systemtap compatible <sys/sdt.h> macros, which bpftrace and
+# friends understand. If <sys/sdt.h> is not available, the probes compile
+# away to nothing.
+#
+have_dtrace()
+{
+    [ "$(uname -s)" = "FreeBSD" ] && command -v dtrace >/dev/null 2>&1
+}
+
+have_sdt()
+{
+    echo '#include <sys/sdt.h>' | ${CC:-cc} -E -x c - >/dev/null 2>&1
+}
+
+emit_sdt_header()
+{
+    awk -v sdt="$1" '
+    /^provider/ {
+        provider = $2
+        print "#ifndef _PROBES_H_"
+        print "#define _PROBES_H_"
+        if (sdt) {
+            print "#include <sys/sdt.h>"
+        }
+        next
+    }
+    /^[ \t]*probe[ \t]/ {
+        line = $0
+        sub(/^[ \t]*probe[ \t]+/, "", line)
+        name = line
+        sub(/\(.*/, "", name)
+        args = line
+        sub(/^[^(]*\(/, "", args)
+        sub(/\).*/, "", args)
+        gsub(/[ \t]/, "", args)
+        nargs = (args == "" || args == "void") ? 0 : split(args, a, ",")
+        params = ""
+        for (k = 0; k < nargs; k++) {
+            params = params (k ? ", " : "") "arg" k
+        }
+        macro = toupper(provider "_" name)
+        if (sdt) {
+            printf("#define\t%s(%s) \\\n", macro, params)
+            if (nargs == 0) {
+                printf("\tDTRACE_PROBE(%s, %s)\n", provider, name)
+            } else {
+                printf("\tDTRACE_PROBE%d(%s, %s, %s)\n", nargs,
+                    provider, name, params)
+            }
+            printf("#define\t%s_ENABLED() (1)\n", macro)
+            next
+        }
+        printf("#define\t%s(%s) do { \\\n", macro, params)
+        for (k = 0; k < nargs; k++) {
+            printf("\t(void)(arg%d); \\\n", k)
+        }
+        printf("} while (0)\n")
+        printf("#define\t%s_ENABLED() (0)\n", macro)
+        next
+    }
+    END {
+        print "#endif"
+    }' "$2"
+}
+
+case $1 in
+objname)
+    if have_dtrace; then
+        echo probes.o
+    fi
+    ;;
+header)
+    if have_dtrace; then
+        exec dtrace -o "$3" -h -s "$2"
+    fi
+    if have_sdt; then
+        emit_sdt_header 1 "$2" > "$3"
+    else
+        emit_sdt_header 0 "$2" > "$3"
+    fi
+    ;;
+object)
+    src="$2"
+    out="$3"
+    shift 3
+    exec dtrace -G -s "$src" -o "$out" -64 "$@"
+    ;;
+*)
+    echo "usage: gen_probes.sh objname | header probes.d probes.h |" \
+      "object probes.d probes.o obj.o ..." >&2
+    exit 1
+    ;;
+esac
@@ -25,6 +25,7 @@
  * SUCH DAMAGE.
  */
 #include <sys/types.h>
+#include <sys/ioctl.h>
 #include <sys/queue.h>
 
 #include <stdio.h>
@@ -35,7 +36,11 @@
 #include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
+#ifdef __FreeBSD__
 #include <libutil.h>
+#else
+#include <pty.h>
+#endif
 #include <string.h>
 
 #include "termbuf.h"
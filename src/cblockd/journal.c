@@ -0,0 +1,520 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __FreeBSD__
+#include <sys/jail.h>
+#endif
+
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include "termbuf.h"
+#include "main.h"
+#include "dispatch.h"
+#include "cblock.h"
+
+#include <cblock/libcblock.h>
+
+#include "journal.h"
+
+/*
+ * The state journal allows cblockd to be restarted without losing track of
+ * the instances it launched. Every launch and every exit is appended to the
+ * journal. At startup the journal is replayed to compute the set of
+ * instances that were live when the previous daemon went away. Instances
+ * whose jails are still around are re-adopted, the rest are torn down and
+ * the journal is re-written containing only the survivors. The same
+ * compaction is done while the daemon runs, whenever most of the journal
+ * is made up of instances that have exited.
+ *
+ * The jail outlives the daemon because stage_launch.sh ignores the SIGHUP
+ * sent when the daemon's end of the console pty is closed, as does the
+ * jailed process which inherits that. The launch script itself is not
+ * what is tracked, it may have exited for other reasons.
+ */
+struct journal_ent {
+	struct journal_rec		je_rec;
+	LIST_ENTRY(journal_ent)		je_hash;
+	TAILQ_ENTRY(journal_ent)	je_glue;
+};
+
+LIST_HEAD(journal_bucket, journal_ent);
+TAILQ_HEAD(journal_list, journal_ent);
+
+static int journal_fd = -1;
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t journal_nrecs;	/* records in the journal */
+static size_t journal_live;	/* of which live launches */
+
+static ssize_t	journal_load(const char *, struct journal_list *);
+static int	journal_compact(const char *, struct journal_list *);
+
+static uint32_t
+journal_hash(const char *s)
+{
+	uint32_t h;
+
+	h = 2166136261U;
+	while (*s != '\0') {
+		h ^= (u_char)*s++;
+		h *= 16777619U;
+	}
+	return (h % JOURNAL_HASH_SIZE);
+}
+
+static void
+journal_path(char *buf, size_t len)
+{
+	extern struct global_params gcfg;
+
+	(void) snprintf(buf, len, "%s/%s", gcfg.c_data_dir, JOURNAL_FILE);
+}
+
+static void
+journal_free_list(struct journal_list *live)
+{
+	struct journal_ent *je;
+
+	while ((je = TAILQ_FIRST(live)) != NULL) {
+		TAILQ_REMOVE(live, je, je_glue);
+		free(je);
+	}
+}
+
+/*
+ * Re-write the journal with the records of live instances only. The
+ * journal is the source of truth here, so this is the same replay and
+ * compaction as at startup. Must be called with journal_mutex held.
+ */
+static void
+journal_shrink(void)
+{
+	struct journal_list live;
+	struct journal_ent *je;
+	char path[MAXPATHLEN];
+	size_t n;
+
+	journal_path(path, sizeof(path));
+	TAILQ_INIT(&live);
+	(void) close(journal_fd);
+	journal_fd = -1;
+	if (journal_load(path, &live) == -1 ||
+	    journal_compact(path, &live) == -1) {
+		journal_fd = open(path, O_WRONLY | O_APPEND | O_CREAT |
+		    O_CLOEXEC, 0600);
+		if (journal_fd == -1) {
+			warn("journal: open(%s) failed", path);
+		}
+		journal_free_list(&live);
+		return;
+	}
+	n = 0;
+	TAILQ_FOREACH(je, &live, je_glue) {
+		n++;
+	}
+	journal_free_list(&live);
+	journal_nrecs = journal_live = n;
+}
+
+static void
+journal_write(struct journal_rec *jr)
+{
+	ssize_t cc;
+
+	/*
+	 * NB: we do not fsync(2) here. The journal exists to survive the
+	 * daemon going away, not the host. If the host reboots, the jails
+	 * are gone too.
+	 */
+	pthread_mutex_lock(&journal_mutex);
+	if (journal_fd == -1) {
+		pthread_mutex_unlock(&journal_mutex);
+		return;
+	}
+	cc = write(journal_fd, jr, sizeof(*jr));
+	if (cc != sizeof(*jr)) {
+		warn("journal: write failed");
+		pthread_mutex_unlock(&journal_mutex);
+		return;
+	}
+	journal_nrecs++;
+	if (jr->j_op == JOURNAL_OP_LAUNCH) {
+		journal_live++;
+	} else if (journal_live > 0) {
+		journal_live--;
+	}
+	if (journal_nrecs >= JOURNAL_COMPACT_MIN &&
+	    journal_nrecs > 2 * journal_live) {
+		journal_shrink();
+	}
+	pthread_mutex_unlock(&journal_mutex);
+}
+
+/*
+ * The name stage_launch.sh gives the jail of an instance.
+ */
+void
+journal_jail_name(struct cblock_instance *pi, char *buf, size_t len)
+{
+
+	(void) snprintf(buf, len, "%s-%.10s", pi->p_image_name,
+	    pi->p_instance_tag);
+}
+
+int
+journal_jail_alive(const char *name)
+{
+#ifdef __FreeBSD__
+	struct iovec iov[2];
+
+	iov[0].iov_base = __DECONST(char *, "name");
+	iov[0].iov_len = sizeof("name");
+	iov[1].iov_base = __DECONST(char *, name);
+	iov[1].iov_len = strlen(name) + 1;
+	return (jail_get(iov, 2, 0) != -1);
+#else
+	(void) name;
+	return (0);
+#endif
+}
+
+void
+journal_record_launch(struct cblock_instance *pi, const char *network)
+{
+	struct journal_rec jr;
+
+	bzero(&jr, sizeof(jr));
+	jr.j_magic = JOURNAL_MAGIC;
+	jr.j_op = JOURNAL_OP_LAUNCH;
+	jr.j_type = pi->p_type;
+	jr.j_pid = pi->p_pid;
+	jr.j_launch_time = pi->p_launch_time;
+	strlcpy(jr.j_instance, pi->p_instance_tag, sizeof(jr.j_instance));
+	strlcpy(jr.j_image, pi->p_image_name, sizeof(jr.j_image));
+	strlcpy(jr.j_ttyname, pi->p_ttyname, sizeof(jr.j_ttyname));
+	if (network != NULL) {
+		strlcpy(jr.j_network, network, sizeof(jr.j_network));
+	}
+	if (pi->p_type == PRISON_TYPE_REGULAR) {
+		journal_jail_name(pi, jr.j_jail, sizeof(jr.j_jail));
+	}
+	journal_write(&jr);
+}
+
+void
+journal_record_exit(struct cblock_instance *pi)
+{
+	struct journal_rec jr;
+
+	bzero(&jr, sizeof(jr));
+	jr.j_magic = JOURNAL_MAGIC;
+	jr.j_op = JOURNAL_OP_EXIT;
+	jr.j_type = pi->p_type;
+	jr.j_pid = pi->p_pid;
+	strlcpy(jr.j_instance, pi->p_instance_tag, sizeof(jr.j_instance));
+	journal_write(&jr);
+}
+
+static struct journal_ent *
+journal_lookup(struct journal_bucket *bucket, const char *instance)
+{
+	struct journal_ent *je;
+
+	LIST_FOREACH(je, bucket, je_hash) {
+		if (strcmp(je->je_rec.j_instance, instance) == 0) {
+			return (je);
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Replay the journal into the list of instances which were live at the time
+ * the previous daemon exited. The whole journal is read in with a single
+ * read and instance records are located using a hash table, so replay time
+ * is linear in the size of the journal.
+ */
+static ssize_t
+journal_load(const char *path, struct journal_list *live)
+{
+	struct journal_bucket *buckets, *bucket;
+	struct journal_rec *base, *jr;
+	struct journal_ent *je;
+	size_t nrecs, k;
+	struct stat sb;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 && errno == ENOENT) {
+		return (0);
+	}
+	if (fd == -1) {
+		warn("journal: open(%s) failed", path);
+		return (-1);
+	}
+	if (fstat(fd, &sb) == -1) {
+		warn("journal: fstat failed");
+		close(fd);
+		return (-1);
+	}
+	nrecs = sb.st_size / sizeof(*jr);
+	if (nrecs == 0) {
+		close(fd);
+		return (0);
+	}
+	base = malloc(nrecs * sizeof(*jr));
+	buckets = calloc(JOURNAL_HASH_SIZE, sizeof(*buckets));
+	if (base == NULL || buckets == NULL) {
+		err(1, "journal: allocation failed");
+	}
+	if (sock_ipc_must_read(fd, base, nrecs * sizeof(*jr)) == 0) {
+		warnx("journal: short read on %s", path);
+		nrecs = 0;
+	}
+	close(fd);
+	for (k = 0; k < nrecs; k++) {
+		jr = &base[k];
+		if (jr->j_magic != JOURNAL_MAGIC) {
+			warnx("journal: bad record at %zu, ignoring remainder",
+			    k);
+			break;
+		}
+		jr->j_instance[sizeof(jr->j_instance) - 1] = '\0';
+		jr->j_image[sizeof(jr->j_image) - 1] = '\0';
+		jr->j_ttyname[sizeof(jr->j_ttyname) - 1] = '\0';
+		jr->j_network[sizeof(jr->j_network) - 1] = '\0';
+		jr->j_jail[sizeof(jr->j_jail) - 1] = '\0';
+		bucket = &buckets[journal_hash(jr->j_instance)];
+		je = journal_lookup(bucket, jr->j_instance);
+		switch (jr->j_op) {
+		case JOURNAL_OP_LAUNCH:
+			if (je == NULL) {
+				je = calloc(1, sizeof(*je));
+				if (je == NULL) {
+					err(1, "journal: calloc failed");
+				}
+				LIST_INSERT_HEAD(bucket, je, je_hash);
+				TAILQ_INSERT_TAIL(live, je, je_glue);
+			}
+			je->je_rec = *jr;
+			break;
+		case JOURNAL_OP_EXIT:
+			if (je == NULL) {
+				break;
+			}
+			LIST_REMOVE(je, je_hash);
+			TAILQ_REMOVE(live, je, je_glue);
+			free(je);
+			break;
+		default:
+			warnx("journal: unknown op %u at %zu", jr->j_op, k);
+		}
+	}
+	free(buckets);
+	free(base);
+	return (k);
+}
+
+/*
+ * Atomically replace the journal with one containing only the records of
+ * instances that are still being managed, then re-open it for appending.
+ */
+static int
+journal_compact(const char *path, struct journal_list *live)
+{
+	char tmp_path[MAXPATHLEN];
+	struct journal_ent *je;
+	int fd;
+
+	(void) snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		warn("journal: open(%s) failed", tmp_path);
+		return (-1);
+	}
+	TAILQ_FOREACH(je, live, je_glue) {
+		if (sock_ipc_must_write(fd, &je->je_rec,
+		    sizeof(je->je_rec)) != sizeof(je->je_rec)) {
+			warnx("journal: failed to write %s", tmp_path);
+			close(fd);
+			(void) unlink(tmp_path);
+			return (-1);
+		}
+	}
+	if (fsync(fd) == -1) {
+		warn("journal: fsync failed");
+	}
+	close(fd);
+	if (rename(tmp_path, path) == -1) {
+		warn("journal: rename(%s) failed", tmp_path);
+		(void) unlink(tmp_path);
+		return (-1);
+	}
+	journal_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+	    0600);
+	if (journal_fd == -1) {
+		warn("journal: open(%s) failed", path);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * An instance is considered alive if its jail still exists and the pid
+ * file the previous daemon held for it is still there. Builds are never
+ * adopted: each stage runs in a jail of its own, and a build whose client
+ * has gone away is of no use to anyone.
+ */
+static int
+journal_instance_alive(struct journal_rec *jr)
+{
+	extern struct global_params gcfg;
+	char pid_path[1024];
+
+	if (jr->j_type != PRISON_TYPE_REGULAR || jr->j_jail[0] == '\0' ||
+	    !journal_jail_alive(jr->j_jail)) {
+		return (0);
+	}
+	(void) snprintf(pid_path, sizeof(pid_path), "%s/locks/%s.pid",
+	    gcfg.c_data_dir, jr->j_instance);
+	return (access(pid_path, F_OK) == 0);
+}
+
+static struct cblock_instance *
+journal_adopt(struct journal_rec *jr)
+{
+	struct cblock_instance *pi;
+
+	pi = calloc(1, sizeof(*pi));
+	if (pi == NULL) {
+		err(1, "journal: calloc failed");
+	}
+	pi->p_type = jr->j_type;
+	pi->p_state = STATE_ADOPTED;
+	pi->p_pid = jr->j_pid;
+	pi->p_ttyfd = -1;
+	pi->p_peer_sock = -1;
+	pi->p_launch_time = jr->j_launch_time;
+	strlcpy(pi->p_ttyname, jr->j_ttyname, sizeof(pi->p_ttyname));
+	strlcpy(pi->p_image_name, jr->j_image, sizeof(pi->p_image_name));
+	pi->p_instance_tag = strdup(jr->j_instance);
+	if (pi->p_instance_tag == NULL) {
+		err(1, "journal: strdup failed");
+	}
+	TAILQ_INIT(&pi->p_ttybuf.t_head);
+	pi->p_ttybuf.t_tot_len = 0;
+	if (cblock_reopen_pid_file(pi) == -1) {
+		free(pi->p_instance_tag);
+		free(pi);
+		return (NULL);
+	}
+	return (pi);
+}
+
+int
+journal_recover(void)
+{
+	extern cblock_instance_head_t pr_head;
+	extern pthread_mutex_t cblock_mutex;
+	extern struct global_params gcfg;
+	struct journal_ent *je, *je_temp;
+	char path[MAXPATHLEN], pid_path[1024];
+	int adopted, torn_down, retained;
+	struct timespec start, end;
+	struct cblock_instance *pi;
+	struct journal_list live;
+	struct journal_rec *jr;
+	ssize_t nrecs;
+	long usec;
+
+	journal_path(path, sizeof(path));
+	TAILQ_INIT(&live);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	nrecs = journal_load(path, &live);
+	if (nrecs == -1) {
+		return (-1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	usec = (end.tv_sec - start.tv_sec) * 1000000 +
+	    (end.tv_nsec - start.tv_nsec) / 1000;
+	adopted = torn_down = retained = 0;
+	TAILQ_FOREACH_SAFE(je, &live, je_glue, je_temp) {
+		jr = &je->je_rec;
+		if (journal_instance_alive(jr)) {
+			pi = journal_adopt(jr);
+			if (pi == NULL) {
+				/*
+				 * The process is alive but we could not lock
+				 * its pid file. Another daemon may be managing
+				 * this data directory, so leave it alone and
+				 * keep the record around for the next restart.
+				 */
+				warnx("journal: could not adopt %s",
+				    jr->j_instance);
+				retained++;
+				continue;
+			}
+			pthread_mutex_lock(&cblock_mutex);
+			TAILQ_INSERT_HEAD(&pr_head, pi, p_glue);
+			pthread_mutex_unlock(&cblock_mutex);
+			adopted++;
+			continue;
+		}
+		cblock_fork_cleanup(jr->j_instance,
+		    jr->j_type == PRISON_TYPE_BUILD ? "build" : "regular",
+		    -1, gcfg.c_verbose);
+		(void) snprintf(pid_path, sizeof(pid_path), "%s/locks/%s.pid",
+		    gcfg.c_data_dir, jr->j_instance);
+		(void) unlink(pid_path);
+		TAILQ_REMOVE(&live, je, je_glue);
+		free(je);
+		torn_down++;
+	}
+	if (journal_compact(path, &live) == -1) {
+		warnx("journal: launches will not be journaled");
+	}
+	journal_nrecs = journal_live = adopted + retained;
+	journal_free_list(&live);
+	printf("journal: replayed %zd records in %ld.%03ld ms: "
+	    "%d adopted, %d torn down, %d retained\n", nrecs,
+	    usec / 1000, usec % 1000, adopted, torn_down, retained);
+	return (0);
+}
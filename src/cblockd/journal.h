@@ -0,0 +1,61 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef JOURNAL_DOT_H_
+#define	JOURNAL_DOT_H_
+
+#define	JOURNAL_FILE		"spool/cblockd.journal"
+#define	JOURNAL_MAGIC		0x63626a32	/* "cbj2" */
+#define	JOURNAL_HASH_SIZE	1024
+#define	JOURNAL_COMPACT_MIN	1024	/* records before compacting */
+
+/*
+ * On-disk journal record. Records are fixed size and appended with a single
+ * write(2) so a partially written record can only ever appear at the tail
+ * of the journal, where recovery will discard it.
+ */
+struct journal_rec {
+	uint32_t		j_magic;
+	uint32_t		j_op;
+#define	JOURNAL_OP_LAUNCH	1
+#define	JOURNAL_OP_EXIT		2
+	int32_t			j_type;
+	int32_t			j_pid;
+	int64_t			j_launch_time;
+	char			j_instance[64];
+	char			j_image[256];
+	char			j_ttyname[64];
+	char			j_network[IF_NAMESIZE];
+	char			j_jail[288];	/* <image>-<instance> */
+};
+
+int		journal_recover(void);
+void		journal_record_launch(struct cblock_instance *, const char *);
+void		journal_record_exit(struct cblock_instance *);
+void		journal_jail_name(struct cblock_instance *, char *, size_t);
+int		journal_jail_alive(const char *);
+
+#endif	/* JOURNAL_DOT_H_ */
@@ -25,15 +25,20 @@
  * SUCH DAMAGE.
  */
 #include <sys/types.h>
+#include <sys/ioctl.h>
 #include <sys/queue.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#ifdef __FreeBSD__
 #include <sys/ttycom.h>
+#endif
 #include <sys/wait.h>
 #include <sys/param.h>
 #include <sys/un.h>
 #include <netinet/in.h>
 
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -53,9 +58,15 @@
 
 #include "config.h"
 #include "cblock.h"
+#include "sched.h"
+#include "stats.h"
+#include "drift.h"
 
 #include <cblock/libcblock.h>
 
+#include "journal.h"
+#include "buildq.h"
+
 struct global_params gcfg;
 
 static char *banner =
@@ -66,7 +77,11 @@ static char *banner =
 
 static char *data_sub_dirs[] = {
 	"spool",
+	"spool/traces",
+	"cache",
 	"lib",
+	"lib/blobs",
+	"lib/fetch",
 	"locks",
 	"images",
 	"instances",
@@ -92,6 +107,13 @@ static struct option long_options[] = {
 	{ "sock-owner",		required_argument, 0, 'o' },
 	{ "logfile",		required_argument, 0, 'l' },
 	{ "create-forge",	required_argument, 0, 'f' },
+	{ "max-launches",	required_argument, 0, 'L' },
+	{ "max-builds",		required_argument, 0, 'B' },
+	{ "metrics-port",	required_argument, 0, 'm' },
+	{ "synthetic",		required_argument, 0, 'S' },
+	{ "build-cache-size",	required_argument, 0, 'C' },
+	{ "fim-interval",	required_argument, 0, 'F' },
+	{ "peer",		required_argument, 0, 'P' },
 	{ 0, 0, 0, 0 }
 };
 
@@ -117,6 +139,14 @@ usage(void)
 	    " -o, --sock-owner=USER       Allow user/groups to connect to socket\n"
 	    " -l, --logfile=FILE          Path to cblock daemon log\n"
 	    " -f, --create-forge=FILE     Create the base image to forge containers\n"
+	    " -L, --max-launches=N        Run at most N launches concurrently (0 = no limit)\n"
+	    " -B, --max-builds=N          Run at most N builds concurrently, queue the rest\n"
+	    " -m, --metrics-port=PORT     Serve Prometheus metrics on localhost:PORT\n"
+	    " -S, --synthetic=PATH        Launch PATH under a pty instead of a jail (testing)\n"
+	    " -C, --build-cache-size=MB   Keep at most MB of cached build steps (0 = off,\n"
+	    "                             the default outside of ZFS)\n"
+	    " -F, --fim-interval=SECS     Check instances for FIM drift every SECS (0 = off)\n"
+	    " -P, --peer=HOST[:PORT]      Offload build stages to the cblockd at HOST\n"
 	);
 	exit(1);
 }
@@ -190,7 +220,8 @@ initialize_data_directory(int iszfs)
 		 * get created as part of the file system creation.
 		 */
 		if (iszfs && (strcmp(dir, "instances") == 0 ||
-		    strcmp(dir, "images") == 0)) {
+		    strcmp(dir, "images") == 0 ||
+		    strcmp(dir, "cache") == 0)) {
 			continue;
 		}
 		(void) snprintf(path, sizeof(path), "%s/%s",
@@ -201,6 +232,39 @@ initialize_data_directory(int iszfs)
 	}
 }
 
+/*
+ * Every instance holds a pty and a pid file open, and each console session
+ * holds a socket, so the default soft limit runs out well before the number
+ * of instances we want to support.
+ */
+static void
+raise_fd_limit(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+		warn("getrlimit(RLIMIT_NOFILE)");
+		return;
+	}
+	if (rl.rlim_cur == rl.rlim_max) {
+		return;
+	}
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+		warn("setrlimit(RLIMIT_NOFILE)");
+	}
+}
+
+/*
+ * A write to a client, peer or helper that has gone away must fail with
+ * EPIPE rather than kill the daemon. SIGPIPE is caught rather than ignored
+ * so that the helpers and jails we exec start out with the default action.
+ */
+static void
+handle_sigpipe(int sig __attribute__((unused)))
+{
+}
+
 static void
 daemonize(struct global_params *gcp)
 {
@@ -234,20 +298,26 @@ daemonize(struct global_params *gcp)
 int
 main(int argc, char *argv [], char *env[])
 {
-	int option_index, c, zfs_selected;
+	extern struct sched launch_sched;
+	int option_index, c, zfs_selected, cache_size_set;
 	pthread_t thr;
 	char *r;
 
 	zfs_selected = 0;
+	cache_size_set = 0;
 	gcfg.c_data_dir = DEFAULT_DATA_DIR;
 	gcfg.global_env = env;
 	gcfg.c_callback = cblock_handle_request;
 	gcfg.c_family = PF_UNSPEC;
 	gcfg.c_tty_buf_size = 5 * 4096;
 	gcfg.c_name = "/var/run/cblock.sock";
+	gcfg.c_max_launches = sysconf(_SC_NPROCESSORS_ONLN);
+	gcfg.c_max_builds = DEFAULT_MAX_BUILDS;
+	gcfg.c_build_cache_size = DEFAULT_BUILD_CACHE_MB;
+	gcfg.c_fim_interval = DEFAULT_FIM_INTERVAL;
 	while (1) {
 		option_index = 0;
-		c = getopt_long(argc, argv, "f:l:o:bd:T:46U:s:p:huzNv", long_options,
+		c = getopt_long(argc, argv, "f:l:o:bd:T:46U:s:p:huzNvL:B:m:S:C:F:P:", long_options,
 		    &option_index);
 		if (c == -1) {
 			break;
@@ -259,6 +329,43 @@ main(int argc, char *argv [], char *env[])
 		case 'f':
 			gcfg.c_forge_path = optarg;
 			break;
+		case 'm':
+			gcfg.c_metrics_port = optarg;
+			break;
+		case 'S':
+			gcfg.c_synthetic = optarg;
+			break;
+		case 'C':
+			gcfg.c_build_cache_size = strtoul(optarg, &r, 10);
+			if (*r != '\0') {
+				errx(1, "invalid build cache size: %s", optarg);
+			}
+			cache_size_set = 1;
+			break;
+		case 'F':
+			gcfg.c_fim_interval = strtoul(optarg, &r, 10);
+			if (*r != '\0') {
+				errx(1, "invalid FIM interval: %s", optarg);
+			}
+			break;
+		case 'P':
+			if (gcfg.c_npeers == MAXPEERS) {
+				errx(1, "too many peers, at most %d", MAXPEERS);
+			}
+			gcfg.c_peers[gcfg.c_npeers++] = optarg;
+			break;
+		case 'L':
+			gcfg.c_max_launches = strtoul(optarg, &r, 10);
+			if (*r != '\0') {
+				errx(1, "invalid max launches: %s", optarg);
+			}
+			break;
+		case 'B':
+			gcfg.c_max_builds = strtoul(optarg, &r, 10);
+			if (*r != '\0') {
+				errx(1, "invalid max builds: %s", optarg);
+			}
+			break;
 		case 'l':
 			gcfg.c_logfile = optarg;
 			break;
@@ -320,12 +427,30 @@ main(int argc, char *argv [], char *env[])
 		    "    --fuse-unionfs\n"
                     "    --zfs");
 	}
+	/*
+	 * Outside of ZFS a cached step is a full copy of the stage root, so
+	 * the step cache is only on by default on ZFS.
+	 */
+	if (!cache_size_set && strcmp(gcfg.c_underlying_fs, "zfs") != 0) {
+		gcfg.c_build_cache_size = 0;
+	}
+	if (gcfg.c_synthetic != NULL && access(gcfg.c_synthetic, X_OK) == -1) {
+		err(1, "synthetic instance program: %s", gcfg.c_synthetic);
+	}
 	fprintf(stdout, "%s\n", banner);
 	fprintf(stdout, "version %s\n", "0.0.0");
 	initialize_data_directory(zfs_selected);
 	if (gcfg.c_forge_path != NULL) {
 		return (create_forge(gcfg.c_forge_path));
 	}
+	raise_fd_limit();
+	(void) signal(SIGPIPE, handle_sigpipe);
+	stats_init();
+	sched_init(&launch_sched, "launch", gcfg.c_max_launches);
+	buildq_init(gcfg.c_max_builds);
+	if (journal_recover() == -1) {
+		errx(1, "failed to recover state journal");
+	}
 	if (gcfg.c_inet) {
 		if (gcfg.c_host == NULL) {
 			gcfg.c_host = "localhost";
@@ -337,12 +462,24 @@ main(int argc, char *argv [], char *env[])
 	} else {
 		sock_ipc_setup_unix(&gcfg);
 	}
+	if (gcfg.c_metrics_port != NULL) {
+		stats_http_setup(gcfg.c_metrics_port);
+	}
 	if (gcfg.c_background) {
 		daemonize(&gcfg);
 	}
+	tty_io_init();
 	if (pthread_create(&thr, NULL, tty_io_queue_loop, NULL) == -1) {
 		err(1, "pthread_create(tty_io_queue_loop)");
 	}
+	if (gcfg.c_metrics_port != NULL &&
+	    pthread_create(&thr, NULL, stats_http_loop, NULL) != 0) {
+		err(1, "pthread_create(stats_http_loop)");
+	}
+	if (gcfg.c_fim_interval != 0 &&
+	    pthread_create(&thr, NULL, drift_monitor_loop, NULL) != 0) {
+		err(1, "pthread_create(drift_monitor_loop)");
+	}
 	sock_ipc_event_loop(&gcfg);
 	return (0);
 }
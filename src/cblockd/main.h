@@ -28,6 +28,7 @@
 #define	MAIN_DOT_H_
 
 #define	MAXSOCKS	64
+#define	MAXPEERS	32
 
 struct global_params {
 	char		*c_name;
@@ -47,6 +48,14 @@ struct global_params {
 	char		*c_logfile;
 	char		*c_forge_path;
 	int		 c_inet;
+	u_int		 c_max_launches;
+	u_int		 c_max_builds;	/* 0 is unlimited */
+	char		*c_metrics_port;
+	char		*c_synthetic;
+	u_long		 c_build_cache_size;	/* MB, 0 disables */
+	u_int		 c_fim_interval;	/* seconds, 0 disables */
+	char		*c_peers[MAXPEERS];	/* host:port to offload to */
+	u_int		 c_npeers;
 };
 
 #endif
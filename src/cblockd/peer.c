@@ -0,0 +1,597 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <netinet/in.h>
+
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <cblock/libcblock.h>
+
+#include "termbuf.h"
+#include "main.h"
+#include "dispatch.h"
+#include "config.h"
+#include "stats.h"
+#include "context.h"
+#include "report.h"
+#include "peer.h"
+
+/*
+ * Stages of a build can be run by the cblockd instances given with --peer,
+ * which listen with --inet. A stage that needs nothing but its base image
+ * and the build context (it does not copy from or build on another stage)
+ * is run by the least loaded peer, if that peer is less loaded than we are.
+ * The peer is sent the build, from which it takes the stage's base image
+ * reference and steps, and whatever context contents it does not already
+ * have. It runs the stage as it would one of its own, forwarding the
+ * console output, and sends back the stage's report records and root, which
+ * is laid out where the stage would have been built here.
+ *
+ * A peer that can not be reached, does not have the base image or fails to
+ * start the stage only means that the stage is run here instead.
+ */
+static u_int peer_stages;
+
+/*
+ * Unlike sock_ipc_must_read(), a peer going away is not fatal.
+ */
+static int
+peer_read(int sock, void *buf, size_t len)
+{
+	ssize_t cc;
+	char *p;
+
+	for (p = buf; len > 0; p += cc, len -= cc) {
+		cc = read(sock, p, len);
+		if (cc == -1 && errno == EINTR) {
+			cc = 0;
+			continue;
+		}
+		if (cc <= 0) {
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+static int
+peer_write(int fd, const void *buf, size_t len)
+{
+	const char *p;
+	ssize_t cc;
+
+	for (p = buf; len > 0; p += cc, len -= cc) {
+		cc = write(fd, p, len);
+		if (cc == -1 && errno == EINTR) {
+			cc = 0;
+			continue;
+		}
+		if (cc <= 0) {
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Peers are given as HOST, HOST:PORT or [ADDRESS]:PORT.
+ */
+static int
+peer_parse(const char *peer, char *host, size_t len, const char **port)
+{
+	char *c;
+
+	*port = BUILD_PEER_PORT;
+	if (strlcpy(host, peer, len) >= len) {
+		return (-1);
+	}
+	if (host[0] == '[') {
+		c = strchr(host, ']');
+		if (c == NULL || (c[1] != '\0' && c[1] != ':')) {
+			return (-1);
+		}
+		*c = '\0';
+		if (c[1] == ':') {
+			*port = peer + (c - host) + 2;
+		}
+		memmove(host, host + 1, strlen(host));
+		return (0);
+	}
+	c = strchr(host, ':');
+	if (c != NULL && strchr(c + 1, ':') == NULL) {
+		*c = '\0';
+		*port = peer + (c - host) + 1;
+	}
+	return (0);
+}
+
+static int
+peer_poll(int sock, short events)
+{
+	struct pollfd pfd;
+	int error;
+
+	pfd.fd = sock;
+	pfd.events = events;
+	do {
+		error = poll(&pfd, 1, BUILD_PEER_TIMEOUT_MS);
+	} while (error == -1 && errno == EINTR);
+	return (error == 1 ? 0 : -1);
+}
+
+/*
+ * Connect to a peer, giving up after BUILD_PEER_TIMEOUT_MS so that a peer
+ * that is down does not hold up the build.
+ */
+static int
+peer_connect(const char *peer)
+{
+	struct addrinfo hints, *res, *res0;
+	char host[MAXHOSTNAMELEN];
+	const char *port;
+	socklen_t slen;
+	int s, error, flags;
+
+	if (peer_parse(peer, host, sizeof(host), &port) == -1) {
+		warnx("%s: invalid peer", peer);
+		return (-1);
+	}
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	error = getaddrinfo(host, port, &hints, &res0);
+	if (error) {
+		warnx("%s: %s", peer, gai_strerror(error));
+		return (-1);
+	}
+	s = -1;
+	for (res = res0; res != NULL; res = res->ai_next) {
+		s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+		if (s == -1) {
+			continue;
+		}
+		flags = fcntl(s, F_GETFL);
+		(void) fcntl(s, F_SETFL, flags | O_NONBLOCK);
+		if (connect(s, res->ai_addr, res->ai_addrlen) == 0) {
+			error = 0;
+		} else if (errno == EINPROGRESS && peer_poll(s, POLLOUT) == 0) {
+			slen = sizeof(error);
+			if (getsockopt(s, SOL_SOCKET, SO_ERROR, &error,
+			    &slen) == -1) {
+				error = errno;
+			}
+		} else {
+			error = ETIMEDOUT;
+		}
+		if (error == 0) {
+			(void) fcntl(s, F_SETFL, flags);
+			break;
+		}
+		(void) close(s);
+		s = -1;
+	}
+	freeaddrinfo(res0);
+	return (s);
+}
+
+/*
+ * The load of a peer: its load average plus the builds and stages it has
+ * started but which may not be showing in the load average yet, per CPU.
+ */
+static int
+peer_get_load(const char *peer, double *loadp)
+{
+	struct cblock_build_load bl;
+	uint32_t cmd;
+	int sock;
+
+	sock = peer_connect(peer);
+	if (sock == -1) {
+		return (-1);
+	}
+	cmd = PRISON_IPC_GET_BUILD_LOAD;
+	if (sock_ipc_may_write(sock, &cmd, sizeof(cmd)) ||
+	    peer_poll(sock, POLLIN) == -1 ||
+	    peer_read(sock, &bl, sizeof(bl)) == -1) {
+		(void) close(sock);
+		return (-1);
+	}
+	(void) close(sock);
+	*loadp = (bl.p_loadavg / 100.0 + bl.p_builds + bl.p_stages) /
+	    (bl.p_ncpu > 0 ? bl.p_ncpu : 1);
+	return (0);
+}
+
+/*
+ * Pick the peer to run a stage on, given the number of stages this build
+ * is already running here. Returns -1 if the stage is best run here.
+ */
+int
+peer_select(int running, char *buf, size_t len)
+{
+	extern struct global_params gcfg;
+	double avg, best, load;
+	long ncpu;
+	int k, sel;
+
+	if (gcfg.c_npeers == 0) {
+		return (-1);
+	}
+	if (getloadavg(&avg, 1) != 1) {
+		avg = 0;
+	}
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	best = (avg + running) / (ncpu > 0 ? ncpu : 1);
+	sel = -1;
+	for (k = 0; k < (int)gcfg.c_npeers; k++) {
+		if (peer_get_load(gcfg.c_peers[k], &load) == -1) {
+			continue;
+		}
+		if (load < best) {
+			best = load;
+			sel = k;
+		}
+	}
+	if (sel == -1) {
+		return (-1);
+	}
+	strlcpy(buf, gcfg.c_peers[sel], len);
+	return (0);
+}
+
+static int
+peer_decline(int k, const char *peer, const char *why)
+{
+
+	print_bold_prefix(stdout);
+	fprintf(stdout, "Peer %s can not run stage %d (%s), running it here\n",
+	    peer, k + 1, why);
+	fflush(stdout);
+	return (-1);
+}
+
+/*
+ * Forward the stage's console output until the peer says the stage is
+ * done.
+ */
+static int
+peer_stage_output(int sock, struct cblock_stage_done *sdp)
+{
+	char buf[8192];
+	uint32_t cmd;
+	size_t len, n;
+
+	for (;;) {
+		if (peer_read(sock, &cmd, sizeof(cmd)) == -1) {
+			return (-1);
+		}
+		switch (cmd) {
+		case PRISON_IPC_CONSOLE_TO_CLIENT:
+			if (peer_read(sock, &len, sizeof(len)) == -1) {
+				return (-1);
+			}
+			for (; len > 0; len -= n) {
+				n = MIN(len, sizeof(buf));
+				if (peer_read(sock, buf, n) == -1) {
+					return (-1);
+				}
+				fwrite(buf, 1, n, stdout);
+			}
+			fflush(stdout);
+			break;
+		case PRISON_IPC_STAGE_DONE:
+			return (peer_read(sock, sdp, sizeof(*sdp)));
+		default:
+			return (-1);
+		}
+	}
+}
+
+/*
+ * The peer timed the stage, so its records become those of the stage.
+ */
+static int
+peer_stage_report(struct build_context *bcp, int stage, int sock,
+    uint64_t len)
+{
+	char *buf, *line, *p;
+
+	if (len > BUILD_PEER_REPORT_MAX) {
+		return (-1);
+	}
+	buf = malloc(len + 1);
+	if (buf == NULL) {
+		err(1, "malloc failed");
+	}
+	if (peer_read(sock, buf, len) == -1) {
+		free(buf);
+		return (-1);
+	}
+	buf[len] = '\0';
+	p = buf;
+	while ((line = strsep(&p, "\n")) != NULL) {
+		if (*line != '\0') {
+			report_record(bcp, stage, "%s", line);
+		}
+	}
+	free(buf);
+	return (0);
+}
+
+/*
+ * Lay out the stage root sent by the peer with stage_import.sh.
+ */
+static int
+peer_import_tree(struct build_context *bcp, struct build_stage *bstg,
+    int sock, uint32_t tree)
+{
+	char script[MAXPATHLEN], index[16], buf[64], **argv;
+	extern struct global_params gcfg;
+	int fds[2], status, estatus, ok;
+	vec_t *vec, *vec_env;
+	u_char *frame;
+	uint32_t len;
+	pid_t pid;
+
+	if (pipe2(fds, O_CLOEXEC) == -1) {
+		err(1, "pipe failed");
+	}
+	pid = fork();
+	if (pid == -1) {
+		err(1, "fork failed");
+	}
+	if (pid == 0) {
+		if (dup2(fds[0], STDIN_FILENO) == -1) {
+			err(1, "dup2 failed");
+		}
+		(void) close(fds[0]);
+		(void) close(fds[1]);
+		(void) close(sock);
+		vec_env = vec_init(8);
+		vec_append(vec_env, DEFAULT_PATH);
+		(void) snprintf(buf, sizeof(buf), "CBLOCK_FS=%s",
+		    gcfg.c_underlying_fs);
+		vec_append(vec_env, buf);
+		vec_append(vec_env, "LC_ALL=C");
+		vec_finalize(vec_env);
+		(void) snprintf(script, sizeof(script),
+		    "%s/lib/stage_import.sh", gcfg.c_data_dir);
+		(void) snprintf(index, sizeof(index), "%d", bstg->bs_index);
+		vec = vec_init(16);
+		vec_append(vec, "/bin/sh");
+		if (bcp->pbc.p_verbose > 0) {
+			vec_append(vec, "-x");
+		}
+		vec_append(vec, script);
+		vec_append(vec, bcp->build_root);
+		vec_append(vec, index);
+		vec_append(vec, tree == CBLOCK_TREE_ZFS ? "zfs" : "tar");
+		if (bstg->bs_name[0] != '\0') {
+			vec_append(vec, bstg->bs_name);
+		}
+		if (vec_finalize(vec) != 0) {
+			errx(1, "failed to construct command line");
+		}
+		argv = vec_return(vec);
+		execve(*argv, argv, vec_return(vec_env));
+		err(1, "execve failed");
+	}
+	(void) close(fds[0]);
+	frame = malloc(CBLOCK_TREE_FRAME_MAX);
+	if (frame == NULL) {
+		err(1, "malloc failed");
+	}
+	ok = 0;
+	for (;;) {
+		if (peer_read(sock, &len, sizeof(len)) == -1 ||
+		    len > CBLOCK_TREE_FRAME_MAX) {
+			break;
+		}
+		if (len == 0) {
+			ok = peer_read(sock, &estatus, sizeof(estatus)) == 0 &&
+			    estatus == 0;
+			break;
+		}
+		if (peer_read(sock, frame, len) == -1 ||
+		    peer_write(fds[1], frame, len) == -1) {
+			break;
+		}
+	}
+	free(frame);
+	(void) close(fds[1]);
+	waitpid_ignore_intr(pid, &status);
+	if (!ok || status != 0) {
+		print_bold_prefix(stdout);
+		fprintf(stdout, "Failed to import stage %d from peer\n",
+		    bstg->bs_index + 1);
+		fflush(stdout);
+		return (1);
+	}
+	return (0);
+}
+
+/*
+ * Run stage k of the build on a peer. Returns -1 if the peer did not start
+ * the stage, which is then best run here, otherwise the stage's status.
+ */
+int
+peer_run_stage(struct build_context *bcp, int k, const char *peer)
+{
+	extern struct global_params gcfg;
+	struct cblock_build_context pbc;
+	struct cblock_response resp;
+	struct cblock_stage_exec se;
+	struct cblock_stage_done sd;
+	struct build_stage *bstg;
+	char ebuf[MAX_ERR_BUF];
+	void *manifest;
+	uint64_t start;
+	uint32_t cmd;
+	size_t len;
+	int sock, status;
+
+	bstg = &bcp->stages[k];
+	start = stats_now_usec();
+	sock = peer_connect(peer);
+	if (sock == -1) {
+		return (peer_decline(k, peer, "can not connect"));
+	}
+	bzero(&se, sizeof(se));
+	se.p_stage = k;
+	se.p_trees = CBLOCK_TREE_TAR;
+	if (strcmp(gcfg.c_underlying_fs, "zfs") == 0) {
+		se.p_trees |= CBLOCK_TREE_ZFS;
+	}
+	/*
+	 * Pack the manifest afresh, the step digests of URL sources may have
+	 * been filled in since it was received.
+	 */
+	manifest = build_manifest_pack(bcp->stages, bcp->pbc.p_nstages,
+	    bcp->steps, bcp->pbc.p_nsteps, &len);
+	if (manifest == NULL) {
+		(void) close(sock);
+		return (peer_decline(k, peer, "can not pack manifest"));
+	}
+	pbc = bcp->pbc;
+	pbc.p_context_transfer = CBLOCK_TRANSFER_RAW;
+	pbc.p_manifest_len = len;
+	cmd = PRISON_IPC_STAGE_EXEC;
+	if (peer_write(sock, &cmd, sizeof(cmd)) == -1 ||
+	    peer_write(sock, &se, sizeof(se)) == -1 ||
+	    peer_write(sock, &pbc, sizeof(pbc)) == -1 ||
+	    peer_write(sock, manifest, len) == -1 ||
+	    peer_read(sock, &resp, sizeof(resp)) == -1) {
+		free(manifest);
+		(void) close(sock);
+		return (peer_decline(k, peer, "connection failed"));
+	}
+	free(manifest);
+	if (resp.p_ecode != 0) {
+		(void) close(sock);
+		return (peer_decline(k, peer, resp.p_errbuf));
+	}
+	if (context_send(bcp, sock, ebuf, sizeof(ebuf)) == -1) {
+		(void) close(sock);
+		return (peer_decline(k, peer, ebuf));
+	}
+	if (peer_read(sock, &resp, sizeof(resp)) == -1) {
+		(void) close(sock);
+		return (peer_decline(k, peer, "connection failed"));
+	}
+	if (resp.p_ecode != 0) {
+		(void) close(sock);
+		return (peer_decline(k, peer, resp.p_errbuf));
+	}
+	stats_counter_add(STATS_BUILD_STAGES_OFFLOADED, 1);
+	report_record(bcp, bstg->bs_index, "peer %s", peer);
+	print_bold_prefix(stdout);
+	fprintf(stdout, "Running stage (%d/%d) on peer %s\n", k + 1,
+	    bcp->pbc.p_nstages, peer);
+	fflush(stdout);
+	status = 1;
+	if (peer_stage_output(sock, &sd) == -1) {
+		print_bold_prefix(stdout);
+		fprintf(stdout, "Lost connection to peer %s\n", peer);
+	} else if (sd.p_status == 0 &&
+	    peer_stage_report(bcp, bstg->bs_index, sock,
+	    sd.p_report_len) == 0 &&
+	    peer_import_tree(bcp, bstg, sock, sd.p_tree) == 0) {
+		status = 0;
+	}
+	(void) close(sock);
+	report_record(bcp, bstg->bs_index, "total %ju %d",
+	    (uintmax_t)(stats_now_usec() - start), status);
+	if (status != 0) {
+		print_bold_prefix(stdout);
+		fprintf(stdout, "Execution of stage of %d ", k + 1);
+		print_red(stdout, "failed");
+		fprintf(stdout, ". Terminating.\n");
+	}
+	fflush(stdout);
+	return (status);
+}
+
+/*
+ * Account for a stage being run on behalf of a peer, for the load we report
+ * to peers.
+ */
+void
+peer_stage_hold(void)
+{
+
+	__atomic_fetch_add(&peer_stages, 1, __ATOMIC_RELAXED);
+	stats_counter_add(STATS_PEER_STAGES, 1);
+}
+
+void
+peer_stage_release(void)
+{
+
+	__atomic_fetch_sub(&peer_stages, 1, __ATOMIC_RELAXED);
+}
+
+int
+dispatch_get_build_load(int sock)
+{
+	extern cblock_instance_head_t pr_head;
+	extern pthread_mutex_t cblock_mutex;
+	struct cblock_build_load bl;
+	struct cblock_instance *pi;
+	double avg;
+
+	bzero(&bl, sizeof(bl));
+	bl.p_ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (getloadavg(&avg, 1) == 1) {
+		bl.p_loadavg = avg * 100;
+	}
+	pthread_mutex_lock(&cblock_mutex);
+	TAILQ_FOREACH(pi, &pr_head, p_glue) {
+		if (pi->p_type == PRISON_TYPE_BUILD &&
+		    (pi->p_state & STATE_DEAD) == 0) {
+			bl.p_builds++;
+		}
+	}
+	pthread_mutex_unlock(&cblock_mutex);
+	bl.p_stages = __atomic_load_n(&peer_stages, __ATOMIC_RELAXED);
+	sock_ipc_must_write(sock, &bl, sizeof(bl));
+	return (1);
+}
@@ -0,0 +1,102 @@
+#ifndef _PROBES_H_
+#define _PROBES_H_
+#define	CBLOCKD_CBLOCK_CREATE(arg0) do { \
+	(void)(arg0); \
+} while (0)
+#define	CBLOCKD_CBLOCK_CREATE_ENABLED() (0)
+#define	CBLOCKD_CBLOCK_DESTROY(arg0, arg1) do { \
+	(void)(arg0); \
+	(void)(arg1); \
+} while (0)
+#define	CBLOCKD_CBLOCK_DESTROY_ENABLED() (0)
+#define	CBLOCKD_CBLOCK_CLEANUP(arg0, arg1, arg2) do { \
+	(void)(arg0); \
+	(void)(arg1); \
+	(void)(arg2); \
+} while (0)
+#define	CBLOCKD_CBLOCK_CLEANUP_ENABLED() (0)
+#define	CBLOCKD_CBLOCK_CONSOLE_ATTACH(arg0) do { \
+	(void)(arg0); \
+} while (0)
+#define	CBLOCKD_CBLOCK_CONSOLE_ATTACH_ENABLED() (0)
+#define	CBLOCKD_CBLOCK_CONSOLE_DETACH(arg0) do { \
+	(void)(arg0); \
+} while (0)
+#define	CBLOCKD_CBLOCK_CONSOLE_DETACH_ENABLED() (0)
+#define	CBLOCKD_LAUNCH_QUEUED(arg0) do { \
+	(void)(arg0); \
+} while (0)
+#define	CBLOCKD_LAUNCH_QUEUED_ENABLED() (0)
+#define	CBLOCKD_LAUNCH_ADMIT(arg0, arg1, arg2, arg3) do { \
+	(void)(arg0); \
+	(void)(arg1); \
+	(void)(arg2); \
+	(void)(arg3); \
+} while (0)
+#define	CBLOCKD_LAUNCH_ADMIT_ENABLED() (0)
+#define	CBLOCKD_LAUNCH_RELEASE(arg0, arg1) do { \
+	(void)(arg0); \
+	(void)(arg1); \
+} while (0)
+#define	CBLOCKD_LAUNCH_RELEASE_ENABLED() (0)
+#define	CBLOCKD_IPC_START(arg0, arg1) do { \
+	(void)(arg0); \
+	(void)(arg1); \
+} while (0)
+#define	CBLOCKD_IPC_START_ENABLED() (0)
+#define	CBLOCKD_IPC_DONE(arg0, arg1, arg2) do { \
+	(void)(arg0); \
+	(void)(arg1); \
+	(void)(arg2); \
+} while (0)
+#define	CBLOCKD_IPC_DONE_ENABLED() (0)
+#define	CBLOCKD_HELPER_EXEC(arg0, arg1, arg2) do { \
+	(void)(arg0); \
+	(void)(arg1); \
+	(void)(arg2); \
+} while (0)
+#define	CBLOCKD_HELPER_EXEC_ENABLED() (0)
+#define	CBLOCKD_HELPER_DONE(arg0, arg1, arg2, arg3) do { \
+	(void)(arg0); \
+	(void)(arg1); \
+	(void)(arg2); \
+	(void)(arg3); \
+} while (0)
+#define	CBLOCKD_HELPER_DONE_ENABLED() (0)
+#define	CBLOCKD_BUILD_STAGE_START(arg0, arg1, arg2) do { \
+	(void)(arg0); \
+	(void)(arg1); \
+	(void)(arg2); \
+} while (0)
+#define	CBLOCKD_BUILD_STAGE_START_ENABLED() (0)
+#define	CBLOCKD_BUILD_STAGE_DONE(arg0, arg1, arg2, arg3) do { \
+	(void)(arg0); \
+	(void)(arg1); \
+	(void)(arg2); \
+	(void)(arg3); \
+} while (0)
+#define	CBLOCKD_BUILD_STAGE_DONE_ENABLED() (0)
+#define	CBLOCKD_TERMBUF_APPEND(arg0, arg1, arg2) do { \
+	(void)(arg0); \
+	(void)(arg1); \
+	(void)(arg2); \
+} while (0)
+#define	CBLOCKD_TERMBUF_APPEND_ENABLED() (0)
+#define	CBLOCKD_TERMBUF_TRIM(arg0, arg1) do { \
+	(void)(arg0); \
+	(void)(arg1); \
+} while (0)
+#define	CBLOCKD_TERMBUF_TRIM_ENABLED() (0)
+#define	CBLOCKD_PEER_WRITE_STALL(arg0, arg1, arg2) do { \
+	(void)(arg0); \
+	(void)(arg1); \
+	(void)(arg2); \
+} while (0)
+#define	CBLOCKD_PEER_WRITE_STALL_ENABLED() (0)
+#define	CBLOCKD_FIM_DRIFT(arg0, arg1, arg2) do { \
+	(void)(arg0); \
+	(void)(arg1); \
+	(void)(arg2); \
+} while (0)
+#define	CBLOCKD_FIM_DRIFT_ENABLED() (0)
+#endif
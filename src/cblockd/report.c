@@ -0,0 +1,523 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <cblock/libcblock.h>
+#include <cblock/sbuf.h>
+
+#include "termbuf.h"
+#include "main.h"
+#include "config.h"
+#include "stats.h"
+#include "report.h"
+
+/*
+ * The build report: where the time of a build went, step by step, and what
+ * each step cost. It is printed at the end of the build and kept with the
+ * image as JSON, so that builds of an image can be compared over time.
+ */
+struct report_step {
+	const char		*rs_string;
+	int			 rs_ran;
+	int			 rs_cached;
+	uint64_t		 rs_real;
+	uint64_t		 rs_user;
+	uint64_t		 rs_sys;
+	uint64_t		 rs_maxrss;	/* KB */
+	uint64_t		 rs_oublock;
+	int64_t			 rs_bytes;
+};
+
+struct report_stage {
+	char			 rg_peer[256];
+	uint64_t		 rg_bootstrap;
+	uint64_t		 rg_total;
+	int			 rg_status;
+	int			 rg_done;
+	int			 rg_nsteps;
+	struct report_step	*rg_steps;
+	struct report_step	 rg_all;	/* steps run as one script */
+};
+
+struct report {
+	time_t			 r_started;
+	uint64_t		 r_start;
+	uint64_t		 r_context;
+	uint64_t		 r_queued;
+	uint64_t		 r_fetch;
+	uint64_t		 r_fim_spec;
+	uint64_t		 r_fim_index;
+	uint64_t		 r_commit;
+	struct report_stage	*r_stages;
+};
+
+void
+report_path(struct build_context *bcp, int stage, char *buf, size_t len)
+{
+
+	if (stage == REPORT_STAGE_BUILD) {
+		(void) snprintf(buf, len, "%s.%s", bcp->build_root,
+		    REPORT_FILE);
+	} else {
+		(void) snprintf(buf, len, "%s.%s.%d", bcp->build_root,
+		    REPORT_FILE, stage);
+	}
+}
+
+/*
+ * Append a record for the build (REPORT_STAGE_BUILD) or a stage. Records
+ * are short enough for a single write to an O_APPEND file to keep them
+ * whole.
+ */
+void
+report_record(struct build_context *bcp, int stage, const char *fmt, ...)
+{
+	char path[MAXPATHLEN], line[256];
+	va_list ap;
+	int fd, len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+	va_end(ap);
+	if (len < 0 || (size_t)len >= sizeof(line) - 1) {
+		return;
+	}
+	line[len++] = '\n';
+	report_path(bcp, stage, path, sizeof(path));
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		warn("open(%s)", path);
+		return;
+	}
+	if (write(fd, line, len) != len) {
+		warn("write(%s)", path);
+	}
+	(void) close(fd);
+}
+
+static void
+report_load_build(struct build_context *bcp, struct report *rp)
+{
+	char path[MAXPATHLEN], line[256], key[32];
+	uintmax_t a, b;
+	FILE *fp;
+
+	report_path(bcp, REPORT_STAGE_BUILD, path, sizeof(path));
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		a = b = 0;
+		if (sscanf(line, "%31s %ju %ju", key, &a, &b) < 2) {
+			continue;
+		}
+		if (strcmp(key, "start") == 0) {
+			rp->r_started = a;
+			rp->r_start = b;
+		} else if (strcmp(key, "context") == 0) {
+			rp->r_context = a;
+		} else if (strcmp(key, "queued") == 0) {
+			rp->r_queued = a;
+		} else if (strcmp(key, "fetch") == 0) {
+			rp->r_fetch = a;
+		} else if (strcmp(key, "fim_spec") == 0) {
+			rp->r_fim_spec = a;
+		} else if (strcmp(key, "fim_index") == 0) {
+			rp->r_fim_index = a;
+		} else if (strcmp(key, "commit") == 0) {
+			rp->r_commit = a;
+		}
+	}
+	(void) fclose(fp);
+}
+
+static void
+report_set_usage(struct report_step *rsp, uintmax_t *v, intmax_t bytes)
+{
+
+	rsp->rs_ran = 1;
+	rsp->rs_real = v[1];
+	rsp->rs_user = v[2];
+	rsp->rs_sys = v[3];
+	rsp->rs_maxrss = v[4];
+	rsp->rs_oublock = v[5];
+	rsp->rs_bytes = bytes;
+}
+
+static void
+report_load_stage(struct build_context *bcp, struct build_stage *bstg,
+    struct report_stage *rgp)
+{
+	char path[MAXPATHLEN], line[256], key[32];
+	uintmax_t v[7];
+	intmax_t bytes;
+	struct report_step *rsp;
+	int k, n;
+	FILE *fp;
+
+	for (n = 0, k = 0; k < bcp->pbc.p_nsteps; k++) {
+		if (bcp->steps[k].stage_index == bstg->bs_index) {
+			n++;
+		}
+	}
+	rgp->rg_steps = calloc(n + 1, sizeof(*rgp->rg_steps));
+	if (rgp->rg_steps == NULL) {
+		err(1, "calloc failed");
+	}
+	rgp->rg_nsteps = n;
+	for (n = 0, k = 0; k < bcp->pbc.p_nsteps; k++) {
+		if (bcp->steps[k].stage_index == bstg->bs_index) {
+			rgp->rg_steps[n++].rs_string =
+			    bcp->steps[k].step_string;
+		}
+	}
+	report_path(bcp, bstg->bs_index, path, sizeof(path));
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "peer %255s", rgp->rg_peer) == 1) {
+			continue;
+		}
+		bzero(v, sizeof(v));
+		bytes = -1;
+		if (sscanf(line, "all %ju %ju %ju %ju %ju %jd", &v[1], &v[2],
+		    &v[3], &v[4], &v[5], &bytes) == 6) {
+			report_set_usage(&rgp->rg_all, v, bytes);
+			continue;
+		}
+		n = sscanf(line, "%31s %ju %ju %ju %ju %ju %ju %jd", key,
+		    &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &bytes);
+		if (n < 2) {
+			continue;
+		}
+		if (strcmp(key, "bootstrap") == 0) {
+			rgp->rg_bootstrap = v[0];
+			continue;
+		}
+		if (strcmp(key, "total") == 0) {
+			rgp->rg_total = v[0];
+			rgp->rg_status = v[1];
+			rgp->rg_done = 1;
+			continue;
+		}
+		if (v[0] >= (uintmax_t)rgp->rg_nsteps) {
+			continue;
+		}
+		rsp = &rgp->rg_steps[v[0]];
+		if (strcmp(key, "cached") == 0) {
+			rsp->rs_cached = 1;
+		} else if (strcmp(key, "step") == 0 && n >= 7) {
+			report_set_usage(rsp, v, bytes);
+		}
+	}
+	(void) fclose(fp);
+}
+
+static void
+report_json_string(struct sbuf *sb, const char *s)
+{
+
+	sbuf_putc(sb, '"');
+	for (; *s != '\0'; s++) {
+		switch (*s) {
+		case '"':
+		case '\\':
+			sbuf_printf(sb, "\\%c", *s);
+			break;
+		case '\n':
+			sbuf_cat(sb, "\\n");
+			break;
+		case '\t':
+			sbuf_cat(sb, "\\t");
+			break;
+		default:
+			if ((u_char)*s < 0x20) {
+				sbuf_printf(sb, "\\u%04x", (u_char)*s);
+			} else {
+				sbuf_putc(sb, *s);
+			}
+		}
+	}
+	sbuf_putc(sb, '"');
+}
+
+static void
+report_json_usage(struct sbuf *sb, struct report_step *rsp)
+{
+
+	sbuf_printf(sb, ", \"real_usec\": %ju, \"user_usec\": %ju, "
+	    "\"sys_usec\": %ju, \"max_rss_kb\": %ju, "
+	    "\"blocks_written\": %ju", (uintmax_t)rsp->rs_real,
+	    (uintmax_t)rsp->rs_user, (uintmax_t)rsp->rs_sys,
+	    (uintmax_t)rsp->rs_maxrss, (uintmax_t)rsp->rs_oublock);
+	if (rsp->rs_bytes >= 0) {
+		sbuf_printf(sb, ", \"bytes_written\": %jd",
+		    (intmax_t)rsp->rs_bytes);
+	}
+}
+
+static struct sbuf *
+report_json(struct build_context *bcp, struct report *rp, uint64_t total,
+    int status)
+{
+	struct report_stage *rgp;
+	struct report_step *rsp;
+	struct build_stage *bstg;
+	struct sbuf *sb;
+	int k, j;
+
+	sb = sbuf_new_auto();
+	sbuf_cat(sb, "{\n  \"image\": ");
+	report_json_string(sb, bcp->pbc.p_image_name);
+	sbuf_cat(sb, ",\n  \"tag\": ");
+	report_json_string(sb, bcp->pbc.p_tag);
+	sbuf_printf(sb, ",\n  \"instance\": \"%s\",\n", bcp->instance);
+	sbuf_printf(sb, "  \"started\": %jd,\n", (intmax_t)rp->r_started);
+	sbuf_printf(sb, "  \"status\": %d,\n", status);
+	sbuf_printf(sb, "  \"total_usec\": %ju,\n", (uintmax_t)total);
+	sbuf_printf(sb, "  \"context_usec\": %ju,\n",
+	    (uintmax_t)rp->r_context);
+	sbuf_printf(sb, "  \"queued_usec\": %ju,\n", (uintmax_t)rp->r_queued);
+	sbuf_printf(sb, "  \"fetch_usec\": %ju,\n", (uintmax_t)rp->r_fetch);
+	sbuf_printf(sb, "  \"fim_spec_usec\": %ju,\n",
+	    (uintmax_t)rp->r_fim_spec);
+	sbuf_printf(sb, "  \"fim_index_usec\": %ju,\n",
+	    (uintmax_t)rp->r_fim_index);
+	sbuf_printf(sb, "  \"commit_usec\": %ju,\n", (uintmax_t)rp->r_commit);
+	sbuf_cat(sb, "  \"stages\": [");
+	for (k = 0; k < bcp->pbc.p_nstages; k++) {
+		bstg = &bcp->stages[k];
+		rgp = &rp->r_stages[k];
+		sbuf_printf(sb, "%s\n    {\n      \"index\": %d,\n",
+		    k == 0 ? "" : ",", bstg->bs_index);
+		sbuf_cat(sb, "      \"name\": ");
+		report_json_string(sb, bstg->bs_name);
+		sbuf_cat(sb, ",\n      \"from\": ");
+		report_json_string(sb, bstg->bs_base_container);
+		if (rgp->rg_peer[0] != '\0') {
+			sbuf_cat(sb, ",\n      \"peer\": ");
+			report_json_string(sb, rgp->rg_peer);
+		}
+		sbuf_printf(sb, ",\n      \"bootstrap_usec\": %ju,\n",
+		    (uintmax_t)rgp->rg_bootstrap);
+		sbuf_printf(sb, "      \"total_usec\": %ju,\n",
+		    (uintmax_t)rgp->rg_total);
+		sbuf_printf(sb, "      \"status\": %d,\n",
+		    rgp->rg_done ? rgp->rg_status : -1);
+		sbuf_cat(sb, "      \"steps\": [");
+		for (j = 0; j < rgp->rg_nsteps; j++) {
+			rsp = &rgp->rg_steps[j];
+			sbuf_printf(sb, "%s\n        { \"step\": %d, "
+			    "\"instruction\": ", j == 0 ? "" : ",", j + 1);
+			report_json_string(sb, rsp->rs_string);
+			sbuf_printf(sb, ", \"cached\": %s",
+			    rsp->rs_cached ? "true" : "false");
+			if (rsp->rs_ran) {
+				report_json_usage(sb, rsp);
+			}
+			sbuf_cat(sb, " }");
+		}
+		sbuf_cat(sb, rgp->rg_nsteps > 0 ? "\n      ]" : "]");
+		/*
+		 * Without the step cache the steps run as one script, so
+		 * what they cost is only known for all of them together.
+		 */
+		if (rgp->rg_all.rs_ran) {
+			sbuf_cat(sb, ",\n      \"all_steps\": { \"cached\": "
+			    "false");
+			report_json_usage(sb, &rgp->rg_all);
+			sbuf_cat(sb, " }");
+		}
+		sbuf_cat(sb, "\n    }");
+	}
+	sbuf_cat(sb, bcp->pbc.p_nstages > 0 ? "\n  ]\n}\n" : "]\n}\n");
+	sbuf_finish(sb);
+	return (sb);
+}
+
+static void
+report_print_usage(const char *label, struct report_step *rsp,
+    const char *what)
+{
+	char wrote[32];
+
+	if (rsp->rs_bytes >= 0) {
+		(void) snprintf(wrote, sizeof(wrote), "%ju MB",
+		    (uintmax_t)rsp->rs_bytes >> 20);
+	} else {
+		(void) snprintf(wrote, sizeof(wrote), "%ju blks",
+		    (uintmax_t)rsp->rs_oublock);
+	}
+	fprintf(stdout, "     %-8s %8.2fs  cpu %7.2fs  rss %5ju MB  "
+	    "wrote %-9s  %.40s\n", label, rsp->rs_real / 1000000.0,
+	    (rsp->rs_user + rsp->rs_sys) / 1000000.0,
+	    (uintmax_t)rsp->rs_maxrss >> 10, wrote, what);
+}
+
+static void
+report_print(struct build_context *bcp, struct report *rp, uint64_t total)
+{
+	struct report_stage *rgp;
+	struct report_step *rsp;
+	struct build_stage *bstg;
+	char label[16];
+	int k, j;
+
+	print_bold_prefix(stdout);
+	fprintf(stdout, "Build report: %.2fs\n", total / 1000000.0);
+	fprintf(stdout, "   %-32s %8.2fs\n", "receive context",
+	    rp->r_context / 1000000.0);
+	if (rp->r_queued != 0) {
+		fprintf(stdout, "   %-32s %8.2fs\n", "waiting in build queue",
+		    rp->r_queued / 1000000.0);
+	}
+	if (rp->r_fetch != 0) {
+		fprintf(stdout, "   %-32s %8.2fs\n", "fetch remote sources",
+		    rp->r_fetch / 1000000.0);
+	}
+	for (k = 0; k < bcp->pbc.p_nstages; k++) {
+		bstg = &bcp->stages[k];
+		rgp = &rp->r_stages[k];
+		fprintf(stdout, "   stage %d/%d: FROM %s%s%s%s%s\n", k + 1,
+		    bcp->pbc.p_nstages, bstg->bs_base_container,
+		    bstg->bs_name[0] != '\0' ? " AS " : "", bstg->bs_name,
+		    rgp->rg_peer[0] != '\0' ? " on " : "", rgp->rg_peer);
+		fprintf(stdout, "     %-30s %8.2fs\n", "bootstrap",
+		    rgp->rg_bootstrap / 1000000.0);
+		for (j = 0; j < rgp->rg_nsteps; j++) {
+			rsp = &rgp->rg_steps[j];
+			if (rsp->rs_cached) {
+				fprintf(stdout, "     step %-3d %9s%46s%.40s\n",
+				    j + 1, "cached", "", rsp->rs_string);
+				continue;
+			}
+			if (!rsp->rs_ran) {
+				continue;
+			}
+			(void) snprintf(label, sizeof(label), "step %-3d",
+			    j + 1);
+			report_print_usage(label, rsp, rsp->rs_string);
+		}
+		if (rgp->rg_all.rs_ran) {
+			report_print_usage("steps", &rgp->rg_all,
+			    "(all, run as one script)");
+		}
+	}
+	if (rp->r_fim_spec != 0) {
+		fprintf(stdout, "   %-32s %8.2fs\n", "FIM spec",
+		    (rp->r_fim_spec + rp->r_fim_index) / 1000000.0);
+	}
+	if (rp->r_commit != 0) {
+		fprintf(stdout, "   %-32s %8.2fs\n", "commit",
+		    rp->r_commit / 1000000.0);
+	}
+	fflush(stdout);
+}
+
+/*
+ * Replace path with the contents of sb, through a temporary file so that
+ * a reader never sees half a report.
+ */
+static void
+report_write(const char *path, struct sbuf *sb)
+{
+	char tmp[MAXPATHLEN + 8];
+	FILE *fp;
+	int ok;
+
+	(void) snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		warn("fopen(%s)", tmp);
+		return;
+	}
+	ok = fwrite(sbuf_data(sb), 1, sbuf_len(sb), fp) ==
+	    (size_t)sbuf_len(sb);
+	if (fclose(fp) != 0 || !ok || rename(tmp, path) == -1) {
+		warn("failed to write %s", path);
+		(void) unlink(tmp);
+	}
+}
+
+/*
+ * Print the report for a build and, if it produced an image, keep it with
+ * the image.
+ */
+void
+report_finish(struct build_context *bcp, int status)
+{
+	char path[MAXPATHLEN];
+	extern struct global_params gcfg;
+	struct report r;
+	struct sbuf *sb;
+	uint64_t total;
+	int k;
+
+	bzero(&r, sizeof(r));
+	r.r_stages = calloc(bcp->pbc.p_nstages + 1, sizeof(*r.r_stages));
+	if (r.r_stages == NULL) {
+		err(1, "calloc failed");
+	}
+	report_load_build(bcp, &r);
+	for (k = 0; k < bcp->pbc.p_nstages; k++) {
+		report_load_stage(bcp, &bcp->stages[k], &r.r_stages[k]);
+	}
+	total = r.r_start != 0 ? stats_now_usec() - r.r_start : 0;
+	report_print(bcp, &r, total);
+	if (status == 0) {
+		sb = report_json(bcp, &r, total, status);
+		if (snprintf(path, sizeof(path), "%s/images/%s.%s/%s",
+		    gcfg.c_data_dir, bcp->pbc.p_image_name, bcp->instance,
+		    REPORT_IMAGE_FILE) >= (int)sizeof(path)) {
+			warnx("%s: report path too long",
+			    bcp->pbc.p_image_name);
+		} else {
+			report_write(path, sb);
+		}
+		sbuf_delete(sb);
+	}
+	for (k = 0; k < bcp->pbc.p_nstages; k++) {
+		free(r.r_stages[k].rg_steps);
+	}
+	free(r.r_stages);
+}
@@ -0,0 +1,59 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef REPORT_DOT_H_
+#define	REPORT_DOT_H_
+
+#define	REPORT_FILE		"REPORT"	/* REPORT.<stage> for stages */
+#define	REPORT_IMAGE_FILE	"BUILDREPORT.json"
+
+/*
+ * Build phases are timed in more than one process (the stages run in
+ * processes of their own and their steps in stage_build.sh), so each one
+ * appends its records to a file next to the build directory, as the context
+ * is: <build root>.REPORT for phases of the build as a whole and
+ * <build root>.REPORT.<stage> for those of a stage. On ZFS the build
+ * directory is replaced by a dataset once the first stage is bootstrapped.
+ * One record per line, a keyword followed by numbers (or for peer, the
+ * peer that ran the stage):
+ *
+ * build	start <time_t> <usec>, context <usec>, fim_spec <usec>,
+ *		fim_index <usec>, commit <usec>
+ * stage	peer <host>, bootstrap <usec>, cached <step>,
+ *		total <usec> <status>, step <step> <real usec> <user usec>
+ *		<sys usec> <max rss KB> <blocks written>
+ *		<bytes written, -1 if unknown>
+ *
+ * Steps are numbered from 0 in the order of the stage.
+ */
+#define	REPORT_STAGE_BUILD	-1
+
+void		report_path(struct build_context *, int, char *, size_t);
+void		report_record(struct build_context *, int, const char *, ...)
+		    __attribute__((format(printf, 3, 4)));
+void		report_finish(struct build_context *, int);
+
+#endif	/* REPORT_DOT_H_ */
@@ -0,0 +1,232 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+
+#include <stdio.h>
+#include <pthread.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "sched.h"
+
+void
+sched_init(struct sched *s, const char *name, u_int limit)
+{
+
+	bzero(s, sizeof(*s));
+	s->s_name = name;
+	pthread_mutex_init(&s->s_mutex, NULL);
+	TAILQ_INIT(&s->s_classes);
+	s->s_stats.ss_limit = limit;
+}
+
+/*
+ * A limit of zero means the scheduler admits everything immediately.
+ */
+static int
+sched_has_slot(struct sched *s)
+{
+
+	return (s->s_stats.ss_limit == 0 ||
+	    s->s_stats.ss_inflight < s->s_stats.ss_limit);
+}
+
+static struct sched_class *
+sched_lookup_class(struct sched *s, uid_t uid)
+{
+	struct sched_class *sc;
+
+	TAILQ_FOREACH(sc, &s->s_classes, sc_glue) {
+		if (sc->sc_uid == uid) {
+			return (sc);
+		}
+	}
+	sc = calloc(1, sizeof(*sc));
+	if (sc == NULL) {
+		err(1, "%s: calloc failed", s->s_name);
+	}
+	sc->sc_uid = uid;
+	TAILQ_INIT(&sc->sc_waiters);
+	TAILQ_INSERT_TAIL(&s->s_classes, sc, sc_glue);
+	return (sc);
+}
+
+/*
+ * Figure out where a waiter is in line. The classes are served round-robin
+ * starting from the head of the class list, so a waiter that is i-th in its
+ * own class will be admitted after i waiters from every other class (or all
+ * of them if the class is shorter), plus one more from each class ahead of
+ * it in the current round.
+ */
+static u_int
+sched_position(struct sched *s, struct sched_class *sc,
+    struct sched_waiter *sw)
+{
+	struct sched_waiter *w;
+	struct sched_class *c;
+	int ahead;
+	u_int pos;
+	size_t i;
+
+	i = 0;
+	TAILQ_FOREACH(w, &sc->sc_waiters, sw_glue) {
+		if (w == sw) {
+			break;
+		}
+		i++;
+	}
+	pos = 1;
+	ahead = 1;
+	TAILQ_FOREACH(c, &s->s_classes, sc_glue) {
+		if (c == sc) {
+			pos += i;
+			ahead = 0;
+			continue;
+		}
+		pos += MIN(c->sc_len, i);
+		if (ahead && c->sc_len > i) {
+			pos++;
+		}
+	}
+	return (pos);
+}
+
+/*
+ * Hand out free slots to waiters. Must be called with s_mutex held.
+ */
+static void
+sched_dispatch(struct sched *s)
+{
+	struct sched_waiter *sw;
+	struct sched_class *sc;
+
+	while (sched_has_slot(s)) {
+		sc = TAILQ_FIRST(&s->s_classes);
+		if (sc == NULL) {
+			break;
+		}
+		sw = TAILQ_FIRST(&sc->sc_waiters);
+		assert(sw != NULL);
+		TAILQ_REMOVE(&sc->sc_waiters, sw, sw_glue);
+		sc->sc_len--;
+		TAILQ_REMOVE(&s->s_classes, sc, sc_glue);
+		if (sc->sc_len == 0) {
+			free(sc);
+		} else {
+			TAILQ_INSERT_TAIL(&s->s_classes, sc, sc_glue);
+		}
+		s->s_stats.ss_queued--;
+		s->s_stats.ss_inflight++;
+		sw->sw_admitted = 1;
+		pthread_cond_signal(&sw->sw_cv);
+	}
+}
+
+/*
+ * Block until the caller has been granted a slot. Returns the number of
+ * microseconds spent waiting.
+ */
+uint64_t
+sched_enter(struct sched *s, uid_t uid, sched_notify_t *notify, void *arg)
+{
+	struct timespec start, now, deadline;
+	struct sched_waiter sw;
+	struct sched_class *sc;
+	u_int pos, last;
+	uint64_t usec;
+
+	pthread_mutex_lock(&s->s_mutex);
+	if (TAILQ_EMPTY(&s->s_classes) && sched_has_slot(s)) {
+		s->s_stats.ss_inflight++;
+		s->s_stats.ss_admitted++;
+		pthread_mutex_unlock(&s->s_mutex);
+		return (0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_cond_init(&sw.sw_cv, NULL);
+	sw.sw_admitted = 0;
+	sc = sched_lookup_class(s, uid);
+	TAILQ_INSERT_TAIL(&sc->sc_waiters, &sw, sw_glue);
+	sc->sc_len++;
+	s->s_stats.ss_queued++;
+	last = 0;
+	while (!sw.sw_admitted) {
+		pos = sched_position(s, sc, &sw);
+		if (pos != last && notify != NULL) {
+			last = pos;
+			pthread_mutex_unlock(&s->s_mutex);
+			(*notify)(arg, pos);
+			pthread_mutex_lock(&s->s_mutex);
+			continue;
+		}
+		/*
+		 * Wake up periodically so we can report our progress through
+		 * the queue as jobs ahead of us are admitted.
+		 */
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec++;
+		(void) pthread_cond_timedwait(&sw.sw_cv, &s->s_mutex,
+		    &deadline);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = (now.tv_sec - start.tv_sec) * 1000000 +
+	    (now.tv_nsec - start.tv_nsec) / 1000;
+	s->s_stats.ss_admitted++;
+	s->s_stats.ss_wait_usec_total += usec;
+	if (usec > s->s_stats.ss_wait_usec_max) {
+		s->s_stats.ss_wait_usec_max = usec;
+	}
+	pthread_mutex_unlock(&s->s_mutex);
+	pthread_cond_destroy(&sw.sw_cv);
+	return (usec);
+}
+
+void
+sched_leave(struct sched *s)
+{
+
+	pthread_mutex_lock(&s->s_mutex);
+	assert(s->s_stats.ss_inflight > 0);
+	s->s_stats.ss_inflight--;
+	sched_dispatch(s);
+	pthread_mutex_unlock(&s->s_mutex);
+}
+
+void
+sched_get_stats(struct sched *s, struct sched_stats *ssp)
+{
+
+	pthread_mutex_lock(&s->s_mutex);
+	*ssp = s->s_stats;
+	pthread_mutex_unlock(&s->s_mutex);
+}
@@ -0,0 +1,75 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef SCHED_DOT_H_
+#define	SCHED_DOT_H_
+
+/*
+ * Admission scheduler: at most s_limit jobs hold a slot at any one time.
+ * Waiters are queued FIFO per uid and the uids are served round-robin so a
+ * single user can not starve everyone else by submitting a burst of jobs.
+ */
+struct sched_waiter {
+	pthread_cond_t			sw_cv;
+	int				sw_admitted;
+	TAILQ_ENTRY(sched_waiter)	sw_glue;
+};
+
+struct sched_class {
+	uid_t				sc_uid;
+	size_t				sc_len;
+	TAILQ_HEAD(, sched_waiter)	sc_waiters;
+	TAILQ_ENTRY(sched_class)	sc_glue;
+};
+
+struct sched_stats {
+	u_int			ss_limit;
+	u_int			ss_inflight;
+	u_int			ss_queued;
+	uint64_t		ss_admitted;
+	uint64_t		ss_wait_usec_total;
+	uint64_t		ss_wait_usec_max;
+};
+
+struct sched {
+	const char			*s_name;
+	pthread_mutex_t			 s_mutex;
+	TAILQ_HEAD(, sched_class)	 s_classes;
+	struct sched_stats		 s_stats;
+};
+
+/*
+ * Called (with no locks held) while a job is waiting, whenever its position
+ * in the queue changes. Position 1 is next in line.
+ */
+typedef void	sched_notify_t(void *, u_int);
+
+void		sched_init(struct sched *, const char *, u_int);
+uint64_t	sched_enter(struct sched *, uid_t, sched_notify_t *, void *);
+void		sched_leave(struct sched *);
+void		sched_get_stats(struct sched *, struct sched_stats *);
+
+#endif	/* SCHED_DOT_H_ */
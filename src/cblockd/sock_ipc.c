@@ -37,6 +37,7 @@
 #include <arpa/inet.h>
 
 #include <netdb.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <strings.h>
 #include <unistd.h>
@@ -48,6 +49,9 @@
 
 #include "main.h"
 #include "sock_ipc.h"
+#include "stats.h"
+
+#include <cblock/libcblock.h>
 
 int
 sock_ipc_setup_unix(struct global_params *cmd)
@@ -181,15 +185,18 @@ sock_ipc_accept_connection(int sock)
 		if (nsock == -1) {
 			err(1, "accept failed");
 		}
+		uid = gid = -1;
 		if (sa.sa_family == PF_UNIX) {
-			uid = gid = -1;
 			if (getpeereid(nsock, &uid, &gid) == -1) {
 				err(1, "getpeereid failed");
 			}
 			printf("user %d gid %d\n", uid, gid);
 		}
 		printf("accepted connection %d\n", nsock);
+		stats_counter_add(STATS_ACCEPTS, 1);
 		p = sock_ipc_construct_peer(nsock, sa.sa_family);
+		p->p_uid = uid;
+		p->p_gid = gid;
 		(void) (*gcfg.c_callback)(p);
 	}
 	return (0);
@@ -0,0 +1,697 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#ifdef __FreeBSD__
+#include <sys/sysctl.h>
+#include <sys/user.h>
+#endif
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "termbuf.h"
+#include "main.h"
+#include "dispatch.h"
+#include "sched.h"
+
+#include <cblock/libcblock.h>
+#include <cblock/sbuf.h>
+
+#include "stats.h"
+#include "buildq.h"
+
+static struct stats_shard *stats_shards;
+static __thread int stats_shard_id = -1;
+static u_int stats_next_shard;
+static int stats_http_sock = -1;
+static pthread_mutex_t stats_cpu_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t stats_cpu_last_usec;
+static uint64_t stats_cpu_last_wall;
+
+static const char *stats_ipc_names[STATS_IPC_MAX] = {
+	[PRISON_IPC_LAUNCH_PRISON] = "launch",
+	[PRISON_IPC_CONSOLE_CONNECT] = "console_connect",
+	[PRISON_IPC_SEND_BUILD_CTX] = "build",
+	[PRISON_IPC_GET_INSTANCES] = "get_instances",
+	[PRISON_IPC_GENERIC_COMMAND] = "generic_command",
+	[PRISON_IPC_NETWORK_CTL] = "network_ctl",
+	[PRISON_IPC_SIGNAL_INSTANCE] = "signal_instance",
+	[PRISON_IPC_GET_STATS] = "get_stats",
+	[PRISON_IPC_GET_FIM_DRIFT] = "get_fim_drift",
+	[PRISON_IPC_FIM_DIFF] = "fim_diff",
+	[PRISON_IPC_FIM_VERIFY] = "fim_verify",
+	[PRISON_IPC_GET_BUILD_LOAD] = "get_build_load",
+	[PRISON_IPC_STAGE_EXEC] = "stage_exec",
+	[PRISON_IPC_BUILD_CTL] = "build_ctl",
+	[PRISON_IPC_GET_TRACE] = "get_trace",
+};
+
+void
+stats_init(void)
+{
+
+	stats_shards = mmap(NULL, STATS_SHARDS * sizeof(struct stats_shard),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	if (stats_shards == MAP_FAILED) {
+		err(1, "mmap(stats) failed");
+	}
+}
+
+uint64_t
+stats_now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static struct stats_shard *
+stats_get_shard(void)
+{
+
+	if (stats_shard_id == -1) {
+		stats_shard_id = __atomic_fetch_add(&stats_next_shard, 1,
+		    __ATOMIC_RELAXED) % STATS_SHARDS;
+	}
+	return (&stats_shards[stats_shard_id]);
+}
+
+void
+stats_counter_add(int counter, uint64_t val)
+{
+	struct stats_shard *ssp;
+
+	ssp = stats_get_shard();
+	__atomic_fetch_add(&ssp->s_counters[counter], val, __ATOMIC_RELAXED);
+}
+
+static int
+stats_hist_bucket(uint64_t v)
+{
+	int shift;
+
+	if (v >= (1ULL << STATS_HIST_MAX_BITS)) {
+		v = (1ULL << STATS_HIST_MAX_BITS) - 1;
+	}
+	if (v < STATS_HIST_SUB) {
+		return (v);
+	}
+	shift = (63 - __builtin_clzll(v)) - STATS_HIST_SUB_BITS;
+	return ((shift + 1) * STATS_HIST_SUB +
+	    (int)((v >> shift) - STATS_HIST_SUB));
+}
+
+/*
+ * Largest value which falls into bucket idx.
+ */
+static uint64_t
+stats_hist_upper(int idx)
+{
+	int shift;
+
+	if (idx < STATS_HIST_SUB) {
+		return (idx);
+	}
+	shift = idx / STATS_HIST_SUB - 1;
+	return (((uint64_t)(idx % STATS_HIST_SUB + STATS_HIST_SUB + 1)
+	    << shift) - 1);
+}
+
+void
+stats_hist_observe(int hist, uint64_t usec)
+{
+	struct stats_hist *hp;
+
+	hp = &stats_get_shard()->s_hists[hist];
+	__atomic_fetch_add(&hp->h_count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hp->h_sum, usec, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hp->h_buckets[stats_hist_bucket(usec)], 1,
+	    __ATOMIC_RELAXED);
+}
+
+void
+stats_ipc_observe(uint32_t cmd, uint64_t usec)
+{
+
+	if (cmd >= STATS_IPC_MAX) {
+		return;
+	}
+	stats_hist_observe(STATS_H_IPC + cmd, usec);
+}
+
+static uint64_t
+stats_counter_sum(int counter)
+{
+	uint64_t sum;
+	int k;
+
+	sum = 0;
+	for (k = 0; k < STATS_SHARDS; k++) {
+		sum += __atomic_load_n(&stats_shards[k].s_counters[counter],
+		    __ATOMIC_RELAXED);
+	}
+	return (sum);
+}
+
+static void
+stats_hist_sum(int hist, struct stats_hist *out)
+{
+	struct stats_hist *hp;
+	int k, j;
+
+	bzero(out, sizeof(*out));
+	for (k = 0; k < STATS_SHARDS; k++) {
+		hp = &stats_shards[k].s_hists[hist];
+		out->h_count += __atomic_load_n(&hp->h_count, __ATOMIC_RELAXED);
+		out->h_sum += __atomic_load_n(&hp->h_sum, __ATOMIC_RELAXED);
+		for (j = 0; j < STATS_HIST_BUCKETS; j++) {
+			out->h_buckets[j] += __atomic_load_n(&hp->h_buckets[j],
+			    __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void
+stats_render_header(struct sbuf *sb, const char *name, const char *type,
+    const char *help)
+{
+
+	sbuf_printf(sb, "# HELP %s %s\n", name, help);
+	sbuf_printf(sb, "# TYPE %s %s\n", name, type);
+}
+
+/*
+ * Emit a histogram in Prometheus form. To keep the output a manageable
+ * size, only the power of two bucket boundaries are exported.
+ */
+static void
+stats_render_hist(struct sbuf *sb, const char *name, const char *labels,
+    int hist)
+{
+	struct stats_hist h;
+	const char *sep;
+	uint64_t cum;
+	int k;
+
+	stats_hist_sum(hist, &h);
+	sep = (labels[0] != '\0') ? "," : "";
+	cum = 0;
+	for (k = 0; k < STATS_HIST_BUCKETS; k++) {
+		cum += h.h_buckets[k];
+		if ((k + 1) % STATS_HIST_SUB != 0) {
+			continue;
+		}
+		sbuf_printf(sb, "%s_bucket{%s%sle=\"%.6f\"} %ju\n", name,
+		    labels, sep, stats_hist_upper(k) / 1000000.0,
+		    (uintmax_t)cum);
+	}
+	sbuf_printf(sb, "%s_bucket{%s%sle=\"+Inf\"} %ju\n", name, labels,
+	    sep, (uintmax_t)h.h_count);
+	sbuf_printf(sb, "%s_sum{%s} %.6f\n", name, labels,
+	    h.h_sum / 1000000.0);
+	sbuf_printf(sb, "%s_count{%s} %ju\n", name, labels,
+	    (uintmax_t)h.h_count);
+}
+
+static void
+stats_render_counter(struct sbuf *sb, const char *name, const char *help,
+    int counter)
+{
+
+	stats_render_header(sb, name, "counter", help);
+	sbuf_printf(sb, "%s %ju\n", name, (uintmax_t)stats_counter_sum(counter));
+}
+
+/*
+ * Only systems that can report the length of a listen queue get the
+ * metric at all: a queue that is always 0 would hide a backlog.
+ */
+#ifdef SO_LISTENQLEN
+static void
+stats_render_accept_queue(struct sbuf *sb)
+{
+	extern struct global_params gcfg;
+	socklen_t len;
+	size_t k;
+	int qlen;
+
+	stats_render_header(sb, "cblockd_accept_queue_depth", "gauge",
+	    "Connections waiting to be accepted");
+	for (k = 0; k < gcfg.c_sock_count; k++) {
+		len = sizeof(qlen);
+		if (getsockopt(gcfg.c_socks[k], SOL_SOCKET, SO_LISTENQLEN,
+		    &qlen, &len) == -1) {
+			continue;
+		}
+		sbuf_printf(sb, "cblockd_accept_queue_depth{sock=\"%zu\"} %d\n",
+		    k, qlen);
+	}
+}
+#endif
+
+/*
+ * Escape a label value as the exposition format requires: backslash,
+ * double quote and newline.
+ */
+static void
+stats_label_escape(const char *in, char *out, size_t len)
+{
+	size_t k;
+
+	for (k = 0; *in != '\0' && k + 2 < len; in++) {
+		switch (*in) {
+		case '\\':
+		case '"':
+			out[k++] = '\\';
+			out[k++] = *in;
+			break;
+		case '\n':
+			out[k++] = '\\';
+			out[k++] = 'n';
+			break;
+		default:
+			out[k++] = *in;
+		}
+	}
+	out[k] = '\0';
+}
+
+static void
+stats_render_instances(struct sbuf *sb)
+{
+	extern cblock_instance_head_t pr_head;
+	extern pthread_mutex_t cblock_mutex;
+	struct cblock_instance *pi;
+	char image[2 * sizeof(pi->p_image_name)];
+
+	stats_render_header(sb, "cblockd_instance_tty_bytes_total", "counter",
+	    "Bytes read from the instance console");
+	pthread_mutex_lock(&cblock_mutex);
+	TAILQ_FOREACH(pi, &pr_head, p_glue) {
+		stats_label_escape(pi->p_image_name, image, sizeof(image));
+		sbuf_printf(sb, "cblockd_instance_tty_bytes_total"
+		    "{instance=\"%.10s\",image=\"%s\"} %ju\n",
+		    pi->p_instance_tag, image, (uintmax_t)pi->p_tty_bytes);
+	}
+	pthread_mutex_unlock(&cblock_mutex);
+	stats_render_header(sb, "cblockd_instance_tty_reads_total", "counter",
+	    "Reads from the instance console");
+	pthread_mutex_lock(&cblock_mutex);
+	TAILQ_FOREACH(pi, &pr_head, p_glue) {
+		stats_label_escape(pi->p_image_name, image, sizeof(image));
+		sbuf_printf(sb, "cblockd_instance_tty_reads_total"
+		    "{instance=\"%.10s\",image=\"%s\"} %ju\n",
+		    pi->p_instance_tag, image, (uintmax_t)pi->p_tty_reads);
+	}
+	pthread_mutex_unlock(&cblock_mutex);
+}
+
+static void
+stats_render_sched(struct sbuf *sb)
+{
+	extern struct sched launch_sched;
+	struct buildq_stats bs;
+	struct sched_stats ss;
+
+	sched_get_stats(&launch_sched, &ss);
+	stats_render_header(sb, "cblockd_launch_inflight", "gauge",
+	    "Launches holding an admission slot");
+	sbuf_printf(sb, "cblockd_launch_inflight %u\n", ss.ss_inflight);
+	stats_render_header(sb, "cblockd_launch_queued", "gauge",
+	    "Launches waiting for admission");
+	sbuf_printf(sb, "cblockd_launch_queued %u\n", ss.ss_queued);
+	stats_render_header(sb, "cblockd_launch_limit", "gauge",
+	    "Maximum number of concurrent launches (0 is unlimited)");
+	sbuf_printf(sb, "cblockd_launch_limit %u\n", ss.ss_limit);
+	stats_render_header(sb, "cblockd_launch_admitted_total", "counter",
+	    "Launches admitted");
+	sbuf_printf(sb, "cblockd_launch_admitted_total %ju\n",
+	    (uintmax_t)ss.ss_admitted);
+	buildq_get_stats(&bs);
+	stats_render_header(sb, "cblockd_build_running", "gauge",
+	    "Builds holding a build slot");
+	sbuf_printf(sb, "cblockd_build_running %u\n", bs.bs_running);
+	stats_render_header(sb, "cblockd_build_queued", "gauge",
+	    "Builds waiting in the build queue");
+	sbuf_printf(sb, "cblockd_build_queued %u\n", bs.bs_queued);
+	stats_render_header(sb, "cblockd_build_limit", "gauge",
+	    "Maximum number of concurrent builds (0 is unlimited)");
+	sbuf_printf(sb, "cblockd_build_limit %u\n", bs.bs_limit);
+	stats_render_header(sb, "cblockd_build_started_total", "counter",
+	    "Builds started from the build queue");
+	sbuf_printf(sb, "cblockd_build_started_total %ju\n",
+	    (uintmax_t)bs.bs_started);
+	stats_render_header(sb, "cblockd_build_cancelled_total", "counter",
+	    "Queued or running builds cancelled");
+	sbuf_printf(sb, "cblockd_build_cancelled_total %ju\n",
+	    (uintmax_t)bs.bs_cancelled);
+	stats_render_header(sb, "cblockd_build_shared_total", "counter",
+	    "Builds that shared an identical build already in flight");
+	sbuf_printf(sb, "cblockd_build_shared_total %ju\n",
+	    (uintmax_t)bs.bs_shared);
+}
+
+static uint64_t
+stats_resident_bytes(void)
+{
+#ifdef __FreeBSD__
+	struct kinfo_proc kp;
+	size_t len;
+	int mib[4];
+
+	mib[0] = CTL_KERN;
+	mib[1] = KERN_PROC;
+	mib[2] = KERN_PROC_PID;
+	mib[3] = getpid();
+	len = sizeof(kp);
+	if (sysctl(mib, 4, &kp, &len, NULL, 0) == -1) {
+		return (0);
+	}
+	return ((uint64_t)kp.ki_rssize * getpagesize());
+#else
+	u_long size, resident;
+	FILE *fp;
+	int n;
+
+	fp = fopen("/proc/self/statm", "r");
+	if (fp == NULL) {
+		return (0);
+	}
+	n = fscanf(fp, "%lu %lu", &size, &resident);
+	(void) fclose(fp);
+	if (n != 2) {
+		return (0);
+	}
+	return ((uint64_t)resident * getpagesize());
+#endif
+}
+
+/*
+ * Daemon CPU and memory, also normalized per 100 instances so that runs
+ * with different instance counts can be compared. Utilization is the
+ * fraction of one CPU used since the previous scrape.
+ */
+static void
+stats_render_process(struct sbuf *sb)
+{
+	extern cblock_instance_head_t pr_head;
+	extern pthread_mutex_t cblock_mutex;
+	struct cblock_instance *pi;
+	uint64_t cpu, wall, rss;
+	struct rusage ru;
+	double util;
+	size_t count;
+
+	count = 0;
+	pthread_mutex_lock(&cblock_mutex);
+	TAILQ_FOREACH(pi, &pr_head, p_glue) {
+		count++;
+	}
+	pthread_mutex_unlock(&cblock_mutex);
+	if (getrusage(RUSAGE_SELF, &ru) == -1) {
+		bzero(&ru, sizeof(ru));
+	}
+	cpu = ru.ru_utime.tv_sec * 1000000ULL + ru.ru_utime.tv_usec +
+	    ru.ru_stime.tv_sec * 1000000ULL + ru.ru_stime.tv_usec;
+	wall = stats_now_usec();
+	pthread_mutex_lock(&stats_cpu_mutex);
+	util = 0;
+	if (stats_cpu_last_wall != 0 && wall > stats_cpu_last_wall) {
+		util = (double)(cpu - stats_cpu_last_usec) /
+		    (wall - stats_cpu_last_wall);
+	}
+	stats_cpu_last_usec = cpu;
+	stats_cpu_last_wall = wall;
+	pthread_mutex_unlock(&stats_cpu_mutex);
+	rss = stats_resident_bytes();
+	stats_render_header(sb, "cblockd_instances", "gauge",
+	    "Instances known to the daemon");
+	sbuf_printf(sb, "cblockd_instances %zu\n", count);
+	stats_render_header(sb, "cblockd_cpu_seconds_total", "counter",
+	    "CPU time consumed by the daemon");
+	sbuf_printf(sb, "cblockd_cpu_seconds_total{mode=\"user\"} %ld.%06ld\n",
+	    (long)ru.ru_utime.tv_sec, (long)ru.ru_utime.tv_usec);
+	sbuf_printf(sb, "cblockd_cpu_seconds_total{mode=\"system\"} %ld.%06ld\n",
+	    (long)ru.ru_stime.tv_sec, (long)ru.ru_stime.tv_usec);
+	stats_render_header(sb, "cblockd_cpu_utilization", "gauge",
+	    "CPUs used by the daemon since the previous scrape");
+	sbuf_printf(sb, "cblockd_cpu_utilization %.4f\n", util);
+	stats_render_header(sb, "cblockd_resident_bytes", "gauge",
+	    "Resident set size of the daemon");
+	sbuf_printf(sb, "cblockd_resident_bytes %ju\n", (uintmax_t)rss);
+	if (count == 0) {
+		return;
+	}
+	stats_render_header(sb, "cblockd_cpu_utilization_per_100_instances",
+	    "gauge", "cblockd_cpu_utilization per 100 instances");
+	sbuf_printf(sb, "cblockd_cpu_utilization_per_100_instances %.4f\n",
+	    util * 100 / count);
+	stats_render_header(sb, "cblockd_resident_bytes_per_100_instances",
+	    "gauge", "cblockd_resident_bytes per 100 instances");
+	sbuf_printf(sb, "cblockd_resident_bytes_per_100_instances %ju\n",
+	    (uintmax_t)(rss * 100 / count));
+}
+
+struct sbuf *
+stats_render(void)
+{
+	struct stats_hist h;
+	char labels[64];
+	struct sbuf *sb;
+	uint32_t cmd;
+
+	sb = sbuf_new_auto();
+	stats_render_header(sb, "cblockd_ipc_duration_seconds", "histogram",
+	    "IPC command latency");
+	for (cmd = 0; cmd < STATS_IPC_MAX; cmd++) {
+		stats_hist_sum(STATS_H_IPC + cmd, &h);
+		if (h.h_count == 0) {
+			continue;
+		}
+		if (stats_ipc_names[cmd] != NULL) {
+			(void) snprintf(labels, sizeof(labels), "cmd=\"%s\"",
+			    stats_ipc_names[cmd]);
+		} else {
+			(void) snprintf(labels, sizeof(labels), "cmd=\"%u\"",
+			    cmd);
+		}
+		stats_render_hist(sb, "cblockd_ipc_duration_seconds", labels,
+		    STATS_H_IPC + cmd);
+	}
+	stats_render_header(sb, "cblockd_launch_duration_seconds",
+	    "histogram", "Time from admission until the launch is set up");
+	stats_render_hist(sb, "cblockd_launch_duration_seconds", "",
+	    STATS_H_LAUNCH);
+	stats_render_header(sb, "cblockd_launch_wait_seconds", "histogram",
+	    "Time spent waiting for launch admission");
+	stats_render_hist(sb, "cblockd_launch_wait_seconds", "",
+	    STATS_H_LAUNCH_WAIT);
+	stats_render_header(sb, "cblockd_cleanup_duration_seconds",
+	    "histogram", "Instance cleanup duration");
+	stats_render_hist(sb, "cblockd_cleanup_duration_seconds", "",
+	    STATS_H_CLEANUP);
+	stats_render_header(sb, "cblockd_build_stage_duration_seconds",
+	    "histogram", "Build stage duration");
+	stats_render_hist(sb, "cblockd_build_stage_duration_seconds", "",
+	    STATS_H_BUILD_STAGE);
+	stats_render_counter(sb, "cblockd_launches_total",
+	    "Instances launched", STATS_LAUNCHES);
+	stats_render_counter(sb, "cblockd_build_stages_total",
+	    "Build stages executed", STATS_BUILD_STAGES);
+	stats_render_counter(sb, "cblockd_build_stages_offloaded_total",
+	    "Build stages run by a peer", STATS_BUILD_STAGES_OFFLOADED);
+	stats_render_counter(sb, "cblockd_peer_stages_total",
+	    "Build stages run on behalf of a peer", STATS_PEER_STAGES);
+	stats_render_counter(sb, "cblockd_build_cache_hits_total",
+	    "Build steps restored from the step cache",
+	    STATS_BUILD_CACHE_HITS);
+	stats_render_counter(sb, "cblockd_build_cache_misses_total",
+	    "Cacheable build steps that had to be run",
+	    STATS_BUILD_CACHE_MISSES);
+	stats_render_counter(sb, "cblockd_build_fetch_hits_total",
+	    "ADD URLs resolved without downloading them",
+	    STATS_BUILD_FETCH_HITS);
+	stats_render_counter(sb, "cblockd_build_fetch_misses_total",
+	    "ADD URLs downloaded", STATS_BUILD_FETCH_MISSES);
+	stats_render_counter(sb, "cblockd_fim_checked_total",
+	    "Instance files checked against their image FIM spec",
+	    STATS_FIM_CHECKED);
+	stats_render_counter(sb, "cblockd_fim_drift_total",
+	    "Integrity drift detected in running instances", STATS_FIM_DRIFT);
+	stats_render_counter(sb, "cblockd_tty_bytes_total",
+	    "Bytes read from instance consoles", STATS_TTY_BYTES);
+	stats_render_counter(sb, "cblockd_tty_reads_total",
+	    "Reads from instance consoles", STATS_TTY_READS);
+	stats_render_counter(sb, "cblockd_termbuf_trims_total",
+	    "Console buffer trims", STATS_TERMBUF_TRIMS);
+	stats_render_counter(sb, "cblockd_termbuf_trimmed_bytes_total",
+	    "Bytes discarded by console buffer trims",
+	    STATS_TERMBUF_TRIM_BYTES);
+	stats_render_counter(sb, "cblockd_accepts_total",
+	    "Connections accepted", STATS_ACCEPTS);
+#ifdef SO_LISTENQLEN
+	stats_render_accept_queue(sb);
+#endif
+	stats_render_sched(sb);
+	stats_render_process(sb);
+	stats_render_instances(sb);
+	sbuf_finish(sb);
+	return (sb);
+}
+
+int
+dispatch_get_stats(int sock)
+{
+	struct sbuf *sb;
+	size_t len;
+
+	sb = stats_render();
+	len = sbuf_len(sb);
+	sock_ipc_must_write(sock, &len, sizeof(len));
+	sock_ipc_must_write(sock, sbuf_data(sb), len);
+	sbuf_delete(sb);
+	return (1);
+}
+
+int
+stats_http_setup(const char *port)
+{
+	struct sockaddr_in sin;
+	char *r;
+	long p;
+	int o;
+
+	p = strtol(port, &r, 10);
+	if (*r != '\0' || p <= 0 || p > 65535) {
+		errx(1, "invalid metrics port: %s", port);
+	}
+	stats_http_sock = socket(PF_INET, SOCK_STREAM, 0);
+	if (stats_http_sock == -1) {
+		err(1, "socket(metrics) failed");
+	}
+	o = 1;
+	if (setsockopt(stats_http_sock, SOL_SOCKET, SO_REUSEADDR, &o,
+	    sizeof(o)) == -1) {
+		err(1, "setsockopt(SO_REUSEADDR) failed");
+	}
+	bzero(&sin, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(p);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(stats_http_sock, (struct sockaddr *)&sin,
+	    sizeof(sin)) == -1) {
+		err(1, "bind(metrics) failed");
+	}
+	if (listen(stats_http_sock, 16) == -1) {
+		err(1, "listen(metrics) failed");
+	}
+	return (0);
+}
+
+static void
+stats_http_send(int sock, const char *buf, size_t len)
+{
+	ssize_t cc;
+
+	while (len > 0) {
+		cc = send(sock, buf, len, MSG_NOSIGNAL);
+		if (cc == -1 && errno == EINTR) {
+			continue;
+		}
+		if (cc <= 0) {
+			return;
+		}
+		buf += cc;
+		len -= cc;
+	}
+}
+
+/*
+ * Minimal HTTP responder for Prometheus scrapes. Whatever is requested, the
+ * metrics are returned.
+ */
+void *
+stats_http_loop(void *arg __attribute__((unused)))
+{
+	static const char hdr[] =
+	    "HTTP/1.0 200 OK\r\n"
+	    "Content-Type: text/plain; version=0.0.4\r\n"
+	    "Connection: close\r\n\r\n";
+	struct timeval tv;
+	struct sbuf *sb;
+	char buf[4096];
+	int nsock;
+
+	while (1) {
+		nsock = accept(stats_http_sock, NULL, NULL);
+		if (nsock == -1 && errno == EINTR) {
+			continue;
+		}
+		if (nsock == -1) {
+			warn("accept(metrics) failed");
+			continue;
+		}
+		/*
+		 * This thread serves every scrape, so a client that
+		 * connects and sends nothing must not hold it up.
+		 */
+		tv.tv_sec = STATS_HTTP_TIMEOUT;
+		tv.tv_usec = 0;
+		if (setsockopt(nsock, SOL_SOCKET, SO_RCVTIMEO, &tv,
+		    sizeof(tv)) == -1 ||
+		    setsockopt(nsock, SOL_SOCKET, SO_SNDTIMEO, &tv,
+		    sizeof(tv)) == -1) {
+			warn("setsockopt(metrics) failed");
+			close(nsock);
+			continue;
+		}
+		(void) recv(nsock, buf, sizeof(buf), 0);
+		sb = stats_render();
+		stats_http_send(nsock, hdr, sizeof(hdr) - 1);
+		stats_http_send(nsock, sbuf_data(sb), sbuf_len(sb));
+		sbuf_delete(sb);
+		close(nsock);
+	}
+	return (NULL);
+}
@@ -0,0 +1,103 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef STATS_DOT_H_
+#define	STATS_DOT_H_
+
+/*
+ * Counters and histograms are sharded so that threads rarely touch the same
+ * cache line. Each thread is bound to a shard the first time it updates a
+ * metric and updates are relaxed atomic adds. Readers sum across shards.
+ * The shards live in an anonymous shared mapping so that updates made in
+ * forked build processes are visible to the daemon.
+ */
+#define	STATS_SHARDS		8
+
+/*
+ * Histograms are log-linear (HDR style): each power of two is split into
+ * STATS_HIST_SUB linear sub-buckets, giving a worst case relative error of
+ * 1/STATS_HIST_SUB. Values are in microseconds and are clamped to
+ * 2^STATS_HIST_MAX_BITS - 1 (about 12 days).
+ */
+#define	STATS_HIST_SUB_BITS	3
+#define	STATS_HIST_SUB		(1 << STATS_HIST_SUB_BITS)
+#define	STATS_HIST_MAX_BITS	40
+#define	STATS_HIST_BUCKETS	\
+    ((STATS_HIST_MAX_BITS - STATS_HIST_SUB_BITS + 1) * STATS_HIST_SUB)
+
+#define	STATS_IPC_MAX		32
+#define	STATS_HTTP_TIMEOUT	2	/* seconds to read a scrape request */
+
+enum {
+	STATS_TTY_BYTES,
+	STATS_TTY_READS,
+	STATS_TERMBUF_TRIMS,
+	STATS_TERMBUF_TRIM_BYTES,
+	STATS_ACCEPTS,
+	STATS_LAUNCHES,
+	STATS_BUILD_STAGES,
+	STATS_BUILD_CACHE_HITS,
+	STATS_BUILD_CACHE_MISSES,
+	STATS_FIM_CHECKED,
+	STATS_FIM_DRIFT,
+	STATS_BUILD_STAGES_OFFLOADED,
+	STATS_PEER_STAGES,
+	STATS_BUILD_FETCH_HITS,
+	STATS_BUILD_FETCH_MISSES,
+	STATS_NCOUNTERS
+};
+
+enum {
+	STATS_H_LAUNCH,
+	STATS_H_LAUNCH_WAIT,
+	STATS_H_CLEANUP,
+	STATS_H_BUILD_STAGE,
+	STATS_H_IPC,
+	STATS_NHISTS = STATS_H_IPC + STATS_IPC_MAX
+};
+
+struct stats_hist {
+	uint64_t		h_count;
+	uint64_t		h_sum;
+	uint64_t		h_buckets[STATS_HIST_BUCKETS];
+};
+
+struct stats_shard {
+	uint64_t		s_counters[STATS_NCOUNTERS];
+	struct stats_hist	s_hists[STATS_NHISTS];
+} __attribute__((aligned(64)));
+
+void		stats_init(void);
+uint64_t	stats_now_usec(void);
+void		stats_counter_add(int, uint64_t);
+void		stats_hist_observe(int, uint64_t);
+void		stats_ipc_observe(uint32_t, uint64_t);
+struct sbuf *	stats_render(void);
+int		stats_http_setup(const char *);
+void *		stats_http_loop(void *);
+int		dispatch_get_stats(int);
+
+#endif	/* STATS_DOT_H_ */
@@ -27,6 +27,7 @@
 #include <sys/types.h>
 #include <sys/queue.h>
 
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
@@ -87,12 +88,16 @@ termbuf_remove_oldest(struct tty_buffer *ttyb)
 	return (ttyb->t_tot_len);
 }
 
-void
+/*
+ * Append bytes to the console buffer, discarding the oldest data if the
+ * buffer has grown past its limit. Returns the number of bytes discarded.
+ */
+size_t
 termbuf_append(struct tty_buffer *ttyb, u_char *bytes, size_t len)
 {
 	extern struct global_params gcfg;
 	struct termbuf *tbp;
-	size_t cur;
+	size_t cur, trimmed;
 
 	assert(bytes != NULL);
 	assert(len != 0);
@@ -114,12 +119,16 @@ termbuf_append(struct tty_buffer *ttyb, u_char *bytes, size_t len)
 	}
 	ttyb->t_tot_len += tbp->t_len;
 	TAILQ_INSERT_TAIL(&ttyb->t_head, tbp, t_glue);
+	trimmed = 0;
 	if (ttyb->t_tot_len > gcfg.c_tty_buf_size) {
 		cur = ttyb->t_tot_len;
+		trimmed = cur;
 		while (cur >= gcfg.c_tty_buf_size) {
 			cur = termbuf_remove_oldest(ttyb);
 		}
+		trimmed -= cur;
 	}
+	return (trimmed);
 }
 
 static void
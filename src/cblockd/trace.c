@@ -0,0 +1,432 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __FreeBSD__
+#include <sys/ttycom.h>
+#endif
+
+#include <stdio.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+
+#include <cblock/libcblock.h>
+
+#include "termbuf.h"
+#include "main.h"
+#include "dispatch.h"
+#include "config.h"
+#include "cblock.h"
+#include "trace.h"
+
+static TAILQ_HEAD( , trace_drain) trace_drains =
+    TAILQ_HEAD_INITIALIZER(trace_drains);
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Each trace is a file in the spool holding one Chrome trace event per
+ * line. Events are appended with a single write(2) so that the daemon, the
+ * build processes and the marker threads can all add to the same trace.
+ */
+static void
+trace_path(const char *id, char *buf, size_t len)
+{
+	extern struct global_params gcfg;
+
+	(void) snprintf(buf, len, "%s/%s/%s", gcfg.c_data_dir, TRACE_DIR, id);
+}
+
+void
+trace_record(const char *id, const char *name, const char *cat, int ph,
+    uint64_t ts, uint64_t dur, pid_t pid)
+{
+	char path[MAXPATHLEN], buf[512];
+	int fd, len;
+
+	if (id == NULL || id[0] == '\0') {
+		return;
+	}
+	len = trace_format_event(buf, sizeof(buf) - 1, name, cat, ph, ts,
+	    dur, pid);
+	if (len < 0 || (size_t)len >= sizeof(buf) - 1) {
+		return;
+	}
+	buf[len++] = '\n';
+	trace_path(id, path, sizeof(path));
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		warn("trace: open(%s)", path);
+		return;
+	}
+	if (write(fd, buf, len) != len) {
+		warn("trace: write failed");
+	}
+	(void) close(fd);
+}
+
+/*
+ * Record a complete event for something done by this process which started
+ * at start (see trace_now_usec) and has just finished.
+ */
+void
+trace_span(const char *id, const char *name, const char *cat, uint64_t start)
+{
+	uint64_t now;
+
+	now = trace_now_usec();
+	trace_record(id, name, cat, 'X', start, now - start, getpid());
+}
+
+void
+trace_process_name(const char *id, const char *name, pid_t pid)
+{
+
+	trace_record(id, name, "", 'M', 0, 0, pid);
+}
+
+/*
+ * Create the marker pipe for a helper about to be forked. Returns -1 with
+ * both descriptors set to -1 if the request is not being traced. The pipe
+ * is close-on-exec so that helpers forked concurrently for other requests
+ * do not hold the write side open.
+ */
+int
+trace_marker_pipe(const char *id, int *fds)
+{
+
+	fds[0] = fds[1] = -1;
+	if (id == NULL || id[0] == '\0') {
+		return (-1);
+	}
+	if (pipe2(fds, O_CLOEXEC) == -1) {
+		warn("trace: pipe failed");
+		fds[0] = fds[1] = -1;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Called in the helper process before it is exec'd. The caller is
+ * responsible for adding CBLOCK_TRACE_FD to the environment.
+ */
+void
+trace_marker_child(int *fds)
+{
+
+	if (fds[1] == -1) {
+		return;
+	}
+	(void) close(fds[0]);
+	if (fds[1] == CBLOCK_TRACE_FD) {
+		(void) fcntl(fds[1], F_SETFD, 0);
+		return;
+	}
+	if (dup2(fds[1], CBLOCK_TRACE_FD) == -1) {
+		err(1, "dup2 failed");
+	}
+	(void) close(fds[1]);
+}
+
+static void
+trace_marker_line(const char *id, char *line, pid_t pid, const char *cat,
+    uint64_t ts)
+{
+	int ph;
+
+	if (line[0] == '\0' || line[1] != ' ' || line[2] == '\0') {
+		return;
+	}
+	switch (line[0]) {
+	case 'B':
+	case 'E':
+		ph = line[0];
+		break;
+	case 'I':
+		ph = 'i';
+		break;
+	default:
+		return;
+	}
+	trace_record(id, &line[2], cat, ph, ts, 0, pid);
+}
+
+/*
+ * Read markers until every copy of the write side has been closed, i.e.
+ * the helper has closed it or exited.
+ */
+void
+trace_marker_drain(const char *id, int fd, pid_t pid, const char *cat)
+{
+	char buf[1024], *nl, *line;
+	size_t off;
+	uint64_t now;
+	ssize_t cc;
+
+	trace_process_name(id, cat, pid);
+	off = 0;
+	while (1) {
+		cc = read(fd, &buf[off], sizeof(buf) - off - 1);
+		if (cc == -1 && errno == EINTR) {
+			continue;
+		}
+		if (cc <= 0) {
+			break;
+		}
+		now = trace_now_usec();
+		off += cc;
+		buf[off] = '\0';
+		line = buf;
+		while ((nl = strchr(line, '\n')) != NULL) {
+			*nl = '\0';
+			trace_marker_line(id, line, pid, cat, now);
+			line = nl + 1;
+		}
+		off = strlen(line);
+		memmove(buf, line, off);
+		/*
+		 * A marker that does not fit in the buffer is not a marker.
+		 */
+		if (off == sizeof(buf) - 1) {
+			off = 0;
+		}
+	}
+	(void) close(fd);
+}
+
+static void *
+trace_marker_thread(void *arg)
+{
+	struct trace_drain *td;
+
+	td = arg;
+	trace_marker_drain(td->td_id, td->td_fd, td->td_pid, td->td_cat);
+	pthread_mutex_lock(&trace_mutex);
+	TAILQ_REMOVE(&trace_drains, td, td_glue);
+	pthread_mutex_unlock(&trace_mutex);
+	free(td);
+	return (NULL);
+}
+
+/*
+ * Drain markers from a helper in the background. This is used for launches,
+ * where the helper goes on to become the instance.
+ */
+void
+trace_marker_spawn(const char *id, int fd, pid_t pid, const char *cat)
+{
+	struct trace_drain *td;
+	pthread_attr_t attr;
+	pthread_t thr;
+
+	td = calloc(1, sizeof(*td));
+	if (td == NULL) {
+		warn("trace: calloc failed");
+		(void) close(fd);
+		return;
+	}
+	strlcpy(td->td_id, id, sizeof(td->td_id));
+	strlcpy(td->td_cat, cat, sizeof(td->td_cat));
+	td->td_fd = fd;
+	td->td_pid = pid;
+	pthread_mutex_lock(&trace_mutex);
+	TAILQ_INSERT_TAIL(&trace_drains, td, td_glue);
+	pthread_mutex_unlock(&trace_mutex);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thr, &attr, trace_marker_thread, td) != 0) {
+		warnx("trace: pthread_create failed");
+		pthread_mutex_lock(&trace_mutex);
+		TAILQ_REMOVE(&trace_drains, td, td_glue);
+		pthread_mutex_unlock(&trace_mutex);
+		(void) close(fd);
+		free(td);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * A trace is still being written while one of its helpers is emitting
+ * markers, or one of its instances has not finished launching.
+ */
+static int
+trace_busy(const char *id)
+{
+	extern cblock_instance_head_t pr_head;
+	extern pthread_mutex_t cblock_mutex;
+	struct cblock_instance *pi;
+	struct trace_drain *td;
+	int busy;
+
+	busy = 0;
+	pthread_mutex_lock(&trace_mutex);
+	TAILQ_FOREACH(td, &trace_drains, td_glue) {
+		if (strcmp(td->td_id, id) == 0) {
+			busy = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&trace_mutex);
+	if (busy) {
+		return (1);
+	}
+	pthread_mutex_lock(&cblock_mutex);
+	TAILQ_FOREACH(pi, &pr_head, p_glue) {
+		if (pi->p_trace_id == NULL ||
+		    strcmp(pi->p_trace_id, id) != 0) {
+			continue;
+		}
+		if ((pi->p_state & STATE_LAUNCHING) != 0) {
+			busy = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cblock_mutex);
+	return (busy);
+}
+
+/*
+ * A client is free to never ask for its trace, so fetching alone does not
+ * bound the spool. Whenever a traced request arrives, and at most once
+ * every TRACE_PRUNE_INTERVAL seconds, remove traces which have not been
+ * written to for TRACE_MAX_AGE seconds and are no longer busy.
+ */
+void
+trace_spool_prune(void)
+{
+	extern struct global_params gcfg;
+	static time_t last_prune;
+	char path[MAXPATHLEN];
+	struct dirent *de;
+	struct stat sb;
+	time_t now;
+	DIR *dirp;
+
+	now = time(NULL);
+	pthread_mutex_lock(&trace_mutex);
+	if (now - last_prune < TRACE_PRUNE_INTERVAL) {
+		pthread_mutex_unlock(&trace_mutex);
+		return;
+	}
+	last_prune = now;
+	pthread_mutex_unlock(&trace_mutex);
+	(void) snprintf(path, sizeof(path), "%s/%s", gcfg.c_data_dir,
+	    TRACE_DIR);
+	dirp = opendir(path);
+	if (dirp == NULL) {
+		return;
+	}
+	while ((de = readdir(dirp)) != NULL) {
+		if (!trace_id_valid(de->d_name)) {
+			continue;
+		}
+		if (fstatat(dirfd(dirp), de->d_name, &sb,
+		    AT_SYMLINK_NOFOLLOW) == -1) {
+			continue;
+		}
+		if (!S_ISREG(sb.st_mode) || now - sb.st_mtime < TRACE_MAX_AGE) {
+			continue;
+		}
+		if (trace_busy(de->d_name)) {
+			continue;
+		}
+		(void) unlinkat(dirfd(dirp), de->d_name, 0);
+	}
+	(void) closedir(dirp);
+}
+
+int
+dispatch_get_trace(int sock)
+{
+	struct cblock_response resp;
+	struct cblock_get_trace gt;
+	char path[MAXPATHLEN], *data;
+	uint64_t waited;
+	struct stat sb;
+	size_t len;
+	int fd;
+
+	bzero(&resp, sizeof(resp));
+	if (sock_ipc_must_read(sock, &gt, sizeof(gt)) == 0) {
+		return (0);
+	}
+	gt.p_trace_id[sizeof(gt.p_trace_id) - 1] = '\0';
+	if (!trace_id_valid(gt.p_trace_id)) {
+		resp.p_ecode = 1;
+		snprintf(resp.p_errbuf, sizeof(resp.p_errbuf),
+		    "invalid trace id");
+		sock_ipc_must_write(sock, &resp, sizeof(resp));
+		return (1);
+	}
+	for (waited = 0; waited < TRACE_WAIT_USEC; waited += 50000) {
+		if (!trace_busy(gt.p_trace_id)) {
+			break;
+		}
+		usleep(50000);
+	}
+	trace_path(gt.p_trace_id, path, sizeof(path));
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		resp.p_ecode = 1;
+		snprintf(resp.p_errbuf, sizeof(resp.p_errbuf),
+		    "%s: no such trace", gt.p_trace_id);
+		sock_ipc_must_write(sock, &resp, sizeof(resp));
+		return (1);
+	}
+	if (fstat(fd, &sb) == -1) {
+		err(1, "trace: fstat failed");
+	}
+	len = sb.st_size;
+	data = malloc(len + 1);
+	if (data == NULL) {
+		err(1, "trace: malloc failed");
+	}
+	len = sock_ipc_must_read(fd, data, len);
+	(void) close(fd);
+	/*
+	 * Traces are handed out once. There is nothing left to add to them
+	 * and the spool should not grow without bound. Traces that are never
+	 * fetched are expired by trace_spool_prune.
+	 */
+	(void) unlink(path);
+	sock_ipc_must_write(sock, &resp, sizeof(resp));
+	sock_ipc_must_write(sock, &len, sizeof(len));
+	sock_ipc_must_write(sock, data, len);
+	free(data);
+	return (1);
+}
@@ -0,0 +1,64 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef TRACE_DOT_H_
+#define	TRACE_DOT_H_
+
+#define	TRACE_DIR		"spool/traces"
+#define	TRACE_WAIT_USEC		30000000	/* max wait for a launch to settle */
+#define	TRACE_MAX_AGE		3600		/* seconds an unfetched trace is kept */
+#define	TRACE_PRUNE_INTERVAL	60		/* seconds between spool sweeps */
+
+/*
+ * Helper scripts emit phase markers on the trace pipe, one per line:
+ *
+ *	B <phase>	phase begins
+ *	E <phase>	phase ends
+ *	I <phase>	instant event
+ *
+ * The daemon timestamps markers as they are read, so the scripts do not need
+ * a sub-second clock.
+ */
+struct trace_drain {
+	char				td_id[CBLOCK_TRACE_ID_LEN];
+	int				td_fd;
+	pid_t				td_pid;
+	char				td_cat[64];
+	TAILQ_ENTRY(trace_drain)	td_glue;
+};
+
+void		trace_record(const char *, const char *, const char *, int,
+		    uint64_t, uint64_t, pid_t);
+void		trace_span(const char *, const char *, const char *, uint64_t);
+void		trace_process_name(const char *, const char *, pid_t);
+int		trace_marker_pipe(const char *, int *);
+void		trace_marker_child(int *);
+void		trace_marker_drain(const char *, int, pid_t, const char *);
+void		trace_marker_spawn(const char *, int, pid_t, const char *);
+void		trace_spool_prune(void);
+int		dispatch_get_trace(int);
+
+#endif	/* TRACE_DOT_H_ */
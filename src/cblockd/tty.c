@@ -30,7 +30,9 @@
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
+#ifdef __FreeBSD__
 #include <sys/ttycom.h>
+#endif
 
 #include <stdio.h>
 #include <ctype.h>
@@ -43,7 +45,11 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <termios.h>
+#ifdef __FreeBSD__
 #include <libutil.h>
+#else
+#include <pty.h>
+#endif
 #include <signal.h>
 #include <assert.h>
 #include <string.h>
@@ -98,7 +104,11 @@ tty_read_header(int sock, int *goteof)
 	header_ptr = (unsigned char *)&header;
 	while (bytes_read < sizeof(header)) {
 		r = read(sock, header_ptr + bytes_read, sizeof(header) - bytes_read);
-		if (r == 0) {
+		/*
+		 * A client that exits with console output still queued
+		 * resets the connection rather than closing it.
+		 */
+		if (r == 0 || (r < 0 && errno == ECONNRESET)) {
 			*goteof = 1;
 			return (0);
 		} else if (r < 0) {
@@ -218,6 +228,28 @@ tty_console_session(const char *instance, int sock, int ttyfd) {
 	printf("console disconnected\n");
 }
 
+/*
+ * Read-only console sessions: whatever the client types is discarded. The
+ * session is over when the client disconnects, which it does once it has
+ * been sent the exit status of the build.
+ */
+void
+tty_follow_session(int sock)
+{
+	char buf[TERM_BUF_SIZE];
+	ssize_t cc;
+
+	while (1) {
+		cc = read(sock, buf, sizeof(buf));
+		if (cc == -1 && errno == EINTR) {
+			continue;
+		}
+		if (cc <= 0) {
+			break;
+		}
+	}
+}
+
 char *
 tty_trim_buffer(char *input, size_t len, size_t *newlen)
 {
@@ -25,11 +25,16 @@
  * SUCH DAMAGE.
  */
 #include <sys/types.h>
+#include <sys/ioctl.h>
 #include <sys/queue.h>
 
 #include <stdio.h>
 #include <err.h>
+#ifdef __FreeBSD__
 #include <libutil.h>
+#else
+#include <pty.h>
+#endif
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -74,7 +79,7 @@ gen_sha256_instance_id(char *instance_name __attribute__((unused)))
 		fprintf(stderr, "EVP_DigestInit_ex failed\n");
 		return (NULL);
 	}
-	if (!EVP_DigestUpdate(hash_ctx, inbuf, strlen(inbuf))) {
+	if (!EVP_DigestUpdate(hash_ctx, inbuf, sizeof(inbuf))) {
 		fprintf(stderr, "EVP_DigestUpdate failed\n");
 		return (NULL);
 	}
@@ -30,8 +30,12 @@
 #include <sys/param.h>
 #include <sys/ioctl.h>
 #include <sys/queue.h>
+#ifdef __FreeBSD__
 #include <sys/ttycom.h>
+#endif
 #include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 
 #ifdef __FreeBSD__
 #include <net/if.h>
@@ -39,6 +43,31 @@
 #define IF_NAMESIZE 16
 #endif
 
+/*
+ * Minimal compatibility shims so that cblockd and its tooling can be built
+ * and load tested on non-FreeBSD hosts.
+ */
+#ifndef __FreeBSD__
+#ifndef TAILQ_FOREACH_SAFE
+#define	TAILQ_FOREACH_SAFE(var, head, field, tvar)			\
+	for ((var) = TAILQ_FIRST((head));				\
+	    (var) && ((tvar) = TAILQ_NEXT((var), field), 1);		\
+	    (var) = (tvar))
+#endif
+#ifndef LIST_FOREACH_SAFE
+#define	LIST_FOREACH_SAFE(var, head, field, tvar)			\
+	for ((var) = LIST_FIRST((head));				\
+	    (var) && ((tvar) = LIST_NEXT((var), field), 1);		\
+	    (var) = (tvar))
+#endif
+#ifndef O_EXLOCK
+#define	O_EXLOCK	0	/* see cblock_lock_fd() */
+#endif
+size_t		strlcpy(char *, const char *, size_t);
+size_t		strlcat(char *, const char *, size_t);
+int		getpeereid(int, uid_t *, gid_t *);
+#endif
+
 #include <termios.h>
 
 struct tailhead_stage;
@@ -52,7 +81,8 @@ struct tailhead_step;
 enum {
         PRISON_TYPE_NONE,
         PRISON_TYPE_BUILD,
-        PRISON_TYPE_REGULAR
+        PRISON_TYPE_REGULAR,
+        PRISON_TYPE_SYNTHETIC
 };
 
 #define	PRISON_IPC_LAUNCH_PRISON	1
@@ -67,6 +97,22 @@ enum {
 #define	PRISON_IPC_GENERIC_COMMAND	10
 #define	PRISON_IPC_NETWORK_CTL		11
 #define	PRISON_IPC_SIGNAL_INSTANCE	12
+#define	PRISON_IPC_GET_STATS		13
+#define	PRISON_IPC_GET_TRACE		14
+#define	PRISON_IPC_GET_FIM_DRIFT	15
+#define	PRISON_IPC_FIM_DIFF		16
+#define	PRISON_IPC_FIM_VERIFY		17
+#define	PRISON_IPC_GET_BUILD_LOAD	18
+#define	PRISON_IPC_STAGE_EXEC		19
+#define	PRISON_IPC_STAGE_DONE		20
+#define	PRISON_IPC_BUILD_CTL		21
+
+/*
+ * Trace IDs are 128 bits rendered as hex. An empty trace ID means the
+ * request is not being traced.
+ */
+#define	CBLOCK_TRACE_ID_LEN		33
+#define	CBLOCK_DIGEST_LEN		65	/* hex SHA-256 + NUL */
 
 struct instance_ent {
 	char					p_instance_name[MAX_PRISON_NAME];
@@ -86,7 +132,8 @@ struct cblock_generic_command {
 struct cblock_build_context {
 	char					p_image_name[MAXPATHLEN];
 	char					p_cblock_file[MAXPATHLEN];
-	off_t					p_context_size;
+	off_t					p_context_size;	/* manifest bytes */
+	int					p_context_entries;
 	char					p_tag[MAXPATHLEN];
 	int					p_nstages;
 	int					p_nsteps;
@@ -97,6 +144,13 @@ struct cblock_build_context {
 	int					p_build_fim_spec;
 	char					p_os_release[MAXPATHLEN];
 	char					p_auditcfg[MAXPATHLEN];
+	char					p_trace_id[CBLOCK_TRACE_ID_LEN];
+	int					p_jobs;
+	int					p_no_cache;
+	int					p_context_transfer;
+	int					p_priority;	/* higher first */
+	int					p_detach;
+	uint64_t				p_manifest_len;
 };
 
 struct cblock_response {
@@ -104,6 +158,49 @@ struct cblock_response {
 	char					p_errbuf[MAX_ERR_BUF];
 };
 
+/*
+ * The build context is sent as a manifest: one entry per file, directory or
+ * symbolic link, each followed by its path and (for links) the link target,
+ * both NUL terminated. cblockd replies with a cblock_response, then the
+ * uint32_t transfer method it accepts (the one the client asked for in
+ * p_context_transfer, or CBLOCK_TRANSFER_RAW), a uint32_t count and that
+ * many digests of file contents that are not in its blob store. The client
+ * sends the contents of just those files, in the order they were asked for:
+ *
+ * RAW	back to back.
+ * ZLIB	as a single zlib stream sent as frames of a uint32_t length followed
+ *	by that many bytes, ending with an empty frame.
+ * FDS	as open file descriptors passed with SCM_RIGHTS, up to
+ *	CBLOCK_TRANSFER_FDS_MAX per message. Only over the UNIX socket.
+ */
+#define	CBLOCK_TRANSFER_RAW			0
+#define	CBLOCK_TRANSFER_ZLIB			1
+#define	CBLOCK_TRANSFER_FDS			2
+#define	CBLOCK_TRANSFER_FDS_MAX			64
+#define	CBLOCK_COMPRESS_FRAME_MAX		(1024 * 1024)
+
+struct cblock_context_entry {
+	uint32_t				ce_mode;
+	uint32_t				ce_path_len;
+	uint32_t				ce_link_len;
+	uint64_t				ce_size;
+	int64_t					ce_mtime;
+	char					ce_digest[CBLOCK_DIGEST_LEN];
+};
+
+/*
+ * Interim response sent while a launch is waiting to be admitted. p_errbuf
+ * holds the position in the queue. Another response will follow.
+ */
+#define	CBLOCK_RESP_QUEUED		-1
+
+/*
+ * Sent instead of the final response to a build that is identical to one
+ * already in flight. p_errbuf holds the instance of that build, whose
+ * console output follows as if attached to it, then its exit status.
+ */
+#define	CBLOCK_RESP_SHARED		-2
+
 struct cblock_launch {
 	char					p_name[MAX_PRISON_NAME];
 	char					p_tag[MAXPATHLEN];
@@ -113,6 +210,7 @@ struct cblock_launch {
 	char					p_ports[MAX_ARG_STRING];
 	char					p_network[IF_NAMESIZE];
 	int					p_verbose;
+	char					p_trace_id[CBLOCK_TRACE_ID_LEN];
 };
 
 struct cblock_signal_instance {
@@ -120,6 +218,126 @@ struct cblock_signal_instance {
 	int					p_sig;
 };
 
+/*
+ * Request the events recorded for a trace. The response is followed by the
+ * length of the event data and the data itself: one Chrome trace event (a
+ * JSON object) per line.
+ */
+struct cblock_get_trace {
+	char					p_trace_id[CBLOCK_TRACE_ID_LEN];
+};
+
+/*
+ * Request the integrity drift cblockd has found in running instances, for
+ * one instance or all of them if p_instance is empty. The response is a
+ * count followed by that many drift records.
+ */
+struct cblock_get_fim_drift {
+	char					p_instance[MAX_PRISON_NAME];
+};
+
+struct cblock_fim_drift {
+	char					p_instance[MAX_PRISON_NAME];
+	char					p_path[MAXPATHLEN];
+	uint32_t				p_kind;
+#define	FIM_DRIFT_CONTENT	1	/* contents, type or link target */
+#define	FIM_DRIFT_ATTR		2	/* mode or ownership */
+#define	FIM_DRIFT_EXTRA		3	/* not in the image */
+#define	FIM_DRIFT_MISSING	4	/* removed from the image */
+	int64_t					p_detected;
+};
+
+/*
+ * Compare two images, or an image against its own FIM index. The response
+ * is followed by the length of a report and the report itself, one line
+ * per changed path. An empty report means there is nothing to report.
+ */
+struct cblock_fim_diff {
+	char					p_image[MAXPATHLEN];
+	char					p_other[MAXPATHLEN];
+};
+
+struct cblock_fim_verify {
+	char					p_image[MAXPATHLEN];
+	int					p_content;	/* hash every file */
+};
+
+/*
+ * How busy a cblockd is, for a peer deciding where to run a build stage.
+ */
+struct cblock_build_load {
+	uint32_t				p_ncpu;
+	uint32_t				p_builds;	/* builds in progress */
+	uint32_t				p_stages;	/* run for peers */
+	uint32_t				p_loadavg;	/* 1 minute, x 100 */
+};
+
+/*
+ * Run a stage of a build on behalf of another cblockd. The request is
+ * followed by the cblock_build_context, stages and steps of the build, as
+ * for PRISON_IPC_SEND_BUILD_CTX, and answered with a cblock_response saying
+ * whether the stage will be run. If it will, the build context manifest and
+ * contents are exchanged as for a build, after which another response says
+ * whether the stage was started. The stage's console output is then
+ * forwarded as PRISON_IPC_CONSOLE_TO_CLIENT messages until a
+ * PRISON_IPC_STAGE_DONE message, followed by a cblock_stage_done. If the
+ * stage succeeded, its report records and then its root follow: the root as
+ * frames of a uint32_t length followed by that many bytes, ending with an
+ * empty frame and an int exit status of whatever produced it.
+ */
+struct cblock_stage_exec {
+	int					p_stage;	/* index */
+	uint32_t				p_trees;	/* accepted */
+#define	CBLOCK_TREE_TAR		0x1
+#define	CBLOCK_TREE_ZFS		0x2	/* zfs send stream */
+#define	CBLOCK_TREE_FRAME_MAX	(1024 * 1024)
+};
+
+struct cblock_stage_done {
+	int					p_status;
+	uint32_t				p_tree;
+	uint64_t				p_report_len;
+};
+
+/*
+ * Builds are queued by cblockd and started in order of priority as build
+ * slots free up. Unless the build was submitted with p_detach set, the
+ * response to PRISON_IPC_SEND_BUILD_CTX is preceded by CBLOCK_RESP_QUEUED
+ * responses carrying the build's position in the queue, as for launches.
+ *
+ * PRISON_IPC_BUILD_CTL operates on the queue. BUILD_CTL_LIST is answered
+ * with a uint32_t count and that many cblock_build_info, the others with a
+ * cblock_response. BUILD_CTL_INSPECT follows it with a cblock_build_info.
+ * BUILD_CTL_FOLLOW waits for the build to start exactly like an attached
+ * build does, after which the console can be connected to. Consoles of
+ * builds that already have one attached are connected read-only.
+ */
+struct cblock_build_ctl {
+	uint32_t				p_op;
+#define	BUILD_CTL_LIST		1
+#define	BUILD_CTL_INSPECT	2
+#define	BUILD_CTL_FOLLOW	3
+#define	BUILD_CTL_CANCEL	4
+	char					p_instance[MAX_PRISON_NAME];
+};
+
+struct cblock_build_info {
+	char					p_instance[MAX_PRISON_NAME];
+	char					p_image_name[MAXPATHLEN];
+	char					p_tag[MAXPATHLEN];
+	uint32_t				p_state;
+#define	BUILD_STATE_QUEUED	1
+#define	BUILD_STATE_RUNNING	2
+	int32_t					p_priority;
+	uint32_t				p_position;	/* 1 is next */
+	uint32_t				p_nstages;
+	int32_t					p_uid;
+	int32_t					p_pid;
+	int64_t					p_submitted;
+	int64_t					p_started;
+	uint32_t				p_shared;	/* joined builds */
+};
+
 struct cblock_console_connect {
 	char					p_name[MAX_PRISON_NAME];
 	char					p_instance[MAX_PRISON_NAME];
@@ -129,15 +347,22 @@ struct cblock_console_connect {
 };
 
 struct build_step_root_pivot {
-	char					sr_dir[MAXPATHLEN];
+	char					*sr_dir;
 };
 
 /*
  * Data structures to facilitate image builds, shared between the client
  * and daemon processs.
+ *
+ * Strings are variable length and live in the manifest's arena on the
+ * client. They are sent to the daemon as a single buffer holding the
+ * stages, then the steps, then the strings they refer to, with every
+ * string pointer replaced by its offset into the strings (see
+ * build_manifest_pack). The daemon turns the offsets back into pointers
+ * into that buffer, so the manifest costs what its text does.
  */
 struct build_step_workdir {
-	char					sw_dir[MAXPATHLEN];
+	char					*sw_dir;
 };
 
 struct build_step_add {
@@ -146,24 +371,24 @@ struct build_step_add {
 #define	ADD_TYPE_ARCHIVE	2
 #define	ADD_TYPE_URL		3
 #define	ADD_TYPE_ARCHIVE_URL	4
-	char					sa_source[MAXPATHLEN];
-	char					sa_dest[MAXPATHLEN];
+	char					*sa_source;
+	char					*sa_dest;
 };
 
 struct build_step_copy_from {
 	int					sc_stage;
-	char					sc_source[MAXPATHLEN];
-	char					sc_dest[MAXPATHLEN];
+	char					*sc_source;
+	char					*sc_dest;
 };
 
 struct build_step_env {
-	char					se_key[MAXPATHLEN];
-	char					se_value[MAXPATHLEN];
+	char					*se_key;
+	char					*se_value;
 };
 
 struct build_step_copy {
-	char					sc_source[MAXPATHLEN];
-	char					sc_dest[MAXPATHLEN];
+	char					*sc_source;
+	char					*sc_dest;
 };
 
 struct build_step {
@@ -178,12 +403,7 @@ struct build_step {
 #define	STEP_ENV	7
 	TAILQ_ENTRY(build_step)	step_glue;
 	union {
-		/*
-		 * NB: This should be dynamic, following something like
-		 * getcnf(ARG_MAX) but we will re-visit this in the
-		 * future if need be.
-		 */
-		char				 step_cmd[MAXPATHLEN];
+		char				*step_cmd;
 		struct build_step_copy		 step_copy;
 		struct build_step_add		 step_add;
 		struct build_step_workdir	 step_workdir;
@@ -191,13 +411,20 @@ struct build_step {
 		struct build_step_root_pivot	 step_root_pivot;
 		struct build_step_env		 step_env;
 	} step_data;
-	char					 step_string[MAXPATHLEN];
+	char					*step_string;
+	/*
+	 * Content hash of the build context files a COPY or ADD step reads.
+	 * cblockd computes it again from the context it received rather
+	 * than trusting the client's. Empty if the step does not read the
+	 * context or the files could not be hashed.
+	 */
+	char					 step_digest[CBLOCK_DIGEST_LEN];
 };
 
 struct build_stage {
-	char					bs_name[MAXPATHLEN];
+	char					*bs_name;
 	int					bs_index;
-	char					bs_base_container[MAXPATHLEN];
+	char					*bs_base_container;
 	TAILQ_HEAD(tailhead_step, build_step)	step_head;
 	TAILQ_ENTRY(build_stage)		stage_glue;
 	int					bs_is_last;
@@ -210,6 +437,7 @@ struct build_manifest {
 	char					*maintainr;
 	char					*osrelease;
 	char					*auditcfg;
+	struct arena				*arena;
 };
 
 struct build_context {
@@ -220,6 +448,9 @@ struct build_context {
 	TAILQ_ENTRY(build_context)		 bc_glue;
 	char					*instance;
 	int					 peer_sock;
+	void					*manifest;	/* stages, steps */
+	size_t					 manifest_len;
+	char					 context_digest[CBLOCK_DIGEST_LEN];
 };
 
 struct vec {
@@ -235,6 +466,21 @@ struct vec {
 
 typedef struct vec vec_t;
 
+/*
+ * Bump allocator for objects that are all freed at once.
+ */
+struct arena_chunk {
+	struct arena_chunk			*ac_next;
+	size_t					 ac_size;
+	size_t					 ac_used;
+	char					 ac_data[];
+};
+
+struct arena {
+	struct arena_chunk			*a_chunk;
+	size_t					 a_bytes;
+};
+
 void		print_red(FILE *, char *, ...);
 void		print_bold_prefix(FILE *);
 pid_t		waitpid_ignore_intr(pid_t, int *);
@@ -247,10 +493,28 @@ char *		vec_join(vec_t *, char);
 char **		vec_unmarshal(vec_t *, char *, size_t);
 char *		vec_marshal(vec_t *);
 int		vec_merge(vec_t *, vec_t *);
+struct arena *	arena_init(void);
+void *		arena_alloc(struct arena *, size_t);
+char *		arena_strdup(struct arena *, const char *);
+char *		arena_vprintf(struct arena *, const char *, va_list);
+char *		arena_printf(struct arena *, const char *, ...)
+		    __attribute__((format(printf, 2, 3)));
+void		arena_free(struct arena *);
+void *		build_manifest_pack(const struct build_stage *, int,
+		    const struct build_step *, int, size_t *);
+int		build_manifest_unpack(void *, size_t, int, int,
+		    struct build_stage **, struct build_step **);
 int		sock_ipc_may_read(int, void *, size_t);
 ssize_t		sock_ipc_must_read(int, void *, size_t);
 ssize_t		sock_ipc_must_write(int, void *, size_t);
+int		sock_ipc_may_write(int, void *, size_t);
 ssize_t		sock_ipc_from_to(int, int, off_t);
 void		sock_ipc_from_sock_to_tty(int);
+int		cblock_lock_fd(int, int);
+uint64_t	trace_now_usec(void);
+void		trace_gen_id(char *, size_t);
+int		trace_id_valid(const char *);
+int		trace_format_event(char *, size_t, const char *, const char *,
+		    int, uint64_t, uint64_t, pid_t);
 
 #endif	/* BUILD_DOT_H_ */
@@ -33,7 +33,17 @@
 #ifndef _SYS_SBUF_H_
 #define	_SYS_SBUF_H_
 
+#ifdef __FreeBSD__
 #include <sys/_types.h>
+#else
+#include <sys/types.h>
+#include <stdarg.h>
+#define	__va_list	va_list
+#ifndef __printflike
+#define	__printflike(fmtarg, firstvararg)	\
+	__attribute__((__format__ (__printf__, fmtarg, firstvararg)))
+#endif
+#endif
 
 struct sbuf;
 typedef int (sbuf_drain_func)(void *, const char *, int);
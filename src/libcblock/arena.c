@@ -0,0 +1,134 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+#include <cblock/libcblock.h>
+
+#define	ARENA_CHUNK_SIZE	(64 * 1024)
+#define	ARENA_ALIGN		(sizeof(void *) * 2)
+
+struct arena *
+arena_init(void)
+{
+
+	return (calloc(1, sizeof(struct arena)));
+}
+
+/*
+ * Allocations are zeroed and aligned for any of the structures we keep in
+ * an arena. Anything larger than a chunk gets a chunk of its own.
+ */
+void *
+arena_alloc(struct arena *ap, size_t len)
+{
+	struct arena_chunk *acp;
+	size_t size;
+	void *ptr;
+
+	len = (len + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	acp = ap->a_chunk;
+	if (acp == NULL || acp->ac_size - acp->ac_used < len) {
+		size = len > ARENA_CHUNK_SIZE ? len : ARENA_CHUNK_SIZE;
+		acp = calloc(1, sizeof(*acp) + size);
+		if (acp == NULL) {
+			return (NULL);
+		}
+		acp->ac_size = size;
+		acp->ac_next = ap->a_chunk;
+		ap->a_chunk = acp;
+	}
+	ptr = &acp->ac_data[acp->ac_used];
+	acp->ac_used += len;
+	ap->a_bytes += len;
+	return (ptr);
+}
+
+char *
+arena_strdup(struct arena *ap, const char *str)
+{
+	size_t len;
+	char *ptr;
+
+	len = strlen(str) + 1;
+	ptr = arena_alloc(ap, len);
+	if (ptr == NULL) {
+		return (NULL);
+	}
+	bcopy(str, ptr, len);
+	return (ptr);
+}
+
+char *
+arena_vprintf(struct arena *ap, const char *fmt, va_list va)
+{
+	va_list va2;
+	char *ptr;
+	int len;
+
+	va_copy(va2, va);
+	len = vsnprintf(NULL, 0, fmt, va2);
+	va_end(va2);
+	if (len < 0) {
+		return (NULL);
+	}
+	ptr = arena_alloc(ap, len + 1);
+	if (ptr != NULL) {
+		(void) vsnprintf(ptr, len + 1, fmt, va);
+	}
+	return (ptr);
+}
+
+char *
+arena_printf(struct arena *ap, const char *fmt, ...)
+{
+	va_list va;
+	char *ptr;
+
+	va_start(va, fmt);
+	ptr = arena_vprintf(ap, fmt, va);
+	va_end(va);
+	return (ptr);
+}
+
+void
+arena_free(struct arena *ap)
+{
+	struct arena_chunk *acp, *next;
+
+	if (ap == NULL) {
+		return;
+	}
+	for (acp = ap->a_chunk; acp != NULL; acp = next) {
+		next = acp->ac_next;
+		free(acp);
+	}
+	free(ap);
+}
@@ -0,0 +1,109 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef __FreeBSD__
+#define	_GNU_SOURCE		/* struct ucred */
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/file.h>
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+
+#include <cblock/libcblock.h>
+
+/*
+ * Acquire the exclusive lock that O_EXLOCK gives us for free on FreeBSD.
+ * The flags are the ones that were passed to open(2).
+ */
+int
+cblock_lock_fd(int fd, int flags)
+{
+#ifdef __FreeBSD__
+	(void) fd;
+	(void) flags;
+	return (0);
+#else
+	int op;
+
+	op = LOCK_EX;
+	if ((flags & O_NONBLOCK) != 0) {
+		op |= LOCK_NB;
+	}
+	while (flock(fd, op) == -1) {
+		if (errno != EINTR) {
+			return (-1);
+		}
+	}
+	return (0);
+#endif
+}
+
+#ifndef __FreeBSD__
+size_t
+strlcpy(char *dst, const char *src, size_t dsize)
+{
+	size_t slen;
+
+	slen = strlen(src);
+	if (dsize != 0) {
+		dsize = (slen >= dsize) ? dsize - 1 : slen;
+		memcpy(dst, src, dsize);
+		dst[dsize] = '\0';
+	}
+	return (slen);
+}
+
+size_t
+strlcat(char *dst, const char *src, size_t dsize)
+{
+	size_t dlen;
+
+	dlen = strnlen(dst, dsize);
+	if (dlen == dsize) {
+		return (dlen + strlen(src));
+	}
+	return (dlen + strlcpy(dst + dlen, src, dsize - dlen));
+}
+
+int
+getpeereid(int s, uid_t *euid, gid_t *egid)
+{
+	struct ucred uc;
+	socklen_t len;
+
+	len = sizeof(uc);
+	if (getsockopt(s, SOL_SOCKET, SO_PEERCRED, &uc, &len) == -1) {
+		return (-1);
+	}
+	*euid = uc.uid;
+	*egid = uc.gid;
+	return (0);
+}
+#endif	/* !__FreeBSD__ */
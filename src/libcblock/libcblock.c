@@ -167,6 +167,36 @@ sock_ipc_must_write(int fd, void *buf, size_t n)
 	return (n);
 }
 
+/*
+ * Like sock_ipc_must_write() but for peers that may legitimately go away,
+ * such as console clients. Returns 1 if the data could not be written. A
+ * peer that has closed the socket results in EPIPE rather than SIGPIPE.
+ */
+int
+sock_ipc_may_write(int fd, void *buf, size_t n)
+{
+	ssize_t res, pos;
+	char *s;
+
+	pos = 0;
+	s = buf;
+	while (n > pos) {
+		res = send(fd, s + pos, n - pos, MSG_NOSIGNAL);
+		switch (res) {
+		case -1:
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			return (1);
+		case 0:
+			return (1);
+		default:
+			pos += res;
+		}
+	}
+	return (0);
+}
+
 ssize_t
 sock_ipc_from_to(int from, int to, off_t len)
 {
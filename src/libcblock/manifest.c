@@ -0,0 +1,251 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <cblock/libcblock.h>
+
+#define	MANIFEST_MAX_STRINGS	3	/* per stage or step */
+
+/*
+ * Return pointers to the string fields of a step, which depend on its
+ * operation, or -1 if the operation is not one we know about.
+ */
+static int
+manifest_step_strings(struct build_step *bs, char ***vec)
+{
+	int n;
+
+	n = 0;
+	vec[n++] = &bs->step_string;
+	switch (bs->step_op) {
+	case STEP_RUN:
+		vec[n++] = &bs->step_data.step_cmd;
+		break;
+	case STEP_COPY:
+		vec[n++] = &bs->step_data.step_copy.sc_source;
+		vec[n++] = &bs->step_data.step_copy.sc_dest;
+		break;
+	case STEP_ADD:
+		vec[n++] = &bs->step_data.step_add.sa_source;
+		vec[n++] = &bs->step_data.step_add.sa_dest;
+		break;
+	case STEP_WORKDIR:
+		vec[n++] = &bs->step_data.step_workdir.sw_dir;
+		break;
+	case STEP_COPY_FROM:
+		vec[n++] = &bs->step_data.step_copy_from.sc_source;
+		vec[n++] = &bs->step_data.step_copy_from.sc_dest;
+		break;
+	case STEP_ROOT_PIVOT:
+		vec[n++] = &bs->step_data.step_root_pivot.sr_dir;
+		break;
+	case STEP_ENV:
+		vec[n++] = &bs->step_data.step_env.se_key;
+		vec[n++] = &bs->step_data.step_env.se_value;
+		break;
+	default:
+		return (-1);
+	}
+	return (n);
+}
+
+static int
+manifest_stage_strings(struct build_stage *bsp, char ***vec)
+{
+
+	vec[0] = &bsp->bs_name;
+	vec[1] = &bsp->bs_base_container;
+	return (2);
+}
+
+/*
+ * Append a string to the string table and replace the pointer with its
+ * offset. A NULL string is sent as the empty string.
+ */
+static void
+manifest_pack_string(char **strp, char *strtab, size_t *offp)
+{
+	const char *str;
+	size_t len;
+
+	str = *strp != NULL ? *strp : "";
+	len = strlen(str) + 1;
+	bcopy(str, strtab + *offp, len);
+	*strp = (char *)(uintptr_t)*offp;
+	*offp += len;
+}
+
+static size_t
+manifest_strings_len(char ***vec, int n)
+{
+	size_t len;
+	int k;
+
+	len = 0;
+	for (k = 0; k < n; k++) {
+		if (*vec[k] != NULL) {
+			len += strlen(*vec[k]);
+		}
+		len++;
+	}
+	return (len);
+}
+
+/*
+ * Serialise stages and steps into one buffer: the stages, then the steps,
+ * then the strings they point to. The string pointers in the copies are
+ * replaced by offsets into the strings, and the list linkage is cleared.
+ */
+void *
+build_manifest_pack(const struct build_stage *stages, int nstages,
+    const struct build_step *steps, int nsteps, size_t *lenp)
+{
+	struct build_stage stage, *bsp;
+	struct build_step step, *bs;
+	char **vec[MANIFEST_MAX_STRINGS];
+	size_t hdr, len, off;
+	char *buf, *strtab;
+	int k, n, j;
+
+	hdr = nstages * sizeof(*stages) + nsteps * sizeof(*steps);
+	len = hdr;
+	for (k = 0; k < nstages; k++) {
+		stage = stages[k];
+		n = manifest_stage_strings(&stage, vec);
+		len += manifest_strings_len(vec, n);
+	}
+	for (k = 0; k < nsteps; k++) {
+		step = steps[k];
+		n = manifest_step_strings(&step, vec);
+		if (n == -1) {
+			return (NULL);
+		}
+		len += manifest_strings_len(vec, n);
+	}
+	buf = malloc(len);
+	if (buf == NULL) {
+		return (NULL);
+	}
+	bsp = (struct build_stage *)buf;
+	bs = (struct build_step *)(buf + nstages * sizeof(*stages));
+	strtab = buf + hdr;
+	off = 0;
+	for (k = 0; k < nstages; k++) {
+		bsp[k] = stages[k];
+		bzero(&bsp[k].step_head, sizeof(bsp[k].step_head));
+		bzero(&bsp[k].stage_glue, sizeof(bsp[k].stage_glue));
+		n = manifest_stage_strings(&bsp[k], vec);
+		for (j = 0; j < n; j++) {
+			manifest_pack_string(vec[j], strtab, &off);
+		}
+	}
+	for (k = 0; k < nsteps; k++) {
+		bs[k] = steps[k];
+		bzero(&bs[k].step_glue, sizeof(bs[k].step_glue));
+		n = manifest_step_strings(&bs[k], vec);
+		for (j = 0; j < n; j++) {
+			manifest_pack_string(vec[j], strtab, &off);
+		}
+	}
+	*lenp = len;
+	return (buf);
+}
+
+static int
+manifest_unpack_string(char **strp, char *strtab, size_t tablen)
+{
+	uintptr_t off;
+
+	off = (uintptr_t)*strp;
+	if (off >= tablen || memchr(strtab + off, '\0', tablen - off) == NULL) {
+		return (-1);
+	}
+	*strp = strtab + off;
+	return (0);
+}
+
+/*
+ * Turn a buffer produced by build_manifest_pack back into stages and steps,
+ * in place. Every offset is checked to refer to a terminated string within
+ * the buffer, since the buffer comes from the network. Returns -1 if it
+ * does not.
+ */
+int
+build_manifest_unpack(void *buf, size_t len, int nstages, int nsteps,
+    struct build_stage **stagesp, struct build_step **stepsp)
+{
+	char **vec[MANIFEST_MAX_STRINGS];
+	struct build_stage *bsp;
+	struct build_step *bs;
+	size_t hdr, tablen;
+	char *strtab;
+	int k, n, j;
+
+	if (nstages < 0 || nsteps < 0) {
+		return (-1);
+	}
+	hdr = nstages * sizeof(*bsp) + nsteps * sizeof(*bs);
+	if (len < hdr) {
+		return (-1);
+	}
+	bsp = buf;
+	bs = (struct build_step *)((char *)buf + nstages * sizeof(*bsp));
+	strtab = (char *)buf + hdr;
+	tablen = len - hdr;
+	for (k = 0; k < nstages; k++) {
+		TAILQ_INIT(&bsp[k].step_head);
+		n = manifest_stage_strings(&bsp[k], vec);
+		for (j = 0; j < n; j++) {
+			if (manifest_unpack_string(vec[j], strtab,
+			    tablen) == -1) {
+				return (-1);
+			}
+		}
+	}
+	for (k = 0; k < nsteps; k++) {
+		bs[k].step_digest[sizeof(bs[k].step_digest) - 1] = '\0';
+		n = manifest_step_strings(&bs[k], vec);
+		if (n == -1) {
+			return (-1);
+		}
+		for (j = 0; j < n; j++) {
+			if (manifest_unpack_string(vec[j], strtab,
+			    tablen) == -1) {
+				return (-1);
+			}
+		}
+	}
+	*stagesp = bsp;
+	*stepsp = bs;
+	return (0);
+}
@@ -29,7 +29,9 @@
  */
 
 #include <sys/cdefs.h>
+#ifdef __FBSDID
 __FBSDID("$FreeBSD: stable/12/sys/kern/subr_sbuf.c 349824 2019-07-07 18:45:57Z mav $");
+#endif
 
 #include <sys/param.h>
 
@@ -54,6 +56,13 @@ __FBSDID("$FreeBSD: stable/12/sys/kern/subr_sbuf.c 349824 2019-07-07 18:45:57Z m
 
 #include <cblock/sbuf.h>
 
+#ifndef roundup2
+#define	roundup2(x, y)	(((x)+((y)-1))&(~((y)-1)))
+#endif
+#ifndef __unused
+#define	__unused	__attribute__((__unused__))
+#endif
+
 #ifdef _KERNEL
 static MALLOC_DEFINE(M_SBUF, "sbuf", "string buffers");
 #define	SBMALLOC(size)		malloc(size, M_SBUF, M_WAITOK|M_ZERO)
@@ -0,0 +1,116 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <cblock/libcblock.h>
+
+/*
+ * Trace events are produced by the client, the daemon and the helper
+ * scripts, so they are timestamped with the wall clock rather than a
+ * monotonic one. Chrome trace timestamps are in microseconds.
+ */
+uint64_t
+trace_now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+void
+trace_gen_id(char *buf, size_t len)
+{
+	u_char id[(CBLOCK_TRACE_ID_LEN - 1) / 2];
+	size_t k;
+
+	arc4random_buf(id, sizeof(id));
+	buf[0] = '\0';
+	for (k = 0; k < sizeof(id) && (k * 2) + 2 < len; k++) {
+		(void) snprintf(&buf[k * 2], 3, "%02x", id[k]);
+	}
+}
+
+/*
+ * Trace IDs are used to name files in the trace spool, so only accept
+ * what trace_gen_id() would have produced.
+ */
+int
+trace_id_valid(const char *id)
+{
+	size_t len;
+
+	len = strlen(id);
+	if (len == 0 || len >= CBLOCK_TRACE_ID_LEN) {
+		return (0);
+	}
+	return (strspn(id, "0123456789abcdef") == len);
+}
+
+/*
+ * Format a single Chrome trace event. Names come from the helper scripts
+ * so anything that would need escaping in JSON is replaced. A phase of 'M'
+ * produces process name metadata, in which case name is the process name.
+ */
+int
+trace_format_event(char *buf, size_t len, const char *name, const char *cat,
+    int ph, uint64_t ts, uint64_t dur, pid_t pid)
+{
+	char sname[128], *p;
+
+	strlcpy(sname, name, sizeof(sname));
+	for (p = sname; *p != '\0'; p++) {
+		if (*p < 0x20 || *p > 0x7e || *p == '"' || *p == '\\') {
+			*p = '_';
+		}
+	}
+	switch (ph) {
+	case 'M':
+		return (snprintf(buf, len, "{\"name\":\"process_name\","
+		    "\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+		    pid, sname));
+	case 'X':
+		return (snprintf(buf, len, "{\"name\":\"%s\",\"cat\":\"%s\","
+		    "\"ph\":\"X\",\"ts\":%ju,\"dur\":%ju,\"pid\":%d,\"tid\":%d}",
+		    sname, cat, (uintmax_t)ts, (uintmax_t)dur, pid, pid));
+	case 'i':
+		return (snprintf(buf, len, "{\"name\":\"%s\",\"cat\":\"%s\","
+		    "\"ph\":\"i\",\"s\":\"p\",\"ts\":%ju,\"pid\":%d,\"tid\":%d}",
+		    sname, cat, (uintmax_t)ts, pid, pid));
+	default:
+		return (snprintf(buf, len, "{\"name\":\"%s\",\"cat\":\"%s\","
+		    "\"ph\":\"%c\",\"ts\":%ju,\"pid\":%d,\"tid\":%d}",
+		    sname, cat, ph, (uintmax_t)ts, pid, pid));
+	}
+}
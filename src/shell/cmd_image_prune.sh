@@ -28,6 +28,33 @@
 data_dir=""
 obliterate="no"
 
+# On ZFS an image committed from a build is a promoted clone whose origin is
+# a snapshot of the image it was built from, so that base can not be
+# destroyed while the newer image exists. If only other images or cached
+# build steps depend on it, promote one of them: the snapshots move over to
+# it and the rest of the base can go. A clone of anything else is an
+# instance or build that is still using the image.
+zfs_release_image()
+{
+    images_vol=$(path_to_vol "${data_dir}/images")
+    cache_vol=$(path_to_vol "${data_dir}/cache")
+    while :; do
+        clone=$(zfs list -H -t snapshot -d 1 -o clones "$1" 2>/dev/null | \
+          tr ',' '\n' | grep -v -e '^-$' -e '^$' | head -n 1)
+        if [ -z "$clone" ]; then
+            return 0
+        fi
+        case $clone in
+        "${images_vol}"/*|"${cache_vol}"/*)
+            zfs promote "$clone" || return 1
+            ;;
+        *)
+            return 1
+            ;;
+        esac
+    done
+}
+
 do_image_purge()
 {
     for image in $(images); do
@@ -48,14 +75,19 @@ do_image_purge()
         if [ "$match" != "no" ]; then
             continue
         fi
-        printf "Removing un-referenced image: %s\n" $(basename $image)
         case $CBLOCK_FS in
         zfs)
             vol=$(path_to_vol $image)
+            if ! zfs_release_image "$vol"; then
+                printf "Keeping image in use: %s\n" $(basename $image)
+                continue
+            fi
+            printf "Removing un-referenced image: %s\n" $(basename $image)
             zfs destroy -r "$vol"
             rm -fr "$vol"
             ;;
         ufs)
+            printf "Removing un-referenced image: %s\n" $(basename $image)
             chflags -R noschg "$image"
             rm -Wfr "$image"
             ;;
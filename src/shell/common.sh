@@ -30,6 +30,21 @@ path_to_vol()
     printf "%s" "$1" | sed -E "s,^/(.*),\1,g"
 }
 
+# Stages of a build may be bootstrapped or imported concurrently. Serialize
+# the parts that are shared between them: the build root dataset and the
+# devfs ruleset.
+build_lock()
+{
+    while ! mkdir "${build_root}.lock" 2>/dev/null; do
+        sleep 0.1
+    done
+}
+
+build_unlock()
+{
+    rmdir "${build_root}.lock"
+}
+
 images()
 {
     find "${data_dir}/images" \
@@ -48,3 +63,54 @@ get_default_ip()
     ipv4=`ifconfig ${netif} | egrep "inet " | tail -n 1 | awk '{ print $2 }'`
     echo "${ipv4}"
 }
+
+# Phase markers for cblock launch/build --trace. cblockd timestamps them as
+# they arrive on CBLOCK_TRACE_FD, which is only set when the request is being
+# traced.
+trace_begin()
+{
+    if [ -z "$CBLOCK_TRACE_FD" ]; then
+        return
+    fi
+    eval "echo B $1 >&${CBLOCK_TRACE_FD}"
+}
+
+trace_end()
+{
+    if [ -z "$CBLOCK_TRACE_FD" ]; then
+        return
+    fi
+    eval "echo E $1 >&${CBLOCK_TRACE_FD}"
+}
+
+trace_instant()
+{
+    if [ -z "$CBLOCK_TRACE_FD" ]; then
+        return
+    fi
+    eval "echo I $1 >&${CBLOCK_TRACE_FD}"
+}
+
+# The trace is complete once every holder of the descriptor has closed it, so
+# it must not be passed on to the jail.
+trace_close()
+{
+    if [ -z "$CBLOCK_TRACE_FD" ]; then
+        return
+    fi
+    eval "exec ${CBLOCK_TRACE_FD}>&-"
+    unset CBLOCK_TRACE_FD
+}
+
+# Tell cblockd that the expensive part of the launch (file system, network
+# and firewall setup) is done so it can admit the next queued launch. The
+# descriptor is closed so the jail does not inherit it.
+launch_ready()
+{
+    trace_close
+    if [ -z "$CBLOCK_READY_FD" ]; then
+        return
+    fi
+    eval "echo ready >&${CBLOCK_READY_FD}"
+    eval "exec ${CBLOCK_READY_FD}>&-"
+}
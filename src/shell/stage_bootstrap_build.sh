@@ -47,6 +47,7 @@ bind_devfs()
     fi
     mount -t devfs devfs "${build_root}/${stage_index}/root/dev"
     devfs -m "${build_root}/${stage_index}/root/dev" ruleset 5000
+    build_lock
     if [ $(devfs rule -s 5000 show | grep -c .) -eq 0 ]; then
         devfs rule -s 5000 add hide
         devfs rule -s 5000 add path null unhide
@@ -59,6 +60,7 @@ bind_devfs()
         devfs rule -s 5000 add path stdout unhide
         devfs rule -s 5000 add path stderr unhide
     fi
+    build_unlock
     devfs -m "${build_root}/${stage_index}/root/dev" rule applyset
 }
 
@@ -90,7 +92,13 @@ prepare_file_system()
     else
         _base="${data_dir}/images/${base_container}:latest"
     fi
-    if [ -h "$_base" ]; then
+    #
+    # If cblockd found the result of some of this stage's steps in the step
+    # cache, start from that layer instead of the base image.
+    #
+    if [ -n "$CBLOCK_CACHE_LAYER" ]; then
+        base_root="$CBLOCK_CACHE_LAYER"
+    elif [ -h "$_base" ]; then
         readlnk=$(readlink "$_base")
         base_root=$(realpath "${readlnk}")
     else
@@ -125,28 +133,28 @@ prepare_file_system()
     zfs)
         build_root_vol=$(path_to_vol "${build_root}")
         base_root_vol=$(path_to_vol "${base_root}")
-        zfs snapshot "${base_root_vol}@${instance_name}_${stage_index}"
-        zfs clone "${base_root_vol}@${instance_name}_${stage_index}" \
-          "${build_root_vol}/${stage_index}"
+        if [ -n "$CBLOCK_CACHE_LAYER" ]; then
+            zfs clone "${base_root_vol}@layer" \
+              "${build_root_vol}/${stage_index}"
+        else
+            zfs snapshot "${base_root_vol}@${instance_name}_${stage_index}"
+            zfs clone "${base_root_vol}@${instance_name}_${stage_index}" \
+              "${build_root_vol}/${stage_index}"
+        fi
         ;;
     esac
 }
 
-get_dep_list()
+# Make the roots of the stages this one copies from available read-only at
+# /tmp/stageN, so COPY --FROM copies straight out of them. The stages have
+# finished by the time this one is started. stage_build.sh unmounts them
+# once the steps have run.
+mount_previous_stage_deps()
 {
-    find "${data_dir}/instances" \
-      -name "copy_from_${instance_name}_*" -type f \
-      -maxdepth 1
-}
-
-extract_previous_stage_deps()
-{
-    for f in $(get_dep_list); do
-        unit=$(echo "$f" | sed -E 's/.*_([[:xdigit:]]+)_([0-9]+).tar/\2/g')
+    for unit in $(echo ${stage_deps} | tr ' ' '\n' | sort -u); do
         targ="${build_root}/${stage_index}/root/tmp/stage${unit}"
         mkdir "${targ}"
-        tar -C "${targ}" -xpf "$f"
-        rm "$f"
+        mount -t nullfs -o ro "${build_root}/${unit}/root" "${targ}"
     done
 }
 
@@ -158,38 +166,65 @@ bootstrap()
         mkdir -p "${build_root}/${stage_index}"
         ;;
     zfs)
+        build_lock
         if ! [ -d "$data_dir/instances" ]; then
             zfs create $(path_to_vol $data_dir/instances)
         fi
         build_root_vol=$(path_to_vol "${build_root}")
-        if [ "${stage_index}" == "0" ]; then
+        # Whichever stage gets here first creates the build root, it is
+        # not necessarily stage 0.
+        if ! zfs list "${build_root_vol}" >/dev/null 2>&1; then
             zfs create "${build_root_vol}"
         fi
+        build_unlock
         ;;
     esac
+    trace_begin prepare_file_system
     prepare_file_system
+    trace_end prepare_file_system
     if [ ! -d "${build_root}/${stage_index}/root/tmp" ]; then
         mkdir "${build_root}/${stage_index}/root/tmp"
     fi
-    extract_previous_stage_deps
+    trace_begin mount_stage_deps
+    mount_previous_stage_deps
+    trace_end mount_stage_deps
+    # The context was laid out once for the whole build by cblockd, the
+    # steps only ever read from it. stage_build.sh unmounts it along with
+    # the stage dependencies.
     stage_work_dir=$(mktemp -d "${build_root}/${stage_index}/root/tmp/XXXXXXXX")
-    tar -C "${stage_work_dir}" -zxf "${build_context}"
+    trace_begin mount_context
+    mount -t nullfs -o ro "${build_context}" "${stage_work_dir}"
+    trace_end mount_context
+    # What the build's ADD steps fetched, see stage_fetch.sh
+    if [ -d "${build_root}.fetch" ]; then
+        mkdir "${build_root}/${stage_index}/root/tmp/cblock_fetch"
+        mount -t nullfs -o ro "${build_root}.fetch" \
+          "${build_root}/${stage_index}/root/tmp/cblock_fetch"
+    fi
 
-    chmod +x "${build_root}.${stage_index}.sh"
-    cp -p "${build_root}.${stage_index}.sh" "${build_root}/${stage_index}/root/tmp/cblock-bootstrap.sh"
+    # One script per step that is left to run, see stage_build.sh
+    for f in "${build_root}.${stage_index}".*.sh; do
+        if [ ! -f "$f" ]; then
+            continue
+        fi
+        step=$(basename "$f" .sh)
+        step=${step##*.}
+        chmod +x "$f"
+        cp -p "$f" "${build_root}/${stage_index}/root/tmp/cblock-step-${step}.sh"
+    done
     VARS="${build_root}/${stage_index}/root/tmp/cblock_build_variables.sh"
     stage_tmp_dir=$(echo "${stage_work_dir}" | sed s,"${build_root}"/"${stage_index}"/root,,g)
     printf "stage_tmp_dir=${stage_tmp_dir}\nstage_tmp_dir=${stage_tmp_dir}\n \
       \nbuild_root=${build_root} \
       \nstage_index=${stage_index}\nstages=${stage_deps_mount}\n" > "$VARS"
+    trace_begin mounts
     bind_devfs
     bind_fdescfs
     install_fsoverride
+    trace_end mounts
 
     if [ "${stage_name}" ]; then
-        if [ ! -d "${build_root}/images" ]; then
-            mkdir "${build_root}/images"
-        fi
+        mkdir -p "${build_root}/images"
         ln -s "${build_root}/${stage_index}" "${build_root}/images/${stage_name}" 
     fi
 }
@@ -31,11 +31,233 @@ set -e
 build_root=$1
 instance_id=$2
 osrelease=$3
+shift 3
+stage_dir=$(dirname "${build_root}")
+stage_index=$(basename "${stage_dir}")
+stage_report="$(dirname "${stage_dir}").REPORT.${stage_index}"
 
 if ! [ "$osrelease" ]; then
     osrelease=$(uname -r)
 fi
 
+# The size of the stage root, where the file system can report it cheaply.
+stage_bytes()
+{
+    case $CBLOCK_FS in
+    zfs)
+        zfs get -Hp -o value referenced "$(path_to_vol "${stage_dir}")"
+        ;;
+    esac
+}
+
+# Run the script of step $1 in a jail, or of all the steps if $1 is "all"
+# (see build_emit_shell_script). The stages of a build that run
+# concurrently each need a distinct jail name. The jail is run under
+# time(1) and what the script cost is appended to the stage report, which
+# cblockd turns into the build report: wall, user and system time, maximum
+# RSS, blocks written and, on ZFS, how much the stage root grew.
+run_step()
+{
+    #
+    # Check to see if this is a forge build. If so, change the path to the
+    # interpreter. We ought to just use PATH for this.
+    #
+    if [ -f "${build_root}/tmp/cblock_forge/bin/sh" ]; then
+        # Forge builds
+        _start="env LD_PRELOAD=/tmp/cblock_forge/lib/libfsoverride.so /tmp/cblock_forge/bin/sh /tmp/cblock-step-$1.sh"
+    else
+        # regular builds
+        _start="env LD_PRELOAD=/usr/local/lib/libfsoverride.so /bin/sh /tmp/cblock-step-$1.sh"
+    fi
+    _before=$(stage_bytes)
+    _rc=0
+    /usr/bin/time -l -o "${stage_report}.rusage" jail -c \
+      "host.hostname=$instance_id" \
+      "ip4.addr=$(get_default_ip)" \
+      "name=${instance_id}_${stage_index}" \
+      "allow.chflags=1" \
+      "osrelease=$osrelease" \
+      "path="${build_root} \
+      exec.start="${_start}" || _rc=$?
+    _after=$(stage_bytes)
+    if [ -n "$_before" ] && [ -n "$_after" ]; then
+        _bytes=$((_after - _before))
+    else
+        _bytes=-1
+    fi
+    awk -v step="$1" -v bytes="$_bytes" '
+        / real / { real = $1; user = $3; sys = $5 }
+        /maximum resident set size/ { rss = $1 }
+        /block output operations/ { oublock = $1 }
+        END {
+            if (step == "all")
+                printf "all"
+            else
+                printf "step %d", step
+            printf " %d %d %d %d %d %d\n", real * 1000000,
+              user * 1000000, sys * 1000000, rss, oublock, bytes
+        }' "${stage_report}.rusage" >> "${stage_report}"
+    rm -f "${stage_report}.rusage"
+    return $_rc
+}
+
+# The step cache is shared by every build, so changes to it are serialized
+# by a lockf(1) lock on a file next to it, which goes away with the process
+# holding it. lockf can only hold the lock around a command, so the locked
+# part is run as this script again (see the end of the file).
+cache_locked()
+{
+    lockf -k "${CBLOCK_CACHE_DIR}.lock" /bin/sh "$0" "${build_root}" \
+      "${instance_id}" "${osrelease}" --locked "$@"
+}
+
+# Save the stage root as the layer for key $1. On ZFS the layer is a clone
+# of a snapshot of the stage, promoted so that it outlives the build. As the
+# stage is itself a clone of the layer of the step before, layers form
+# chains in which each is a clone of its parent (see cache_evict_zfs). On
+# UFS the layer is a full copy of the stage root, base image included,
+# which later builds mount below their own root; this is why the cache is
+# off by default on UFS. The LAYER file holding the size is written last
+# and marks the layer as complete.
+cache_store()
+{
+    layer="${CBLOCK_CACHE_DIR}/$1"
+    case $CBLOCK_FS in
+    zfs)
+        cache_locked cache_store_zfs "$1"
+        ;;
+    ufs)
+        if [ -f "${layer}/LAYER" ]; then
+            return 0
+        fi
+        tmp="${layer}.$$"
+        mkdir -p "${tmp}/root/tmp" "${tmp}/root/dev"
+        chmod 1777 "${tmp}/root/tmp"
+        if ! tar -C "${build_root}" --exclude="/dev" --exclude="/tmp" \
+          -cf - . | tar -C "${tmp}/root" -xpf -; then
+            rm -fr "${tmp}"
+            return 1
+        fi
+        du -sk "${tmp}" | awk '{ printf "%d\n", $1 * 1024 }' > "${tmp}/LAYER.new"
+        cache_locked cache_install "$1" "${tmp}"
+        # Another build stored the layer first.
+        if [ -d "${tmp}" ]; then
+            chflags -R noschg "${tmp}"
+            rm -fr "${tmp}"
+        fi
+        ;;
+    esac
+}
+
+# Called with the cache lock held.
+cache_store_zfs()
+{
+    layer="${CBLOCK_CACHE_DIR}/$1"
+    stage_vol=$(path_to_vol "$(dirname "${build_root}")")
+    cache_vol=$(path_to_vol "${CBLOCK_CACHE_DIR}")
+    if [ -f "${layer}/LAYER" ]; then
+        return 0
+    fi
+    if ! zfs list "${cache_vol}" >/dev/null 2>&1; then
+        zfs create "${cache_vol}" || return 1
+    fi
+    zfs snapshot "${stage_vol}@layer" || return 1
+    if ! zfs clone "${stage_vol}@layer" "${cache_vol}/$1"; then
+        zfs destroy "${stage_vol}@layer"
+        return 1
+    fi
+    if ! zfs promote "${cache_vol}/$1"; then
+        zfs destroy "${cache_vol}/$1"
+        zfs destroy "${stage_vol}@layer"
+        return 1
+    fi
+    zfs get -Hp -o value used "${cache_vol}/$1" > "${layer}/LAYER"
+}
+
+# Move the copy $2 into place as the UFS layer for key $1, unless there is
+# one already. Called with the cache lock held.
+cache_install()
+{
+    layer="${CBLOCK_CACHE_DIR}/$1"
+    if [ -d "${layer}" ]; then
+        return 0
+    fi
+    mv "$2/LAYER.new" "$2/LAYER"
+    mv "$2" "${layer}"
+}
+
+# UFS layers that running builds have mounted can not be removed.
+cache_remove()
+{
+    if mount -p | grep -qF "$1/root"; then
+        return 1
+    fi
+    chflags -R noschg "$1"
+    rm -fr "$1"
+}
+
+# Evict the least recently used layers until the cache fits in
+# CBLOCK_CACHE_SIZE megabytes. Layers used in the last few minutes are left
+# alone, as a build may have just looked them up and be about to use them.
+cache_evict()
+{
+    limit=$((CBLOCK_CACHE_SIZE * 1024 * 1024))
+    if [ "$CBLOCK_FS" = "zfs" ]; then
+        cache_evict_zfs
+        return
+    fi
+    total=0
+    for f in $(ls -t "${CBLOCK_CACHE_DIR}"/*/LAYER 2>/dev/null); do
+        size=$(cat "$f")
+        total=$((total + size))
+        if [ $total -le $limit ]; then
+            continue
+        fi
+        if [ -n "$(find "$f" -mmin -5)" ]; then
+            continue
+        fi
+        if cache_remove "$(dirname "$f")"; then
+            total=$((total - size))
+        fi
+    done
+}
+
+# A ZFS layer with clones of its own can not be destroyed, and the oldest
+# layers are the parents of the newer ones. So only leaves are evicted,
+# least recently used first, each making room for its parent to go the
+# same way, until the cache dataset, which is what the layers really take
+# up, fits. Layers that a running build or a committed image was cloned
+# from stay until those are gone.
+cache_evict_zfs()
+{
+    cache_vol=$(path_to_vol "${CBLOCK_CACHE_DIR}")
+    while :; do
+        used=$(zfs get -Hp -o value used "${cache_vol}" 2>/dev/null || true)
+        if [ -z "$used" ] || [ "$used" -le "$limit" ]; then
+            return 0
+        fi
+        evicted=no
+        for f in $(ls -tr "${CBLOCK_CACHE_DIR}"/*/LAYER 2>/dev/null); do
+            if [ -n "$(find "$f" -mmin -5)" ]; then
+                break
+            fi
+            vol=$(path_to_vol "$(dirname "$f")")
+            clones=$(zfs list -H -t snapshot -o clones "${vol}@layer" \
+              2>/dev/null | grep -v '^-$' || true)
+            if [ -n "$clones" ]; then
+                continue
+            fi
+            if zfs destroy -r "${vol}" 2>/dev/null; then
+                evicted=yes
+                break
+            fi
+        done
+        if [ "$evicted" = "no" ]; then
+            return 0
+        fi
+    done
+}
+
 init_build()
 {
     # Inject the /etc/resolv.conf from the host environment into this build
@@ -46,31 +268,24 @@ init_build()
     if [ -d "${build_root}/etc" ]; then
         cp /etc/resolv.conf "${build_root}/etc/resolv.conf"
     fi
-    #
-    # Check to see if this is a forge build. If so, change the path to the
-    # interpreter. We ought to just use PATH for this.
-    #
-    if [ -f "${build_root}/tmp/cblock_forge/bin/sh" ]; then
-        # Forge builds
-        jail -c \
-          "host.hostname=$instance_id" \
-          "ip4.addr=$(get_default_ip)" \
-          "name=$instance_id" \
-          "allow.chflags=1" \
-          "osrelease=$osrelease" \
-          "path="${build_root} \
-          exec.start="env LD_PRELOAD=/tmp/cblock_forge/lib/libfsoverride.so /tmp/cblock_forge/bin/sh /tmp/cblock-bootstrap.sh"
-    else
-        # regular builds
-        jail -c \
-          "host.hostname=$instance_id" \
-          "ip4.addr=$(get_default_ip)" \
-          "name=$instance_id" \
-          "allow.chflags=1" \
-          "osrelease=$osrelease" \
-          "path="${build_root} \
-          exec.start="env LD_PRELOAD=/usr/local/lib/libfsoverride.so /bin/sh /tmp/cblock-bootstrap.sh"
+    for s in "$@"; do
+        step=${s%%:*}
+        key=${s#*:}
+        run_step "$step"
+        if [ "$key" = "-" ]; then
+            continue
+        fi
+        # Failing to cache a step should not fail the build.
+        if ! cache_store "$key"; then
+            echo "Warning: failed to cache step $((step + 1))"
+        fi
+    done
+    if [ $CBLOCK_CACHE_SIZE -ne 0 ]; then
+        cache_locked cache_evict
     fi
+    for m in $(mount -p | awk '{ print $2 }' | grep "^${build_root}/tmp/"); do
+        umount "$m"
+    done
     #
     # Cleanup artifacts that were in /tmp just in case subsequent stages want
     # to create directories etc (e.g.: like stage dependecies). Also we don't
@@ -80,4 +295,9 @@ init_build()
     rm -Wfr "${build_root}"/tmp/*
 }
 
-init_build
+if [ "$1" = "--locked" ]; then
+    shift
+    "$@"
+    exit $?
+fi
+init_build "$@"
@@ -34,73 +34,143 @@ data_dir=$3
 image_name=$4
 n_stages=$5
 instance="$6"
-fim_spec_mode="$7"
-build_tag="$8"
+build_tag="$7"
 
-commit_image()
+# The image is committed by the cheapest means the underlying file system
+# offers. CBLOCK_COMMIT_BACKEND overrides the choice, "dir" being a plain
+# directory copy that needs neither ZFS nor the BSD tools, for testing the
+# build pipeline on other systems.
+commit_backend()
 {
-    if [ -h "${build_root}/${build_index}/root/cellblock-root-ptr" ]; then
-        dir=$(readlink "${build_root}/${build_index}/root/cellblock-root-ptr")
-        src="${build_root}/${build_index}/root/${dir}"
-        #
-        # If the container is expecting a specific OS release to be specified
-        # for package installs or whatever else, copy that over into the
-        # the image so the dispatcher and set it properly
-        #
-        if [ -f "${build_root}/${build_index}/OSRELEASE" ]; then
-            cp "${build_root}/${build_index}/OSRELEASE" \
-                "${build_root}/${build_index}/root/${dir}"
-        fi
-        #
-        # If we have root pivoting step, make sure we copy the entry point
-        # and entry point args from the original root.
-        #
-        if [ -f "${build_root}/${build_index}/ENTRYPOINT" ]; then
-            cp "${build_root}/${build_index}/ENTRYPOINT" \
-                "${build_root}/${build_index}/root/${dir}"
-        fi
-        if [ -f "${build_root}/${build_index}/ARGS" ]; then
-            cp "${build_root}/${build_index}/ARGS" \
-                "${build_root}/${build_index}/root/${dir}"
-        fi
-        #
-        # Don't forget the audit configuration if one has been specified
-        #
-        if [ -f "${build_root}/${build_index}/AUDITCFG" ]; then
-            cp "${build_root}/${build_index}/AUDITCFG" \
-                "${build_root}/${build_index}/root/${dir}"
+    if [ -n "$CBLOCK_COMMIT_BACKEND" ]; then
+        echo "$CBLOCK_COMMIT_BACKEND"
+        return
+    fi
+    case $CBLOCK_FS in
+    zfs)
+        # A pivoted root is a directory within the stage, not a dataset
+        if [ "${src}" = "${build_root}/${build_index}" ]; then
+            echo zfs
+        else
+            echo copy
         fi
-    else
-        rm -Wfr "${build_root}/${build_index}/root/tmp/*"
-        src="${build_root}/${build_index}"
+        ;;
+    *)
+        echo copy
+        ;;
+    esac
+}
+
+# The stage dataset becomes the image: snapshot it, clone the snapshot to
+# the image dataset and promote the clone so that it outlives the build,
+# which is destroyed along with its instance. No data is copied, and the
+# image size comes from the dataset rather than walking the tree. This
+# holds the image lock, as the copy does, for which the sequence is run as
+# this script again under lockf(1) (see the end of the file).
+commit_zfs()
+{
+    trace_begin create_image
+    if ! lockf -k "${data_dir}/images/${image_name}.lock" /bin/sh "$0" \
+      "${build_root}" "${build_index}" "${data_dir}" "${image_name}" \
+      "${n_stages}" "${instance}" "${build_tag}" --locked \
+      zfs_clone_image "$(path_to_vol "${src}")" "$(path_to_vol "${dest}")"; then
+        trace_end create_image
+        return 1
     fi
-    if [ "${fim_spec_mode}" = "ON" ]; then
-        printf "\033[1m--\033[0m %s\n" \
-          "Generating cryptographic checksums for container image files"
-        cd "${src}"
-        mtree -c -K sha256 -p . > FIM.spec
+    trace_end create_image
+    zfs get -Hp -o value referenced "$(path_to_vol "${dest}")" | \
+      awk '{ printf "%d bytes transferred\n", $1 }' > "${dest}/TOTALS"
+}
+
+# Make dataset $2 a promoted clone of dataset $1. Called with the image
+# lock held.
+zfs_clone_image()
+{
+    zfs snapshot "$1@commit" || return 1
+    if ! zfs clone "$1@commit" "$2"; then
+        zfs destroy "$1@commit"
+        return 1
     fi
+    if ! zfs promote "$2"; then
+        zfs destroy "$2"
+        zfs destroy "$1@commit"
+        return 1
+    fi
+}
+
+# Stream the tree into a new image. dd counts the bytes as they pass so the
+# image does not have to be walked a second time to size it.
+commit_copy()
+{
+    trace_begin create_image
     case $CBLOCK_FS in
     zfs)
-        nvol=$(path_to_vol "${data_dir}/images/${image_name}.${instance}")
-        zfs create "${nvol}"
+        zfs create "$(path_to_vol "${dest}")"
         ;;
-    ufs)
-        mkdir "${data_dir}/images/${image_name}.${instance}"
+    *)
+        mkdir "${dest}"
         ;;
     esac
-    dest="${data_dir}/images/${image_name}.${instance}"
-    if [ -f "${build_root}/${build_index}/TOTALS" ]; then
-        rm "${build_root}/${build_index}/TOTALS"
-    fi
+    trace_end create_image
     lockf -k "${data_dir}/images/${image_name}.lock" \
       tar -C "${src}" --exclude="/tmp" \
       --no-xattrs \
       --exclude="/dev" \
       -b 32 -cf - . | \
-    tar -b 32 -xpf - -C "${data_dir}/images/${image_name}.${instance}"
+    dd bs=16k 2> "${dest}.totals" | \
+    tar -b 32 -xpf - -C "${dest}"
+    mv "${dest}.totals" "${dest}/TOTALS"
+}
+
+# Copy the tree with cp, which shares the blocks with the stage where the
+# file system supports reflinks.
+commit_dir()
+{
+    trace_begin create_image
+    mkdir "${dest}"
+    trace_end create_image
+    if cp --reflink=auto /dev/null "${dest}/.reflink" 2>/dev/null; then
+        rm "${dest}/.reflink"
+        cp -a --reflink=auto "${src}/." "${dest}"
+    else
+        cp -Rp "${src}/." "${dest}"
+    fi
+    rm -fr "${dest}/tmp" "${dest}/dev"
     du -sk "${dest}" | awk '{ printf "%d bytes transferred\n", $1 * 1024 }' \
       > "${dest}/TOTALS"
+}
+
+commit_image()
+{
+    if [ -h "${build_root}/${build_index}/root/cellblock-root-ptr" ]; then
+        dir=$(readlink "${build_root}/${build_index}/root/cellblock-root-ptr")
+        src="${build_root}/${build_index}/root/${dir}"
+    else
+        rm -fr "${build_root}/${build_index}"/root/tmp/*
+        src="${build_root}/${build_index}"
+    fi
+    dest="${data_dir}/images/${image_name}.${instance}"
+    if [ -f "${build_root}/${build_index}/TOTALS" ]; then
+        rm "${build_root}/${build_index}/TOTALS"
+    fi
+    trace_begin copy_image
+    case $(commit_backend) in
+    zfs)
+        if ! commit_zfs; then
+            trace_end copy_image
+            echo "Failed to create image ${image_name}" >&2
+            return 1
+        fi
+        ;;
+    dir)
+        commit_dir
+        ;;
+    *)
+        commit_copy
+        ;;
+    esac
+    trace_end copy_image
+    trace_begin tag_image
     # NB: we need to do this atomically
     #
     if [ -h "${data_dir}/images/${image_name}:${build_tag}" ]; then
@@ -108,6 +178,12 @@ commit_image()
     fi
     ln -s "${data_dir}/images/${image_name}.${instance}" \
         "${data_dir}/images/${image_name}:${build_tag}"
+    trace_end tag_image
 }
 
+if [ "$8" = "--locked" ]; then
+    shift 8
+    "$@"
+    exit $?
+fi
 commit_image
@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# Copyright (c) 2020 Christian S.J. Peron
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+#
+set -e
+
+. "$(dirname "$0")/common.sh"
+
+build_root=$1
+stage_index=$2
+tree=$3
+
+# Write the root of a stage that was run for a peer to stdout, see peer.c.
+# A ZFS stage is sent as a replication stream, anything else as a tar of the
+# stage directory without the file systems mounted into it.
+case $tree in
+zfs)
+    stage_vol=$(path_to_vol "${build_root}/${stage_index}")
+    zfs snapshot "${stage_vol}@export"
+    zfs send "${stage_vol}@export"
+    ;;
+*)
+    tar -C "${build_root}/${stage_index}" \
+      --exclude "./root/dev/*" \
+      --exclude "./root/tmp/*" \
+      --no-xattrs -b 32 -cf - .
+    ;;
+esac
@@ -0,0 +1,100 @@
+#!/bin/sh
+#
+# Copyright (c) 2020 Christian S.J. Peron
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+#
+set -e
+
+. "$(dirname "$0")/common.sh"
+
+data_dir=$1
+build_root=$2
+url=$3
+pin=""
+if [ "$4" ]; then
+    pin=$4
+fi
+
+# Resolve the URL of an ADD step to the digest of its content, see fetch.c.
+# Content lives in the blob store, one file per digest. The URL index maps
+# the SHA-256 of a URL to the digest it last resolved to, and carries the
+# Last-Modified time of that content as its modification time, which is what
+# fetch -i revalidates against. Prints "<digest> <how>", where how is one of
+# cached (pinned and already stored), unmodified or fetched.
+blob_dir="${data_dir}/lib/blobs"
+index="${data_dir}/lib/fetch/$(printf "%s" "${url}" | sha256 -q)"
+tmp="${index}.$$"
+trap 'rm -f "${tmp}" "${tmp}.index"' EXIT
+
+blob_path()
+{
+    printf "%s/%.2s/%s" "${blob_dir}" "$1" "$1"
+}
+
+# Make the content available to the stages of the build.
+publish()
+{
+    mkdir -p "${build_root}.fetch"
+    if [ -e "${build_root}.fetch/$1" ]; then
+        return
+    fi
+    if ! ln "$(blob_path "$1")" "${build_root}.fetch/$1" 2>/dev/null; then
+        cp "$(blob_path "$1")" "${build_root}.fetch/$1"
+    fi
+}
+
+if [ -n "${pin}" ] && [ -f "$(blob_path "${pin}")" ]; then
+    publish "${pin}"
+    echo "${pin} cached"
+    exit 0
+fi
+# fetch(1) only ever talks on stderr, stdout is for cblockd.
+if [ -z "${pin}" ] && [ -f "${index}" ] &&
+  [ -f "$(blob_path "$(cat "${index}")")" ]; then
+    fetch -q -i "${index}" -o "${tmp}" "${url}" >&2
+    if [ ! -e "${tmp}" ]; then
+        digest=$(cat "${index}")
+        publish "${digest}"
+        echo "${digest} unmodified"
+        exit 0
+    fi
+else
+    fetch -q -o "${tmp}" "${url}" >&2
+fi
+digest=$(sha256 -q "${tmp}")
+if [ -n "${pin}" ] && [ "${digest}" != "${pin}" ]; then
+    echo "${url}: checksum mismatch, expected ${pin} got ${digest}" >&2
+    exit 1
+fi
+echo "${digest}" > "${tmp}.index"
+touch -r "${tmp}" "${tmp}.index"
+blob=$(blob_path "${digest}")
+if [ ! -f "${blob}" ]; then
+    mkdir -p "$(dirname "${blob}")"
+    chmod 0444 "${tmp}"
+    mv "${tmp}" "${blob}"
+fi
+mv "${tmp}.index" "${index}"
+publish "${digest}"
+echo "${digest} fetched"
@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# Copyright (c) 2020 Christian S.J. Peron
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+#
+set -e
+
+. "$(dirname "$0")/common.sh"
+
+build_root=$1
+stage_index=$2
+tree=$3
+stage_name=""
+if [ "$4" ]; then
+    stage_name=$4
+fi
+
+# Lay out the root of a stage that a peer ran from the stream written by its
+# stage_export.sh on stdin, in place of stage_bootstrap_build.sh.
+case $tree in
+zfs)
+    build_root_vol=$(path_to_vol "${build_root}")
+    build_lock
+    if ! [ -d "$(dirname "${build_root}")" ]; then
+        zfs create $(path_to_vol "$(dirname "${build_root}")")
+    fi
+    if ! zfs list "${build_root_vol}" >/dev/null 2>&1; then
+        zfs create "${build_root_vol}"
+    fi
+    build_unlock
+    zfs receive "${build_root_vol}/${stage_index}"
+    zfs destroy "${build_root_vol}/${stage_index}@export"
+    ;;
+*)
+    mkdir -p "${build_root}/${stage_index}/root"
+    tar -C "${build_root}/${stage_index}" -xpf -
+    ;;
+esac
+if [ "${stage_name}" ]; then
+    mkdir -p "${build_root}/images"
+    ln -s "${build_root}/${stage_index}" "${build_root}/images/${stage_name}"
+fi
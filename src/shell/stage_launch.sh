@@ -347,7 +347,9 @@ network_to_ip6()
         for ip in $(subcalc inet6 $net_addr print | grep -v "^;"); do
             if [ $(is_assigned $ip $version) = "no" ] && \
                [ $(is_broadcast $net_addr $ip $version) = "no" ]; then
+                trace_begin ifconfig
                 ifconfig cblock0 inet6 "${ip}/128" alias
+                trace_end ifconfig
                 echo "${ip}"
                 echo "nat,${instance_id},${ip},$network,6" >> \
                   $data_root/networks/cur
@@ -374,7 +376,10 @@ network_to_ip()
         for ip in $(subcalc inet $net_addr print | grep -v "^;"); do
             if [ $(is_assigned $ip "4") = "no" ] && \
                [ $(is_broadcast $net_addr $ip "4") = "no" ]; then
+                trace_begin ifconfig
                 ifconfig cblock0 inet "${ip}/32" alias
+                trace_end ifconfig
+                trace_begin pfctl
                 echo "nat on $out_if from ${ip}/32 to any -> ($out_if)" | \
                     pfctl -a cblock-nat/${instance_id} -f -
                 echo "nat,${instance_id},${ip},$network,4" >> \
@@ -382,6 +387,7 @@ network_to_ip()
                 echo "${ip}"
                 setup_port_redirects "$ports" "$ip" "$out_if" | \
                   pfctl -a cblock-rdr/${instance_id} -f -
+                trace_end pfctl
                 return
             fi
         done
@@ -391,6 +397,7 @@ network_to_ip()
 
 do_launch()
 {
+    trace_begin forwarding
     if [ $(sysctl net.inet.ip.forwarding | awk '{ print $2 }') != "1" ]; then
         sysctl net.inet.ip.forwarding=1 2>&1 >/dev/null
         if [ $? -ne 0 ]; then
@@ -398,14 +405,18 @@ do_launch()
             exit 1
         fi
     fi
+    trace_end forwarding
     img_tag="${image_name}:${tag}"
     if [ ! -h "${data_root}/images/${img_tag}" ]; then
         echo "[FATAL]: no such image ${image_name} downloaded"
         exit 1
     fi
+    trace_begin readlink
     image_dir=`readlink "${data_root}/images/${img_tag}"`
+    trace_end readlink
     instance_hostname=`printf "%10.10s" ${instance_id}`
     instance_root="${data_root}/instances/${instance_id}/root"
+    trace_begin clone
     case $CBLOCK_FS in
     zfs)
         volname=`path_to_vol "${image_dir}"`
@@ -414,24 +425,39 @@ do_launch()
         zfs clone "$volname@${instance_hostname}" "${dest_volname}"
         ;;
     ufs)
-        mkdir -p "${instance_root}"
-        mount -t unionfs -o noatime -o below \
-          "${image_dir}/root" "${instance_root}"
+        # Keep the writable layer in its own directory rather than the one
+        # the union covers, so the FIM drift monitor can see what the
+        # instance has changed relative to its image.
+        mkdir -p "${instance_root}" \
+          "${data_root}/instances/${instance_id}/upper"
+        mount -t nullfs -o ro "${image_dir}/root" "${instance_root}"
+        mount -t unionfs -o noatime \
+          "${data_root}/instances/${instance_id}/upper" "${instance_root}"
         ;;
     esac
+    echo "${image_dir}" > "${data_root}/instances/${instance_id}/IMAGE"
+    trace_end clone
+    trace_begin config_devfs
     mount -t devfs devfs "${instance_root}/dev"
     config_devfs
+    trace_end config_devfs
     # if mount_spec is *just* devfs skip over mount operations since
     # devfs is handled elsewhere.
     # NB: handle trailing ',' character...
     if [ "$mount_spec" != "devfs," ]; then
+        trace_begin mounts
         mnt_cmd=$(emit_mount_specification "$mount_spec")
         eval $mnt_cmd
+        trace_end mounts
     fi
     is_bridge=$(network_is_bridge)
     set $(emit_entrypoint)
     if [ "$is_bridge" = "TRUE" ]; then
+       trace_begin network
        netif=$(get_jail_interface)
+       trace_end network
+       trace_instant jail
+       launch_ready
        jail -c \
           "host.hostname=${instance_hostname}" \
           "vnet" \
@@ -442,6 +468,7 @@ do_launch()
           "path=${instance_root}" \
           command="$@"
     else
+        trace_begin network
         if [ "$network" = "__host__" ]; then
             ip4=$(get_default_ip)
         else
@@ -459,13 +486,20 @@ do_launch()
         else
             netspec="ip4.addr=$ip4"
         fi
+        trace_end network
         jailcmd="$jailcmd $netspec osrelease=$(emit_os_release) command=$@"
+        trace_instant jail
+        launch_ready
         eval $jailcmd
     fi
 }
 
 launch_block()
 {
+    # The instance must survive cblockd going away (see journal.c): when
+    # the daemon's end of the console pty is closed, the session is sent
+    # SIGHUP. Ignore it here, the jailed process inherits that.
+    trap '' HUP
     network_is_defined
     do_launch
 }
@@ -109,11 +109,17 @@ cleanup()
     fi
     case $type in
     build)
-        rm "${data_root}/instances/${instance}.tar.gz"
+        rm -fr "${data_root}/instances/${instance}.ctx"
         rm ${data_root}/instances/${instance}.*.sh
+        rm -f "${data_root}/instances/${instance}".REPORT*
+        rm -f "${data_root}/instances/${instance}.manifest"
+        rm -fr "${data_root}/instances/${instance}.fetch"
         rm -Wfr "${data_root}/instances/${instance}/images"
         stage_list=$(echo "${data_root}"/instances/"${instance}"/[0-9]*)
         for d in $stage_list; do
+            for m in $(mount -p | awk '{ print $2 }' | grep "^${d}/root/tmp/"); do
+                umount -f "$m"
+            done
             umount -f "${d}/root/dev/fd"
             umount -f "${d}/root/dev"
             case $CBLOCK_FS in